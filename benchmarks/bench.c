@@ -0,0 +1,290 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  A small harness for the microbenchmarks of the hot paths. Each benchmark
+  program runs its functions with bench_run() and ends with bench_finish(),
+  which prints the results as JSON for regression tracking:
+
+      {"suite": "uvc", "git": "...", "seconds": 1.0, "results": [
+      {"name": "memcpy_picture/dht", "iterations": 1310720, "ns_per_op": 731.2, ...},
+      ...]}
+
+  A table for humans goes to stderr. The time per call is the median of the
+  batches, which is less disturbed by other processes than the mean.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define NSEC 1000000000LL
+
+/* a batch runs for at least that long to hide the overhead of the clock */
+#define MIN_BATCH (NSEC / 100)
+#define MAX_BATCHES 4096
+#define MAX_RESULTS 64
+#define MAX_VALUES 12
+
+typedef struct {
+    char name[64];
+    int count;
+    const char *key[MAX_VALUES];
+    double value[MAX_VALUES];
+} result;
+
+static const char *suite_name;
+static const char *filter;
+static const char *output_file;
+static double seconds = 1.0;
+static result results[MAX_RESULTS];
+static int result_count;
+static long long batches[MAX_BATCHES];
+
+/******************************************************************************
+Description.: print the help for the common options
+Input Value.: name of the program
+Return Value: -
+******************************************************************************/
+static void help(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-t seconds] [-o file.json] [filter]\n" \
+            " -t seconds : time to spend on each benchmark, default 1\n" \
+            " -o file    : write the JSON results to file instead of stdout\n" \
+            " filter     : run only the benchmarks whose name contains it\n", program);
+}
+
+int bench_init(int argc, char *argv[], const char *suite, const char *options, bench_option option)
+{
+    char optstring[64];
+    int c;
+
+    suite_name = suite;
+    snprintf(optstring, sizeof(optstring), "+t:o:h%s", options != NULL ? options : "");
+
+    while((c = getopt(argc, argv, optstring)) != -1) {
+        switch(c) {
+        case 't':
+            seconds = strtod(optarg, NULL);
+            if(seconds <= 0)
+                seconds = 1.0;
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'h':
+        case '?':
+            help(argv[0]);
+            return -1;
+        default:
+            if(option == NULL || option(c, optarg) != 0) {
+                help(argv[0]);
+                return -1;
+            }
+        }
+    }
+
+    if(optind < argc)
+        filter = argv[optind];
+
+    return 0;
+}
+
+int bench_selected(const char *name)
+{
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+double bench_seconds(void)
+{
+    return seconds;
+}
+
+static long long clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+long long bench_now(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+long long bench_cpu(void)
+{
+    return clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/******************************************************************************
+Description.: add a value to the last result
+Input Value.: key and value
+Return Value: -
+******************************************************************************/
+static void add_value(result *r, const char *key, double value)
+{
+    if(r->count == MAX_VALUES)
+        return;
+    r->key[r->count] = key;
+    r->value[r->count++] = value;
+}
+
+static result *new_result(const char *name)
+{
+    result *r;
+
+    if(result_count == MAX_RESULTS) {
+        fprintf(stderr, "too many results, %s is dropped\n", name);
+        return NULL;
+    }
+
+    r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->count = 0;
+    return r;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+void bench_run(const char *name, bench_fn fn, void *arg, size_t bytes)
+{
+    long long start, end, elapsed, cpu, iterations = 0, i, n = 1;
+    int count = 0;
+    double median;
+    result *r;
+
+    if(!bench_selected(name))
+        return;
+
+    /* find a batch size that takes MIN_BATCH, this warms the caches too */
+    for(;;) {
+        start = bench_now();
+        for(i = 0; i < n; i++)
+            fn(arg);
+        if(bench_now() - start >= MIN_BATCH)
+            break;
+        n *= 2;
+    }
+
+    start = bench_now();
+    cpu = bench_cpu();
+    do {
+        long long batch = bench_now();
+
+        for(i = 0; i < n; i++)
+            fn(arg);
+
+        end = bench_now();
+        batches[count++] = end - batch;
+        iterations += n;
+    } while(end - start < seconds * NSEC && count < MAX_BATCHES);
+    cpu = bench_cpu() - cpu;
+    elapsed = end - start;
+
+    /* the time per call of the median batch */
+    qsort(batches, count, sizeof(batches[0]), compare);
+    median = (double)batches[count / 2] / n;
+
+    if((r = new_result(name)) == NULL)
+        return;
+    add_value(r, "iterations", iterations);
+    add_value(r, "ns_per_op", median);
+    add_value(r, "ns_per_op_min", (double)batches[0] / n);
+    add_value(r, "ns_per_op_max", (double)batches[count - 1] / n);
+    add_value(r, "cpu_ns_per_op", (double)cpu / iterations);
+    if(bytes > 0)
+        add_value(r, "mb_per_s", bytes / median * NSEC / (1024 * 1024));
+
+    fprintf(stderr, "%-40s %12.1f ns/op", name, median);
+    if(bytes > 0)
+        fprintf(stderr, " %10.1f MB/s", bytes / median * NSEC / (1024 * 1024));
+    fprintf(stderr, "  (%lld calls in %.2f s)\n", iterations, (double)elapsed / NSEC);
+}
+
+void bench_result(const char *name, ...)
+{
+    const char *key;
+    va_list ap;
+    result *r;
+    int i;
+
+    if((r = new_result(name)) == NULL)
+        return;
+
+    va_start(ap, name);
+    while((key = va_arg(ap, const char *)) != NULL)
+        add_value(r, key, va_arg(ap, double));
+    va_end(ap);
+
+    fprintf(stderr, "%-40s", name);
+    for(i = 0; i < r->count; i++)
+        fprintf(stderr, " %s=%.1f", r->key[i], r->value[i]);
+    fprintf(stderr, "\n");
+}
+
+int bench_finish(void)
+{
+    FILE *f = stdout;
+    int i, j;
+
+    if(output_file != NULL && (f = fopen(output_file, "w")) == NULL) {
+        perror(output_file);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(f, "{\"suite\": \"%s\", ", suite_name);
+#ifdef GIT_HASH
+    fprintf(f, "\"git\": \"%s\", ", GIT_HASH);
+#endif
+    fprintf(f, "\"seconds\": %.2f, \"results\": [", seconds);
+    for(i = 0; i < result_count; i++) {
+        fprintf(f, "%s\n{\"name\": \"%s\"", i ? "," : "", results[i].name);
+        for(j = 0; j < results[i].count; j++) {
+            double v = results[i].value[j];
+
+            /* counts without the fraction */
+            if(v == (long long)v)
+                fprintf(f, ", \"%s\": %lld", results[i].key[j], (long long)v);
+            else
+                fprintf(f, ", \"%s\": %.3f", results[i].key[j], v);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+
+    if(f != stdout)
+        fclose(f);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+/* the function measured by bench_run(), called over and over */
+typedef void (*bench_fn)(void *arg);
+
+/* a handler for the options of a benchmark program, returns 0 if the option
+   was fine */
+typedef int (*bench_option)(int c, const char *arg);
+
+/* parses the common options of all benchmarks:
+     -t seconds  time to spend on each benchmark, default 1
+     -o file     write the JSON results to the file instead of stdout
+     -h          help
+   the getopt() string options adds more, they are passed to option. The
+   first other argument is a filter, only benchmarks whose name contains it
+   are run. Returns -1 after -h or an invalid option, otherwise 0. */
+int bench_init(int argc, char *argv[], const char *suite, const char *options, bench_option option);
+
+/* nonzero if the benchmark of that name passes the filter */
+int bench_selected(const char *name);
+
+/* the time to spend on each benchmark in seconds */
+double bench_seconds(void);
+
+/* CLOCK_MONOTONIC and CLOCK_PROCESS_CPUTIME_ID in ns */
+long long bench_now(void);
+long long bench_cpu(void);
+
+/* runs fn in batches of at least 10 ms for bench_seconds() and records the
+   time per call, bytes is the amount of data one call processes or 0 */
+void bench_run(const char *name, bench_fn fn, void *arg, size_t bytes);
+
+/* records a result measured by the caller, the values are name/value pairs
+   ending with NULL: bench_result("x", "fps", 30.0, "p99_us", 812.0, NULL) */
+void bench_result(const char *name, ...);
+
+/* writes the JSON results, returns the exit code for main() */
+int bench_finish(void);
+
+#endif
@@ -0,0 +1,390 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  The whole pipeline in one process: input_testpicture publishes frames,
+  output_http streams them to clients on the loopback interface, which run as
+  threads of this program. The plugins are loaded like mjpg_streamer does it.
+
+  The frames of input_testpicture carry the time they were published in a
+  COM segment, the clients take the latency from there. The CPU time per
+  frame is the time of the process less the time of the client threads,
+  divided by the frames the clients received.
+
+      bench_pipeline [-c clients] [-p port] [-i "input options"] [-d plugin dir]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../mjpg_streamer.h"
+#include "bench.h"
+
+#define MAX_CLIENTS 256
+#define MAX_SAMPLES (1024 * 1024)
+#define RECEIVE_SIZE (8 * 1024 * 1024)
+
+/* the seconds to run before measuring */
+#define WARMUP 0.5
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    char *buffer;
+    int start, end;
+
+    /* results of the measuring window */
+    unsigned long frames;
+    unsigned int first_seq, last_seq;
+    long long cpu_start, cpu_end;
+    long long *latency;     /* in us */
+    int samples;
+} client;
+
+static globals global;
+static client clients[MAX_CLIENTS];
+static int client_count = 4;
+static int port = 8090;
+static const char *input_options = "-r 640x480 -f 0";
+static const char *plugin_dir = ".";
+
+static volatile int measuring, running = 1;
+
+static int option(int c, const char *arg)
+{
+    switch(c) {
+    case 'c':
+        client_count = atoi(arg);
+        return client_count < 1 || client_count > MAX_CLIENTS;
+    case 'p':
+        port = atoi(arg);
+        return port <= 0;
+    case 'i':
+        input_options = arg;
+        return 0;
+    case 'd':
+        plugin_dir = arg;
+        return 0;
+    }
+    return -1;
+}
+
+static long long thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/******************************************************************************
+Description.: receive until the buffer of the client holds size bytes behind
+              start
+Input Value.: client, bytes needed
+Return Value: 0 if ok, -1 when the connection ended
+******************************************************************************/
+static int receive(client *cl, int size)
+{
+    int n;
+
+    if(cl->end - cl->start >= size)
+        return 0;
+
+    if(size > RECEIVE_SIZE)
+        return -1;
+
+    if(RECEIVE_SIZE - cl->start < size) {
+        memmove(cl->buffer, cl->buffer + cl->start, cl->end - cl->start);
+        cl->end -= cl->start;
+        cl->start = 0;
+    }
+
+    while(cl->end - cl->start < size) {
+        if((n = recv(cl->fd, cl->buffer + cl->end, RECEIVE_SIZE - cl->end, 0)) <= 0)
+            return -1;
+        cl->end += n;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: receive up to and including the next empty line
+Input Value.: client
+Return Value: the headers, terminated at the empty line, or NULL
+******************************************************************************/
+static char *receive_headers(client *cl)
+{
+    char *headers, *end;
+
+    for(;;) {
+        headers = cl->buffer + cl->start;
+        end = memmem(headers, cl->end - cl->start, "\r\n\r\n", 4);
+        if(end != NULL) {
+            *end = '\0';
+            cl->start = end + 4 - cl->buffer;
+            return headers;
+        }
+        if(receive(cl, cl->end - cl->start + 1) != 0)
+            return NULL;
+    }
+}
+
+/******************************************************************************
+Description.: record the latency and sequence number of a frame
+Input Value.: client, JPEG frame, its size
+Return Value: -
+******************************************************************************/
+static void record(client *cl, const unsigned char *frame, int size)
+{
+    struct timeval now;
+    unsigned int seq;
+    long sec, usec;
+
+    if(size < 70 || frame[2] != 0xff || frame[3] != 0xfe ||
+       sscanf((const char *)frame + 6, "mjpg-streamer seq=%u time=%ld.%ld", &seq, &sec, &usec) != 3)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    if(cl->frames++ == 0) {
+        cl->first_seq = seq;
+        cl->cpu_start = thread_cpu();
+    }
+    cl->last_seq = seq;
+    cl->cpu_end = thread_cpu();
+
+    if(cl->samples < MAX_SAMPLES)
+        cl->latency[cl->samples++] = (now.tv_sec - sec) * 1000000LL + (now.tv_usec - usec);
+}
+
+/******************************************************************************
+Description.: a client reading the M-JPEG stream
+Input Value.: the client
+Return Value: NULL
+******************************************************************************/
+static void *client_thread(void *arg)
+{
+    static const char request[] = "GET /?action=stream HTTP/1.0\r\n\r\n";
+    client *cl = arg;
+    struct sockaddr_in addr;
+    char *headers, *length;
+    int size;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       write(cl->fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        perror("connect");
+        return NULL;
+    }
+
+    /* the response headers */
+    if(receive_headers(cl) == NULL)
+        return NULL;
+
+    while(running) {
+        if((headers = receive_headers(cl)) == NULL)
+            break;
+        if((length = strstr(headers, "Content-Length: ")) == NULL)
+            continue;
+        size = atoi(length + strlen("Content-Length: "));
+
+        if(receive(cl, size) != 0)
+            break;
+        if(measuring)
+            record(cl, (unsigned char *)cl->buffer + cl->start, size);
+        cl->start += size;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: load a plugin and initialize it like mjpg_streamer does
+Input Value.: file name of the plugin, prefix of its functions, its options,
+              parameter structure, addresses for the functions
+Return Value: the handle of the plugin or NULL
+******************************************************************************/
+static void *load_plugin(const char *name, const char *prefix, const char *options,
+                         int *argc, char **argv, void **init, void **stop, void **run)
+{
+    char path[1024], symbol[64], *arg, *token, *saveptr = NULL;
+    void *handle;
+
+    snprintf(path, sizeof(path), "%s/%s", plugin_dir, name);
+    if((handle = dlopen(path, RTLD_NOW)) == NULL) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return NULL;
+    }
+
+    snprintf(symbol, sizeof(symbol), "%s_init", prefix);
+    *init = dlsym(handle, symbol);
+    snprintf(symbol, sizeof(symbol), "%s_stop", prefix);
+    *stop = dlsym(handle, symbol);
+    snprintf(symbol, sizeof(symbol), "%s_run", prefix);
+    *run = dlsym(handle, symbol);
+    if(*init == NULL || *stop == NULL || *run == NULL) {
+        fprintf(stderr, "%s is not a %s plugin\n", path, prefix);
+        return NULL;
+    }
+
+    /* the same arguments split_parameters() of mjpg_streamer prepares */
+    *argc = 1;
+    argv[0] = NULL;
+    arg = strdup(options);
+    for(token = strtok_r(arg, " ", &saveptr); token != NULL && *argc < MAX_PLUGIN_ARGUMENTS;
+        token = strtok_r(NULL, " ", &saveptr))
+        argv[(*argc)++] = strdup(token);
+    free(arg);
+
+    return handle;
+}
+
+static int compare(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    char output_options[64], name[64];
+    long long start, cpu, client_cpu = 0, *latency;
+    unsigned long frames = 0, published = 0;
+    double elapsed;
+    int i, j, samples = 0;
+
+    if(bench_init(argc, argv, "pipeline", "c:p:i:d:", option) < 0)
+        return EXIT_FAILURE;
+
+    /* ignore SIGPIPE like mjpg_streamer, the clients disconnect at the end */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* the input plugin */
+    global.incnt = 1;
+    pthread_mutex_init(&global.in[0].db, NULL);
+    pthread_cond_init(&global.in[0].db_update, NULL);
+    global.in[0].plugin = "input_testpicture.so";
+    global.in[0].handle = load_plugin(global.in[0].plugin, "input", input_options,
+                                      &global.in[0].param.argc, global.in[0].param.argv,
+                                      (void **)&global.in[0].init, (void **)&global.in[0].stop,
+                                      (void **)&global.in[0].run);
+    global.in[0].param.global = &global;
+    global.in[0].param.id = 0;
+    if(global.in[0].handle == NULL || global.in[0].init(&global.in[0].param, 0) != 0)
+        return EXIT_FAILURE;
+
+    /* the output plugin */
+    snprintf(output_options, sizeof(output_options), "-p %d", port);
+    global.outcnt = 1;
+    global.out[0].plugin = "output_http.so";
+    global.out[0].handle = load_plugin(global.out[0].plugin, "output", output_options,
+                                       &global.out[0].param.argc, global.out[0].param.argv,
+                                       (void **)&global.out[0].init, (void **)&global.out[0].stop,
+                                       (void **)&global.out[0].run);
+    global.out[0].param.global = &global;
+    global.out[0].param.id = 0;
+    if(global.out[0].handle == NULL || global.out[0].init(&global.out[0].param, 0) != 0)
+        return EXIT_FAILURE;
+
+    global.in[0].run(0);
+    global.out[0].run(0);
+    usleep(100 * 1000);
+
+    for(i = 0; i < client_count; i++) {
+        clients[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+        clients[i].buffer = malloc(RECEIVE_SIZE);
+        clients[i].latency = malloc(MAX_SAMPLES * sizeof(long long));
+        if(clients[i].fd < 0 || clients[i].buffer == NULL || clients[i].latency == NULL)
+            return EXIT_FAILURE;
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    }
+
+    usleep(WARMUP * 1000000);
+
+    start = bench_now();
+    cpu = bench_cpu();
+    measuring = 1;
+    usleep(bench_seconds() * 1000000);
+    measuring = 0;
+    cpu = bench_cpu() - cpu;
+    elapsed = (bench_now() - start) / 1e9;
+
+    /* the clients stop after their current frame */
+    running = 0;
+    for(i = 0; i < client_count; i++) {
+        shutdown(clients[i].fd, SHUT_RDWR);
+        pthread_join(clients[i].thread, NULL);
+        close(clients[i].fd);
+    }
+
+    global.stop = 1;
+    global.in[0].stop(0);
+    global.out[0].stop(0);
+
+    latency = malloc(client_count * (size_t)MAX_SAMPLES * sizeof(long long));
+    for(i = 0; i < client_count; i++) {
+        frames += clients[i].frames;
+        client_cpu += clients[i].cpu_end - clients[i].cpu_start;
+        if(clients[i].frames > 0 && clients[i].last_seq - clients[i].first_seq + 1 > published)
+            published = clients[i].last_seq - clients[i].first_seq + 1;
+        for(j = 0; j < clients[i].samples; j++)
+            latency[samples++] = clients[i].latency[j];
+        free(clients[i].buffer);
+        free(clients[i].latency);
+    }
+
+    if(samples == 0) {
+        fprintf(stderr, "the clients received no frames\n");
+        return EXIT_FAILURE;
+    }
+    qsort(latency, samples, sizeof(latency[0]), compare);
+
+    snprintf(name, sizeof(name), "pipeline/testpicture_http/%d_clients", client_count);
+    bench_result(name,
+                 "clients", (double)client_count,
+                 "fps", frames / elapsed / client_count,
+                 "input_fps", published / elapsed,
+                 "cpu_us_per_frame", (cpu - client_cpu) / 1e3 / frames,
+                 "latency_p50_us", (double)latency[samples / 2],
+                 "latency_p90_us", (double)latency[samples * 9 / 10],
+                 "latency_p99_us", (double)latency[samples * 99 / 100],
+                 "latency_max_us", (double)latency[samples - 1],
+                 NULL);
+    free(latency);
+
+    return bench_finish();
+}
@@ -0,0 +1,155 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  The stream parser of input_http: extract_data() on a stream of
+  mjpg-streamer, once with Content-Length headers and once without, where the
+  body has to be searched for the next boundary. The data is handed over in
+  pieces of the size recv() typically returns, the buffer is managed like
+  proxy_receive() does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../plugins/input_http/mjpg-proxy.h"
+#include "bench.h"
+#include "pictures.h"
+
+#define PIECE_SIZE (16 * 1024)
+
+typedef struct {
+    struct extractor_state state;
+    char *part;
+    int size;
+    unsigned long frames;
+} parse_job;
+
+static void on_image(struct extractor_state *state, char *data, int length)
+{
+    parse_job *job = (parse_job *)state;
+
+    job->frames++;
+}
+
+/******************************************************************************
+Description.: feed one part of the stream to the parser, the parts repeat so
+              this is a continuous stream
+Input Value.: the job
+Return Value: -
+******************************************************************************/
+static void run_extract_data(void *arg)
+{
+    parse_job *job = arg;
+    struct extractor_state *state = &job->state;
+    const char *error;
+    int offset, n, shift;
+
+    for(offset = 0; offset < job->size; offset += n) {
+        n = job->size - offset < PIECE_SIZE ? job->size - offset : PIECE_SIZE;
+
+        if(state->net_start == state->net_end) {
+            state->net_start = state->net_end = state->chunk_pos = state->searched = 0;
+        } else if(state->net_capacity - state->net_end < PIECE_SIZE) {
+            shift = state->net_start;
+            memmove(state->netbuffer, state->netbuffer + shift, state->net_end - shift);
+            state->net_start = 0;
+            state->net_end -= shift;
+            state->searched = state->searched > shift ? state->searched - shift : 0;
+        }
+
+        memcpy(state->netbuffer + state->net_end, job->part + offset, n);
+        state->net_end += n;
+
+        if((error = extract_data(state)) != NULL) {
+            fprintf(stderr, "extract_data: %s\n", error);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/******************************************************************************
+Description.: prepare the parser and a part like output_http sends it
+Input Value.: the job, the frame, whether to send Content-Length
+Return Value: -
+******************************************************************************/
+static void init_job(parse_job *job, const picture *pic, int content_length)
+{
+    char header[256];
+    int length;
+
+    memset(job, 0, sizeof(*job));
+    init_mjpg_proxy(&job->state);
+    job->state.phase = PHASE_DELIMITER;
+    job->state.on_image_received = on_image;
+
+    if(content_length)
+        length = snprintf(header, sizeof(header), "--boundarydonotcross\r\n" \
+                          "Content-Type: image/jpeg\r\n" \
+                          "Content-Length: %d\r\n" \
+                          "X-Timestamp: 1234567890.123456\r\n" \
+                          "\r\n", pic->size);
+    else
+        length = snprintf(header, sizeof(header), "--boundarydonotcross\r\n" \
+                          "Content-Type: image/jpeg\r\n" \
+                          "X-Timestamp: 1234567890.123456\r\n" \
+                          "\r\n");
+
+    job->size = length + pic->size + 2;
+    job->part = malloc(job->size);
+    memcpy(job->part, header, length);
+    memcpy(job->part + length, pic->data, pic->size);
+    memcpy(job->part + length + pic->size, "\r\n", 2);
+
+    /* room for two parts, the body search keeps the part until the next
+       delimiter arrived */
+    job->state.net_capacity = 2 * job->size + PIECE_SIZE;
+    job->state.netbuffer = malloc(job->state.net_capacity);
+    job->state.capacity = pic->size;
+    job->state.buffer = malloc(job->state.capacity);
+}
+
+static void free_job(parse_job *job)
+{
+    close_mjpg_proxy(&job->state);
+    free(job->part);
+}
+
+int main(int argc, char *argv[])
+{
+    const picture *pic = find_picture("640x480_1");
+    parse_job job;
+
+    if(bench_init(argc, argv, "proxy", NULL, NULL) < 0)
+        return EXIT_FAILURE;
+
+    init_job(&job, pic, 1);
+    bench_run("extract_data/content_length", run_extract_data, &job, job.size);
+    free_job(&job);
+
+    init_job(&job, pic, 0);
+    bench_run("extract_data/boundary_search", run_extract_data, &job, job.size);
+    free_job(&job);
+
+    return bench_finish();
+}
@@ -0,0 +1,106 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  The sharpness estimate of output_autofocus and output_http on frames of
+  different sizes: with the tables cached from the previous frame, with a new
+  engine that builds the tables for every frame, and for the centre quarter
+  of the frame.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../sharpness.h"
+#include "bench.h"
+#include "pictures.h"
+
+typedef struct {
+    unsigned char *data;
+    int size;
+    sharpness *engine;
+    const sharpness_roi *roi;
+} sharpness_job;
+
+static const sharpness_roi center = { 0.25, 0.25, 0.5, 0.5 };
+
+static void run_cached(void *arg)
+{
+    sharpness_job *job = arg;
+
+    sharpness_measure(job->engine, job->data, job->size, job->roi, NULL);
+}
+
+static void run_cold(void *arg)
+{
+    sharpness_job *job = arg;
+    sharpness *engine = sharpness_new();
+
+    sharpness_measure(engine, job->data, job->size, NULL, NULL);
+    sharpness_free(engine);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = { "320x240_1", "640x480_1", "960x720_1" };
+    char name[64];
+    sharpness_job job;
+    const picture *pic;
+    int i;
+
+    if(bench_init(argc, argv, "sharpness", NULL, NULL) < 0)
+        return EXIT_FAILURE;
+
+    if((job.engine = sharpness_new()) == NULL)
+        return EXIT_FAILURE;
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        pic = find_picture(names[i]);
+        job.size = pic->size;
+        if((job.data = malloc(job.size)) == NULL)
+            return EXIT_FAILURE;
+        memcpy(job.data, pic->data, job.size);
+
+        if(sharpness_measure(job.engine, job.data, job.size, NULL, NULL) < 0) {
+            fprintf(stderr, "%s: %s\n", names[i], sharpness_error(job.engine));
+            return EXIT_FAILURE;
+        }
+
+        job.roi = NULL;
+        snprintf(name, sizeof(name), "sharpness_measure/%s", names[i]);
+        bench_run(name, run_cached, &job, job.size);
+
+        snprintf(name, sizeof(name), "sharpness_measure/%s/new_engine", names[i]);
+        bench_run(name, run_cold, &job, job.size);
+
+        job.roi = &center;
+        snprintf(name, sizeof(name), "sharpness_measure/%s/center", names[i]);
+        bench_run(name, run_cached, &job, job.size);
+
+        free(job.data);
+    }
+
+    sharpness_free(job.engine);
+
+    return bench_finish();
+}
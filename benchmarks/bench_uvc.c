@@ -0,0 +1,170 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  The per-frame work of input_uvc: memcpy_picture() with and without the
+  Huffman tables of MJPEG cameras, and compress_image_to_jpeg() for each raw
+  format it converts.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../plugins/input_uvc/v4l2uvc.h"
+#include "../plugins/input_uvc/jpeg_utils.h"
+#include "bench.h"
+#include "pictures.h"
+
+#define WIDTH 640
+#define HEIGHT 480
+#define QUALITY 80
+
+/* room for the DHT segment memcpy_picture() inserts */
+#define DHT_ROOM 1024
+
+typedef struct {
+    unsigned char *in, *out;
+    int size;
+} copy_job;
+
+typedef struct {
+    struct vdIn vd;
+    unsigned char *out;
+    int size;
+} compress_job;
+
+static void run_is_huffman(void *arg)
+{
+    copy_job *job = arg;
+
+    is_huffman(job->in);
+}
+
+static void run_memcpy_picture(void *arg)
+{
+    copy_job *job = arg;
+
+    memcpy_picture(job->out, job->in, job->size);
+}
+
+static void run_compress(void *arg)
+{
+    compress_job *job = arg;
+
+    compress_image_to_jpeg(&job->vd, job->out, job->size, QUALITY);
+}
+
+/******************************************************************************
+Description.: copy a JPEG without its DHT segments, like the frames of MJPEG
+              cameras that rely on the default Huffman tables
+Input Value.: picture, destination of at least the size of the picture
+Return Value: size of the copy
+******************************************************************************/
+static int strip_dht(const picture *pic, unsigned char *out)
+{
+    const unsigned char *p = pic->data + 2, *end = pic->data + pic->size;
+    int size = 2, length;
+
+    memcpy(out, pic->data, 2);
+    while(p + 4 <= end && p[0] == 0xff && p[1] != 0xda) {
+        length = 2 + ((p[2] << 8) | p[3]);
+        if(p[1] != 0xc4) {
+            memcpy(out + size, p, length);
+            size += length;
+        }
+        p += length;
+    }
+    memcpy(out + size, p, end - p);
+    return size + (end - p);
+}
+
+/******************************************************************************
+Description.: fill a raw frame with a gradient, so the encoder has some
+              detail to compress
+Input Value.: frame, its size
+Return Value: -
+******************************************************************************/
+static void fill_frame(unsigned char *frame, int size)
+{
+    int i;
+
+    for(i = 0; i < size; i++)
+        frame[i] = (i * 7 + (i / (WIDTH * 2)) * 3) & 0xff;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct {
+        const char *name;
+        int format, bytes_per_pixel;
+    } formats[] = {
+        { "compress_image_to_jpeg/yuyv", V4L2_PIX_FMT_YUYV, 2 },
+        { "compress_image_to_jpeg/uyvy", V4L2_PIX_FMT_UYVY, 2 },
+        { "compress_image_to_jpeg/rgb24", V4L2_PIX_FMT_RGB24, 3 },
+        { "compress_image_to_jpeg/rgb565", V4L2_PIX_FMT_RGB565, 2 }
+    };
+    const picture *pic = find_picture("640x480_1");
+    copy_job copy;
+    compress_job compress;
+    int i;
+
+    if(bench_init(argc, argv, "uvc", NULL, NULL) < 0)
+        return EXIT_FAILURE;
+
+    copy.in = malloc(pic->size);
+    copy.out = malloc(pic->size + DHT_ROOM);
+    if(copy.in == NULL || copy.out == NULL)
+        return EXIT_FAILURE;
+
+    memcpy(copy.in, pic->data, pic->size);
+    copy.size = pic->size;
+    bench_run("is_huffman/dht", run_is_huffman, &copy, 0);
+    bench_run("memcpy_picture/dht", run_memcpy_picture, &copy, copy.size);
+
+    copy.size = strip_dht(pic, copy.in);
+    bench_run("is_huffman/no_dht", run_is_huffman, &copy, 0);
+    bench_run("memcpy_picture/no_dht", run_memcpy_picture, &copy, copy.size);
+
+    memset(&compress, 0, sizeof(compress));
+    compress.vd.width = WIDTH;
+    compress.vd.height = HEIGHT;
+    compress.size = WIDTH * HEIGHT * 3;
+    compress.vd.framebuffer = malloc(compress.size);
+    compress.out = malloc(compress.size);
+    if(compress.vd.framebuffer == NULL || compress.out == NULL)
+        return EXIT_FAILURE;
+    fill_frame(compress.vd.framebuffer, compress.size);
+
+    for(i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        compress.vd.formatIn = formats[i].format;
+        bench_run(formats[i].name, run_compress, &compress,
+                  WIDTH * HEIGHT * formats[i].bytes_per_pixel);
+    }
+
+    free(copy.in);
+    free(copy.out);
+    free(compress.vd.framebuffer);
+    free(compress.out);
+
+    return bench_finish();
+}
@@ -0,0 +1,35 @@
+/* the JPEG pictures of input_testpicture, used as sample frames */
+
+#ifndef BENCH_PICTURES_H
+#define BENCH_PICTURES_H
+
+#include <string.h>
+
+#include "../plugins/input_testpicture/testpictures.h"
+
+typedef struct {
+    const char *name;
+    const unsigned char *data;
+    int size;
+} picture;
+
+#define PICTURE(w, h, n) { #w "x" #h "_" #n, PIC_##w##x##h##_##n, sizeof(PIC_##w##x##h##_##n) }
+
+static const picture pictures[] = {
+    PICTURE(160, 120, 1), PICTURE(160, 120, 2),
+    PICTURE(320, 240, 1), PICTURE(320, 240, 2),
+    PICTURE(640, 480, 1), PICTURE(640, 480, 2),
+    PICTURE(960, 720, 1), PICTURE(960, 720, 2)
+};
+
+static inline const picture *find_picture(const char *name)
+{
+    int i;
+
+    for(i = 0; i < sizeof(pictures) / sizeof(pictures[0]); i++)
+        if(strcmp(pictures[i].name, name) == 0)
+            return &pictures[i];
+    return NULL;
+}
+
+#endif
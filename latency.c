@@ -0,0 +1,446 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Latency tracing
+
+  Every frame gets the time it was captured on CLOCK_MONOTONIC, stored in
+  pglobal->in[].captured next to the frame. The plugins record the trace
+  points of a frame with latency_trace(), which appends to a ring owned by
+  the calling thread without taking a lock. A collector thread drains the
+  rings every 100 ms and adds the time since the capture to one histogram
+  per input and trace point. With --trace, it also writes the events as a
+  Chrome trace that chrome://tracing and Perfetto open.
+
+  The histograms keep 64 linear buckets per power of two above 128 us, so
+  the percentiles are off by 1.6 % at most.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "mjpg_streamer.h"
+#include "utils.h"
+#include "latency.h"
+
+#define RING_SIZE 1024          /* events per thread, a power of two */
+#define COLLECT_INTERVAL 100    /* ms */
+
+#define SUB_BUCKETS 64
+#define LINEAR_BUCKETS (2 * SUB_BUCKETS)
+#define BUCKETS (LINEAR_BUCKETS + (32 - 7) * SUB_BUCKETS)
+#define MAX_VALUE 0xFFFFFFFFLL  /* us, a bit more than an hour */
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "dequeue", "encode_start", "encode_end", "publish", "copy", "write"
+};
+
+typedef struct {
+    int input;
+    int stage;
+    long long captured;
+    long long start;    /* of the slice in the Chrome trace */
+    long long time;
+} latency_event;
+
+typedef struct _latency_ring latency_ring;
+struct _latency_ring {
+    latency_event events[RING_SIZE];
+    unsigned long head;     /* written by the owner thread only */
+    unsigned long tail;     /* written by the collector only */
+    int released;           /* the owner thread exited */
+    int tid;
+
+    /* the last event of the owner thread */
+    long long last_captured;
+    long long last_time;
+
+    latency_ring *next;
+};
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum;
+    long long min, max;
+    unsigned int buckets[BUCKETS];
+} histogram;
+
+int latency_enabled = 0;
+
+static pthread_key_t ring_key;
+static latency_ring *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the collector owns everything below */
+static pthread_mutex_t collect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static histogram *histograms[MAX_INPUT_PLUGINS][LATENCY_STAGES];
+static unsigned long lost = 0;
+static FILE *trace = NULL;
+static int trace_events = 0;
+
+static pthread_t collector;
+static int collecting = 0;
+
+/******************************************************************************
+Description.: reads the clock the trace points are measured with
+Input Value.: -
+Return Value: CLOCK_MONOTONIC in ns
+******************************************************************************/
+long long latency_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* the owner thread exits, the collector drains what is left and the ring
+   can be taken over by a new thread afterwards */
+static void release_ring(void *arg)
+{
+    latency_ring *ring = arg;
+
+    __atomic_store_n(&ring->released, 1, __ATOMIC_RELEASE);
+}
+
+/* the ring of the calling thread, a drained ring of a thread that exited
+   is reused */
+static latency_ring *thread_ring(void)
+{
+    latency_ring *ring = pthread_getspecific(ring_key);
+
+    if(ring != NULL)
+        return ring;
+
+    pthread_mutex_lock(&rings_mutex);
+    for(ring = rings; ring != NULL; ring = ring->next) {
+        if(__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head)
+            break;
+    }
+
+    if(ring == NULL) {
+        ring = calloc(1, sizeof(latency_ring));
+        if(ring == NULL) {
+            pthread_mutex_unlock(&rings_mutex);
+            return NULL;
+        }
+        ring->next = rings;
+        rings = ring;
+    }
+
+    ring->tid = syscall(SYS_gettid);
+    ring->last_captured = 0;
+    __atomic_store_n(&ring->released, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_mutex);
+
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/******************************************************************************
+Description.: records that a frame passed a trace point, without locking
+Input Value.: input plugin number, capture time of the frame from
+              latency_now() or 0 if unknown, the trace point
+Return Value: -
+******************************************************************************/
+void latency_trace(int input, long long captured, latency_stage stage)
+{
+    latency_ring *ring;
+    latency_event *event;
+    long long now;
+
+    if(!latency_enabled || captured == 0 || input < 0 || input >= MAX_INPUT_PLUGINS)
+        return;
+
+    ring = thread_ring();
+    if(ring == NULL)
+        return;
+
+    now = latency_now();
+
+    /* the collector must see the head that marks the slot as overwritten
+       before any of the new event, pairs with the fence in collect() */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event = &ring->events[ring->head & (RING_SIZE - 1)];
+    event->input = input;
+    event->stage = stage;
+    event->captured = captured;
+    event->time = now;
+
+    /* a slice from the previous point of the same frame in this thread, the
+       first point of the input plugin starts at the capture */
+    if(ring->last_captured == captured)
+        event->start = ring->last_time;
+    else
+        event->start = (stage < LATENCY_COPY) ? captured : now;
+
+    ring->last_captured = captured;
+    ring->last_time = now;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static int bucket_index(long long value)
+{
+    int bits, shift;
+
+    if(value < LINEAR_BUCKETS)
+        return value;
+
+    bits = 63 - __builtin_clzll(value);
+    shift = bits - 6;
+    return LINEAR_BUCKETS + (bits - 7) * SUB_BUCKETS + (int)(value >> shift) - SUB_BUCKETS;
+}
+
+/* the middle of the values counted in a bucket */
+static long long bucket_value(int index)
+{
+    int bits, shift;
+
+    if(index < LINEAR_BUCKETS)
+        return index;
+
+    bits = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 7;
+    shift = bits - 6;
+    return ((long long)((index - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS) << shift) + (1LL << shift) / 2;
+}
+
+static void record(int input, int stage, long long value)
+{
+    histogram *h = histograms[input][stage];
+
+    if(h == NULL) {
+        h = histograms[input][stage] = calloc(1, sizeof(histogram));
+        if(h == NULL)
+            return;
+        h->min = MAX_VALUE;
+    }
+
+    if(value < 0)
+        value = 0;
+    if(value > MAX_VALUE)
+        value = MAX_VALUE;
+
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value < h->min)
+        h->min = value;
+    if(value > h->max)
+        h->max = value;
+}
+
+static long long percentile(histogram *h, double p)
+{
+    unsigned long long rank = (unsigned long long)(p * h->count + 0.5), seen = 0;
+    long long value;
+    int i;
+
+    if(rank < 1)
+        rank = 1;
+
+    for(i = 0; i < BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= rank)
+            break;
+    }
+
+    value = bucket_value(i);
+    if(value < h->min)
+        value = h->min;
+    if(value > h->max)
+        value = h->max;
+    return value;
+}
+
+static void write_event(latency_event *event, int tid)
+{
+    fprintf(trace, "%s{\"name\":\"%s\",\"cat\":\"input%d\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld,\"latency_us\":%lld}}",
+            trace_events++ ? ",\n" : "[\n", stage_names[event->stage], event->input, event->input, tid,
+            event->start / 1000.0, (event->time - event->start) / 1000.0,
+            event->captured / 1000, (event->time - event->captured) / 1000);
+}
+
+/* drains all rings into the histograms, collect_mutex must be held */
+static void collect(void)
+{
+    latency_ring *ring;
+
+    pthread_mutex_lock(&rings_mutex);
+    for(ring = rings; ring != NULL; ring = ring->next) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = ring->tail;
+
+        if(head - tail > RING_SIZE) {
+            lost += head - tail - RING_SIZE;
+            tail = head - RING_SIZE;
+        }
+
+        for(; tail != head; tail++) {
+            latency_event event = ring->events[tail & (RING_SIZE - 1)];
+
+            /* the owner may have overwritten it while it was copied, the
+               fence keeps the copy ahead of the check of head */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - tail >= RING_SIZE) {
+                lost++;
+                continue;
+            }
+
+            record(event.input, event.stage, (event.time - event.captured) / 1000);
+            if(trace != NULL)
+                write_event(&event, ring->tid);
+        }
+
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if(trace != NULL)
+        fflush(trace);
+}
+
+static void *collector_thread(void *arg)
+{
+    struct timespec interval = { 0, COLLECT_INTERVAL * 1000000L };
+
+    while(__atomic_load_n(&collecting, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+
+        pthread_mutex_lock(&collect_mutex);
+        collect();
+        pthread_mutex_unlock(&collect_mutex);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: enables the tracing and starts the collector
+Input Value.: file for the Chrome trace or NULL
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+int latency_start(const char *trace_file)
+{
+    if(pthread_key_create(&ring_key, release_ring) != 0)
+        return -1;
+
+    if(trace_file != NULL) {
+        trace = fopen(trace_file, "w");
+        if(trace == NULL) {
+            perror("could not open the trace file");
+            return -1;
+        }
+    }
+
+    collecting = 1;
+    if(pthread_create(&collector, NULL, collector_thread, NULL) != 0) {
+        collecting = 0;
+        if(trace != NULL)
+            fclose(trace);
+        trace = NULL;
+        return -1;
+    }
+
+    latency_enabled = 1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: collects the remaining events and completes the trace file
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void latency_stop(void)
+{
+    if(!latency_enabled)
+        return;
+
+    latency_enabled = 0;
+    __atomic_store_n(&collecting, 0, __ATOMIC_RELEASE);
+    pthread_join(collector, NULL);
+
+    pthread_mutex_lock(&collect_mutex);
+    collect();
+    if(trace != NULL) {
+        fprintf(trace, "%s]\n", trace_events ? "\n" : "[");
+        fclose(trace);
+        trace = NULL;
+    }
+    pthread_mutex_unlock(&collect_mutex);
+}
+
+/******************************************************************************
+Description.: formats the histograms as JSON, the times since the capture of
+              the frames in us
+Input Value.: buffer and its size
+Return Value: length of the text, it was cut off if not less than size
+******************************************************************************/
+int latency_json(char *buffer, size_t size)
+{
+    int input, stage, length = 0, first_input = 1;
+
+    pthread_mutex_lock(&collect_mutex);
+    if(latency_enabled)
+        collect();
+
+    append_text(buffer, size, &length, "{\n\"enabled\": %s,\n\"unit\": \"us\",\n\"lost\": %lu,\n\"inputs\": [",
+           latency_enabled ? "true" : "false", lost);
+
+    for(input = 0; input < MAX_INPUT_PLUGINS; input++) {
+        int first_stage = 1;
+
+        for(stage = 0; stage < LATENCY_STAGES; stage++) {
+            histogram *h = histograms[input][stage];
+
+            if(h == NULL || h->count == 0)
+                continue;
+
+            if(first_stage) {
+                append_text(buffer, size, &length, "%s\n{\n\"id\": %d,\n\"stages\": {", first_input ? "" : ",", input);
+                first_input = 0;
+            }
+
+            append_text(buffer, size, &length, "%s\n\"%s\": {\"count\": %llu, \"min\": %lld, \"mean\": %llu, "
+                   "\"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}",
+                   first_stage ? "" : ",", stage_names[stage], h->count, h->min, h->sum / h->count,
+                   percentile(h, 0.5), percentile(h, 0.9), percentile(h, 0.99), percentile(h, 0.999),
+                   h->max);
+            first_stage = 0;
+        }
+
+        if(!first_stage)
+            append_text(buffer, size, &length, "\n}\n}");
+    }
+
+    append_text(buffer, size, &length, "\n]\n}\n");
+    pthread_mutex_unlock(&collect_mutex);
+
+    return length;
+}
@@ -0,0 +1,50 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stddef.h>
+
+/* the points a frame passes on its way from the camera to the clients, in
+   this order */
+typedef enum {
+    LATENCY_DEQUEUE,        /* the driver handed the frame over */
+    LATENCY_ENCODE_START,   /* compressing started */
+    LATENCY_ENCODE_END,     /* compressing finished */
+    LATENCY_PUBLISH,        /* the frame is in the global buffer */
+    LATENCY_COPY,           /* an output plugin copied the frame */
+    LATENCY_WRITE,          /* an output plugin wrote the frame to a socket */
+    LATENCY_STAGES
+} latency_stage;
+
+/* set by mjpg_streamer with --latency, tracing costs nothing otherwise */
+extern int latency_enabled;
+
+long long latency_now(void);
+void latency_trace(int input, long long captured, latency_stage stage);
+
+int latency_start(const char *trace_file);
+void latency_stop(void);
+int latency_json(char *buffer, size_t size);
+
+#endif
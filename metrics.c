@@ -0,0 +1,200 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  The registry of the metrics, see mjpg_streamer.h. Registering and the
+  text export take a mutex, updating a metric does not.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mjpg_streamer.h"
+#include "utils.h"
+
+static metric *metrics = NULL, *last = NULL;
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: adds a metric to the registry, it starts at 0
+Input Value.: name, help text and type of the metric, the factor of the
+              exposed value and the labels, formatted like printf, or NULL
+Return Value: the metric or NULL if there is no memory, updating NULL does
+              nothing
+******************************************************************************/
+metric *metric_register(const char *name, const char *help, int type, double scale,
+                        const char *labels, ...)
+{
+    metric *m = calloc(1, sizeof(metric));
+    va_list args;
+
+    if(m == NULL)
+        return NULL;
+
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    snprintf(m->help, sizeof(m->help), "%s", help);
+    if(labels != NULL) {
+        va_start(args, labels);
+        vsnprintf(m->labels, sizeof(m->labels), labels, args);
+        va_end(args);
+    }
+    m->type = type;
+    m->scale = scale;
+
+    /* appended, so the metrics of a name stay in the order of registering */
+    pthread_mutex_lock(&metrics_mutex);
+    if(last != NULL)
+        last->next = m;
+    else
+        metrics = m;
+    last = m;
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return m;
+}
+
+/******************************************************************************
+Description.: removes a metric from the registry and frees it
+Input Value.: the metric or NULL
+Return Value: -
+******************************************************************************/
+void metric_unregister(metric *m)
+{
+    metric **p, *previous = NULL;
+
+    if(m == NULL)
+        return;
+
+    pthread_mutex_lock(&metrics_mutex);
+    for(p = &metrics; *p != NULL; previous = *p, p = &(*p)->next) {
+        if(*p == m) {
+            *p = m->next;
+            if(last == m)
+                last = previous;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+
+    free(m);
+}
+
+/******************************************************************************
+Description.: reads the clock the wait times are measured with
+Input Value.: -
+Return Value: CLOCK_MONOTONIC in us
+******************************************************************************/
+long long metric_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/******************************************************************************
+Description.: locks a mutex and adds the time it had to wait for it, if any,
+              to a metric in us
+Input Value.: mutex and metric
+Return Value: -
+******************************************************************************/
+void metric_lock(pthread_mutex_t *mutex, metric *wait)
+{
+    long long start;
+
+    if(wait == NULL || pthread_mutex_trylock(mutex) == 0) {
+        if(wait == NULL)
+            pthread_mutex_lock(mutex);
+        return;
+    }
+
+    start = metric_now();
+    pthread_mutex_lock(mutex);
+    metric_add(wait, metric_now() - start);
+}
+
+/******************************************************************************
+Description.: registers the metrics input plugins have in common
+Input Value.: metrics to fill in, input plugin number
+Return Value: -
+******************************************************************************/
+void input_metrics_register(input_metrics *m, int input)
+{
+    m->frames = metric_register("mjpg_input_frames_total", "Frames published by the input plugin",
+                                METRIC_COUNTER, 1, "input=\"%d\"", input);
+    m->dropped = metric_register("mjpg_input_dropped_frames_total", "Frames captured but not published",
+                                 METRIC_COUNTER, 1, "input=\"%d\"", input);
+    m->encode = metric_register("mjpg_input_encode_seconds_total", "Time spent compressing frames",
+                                METRIC_COUNTER, 1e-6, "input=\"%d\"", input);
+    m->lock_wait = metric_register("mjpg_input_lock_wait_seconds_total",
+                                   "Time the input plugin waited for output plugins copying a frame",
+                                   METRIC_COUNTER, 1e-6, "input=\"%d\"", input);
+}
+
+/******************************************************************************
+Description.: formats all metrics in the Prometheus text format
+Input Value.: buffer and its size
+Return Value: length of the text, it was cut off if not less than size
+******************************************************************************/
+int metrics_text(char *buffer, size_t size)
+{
+    metric *m, *n;
+    int length = 0;
+
+    if(size > 0)
+        buffer[0] = '\0';
+
+    pthread_mutex_lock(&metrics_mutex);
+    for(m = metrics; m != NULL; m = m->next) {
+        /* the header once per name, before the first metric of the name */
+        for(n = metrics; n != m && strcmp(n->name, m->name) != 0; n = n->next)
+            ;
+        if(n != m)
+            continue;
+
+        append_text(buffer, size, &length, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help,
+               m->name, (m->type == METRIC_COUNTER) ? "counter" : "gauge");
+
+        for(n = m; n != NULL; n = n->next) {
+            long long value;
+
+            if(strcmp(n->name, m->name) != 0)
+                continue;
+
+            value = __atomic_load_n(&n->value, __ATOMIC_RELAXED);
+            if(n->scale == 1)
+                append_text(buffer, size, &length, "%s%s%s%s %lld\n", n->name, n->labels[0] ? "{" : "",
+                       n->labels, n->labels[0] ? "}" : "", value);
+            else
+                append_text(buffer, size, &length, "%s%s%s%s %.6f\n", n->name, n->labels[0] ? "{" : "",
+                       n->labels, n->labels[0] ? "}" : "", value * n->scale);
+        }
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+
+    return length;
+}
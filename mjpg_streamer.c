@@ -41,6 +41,7 @@
 
 #include "utils.h"
 #include "mjpg_streamer.h"
+#include "latency.h"
 
 /* globals */
 static globals global;
@@ -58,7 +59,10 @@ static void help(char *progname)
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n" \
+            " [-l | --latency ].....: trace the latency of the frames, see ?action=latency\n" \
+            " [-t | --trace ].......: also write the trace points to this file, in the\n" \
+            "                         JSON format of chrome://tracing and Perfetto\n", progname);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -121,6 +125,9 @@ static void signal_handler(int sig)
     }
     usleep(1000 * 1000);
 
+    /* collect the last trace points and complete the trace file */
+    latency_stop();
+
     /* close handles of input plugins */
     for(i = 0; i < global.incnt; i++) {
         dlclose(global.in[i].handle);
@@ -194,7 +201,8 @@ int main(int argc, char *argv[])
     //char *input  = "input_uvc.so --resolution 640x480 --fps 5 --device /dev/video0";
     char *input[MAX_INPUT_PLUGINS];
     char *output[MAX_OUTPUT_PLUGINS];
-    int daemon = 0, i, j;
+    int daemon = 0, latency = 0, i, j;
+    char *trace_file = NULL;
     size_t tmp = 0;
 
     output[0] = "output_http.so --port 8080";
@@ -210,16 +218,22 @@ int main(int argc, char *argv[])
             {"output", required_argument, NULL, 'o'},
             {"version", no_argument, NULL, 'v'},
             {"background", no_argument, NULL, 'b'},
+            {"latency", no_argument, NULL, 'l'},
+            {"trace", required_argument, NULL, 't'},
             {NULL, 0, NULL, 0}
         };
 
-        c = getopt_long(argc, argv, "hi:o:vb", long_options, NULL);
+        c = getopt_long(argc, argv, "hi:o:vblt:", long_options, NULL);
 
         /* no more options to parse */
         if(c == -1) break;
 
         switch(c) {
         case 'i':
+            if(global.incnt == MAX_INPUT_PLUGINS) {
+                fprintf(stderr, "at most %d input plugins are supported\n", MAX_INPUT_PLUGINS);
+                exit(EXIT_FAILURE);
+            }
             input[global.incnt++] = strdup(optarg);
             break;
 
@@ -242,6 +256,15 @@ int main(int argc, char *argv[])
             daemon = 1;
             break;
 
+        case 'l':
+            latency = 1;
+            break;
+
+        case 't':
+            latency = 1;
+            trace_file = optarg;
+            break;
+
         case 'h': /* fall through */
         default:
             help(argv[0]);
@@ -259,6 +282,13 @@ int main(int argc, char *argv[])
         daemon_mode();
     }
 
+    /* the collector thread of the latency trace must start after forking */
+    if(latency && latency_start(trace_file) != 0) {
+        LOG("could not start the latency trace\n");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+
     /* ignore SIGPIPE (send by OS if transmitting to closed TCP sockets) */
     signal(SIGPIPE, SIG_IGN);
 
@@ -24,8 +24,7 @@
 #define MJPG_STREAMER_H
 #define SOURCE_VERSION "2.0"
 
-/* FIXME take a look to the output_http clients thread marked with fixme if you want to set more then 10 plugins */
-#define MAX_INPUT_PLUGINS 10
+#define MAX_INPUT_PLUGINS 64
 #define MAX_OUTPUT_PLUGINS 10
 #define MAX_PLUGIN_ARGUMENTS 32
 
@@ -92,4 +91,53 @@ struct _globals {
     //int (*control)(int command, char *details);
 };
 
+/*
+ * metrics, output_http exposes them at /metrics in the Prometheus text
+ * format. A plugin registers a metric once and updates it with relaxed
+ * atomics, which costs about as much as incrementing a variable. Metrics
+ * with the same name must differ in their labels, e.g. input="0".
+ */
+#define METRIC_COUNTER 0
+#define METRIC_GAUGE   1
+
+typedef struct _metric metric;
+struct _metric {
+    char name[64];
+    char help[128];
+    char labels[128];
+    int type;
+    double scale;       /* exposed value = value * scale, e.g. 1e-6 for us */
+    long long value;
+    metric *next;
+};
+
+metric *metric_register(const char *name, const char *help, int type, double scale,
+                        const char *labels, ...);
+void metric_unregister(metric *m);
+void metric_lock(pthread_mutex_t *mutex, metric *wait);
+long long metric_now(void);
+int metrics_text(char *buffer, size_t size);
+
+static inline void metric_add(metric *m, long long n)
+{
+    if(m != NULL)
+        __atomic_fetch_add(&m->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_set(metric *m, long long n)
+{
+    if(m != NULL)
+        __atomic_store_n(&m->value, n, __ATOMIC_RELAXED);
+}
+
+/* the metrics input plugins have in common, labeled with the input number */
+typedef struct {
+    metric *frames;     /* published */
+    metric *dropped;    /* captured but not published */
+    metric *encode;     /* us spent compressing frames */
+    metric *lock_wait;  /* us waited for the frame lock to publish */
+} input_metrics;
+
+void input_metrics_register(input_metrics *m, int input);
+
 #endif
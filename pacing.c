@@ -0,0 +1,158 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Input plugins that produce frames on a timer used to sleep a fixed time
+  after each frame, so the frame rate dropped by the time the work took and
+  drifted under load. The deadlines here are absolute on CLOCK_MONOTONIC, the
+  time spent between two calls of pacing_wait() is not added to the interval.
+
+  The first call of pacing_wait() returns at once, every following call
+  sleeps until the next deadline:
+
+      pacing_init(&p, 1.0 / fps, PACING_SKIP);
+      while(!pglobal->stop) {
+          pacing_wait(&p);
+          grab and publish a frame
+      }
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pacing.h"
+
+#define NSEC 1000000000LL
+
+/* a PACING_CATCH_UP schedule gives up after falling behind that far */
+#define MAX_BACKLOG NSEC
+
+static long long to_ns(const struct timespec *ts)
+{
+    return (long long)ts->tv_sec * NSEC + ts->tv_nsec;
+}
+
+static struct timespec from_ns(long long ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / NSEC;
+    ts.tv_nsec = ns % NSEC;
+    return ts;
+}
+
+/******************************************************************************
+Description.: sets up a schedule, the first deadline is now
+Input Value.: schedule, seconds between deadlines and what to do with late
+              deadlines
+Return Value: -
+******************************************************************************/
+void pacing_init(pacing *p, double interval, pacing_policy policy)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    p->next = now;
+    p->interval = (interval > 0) ? (long long)(interval * NSEC) : 0;
+    p->policy = policy;
+
+    p->since = now;
+    p->ticks = p->late = p->skipped = p->sleeps = 0;
+    p->jitter_sum = p->jitter_max = 0;
+}
+
+/******************************************************************************
+Description.: sleeps until the next deadline, returns at once if it passed
+              already. This is a cancellation point.
+Input Value.: schedule
+Return Value: -
+******************************************************************************/
+void pacing_wait(pacing *p)
+{
+    struct timespec now;
+    long long next, behind, missed;
+
+    if(p->interval == 0) {
+        p->ticks++;
+        return;
+    }
+
+    next = to_ns(&p->next);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if(to_ns(&now) < next) {
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &p->next, NULL) == EINTR)
+            ;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        behind = to_ns(&now) - next;
+        p->jitter_sum += behind;
+        if(behind > p->jitter_max)
+            p->jitter_max = behind;
+        p->sleeps++;
+        next += p->interval;
+    } else {
+        behind = to_ns(&now) - next;
+        if(p->ticks > 0)
+            p->late++;
+
+        if(p->policy == PACING_SKIP) {
+            /* continue with the first deadline after now */
+            missed = behind / p->interval;
+            p->skipped += missed;
+            next += (missed + 1) * p->interval;
+        } else if(behind > MAX_BACKLOG) {
+            /* too far behind to catch up, start over */
+            next = to_ns(&now) + p->interval;
+        } else {
+            next += p->interval;
+        }
+    }
+
+    p->next = from_ns(next);
+    p->ticks++;
+}
+
+/******************************************************************************
+Description.: formats the statistics since the last report and resets them
+Input Value.: schedule and the buffer for the text
+Return Value: -
+******************************************************************************/
+void pacing_report(pacing *p, char *buffer, size_t size)
+{
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (double)(to_ns(&now) - to_ns(&p->since)) / NSEC;
+
+    snprintf(buffer, size, "%.2f fps, %lu late, %lu skipped, wake-up jitter %.3f/%.3f ms (avg/max)",
+             (elapsed > 0) ? p->ticks / elapsed : 0.0, p->late, p->skipped,
+             p->sleeps ? (double)p->jitter_sum / p->sleeps / 1000000 : 0.0,
+             (double)p->jitter_max / 1000000);
+
+    p->since = now;
+    p->ticks = p->late = p->skipped = p->sleeps = 0;
+    p->jitter_sum = p->jitter_max = 0;
+}
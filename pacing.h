@@ -0,0 +1,55 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef PACING_H
+#define PACING_H
+
+#include <stddef.h>
+#include <time.h>
+
+typedef enum {
+    /* late deadlines are served back to back until the schedule is met */
+    PACING_CATCH_UP,
+    /* late deadlines are dropped, the schedule continues at the next one */
+    PACING_SKIP
+} pacing_policy;
+
+typedef struct {
+    struct timespec next;       /* the next deadline */
+    long long interval;         /* between deadlines in ns, 0 = no pacing */
+    pacing_policy policy;
+
+    /* statistics since the last report */
+    struct timespec since;
+    unsigned long ticks;        /* deadlines served */
+    unsigned long late;         /* deadlines that had passed already */
+    unsigned long skipped;      /* deadlines dropped by PACING_SKIP */
+    long long jitter_sum;       /* ns woken up after the deadline */
+    long long jitter_max;
+    unsigned long sleeps;
+} pacing;
+
+void pacing_init(pacing *p, double interval, pacing_policy policy);
+void pacing_wait(pacing *p);
+void pacing_report(pacing *p, char *buffer, size_t size);
+
+#endif
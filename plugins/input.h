@@ -23,7 +23,7 @@
 #include <syslog.h>
 #include "../mjpg_streamer.h"
 #define INPUT_PLUGIN_PREFIX " i: "
-#define IPRINT(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
+#define IPRINT(...) { char _bf[4096] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", INPUT_PLUGIN_PREFIX); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
 /* parameters for input plugin */
 typedef struct _input_parameter input_parameter;
@@ -76,6 +76,10 @@ struct _input {
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* CLOCK_MONOTONIC time in ns the frame was captured, for the latency
+       trace, 0 if the input plugin does not trace */
+    long long captured;
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
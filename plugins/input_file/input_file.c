@@ -30,10 +30,15 @@
 #include <sys/inotify.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../../pacing.h"
 
 #define INPUT_PLUGIN_NAME "FILE input plugin"
 
@@ -42,6 +47,23 @@ typedef enum _read_mode {
     ExistingFiles
 } read_mode;
 
+typedef enum _backlog_policy {
+    DropOldest,
+    KeepAll
+} backlog_policy;
+
+/* a file announced by inotify that was not served yet */
+typedef struct _pending_file {
+    char name[NAME_MAX + 1];
+} pending_file;
+
+/* a frame buffer that is reused for the following files */
+typedef struct _frame_buffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} frame_buffer;
+
 /* private functions and variables to this plugin */
 static pthread_t   worker;
 static globals     *pglobal;
@@ -56,16 +78,45 @@ static char *filename = NULL;
 static int rm = 0;
 static int plugin_number;
 static read_mode mode = NewFilesOnly;
+static backlog_policy policy = DropOldest;
+static int queue_limit = 16;
+static int stats_interval = 0;
 
 /* global variables for this plugin */
 static int fd, rc, wd, size;
 static struct inotify_event *ev;
 
+/* files waiting to be served, a ring that grows for the keep-all policy */
+static pending_file *queue = NULL;
+static int queue_capacity = 0, queue_head = 0, queue_count = 0;
+
+/* one buffer is published, the next file is read into the other one */
+static frame_buffer frames[2];
+static int published = 0;
+
+static struct {
+    unsigned int frames;
+    unsigned int dropped;
+    unsigned int failed;
+    unsigned int overflows;
+    int peak_backlog;
+} stats;
+
+/* a frame every "delay" seconds, existing files are played at that rate on
+   average, new files that arrive late do not make up for the lost time */
+static pacing pacer;
+
+static input_metrics metrics;
+static metric *backlog;
+
 /*** plugin interface functions ***/
 int input_init(input_parameter *param, int id)
 {
     int i;
     plugin_number = id;
+    input_metrics_register(&metrics, id);
+    backlog = metric_register("mjpg_input_backlog_files", "New files waiting to be served",
+                              METRIC_GAUGE, 1, "input=\"%d\"", id);
 
     param->argv[0] = INPUT_PLUGIN_NAME;
 
@@ -91,6 +142,12 @@ int input_init(input_parameter *param, int id)
             {"name", required_argument, 0, 0},
             {"e", no_argument, 0, 0},
             {"existing", no_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
+            {"k", no_argument, 0, 0},
+            {"keep", no_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"stats", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -151,6 +208,31 @@ int input_init(input_parameter *param, int id)
             DBG("case 10,11\n");
             mode = ExistingFiles;
             break;
+
+            /* q, queue */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            queue_limit = atoi(optarg);
+            if(queue_limit < 1) {
+                IPRINT("ERROR: the queue must hold at least one file\n");
+                return 1;
+            }
+            break;
+
+            /* k, keep */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            policy = KeepAll;
+            break;
+
+            /* s, stats */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            stats_interval = atoi(optarg);
+            break;
         default:
             DBG("default case\n");
             help();
@@ -170,6 +252,13 @@ int input_init(input_parameter *param, int id)
     IPRINT("forced delay......: %.4f\n", delay);
     IPRINT("delete file.......: %s\n", (rm) ? "yes, delete" : "no, do not delete");
     IPRINT("filename must be..: %s\n", (filename == NULL) ? "-no filter for certain filename set-" : filename);
+    if(mode == NewFilesOnly) {
+        if(policy == KeepAll) {
+            IPRINT("backlog...........: keep all files\n");
+        } else {
+            IPRINT("backlog...........: %d files, drop the oldest\n", queue_limit);
+        }
+    }
 
     param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
@@ -189,7 +278,7 @@ int input_run(int id)
     pglobal->in[id].buf = NULL;
 
     if (mode == NewFilesOnly) {
-        rc = fd = inotify_init();
+        rc = fd = inotify_init1(IN_NONBLOCK);
         if(rc == -1) {
             perror("could not initilialize inotify");
             return 1;
@@ -227,26 +316,247 @@ void help(void)
     " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
     " ---------------------------------------------------------------\n" \
     " The following parameters can be passed to this plugin:\n\n" \
-    " [-d | --delay ]........: delay (in seconds) to pause between frames\n" \
+    " [-d | --delay ]........: interval (in seconds) between frames\n" \
     " [-f | --folder ].......: folder to watch for new JPEG files\n" \
     " [-r | --remove ].......: remove/delete JPEG file after reading\n" \
     " [-n | --name ].........: ignore changes unless filename matches\n" \
     " [-e | --existing ].....: serve the existing *.jpg files from the specified directory\n" \
+    " [-q | --queue ]........: number of new files to keep when falling behind, defaults to 16\n" \
+    " [-k | --keep ].........: never drop new files, serve the whole backlog\n" \
+    " [-s | --stats ]........: report the backlog statistics every n seconds\n" \
     " ---------------------------------------------------------------\n");
 }
 
+/******************************************************************************
+Description.: returns the current time in milliseconds
+Input Value.: -
+Return Value: milliseconds since the epoch
+******************************************************************************/
+static long long now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/******************************************************************************
+Description.: appends a file to the backlog, with the drop-oldest policy the
+              oldest file gives way once the queue is full
+Input Value.: name of the file inside the watched folder
+Return Value: 0 if ok, -1 if there is not enough memory
+******************************************************************************/
+static int queue_push(const char *name)
+{
+    if(policy == DropOldest && queue_count == queue_limit) {
+        DBG("dropping %s%s\n", folder, queue[queue_head].name);
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count--;
+        stats.dropped++;
+        metric_add(metrics.dropped, 1);
+    }
+
+    if(queue_count == queue_capacity) {
+        int capacity = (queue_capacity == 0) ? 16 : 2 * queue_capacity;
+        int wrapped = queue_head + queue_count - queue_capacity;
+        pending_file *grown = realloc(queue, capacity * sizeof(pending_file));
+
+        if(grown == NULL)
+            return -1;
+
+        /* unwrap the ring, the new space follows the old end */
+        if(wrapped > 0)
+            memcpy(grown + queue_capacity, grown, wrapped * sizeof(pending_file));
+
+        queue = grown;
+        queue_capacity = capacity;
+    }
+
+    snprintf(queue[(queue_head + queue_count) % queue_capacity].name, NAME_MAX + 1, "%s", name);
+    queue_count++;
+    metric_set(backlog, queue_count);
+
+    if(queue_count > stats.peak_backlog)
+        stats.peak_backlog = queue_count;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: moves all pending inotify events into the backlog, a burst of
+              uploads arrives as many events per read
+Input Value.: timeout in ms to wait for events, -1 waits until one arrives
+Return Value: 0 if ok, -1 if the watch is gone or on errors
+******************************************************************************/
+static int collect_events(int timeout)
+{
+    struct pollfd pfd;
+    struct inotify_event *event;
+    char *p;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+        perror("waiting for inotify events failed\n");
+        return -1;
+    }
+
+    while(1) {
+        rc = read(fd, ev, size);
+        if(rc == -1) {
+            if(errno == EAGAIN || errno == EINTR)
+                return 0;
+            perror("reading inotify events failed\n");
+            return -1;
+        }
+
+        for(p = (char *)ev; p < (char *)ev + rc; p += sizeof(struct inotify_event) + event->len) {
+            event = (struct inotify_event *)p;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                fprintf(stderr, "inotify queue overflowed, new files were missed\n");
+                stats.overflows++;
+                continue;
+            }
+
+            if(event->mask & (IN_IGNORED | IN_UNMOUNT)) {
+                fprintf(stderr, "event mask suggests to stop\n");
+                return -1;
+            }
+
+            /* sanity check */
+            if(wd != event->wd) {
+                fprintf(stderr, "This event is not for the watched directory (%d != %d)\n", wd, event->wd);
+                continue;
+            }
+
+            if(event->len == 0)
+                continue;
+
+            /* check if the filename matches specified parameter (if given) */
+            if((filename != NULL) && (strcmp(filename, event->name) != 0)) {
+                DBG("ignoring this change (specified filename does not match)\n");
+                continue;
+            }
+
+            DBG("new file detected: %s%s\n", folder, event->name);
+            if(queue_push(event->name) == -1) {
+                fprintf(stderr, "could not allocate memory\n");
+                return -1;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: reads a whole file into a frame buffer, the buffer only grows
+Input Value.: path of the file and the buffer to fill
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int load_file(const char *path, frame_buffer *frame)
+{
+    struct stat st;
+    int file;
+    ssize_t n;
+
+    /* open file for reading */
+    file = open(path, O_RDONLY);
+    if(file == -1) {
+        perror("could not open file for reading");
+        return -1;
+    }
+
+    /* approximate size of file */
+    if(fstat(file, &st) == -1) {
+        perror("could not read statistics of file");
+        close(file);
+        return -1;
+    }
+
+    if(frame->capacity < (size_t)st.st_size) {
+        size_t capacity = st.st_size + (1 << 16);
+        unsigned char *grown = realloc(frame->data, capacity);
+        if(grown == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            close(file);
+            return -1;
+        }
+        frame->data = grown;
+        frame->capacity = capacity;
+    }
+
+    frame->size = 0;
+    while(frame->size < (size_t)st.st_size) {
+        n = read(file, frame->data + frame->size, st.st_size - frame->size);
+        if(n == -1) {
+            if(errno == EINTR)
+                continue;
+            perror("could not read from file");
+            close(file);
+            return -1;
+        }
+        if(n == 0)
+            break;
+        frame->size += n;
+    }
+
+    close(file);
+    return 0;
+}
+
+/******************************************************************************
+Description.: publishes the frame read last by swapping the buffers, the
+              readers copy under the lock so the old one is free afterwards
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void publish(void)
+{
+    frame_buffer *frame = &frames[1 - published];
+    struct timeval timestamp;
+
+    gettimeofday(&timestamp, NULL);
+
+    metric_lock(&pglobal->in[plugin_number].db, metrics.lock_wait);
+    pglobal->in[plugin_number].buf = frame->data;
+    pglobal->in[plugin_number].size = frame->size;
+    pglobal->in[plugin_number].timestamp = timestamp;
+    DBG("new frame published (size: %d)\n", pglobal->in[plugin_number].size);
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    published = 1 - published;
+    stats.frames++;
+    metric_add(metrics.frames, 1);
+}
+
+/******************************************************************************
+Description.: prints the backlog statistics, the peak starts over afterwards
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void report_stats(void)
+{
+    IPRINT("backlog %d files (peak %d), %u frames, %u dropped, %u failed, %u overflows\n",
+           queue_count, stats.peak_backlog, stats.frames, stats.dropped, stats.failed, stats.overflows);
+    stats.peak_backlog = queue_count;
+
+    if(delay != 0) {
+        char report[128];
+        pacing_report(&pacer, report, sizeof(report));
+        IPRINT("pacing %s\n", report);
+    }
+}
+
 /* the single writer thread */
 void *worker_thread(void *arg)
 {
     char buffer[1<<16];
-    int file;
-    size_t filesize = 0;
-    struct stat stats;
-    struct dirent **fileList;
+    struct dirent **fileList = NULL;
     int fileCount = 0;
     int currentFileNumber = 0;
     char hasJpgFile = 0;
-    struct timeval timestamp;
+    long long next_report = now_ms() + 1000LL * stats_interval;
 
     if (mode == ExistingFiles) {
         fileCount = scandir(folder, &fileList, 0, alphasort);
@@ -259,35 +569,34 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    pacing_init(&pacer, delay, (mode == ExistingFiles) ? PACING_CATCH_UP : PACING_SKIP);
+
     while(!pglobal->stop) {
+        if(stats_interval > 0 && now_ms() >= next_report) {
+            report_stats();
+            next_report += 1000LL * stats_interval;
+        }
+
         if (mode == NewFilesOnly) {
-            /* wait for new frame, read will block until something happens */
-            rc = read(fd, ev, size);
-            if(rc == -1) {
-                perror("reading inotify events failed\n");
-                break;
-            }
+            int timeout = -1;
 
-            /* sanity check */
-            if(wd != ev->wd) {
-                fprintf(stderr, "This event is not for the watched directory (%d != %d)\n", wd, ev->wd);
-                continue;
-            }
+            /* only wait for new files while the backlog is empty */
+            if(queue_count > 0)
+                timeout = 0;
+            else if(stats_interval > 0)
+                timeout = (now_ms() < next_report) ? next_report - now_ms() : 0;
 
-            if(ev->mask & (IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT)) {
-                fprintf(stderr, "event mask suggests to stop\n");
+            if(collect_events(timeout) == -1)
                 break;
-            }
 
-            /* prepare filename */
-            snprintf(buffer, sizeof(buffer), "%s%s", folder, ev->name);
-
-            /* check if the filename matches specified parameter (if given) */
-            if((filename != NULL) && (strcmp(filename, ev->name) != 0)) {
-                DBG("ignoring this change (specified filename does not match)\n");
+            if(queue_count == 0)
                 continue;
-            }
-            DBG("new file detected: %s\n", buffer);
+
+            /* prepare filename */
+            snprintf(buffer, sizeof(buffer), "%s%s", folder, queue[queue_head].name);
+            queue_head = (queue_head + 1) % queue_capacity;
+            queue_count--;
+            metric_set(backlog, queue_count);
         } else {
             if ((strstr(fileList[currentFileNumber]->d_name, ".jpg") != NULL) ||
                 (strstr(fileList[currentFileNumber]->d_name, ".JPG") != NULL)) {
@@ -312,53 +621,17 @@ void *worker_thread(void *arg)
             }
         }
 
-        /* open file for reading */
-        rc = file = open(buffer, O_RDONLY);
-        if(rc == -1) {
-            perror("could not open file for reading");
-            break;
-        }
-
-        /* approximate size of file */
-        rc = fstat(file, &stats);
-        if(rc == -1) {
-            perror("could not read statistics of file");
-            close(file);
-            break;
-        }
-
-        filesize = stats.st_size;
-
-        /* copy frame from file to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
-        /* allocate memory for frame */
-        if(pglobal->in[plugin_number].buf != NULL)
-            free(pglobal->in[plugin_number].buf);
-
-        pglobal->in[plugin_number].buf = malloc(filesize + (1 << 16));
-
-        if(pglobal->in[plugin_number].buf == NULL) {
-            fprintf(stderr, "could not allocate memory\n");
-            break;
-        }
-
-        if((pglobal->in[plugin_number].size = read(file, pglobal->in[plugin_number].buf, filesize)) == -1) {
-            perror("could not read from file");
-            free(pglobal->in[plugin_number].buf); pglobal->in[plugin_number].buf = NULL; pglobal->in[plugin_number].size = 0;
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-            close(file);
-            break;
+        /* read the file without holding the lock, a file of the backlog
+           may be gone already, so only the existing files are fatal */
+        if(load_file(buffer, &frames[1 - published]) == -1) {
+            stats.failed++;
+            if(mode == ExistingFiles)
+                break;
+            continue;
         }
 
-        gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
-        DBG("new frame copied (size: %d)\n", pglobal->in[plugin_number].size);
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-
-        close(file);
+        pacing_wait(&pacer);
+        publish();
 
         /* delete file if necessary */
         if(rm) {
@@ -367,9 +640,6 @@ void *worker_thread(void *arg)
                 perror("could not remove/delete file");
             }
         }
-
-        if(delay != 0)
-            usleep(1000 * 1000 * delay);
     }
 
 thread_quit:
@@ -397,8 +667,15 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    /* the consumers copy under the lock, so the frames are not referenced anymore */
+    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    pglobal->in[plugin_number].buf = NULL;
+    pglobal->in[plugin_number].size = 0;
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+    free(frames[0].data);
+    free(frames[1].data);
 
+    free(queue);
     free(ev);
 
     if (mode == NewFilesOnly) {
@@ -413,8 +690,3 @@ void worker_cleanup(void *arg)
         }
     }
 }
-
-
-
-
-
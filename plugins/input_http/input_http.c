@@ -44,14 +44,21 @@
 static pthread_t   worker;
 static globals     *pglobal;
 static pthread_mutex_t controls_mutex;
-static int plugin_number;
 
 void *worker_thread(void *);
 void worker_cleanup(void *);
+void on_image_received(struct extractor_state * state, char * data, int length);
 
 #define INPUT_PLUGIN_NAME "HTTP Input plugin"
 
-struct extractor_state  proxy;
+/*
+ * Every instance of this plugin is one upstream. The instances share this
+ * module, and a single worker thread serves all of them.
+ */
+static struct extractor_state proxy[MAX_INPUT_PLUGINS];
+static int buffer_size[MAX_INPUT_PLUGINS];
+static int running = 0;
+static pthread_mutex_t running_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /*** plugin interface functions ***/
 
@@ -77,16 +84,20 @@ int input_init(input_parameter *param, int plugin_no)
     for(i = 0; i < param->argc; i++) {
         DBG("argv[%d]=%s\n", i, param->argv[i]);
     }
-    init_mjpg_proxy( &proxy );
+    init_mjpg_proxy( &proxy[plugin_no] );
+    proxy[plugin_no].id = plugin_no;
 
     reset_getopt();
-    if (parse_cmd_line(&proxy, param->argc, param->argv))
+    if (parse_cmd_line(&proxy[plugin_no], param->argc, param->argv))
        return 1;
 
     pglobal = param->global;
 
-    IPRINT("host.............: %s\n", proxy.hostname);
-    IPRINT("port.............: %s\n", proxy.port);
+    IPRINT("host.............: %s\n", proxy[plugin_no].hostname);
+    IPRINT("port.............: %s\n", proxy[plugin_no].port);
+    IPRINT("path.............: %s\n", proxy[plugin_no].path);
+    IPRINT("authentication...: %s\n", proxy[plugin_no].authorization ? "basic" : "none");
+    IPRINT("timeout..........: %d ms\n", proxy[plugin_no].timeout);
 
     return 0;
 }
@@ -98,45 +109,88 @@ Return Value: 0
 ******************************************************************************/
 int input_stop(int id)
 {
-    DBG("will cancel input thread\n");
-    pthread_cancel(worker);
+    /*
+     * all instances share the thread, it gets cancelled by the first call
+     * unless it already left on its own, it is detached and gone then
+     */
+    pthread_mutex_lock(&running_mutex);
+    if(running) {
+        DBG("will cancel input thread\n");
+        running = 0;
+        pthread_cancel(worker);
+    }
+    pthread_mutex_unlock(&running_mutex);
     return 0;
 }
 
 /******************************************************************************
-Description.: starts the worker thread and allocates memory
+Description.: registers the upstream of this instance and starts the worker
+              thread with the first instance
 Input Value.: -
 Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
+    buffer_size[id] = BUFFER_SIZE;
+    pglobal->in[id].buf = malloc(buffer_size[id]);
     if(pglobal->in[id].buf == NULL) {
         fprintf(stderr, "could not allocate memory\n");
         exit(EXIT_FAILURE);
     }
 
+    if(proxy_loop_init() < 0) {
+        free(pglobal->in[id].buf);
+        exit(EXIT_FAILURE);
+    }
+
+    proxy[id].on_image_received = on_image_received;
+    proxy_loop_add(&proxy[id]);
+
+    pthread_mutex_lock(&running_mutex);
+    if(running) {
+        pthread_mutex_unlock(&running_mutex);
+        return 0;
+    }
+
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
+        pthread_mutex_unlock(&running_mutex);
         free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
     pthread_detach(worker);
+    running = 1;
+    pthread_mutex_unlock(&running_mutex);
 
     return 0;
 }
 
 
-void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+void on_image_received(struct extractor_state * state, char * data, int length){
+        int id = state->id;
+        unsigned char *tmp;
 
-        pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
+        /* copy JPG picture to global buffer */
+        pthread_mutex_lock(&pglobal->in[id].db);
+
+        /* frames are not limited in size, grow the buffer if necessary */
+        if(length > buffer_size[id]) {
+            if((tmp = realloc(pglobal->in[id].buf, length + (1 << 16))) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[id].db);
+                fprintf(stderr, "could not allocate memory\n");
+                return;
+            }
+            pglobal->in[id].buf = tmp;
+            buffer_size[id] = length + (1 << 16);
+        }
+
+        pglobal->in[id].size = length;
+        memcpy(pglobal->in[id].buf, data, pglobal->in[id].size);
+        gettimeofday(&pglobal->in[id].timestamp, NULL);
 
         /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        pthread_cond_broadcast(&pglobal->in[id].db_update);
+        pthread_mutex_unlock(&pglobal->in[id].db);
 
 }
 
@@ -146,9 +200,7 @@ void *worker_thread(void *arg)
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    proxy.on_image_received = on_image_received;
-    proxy.should_stop =  & pglobal->stop;
-    connect_and_stream(&proxy);
+    proxy_loop_run(&pglobal->stop);
 
     IPRINT("leaving input thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
@@ -164,6 +216,7 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    int i;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -171,11 +224,21 @@ void worker_cleanup(void *arg)
     }
 
     first_run = 0;
+    pthread_mutex_lock(&running_mutex);
+    running = 0;
+    pthread_mutex_unlock(&running_mutex);
+
     DBG("cleaning up resources allocated by input thread\n");
-    close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    proxy_loop_close();
+    for(i = 0; i < pglobal->incnt; i++) {
+        if(proxy[i].on_image_received == NULL)
+            continue;
+        close_mjpg_proxy(&proxy[i]);
+        if(pglobal->in[i].buf != NULL) free(pglobal->in[i].buf);
+    }
 }
 
 
 
 
+
@@ -41,6 +41,13 @@ int min(int a, int b) {
         return b;
 }
 
+int max(int a, int b) {
+    if (a>b)
+        return a;
+    else
+        return b;
+}
+
 
 void search_pattern_reset(struct search_pattern * pattern) {
     pattern->current_matched_char = pattern->string;
@@ -20,6 +20,7 @@
 #define HTTP_UTILS
 
 int min(int a, int b);
+int max(int a, int b);
 void write_image(char * image, int length);
 
 // dumb 4 byte storing to detect double CRLF
@@ -21,13 +21,20 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 
 #include "version.h"
@@ -38,94 +45,956 @@
 
 
 
-#define HEADER 1
-#define CONTENT 0
-#define NETBUFFER_SIZE 1024 * 4
+#define NETBUFFER_SIZE 1024 * 64
+#define MAX_HEADER_SIZE 1024 * 64
+#define MAX_FRAME_SIZE 1024 * 1024 * 64
+#define MAX_EVENTS 64
+#define INITIAL_BACKOFF 1000
+// snapshot polling slows down to at most this interval in ms
+#define MAX_POLL_INTERVAL 10000
 #define TRUE 1
 #define FALSE 0
 
 const char * CONTENT_LENGTH = "Content-Length:";
-// TODO: this must be decoupled from mjpeg-streamer
-const char * BOUNDARY =     "--boundarydonotcross";
+const char * CONTENT_TYPE = "Content-Type:";
+const char * TRANSFER_ENCODING = "Transfer-Encoding:";
+const char * CONNECTION = "Connection:";
+// used if the server does not tell the boundary, it is the one of mjpeg-streamer
+const char * BOUNDARY =     "boundarydonotcross";
+
+// all upstreams are served by one epoll loop, data.ptr is the extractor_state
+// of a socket or NULL for the wake up eventfd
+static int epollfd = -1;
+static int wakefd = -1;
+static pthread_mutex_t wakefd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t upstreams_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct extractor_state * upstreams = NULL;
+
+long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
 void init_extractor_state(struct extractor_state * state) {
     state->length = 0;
-    state->part = HEADER;
-    state->last_four_bytes = 0;
-    state->contentlength.string = CONTENT_LENGTH;
-    state->boundary.string = BOUNDARY;
-    search_pattern_reset(&state->contentlength);
-    search_pattern_reset(&state->boundary);
+    state->net_start = 0;
+    state->net_end = 0;
+    state->phase = PHASE_RESPONSE;
+    state->content_length = -1;
+    state->copied = 0;
+    state->searched = 0;
+    state->chunked = FALSE;
+    state->chunk_pos = 0;
+    state->chunk_remaining = 0;
+    state->chunk_crlf = FALSE;
+    state->chunk_last = FALSE;
+    state->in_flight = 0;
+    state->responses = 0;
+    state->keepalive = TRUE;
+    snprintf(state->boundary, sizeof(state->boundary), "--%s", BOUNDARY);
 }
 
 void init_mjpg_proxy(struct extractor_state * state){
     state->hostname = strdup("localhost");
     state->port = strdup("8080");
+    state->path = strdup("/?action=stream");
+    state->authorization = NULL;
+
+    state->buffer = NULL;
+    state->capacity = 0;
+    state->sockfd = -1;
+    state->netbuffer = NULL;
+    state->net_capacity = 0;
+    state->lookup_pending = FALSE;
+    state->addresses = NULL;
+
+    state->timeout = 5000;
+    state->backoff = INITIAL_BACKOFF;
+    state->max_backoff = 60000;
+    state->deadline = 0;
+
+    state->rate = 0;
+    state->poll_interval = 0;
+    state->response_time = 0;
+
+    memset(&state->stats, 0, sizeof(state->stats));
+    state->stats_interval = 0;
+    state->next_report = 0;
+    state->next = NULL;
 
     init_extractor_state(state);
+    state->phase = PHASE_IDLE;
 }
 
-// main method
-// we process all incoming buffer byte per byte and extract binary data from it to state->buffer
-// if boundary is detected, then callback for image processing is run
-// TODO; decouple from mjpeg streamer and ensure content-length processing
-//       for that, we must properly work with headers, not just detect them
-void extract_data(struct extractor_state * state, char * buffer, int length) {
+// makes sure *buffer holds at least needed bytes, it grows by doubling
+int reserve(char ** buffer, int * capacity, int needed) {
+    char * tmp;
+    int size = *capacity ? *capacity : NETBUFFER_SIZE;
+
+    if (needed <= *capacity)
+        return 0;
+
+    while (size < needed)
+        size *= 2;
+
+    if ((tmp = realloc(*buffer, size)) == NULL) {
+        perror("Not enough memory\n");
+        return -1;
+    }
+
+    *buffer = tmp;
+    *capacity = size;
+    return 0;
+}
+
+char * base64_encode(const char * data, int length) {
+    const char * table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char * result = malloc((length + 2) / 3 * 4 + 1), * out = result;
     int i;
-    for (i = 0; i < length && !*(state->should_stop); i++) {
-        switch (state->part) {
-        case HEADER:
-            push_byte(&state->last_four_bytes, buffer[i]);
-            if (is_crlfcrlf(state->last_four_bytes))
-                state->part = CONTENT;
-            else if (is_crlf(state->last_four_bytes))
-                search_pattern_reset(&state->contentlength);
-            else {
-                search_pattern_compare(&state->contentlength, buffer[i]);
-                if (search_pattern_matches(&state->contentlength)) {
-                    DBG("Content length found\n");
-                    search_pattern_reset(&state->contentlength);
-                }
-            }
+    uint32_t bits;
+
+    if (result == NULL)
+        return NULL;
+
+    for (i = 0; i < length; i += 3) {
+        bits = (unsigned char)data[i] << 16;
+        if (i + 1 < length) bits |= (unsigned char)data[i + 1] << 8;
+        if (i + 2 < length) bits |= (unsigned char)data[i + 2];
+        *out++ = table[(bits >> 18) & 63];
+        *out++ = table[(bits >> 12) & 63];
+        *out++ = (i + 1 < length) ? table[(bits >> 6) & 63] : '=';
+        *out++ = (i + 2 < length) ? table[bits & 63] : '=';
+    }
+    *out = 0;
+
+    return result;
+}
+
+// splits http://[user:password@]host[:port][/path]
+int parse_url(struct extractor_state * state, const char * url) {
+    const char * host, * end, * at, * slash;
+
+    if (strncasecmp(url, "http://", 7) == 0)
+        url += 7;
+    else if (strstr(url, "://") != NULL) {
+        fprintf(stderr, "Only http:// URLs are supported\n");
+        return 1;
+    }
+
+    slash = url + strcspn(url, "/");
+    at = memrchr(url, '@', slash - url);
+    host = at ? at + 1 : url;
+
+    if (*host == '[') {
+        if ((end = memchr(host, ']', slash - host)) == NULL) {
+            fprintf(stderr, "Invalid URL %s\n", url);
+            return 1;
+        }
+        free(state->hostname);
+        state->hostname = strndup(host + 1, end - host - 1);
+        end++;
+    } else {
+        if ((end = memchr(host, ':', slash - host)) == NULL)
+            end = slash;
+        free(state->hostname);
+        state->hostname = strndup(host, end - host);
+    }
+
+    free(state->port);
+    state->port = (end < slash && *end == ':') ? strndup(end + 1, slash - end - 1) : strdup("80");
+
+    free(state->path);
+    state->path = strdup(*slash ? slash : "/");
+
+    free(state->authorization);
+    state->authorization = at ? base64_encode(url, at - url) : NULL;
+
+    return 0;
+}
+
+// returns the value of a header line in headers, or NULL if it is missing
+// the value ends at the next CR
+char * find_header(char * headers, int length, const char * name) {
+    char * line = headers, * end = headers + length, * next;
+    int name_length = strlen(name);
+
+    while (line < end) {
+        next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (next - line > name_length && strncasecmp(line, name, name_length) == 0) {
+            line += name_length;
+            while (line < next && (*line == ' ' || *line == '\t'))
+                line++;
+            return line;
+        }
+        line = next;
+    }
+
+    return NULL;
+}
+
+// takes the boundary from the Content-Type of the response, e.g.
+// multipart/x-mixed-replace; boundary="frame"
+void parse_boundary(struct extractor_state * state, char * headers, int length) {
+    char * value, * end, * boundary;
+    int boundary_length;
+
+    if ((value = find_header(headers, length, CONTENT_TYPE)) == NULL)
+        return;
+
+    end = memchr(value, '\r', headers + length - value);
+    if (end == NULL)
+        end = headers + length;
+
+    for (boundary = value; boundary + 9 <= end; boundary++)
+        if (strncasecmp(boundary, "boundary=", 9) == 0)
+            break;
+    if (boundary + 9 > end)
+        return;
+
+    boundary += 9;
+    if (boundary < end && *boundary == '"')
+        boundary++;
+    for (boundary_length = 0; boundary + boundary_length < end; boundary_length++)
+        if (strchr("\";, \t", boundary[boundary_length]))
+            break;
+
+    // some servers put the leading dashes into the boundary parameter
+    if (boundary_length > 2 && strncmp(boundary, "--", 2) == 0) {
+        boundary += 2;
+        boundary_length -= 2;
+    }
+
+    if (boundary_length == 0 || boundary_length + 3 > (int)sizeof(state->boundary))
+        return;
+
+    snprintf(state->boundary, sizeof(state->boundary), "--%.*s", boundary_length, boundary);
+    DBG("boundary is %s\n", state->boundary);
+}
+
+// drops the cached result of the last lookup
+void proxy_forget_addresses(struct extractor_state * state) {
+    if (state->addresses != NULL)
+        freeaddrinfo(state->addresses);
+    state->addresses = NULL;
+}
+
+void proxy_close(struct extractor_state * state) {
+    if (state->sockfd >= 0) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, state->sockfd, NULL);
+        close(state->sockfd);
+        state->sockfd = -1;
+    }
+    state->phase = PHASE_IDLE;
+}
+
+// closes the connection and schedules the next attempt, the delay doubles
+// with every failure until a frame gets through
+void proxy_fail(struct extractor_state * state, const char * reason) {
+    // the upstream may have moved, look its name up again
+    if (state->phase <= PHASE_CONNECTING)
+        proxy_forget_addresses(state);
+    proxy_close(state);
+
+    state->stats.failures++;
+    snprintf(state->stats.last_error, sizeof(state->stats.last_error), "%s", reason);
+    fprintf(stderr, " i: upstream %s:%s%s: %s, reconnecting in %d ms\n",
+            state->hostname, state->port, state->path, reason, state->backoff);
+
+    state->phase = PHASE_IDLE;
+    state->deadline = now_ms() + state->backoff;
+    state->backoff = min(state->backoff * 2, state->max_backoff);
+}
+
+// runs on a thread of the resolver when a lookup is done, wakes up the loop
+void lookup_done(union sigval value) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&wakefd_mutex);
+    if (wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0)
+        DBG("Can't wake up the loop\n");
+    pthread_mutex_unlock(&wakefd_mutex);
+}
+
+// starts the asynchronous name lookup, the loop connects once it is done
+void proxy_resolve(struct extractor_state * state) {
+    struct gaicb * list [1] = { &state->lookup };
+    struct sigevent event;
+    int errorcode;
+
+    // the lookup of a timed out attempt still runs, it owns the gaicb
+    if (state->lookup_pending) {
+        proxy_fail(state, "Name lookup timed out");
+        return;
+    }
+
+    memset(&state->hints, 0, sizeof(state->hints));
+    state->hints.ai_socktype = SOCK_STREAM;
+    memset(&state->lookup, 0, sizeof(state->lookup));
+    state->lookup.ar_name = state->hostname;
+    state->lookup.ar_service = state->port;
+    state->lookup.ar_request = &state->hints;
+
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD;
+    event.sigev_notify_function = lookup_done;
+
+    errorcode = getaddrinfo_a(GAI_NOWAIT, list, 1, &event);
+    if (errorcode) {
+        proxy_fail(state, gai_strerror(errorcode));
+        return;
+    }
+
+    state->lookup_pending = TRUE;
+    state->phase = PHASE_RESOLVING;
+    state->deadline = now_ms() + state->timeout;
+}
+
+// starts a non-blocking connect to the first address that accepts it
+void proxy_connect(struct extractor_state * state, struct addrinfo * info) {
+    struct epoll_event event;
+    struct addrinfo * rp;
+
+    for (rp = info ; rp != NULL; rp = rp->ai_next) {
+        state->sockfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+        if (state->sockfd < 0)
+            continue;
+
+        if (connect(state->sockfd, rp->ai_addr, rp->ai_addrlen) == 0 || errno == EINPROGRESS)
             break;
 
-        case CONTENT:
-            if (state->length >= BUFFER_SIZE - 1) {
-                perror("Buffer too small\n");
+        close(state->sockfd);
+        state->sockfd = -1;
+    }
+
+    if (state->sockfd < 0) {
+        proxy_fail(state, "Can't connect to server");
+        return;
+    }
+
+    DBG("connecting to %s:%s, socket value is %d\n", state->hostname, state->port, state->sockfd);
+    state->phase = PHASE_CONNECTING;
+    state->deadline = now_ms() + state->timeout;
+
+    event.events = EPOLLOUT;
+    event.data.ptr = state;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, state->sockfd, &event);
+}
+
+// connects with the result of a finished lookup
+void proxy_lookup_finished(struct extractor_state * state) {
+    int errorcode = gai_error(&state->lookup);
+
+    if (errorcode == EAI_INPROGRESS)
+        return;
+    state->lookup_pending = FALSE;
+
+    // the attempt timed out meanwhile
+    if (state->phase != PHASE_RESOLVING) {
+        if (state->lookup.ar_result != NULL)
+            freeaddrinfo(state->lookup.ar_result);
+        return;
+    }
+
+    if (errorcode) {
+        proxy_fail(state, gai_strerror(errorcode));
+        return;
+    }
+
+    proxy_forget_addresses(state);
+    state->addresses = state->lookup.ar_result;
+    proxy_connect(state, state->addresses);
+}
+
+// writes the request for the path of the upstream
+int build_request(struct extractor_state * state, char * request, int size) {
+    return snprintf(request, size,
+                    "GET %s HTTP/1.1\r\n"
+                    "Host: %s%s%s%s%s\r\n"
+                    "User-Agent: mjpg-streamer\r\n"
+                    "%s%s%s"
+                    "Connection: %s\r\n\r\n",
+                    state->path,
+                    strchr(state->hostname, ':') ? "[" : "", state->hostname, strchr(state->hostname, ':') ? "]" : "",
+                    strcmp(state->port, "80") ? ":" : "", strcmp(state->port, "80") ? state->port : "",
+                    state->authorization ? "Authorization: Basic " : "",
+                    state->authorization ? state->authorization : "",
+                    state->authorization ? "\r\n" : "",
+                    state->rate > 0 ? "keep-alive" : "close");
+}
+
+// sends the request, it fits into any socket buffer
+int send_request(struct extractor_state * state) {
+    char request [2048];
+    int length = build_request(state, request, sizeof(request));
+
+    if (length >= (int)sizeof(request) || send(state->sockfd, request, length, MSG_NOSIGNAL) != length) {
+        proxy_fail(state, "Can't send request");
+        return -1;
+    }
+    return 0;
+}
+
+// sends the next snapshot requests when they are due, up to two are in
+// flight on a keep-alive connection to hide the round trip time
+void proxy_poll(struct extractor_state * state, long long now) {
+    int depth = state->keepalive ? PIPELINE_DEPTH : 1;
+
+    while (state->in_flight < depth && state->next_request <= now) {
+        if (state->keepalive == FALSE && state->responses > 0)
+            return; // the server closes the connection, the next request goes on a new one
+
+        if (send_request(state) < 0)
+            return;
+
+        if (state->in_flight == 0)
+            state->deadline = now + state->timeout;
+        state->sent_at[state->in_flight++] = now;
+
+        // keep the pace, but do not make up for a long stall with a burst
+        state->next_request += state->poll_interval;
+        if (state->next_request < now - state->poll_interval)
+            state->next_request = now;
+    }
+}
+
+// a snapshot response is complete, adapt the polling interval
+// the camera is asked at most every 1.5 times its smoothed service time, so
+// the rate goes down as soon as it takes longer to answer, and back up to
+// the target once it is fast again
+void snapshot_done(struct extractor_state * state) {
+    long long now = now_ms();
+    double service = now - (state->sent_at[0] > state->last_complete ? state->sent_at[0] : state->last_complete);
+    int target = 1000 / state->rate;
+
+    if (state->in_flight > 0) {
+        state->in_flight--;
+        memmove(state->sent_at, state->sent_at + 1, state->in_flight * sizeof(state->sent_at[0]));
+    }
+    state->responses++;
+    state->last_complete = now;
+
+    if (state->response_time == 0)
+        state->response_time = service;
+    else
+        state->response_time = 0.8 * state->response_time + 0.2 * service;
+
+    state->poll_interval = min(max(1.5 * state->response_time, target), MAX_POLL_INTERVAL);
+
+    if (state->in_flight == 0)
+        state->deadline = state->next_request + state->timeout;
+}
+
+// connect finished, send the request
+void proxy_connected(struct extractor_state * state) {
+    struct epoll_event event;
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+
+    getsockopt(state->sockfd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+    if (error) {
+        proxy_fail(state, strerror(error));
+        return;
+    }
+
+    init_extractor_state(state);
+    state->deadline = now_ms() + state->timeout;
+
+    event.events = EPOLLIN;
+    event.data.ptr = state;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, state->sockfd, &event);
+
+    if (state->rate > 0) {
+        // a reconnect after a closed connection keeps the pace
+        state->last_complete = now_ms();
+        if (state->next_request < state->last_complete)
+            state->next_request = state->last_complete;
+        proxy_poll(state, state->last_complete);
+    } else {
+        send_request(state);
+    }
+}
+
+void deliver(struct extractor_state * state, char * data, int length) {
+    state->length = length;
+    state->stats.frames++;
+    state->backoff = INITIAL_BACKOFF;
+    DBG("Image of length %d received\n", state->length);
+    if (state->on_image_received) // callback
+        state->on_image_received(state, data, length);
+}
+
+// removes the chunk headers of chunked transfer encoding from the received
+// data, everything before chunk_pos is plain data afterwards
+// returns -1 at the end of a stream or on invalid chunk sizes
+int dechunk(struct extractor_state * state) {
+    char * line, * newline, * end;
+    int n, removed;
+    long size;
+
+    while (state->chunk_pos < state->net_end) {
+        if (state->chunk_remaining > 0) {
+            n = min(state->chunk_remaining, state->net_end - state->chunk_pos);
+            state->chunk_pos += n;
+            state->chunk_remaining -= n;
+            state->chunk_crlf = (state->chunk_remaining == 0);
+            continue;
+        }
+
+        line = state->netbuffer + state->chunk_pos;
+        if ((newline = memchr(line, '\n', state->net_end - state->chunk_pos)) == NULL)
+            return 0;
+
+        if (state->chunk_crlf) {
+            // the CRLF behind the data of the previous chunk
+            state->chunk_crlf = FALSE;
+        } else {
+            size = strtol(line, &end, 16);
+            if (end == line || size < 0 || size > MAX_FRAME_SIZE)
+                return -1;
+            // a stream must not end, a snapshot ends with an empty chunk and an empty line
+            if (size == 0 && state->rate == 0)
+                return -1;
+            state->chunk_remaining = size;
+            state->chunk_last = (size == 0);
+            state->chunk_crlf = (size == 0);
+        }
+
+        removed = newline + 1 - line;
+        memmove(line, newline + 1, state->net_end - state->chunk_pos - removed);
+        state->net_end -= removed;
+
+        // the snapshot ends at chunk_pos, what follows is the next response
+        if (state->chunk_last && !state->chunk_crlf) {
+            state->chunked = FALSE;
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// takes the headers of a snapshot response, found points to their end
+// returns -1 if the start of a chunked body is invalid
+int snapshot_headers(struct extractor_state * state, char * found) {
+    char * headers = state->netbuffer + state->net_start, * value;
+    int length = found + 2 - headers;
+
+    value = find_header(headers, length, CONNECTION);
+    if (value != NULL)
+        state->keepalive = strncasecmp(value, "close", 5) != 0;
+    else
+        state->keepalive = strncmp(headers, "HTTP/1.0", 8) != 0;
+
+    value = find_header(headers, length, CONTENT_LENGTH);
+    state->content_length = value ? atoi(value) : -1;
+
+    if (state->responses == 0) {
+        if (state->stats.connects++ == 0)
+            fprintf(stderr, " i: upstream %s:%s%s: polling snapshots%s\n", state->hostname, state->port, state->path,
+                    state->keepalive ? " on a keep-alive connection" : ", the server closes the connection");
+    }
+
+    value = find_header(headers, length, TRANSFER_ENCODING);
+    state->net_start = found + 4 - state->netbuffer;
+
+    if (value != NULL && strncasecmp(value, "chunked", 7) == 0) {
+        state->chunked = TRUE;
+        state->chunk_pos = state->net_start;
+        state->chunk_remaining = 0;
+        state->chunk_crlf = FALSE;
+        state->chunk_last = FALSE;
+        state->phase = PHASE_BODY_CHUNKED;
+        if (dechunk(state) < 0)
+            return -1;
+    } else if (state->content_length >= 0 && state->content_length <= MAX_FRAME_SIZE) {
+        reserve(&state->buffer, &state->capacity, max(state->content_length, 1));
+        state->copied = 0;
+        state->phase = PHASE_BODY_LENGTH;
+    } else {
+        state->phase = PHASE_BODY_CLOSE;
+    }
+
+    return 0;
+}
+
+// main method
+// parses the received data as far as possible and runs the image callback
+// for every complete part
+// with a Content-Length header the body is copied straight into the frame
+// buffer, otherwise the received data is searched for the next boundary
+// returns an error message or NULL if more data is needed
+const char * extract_data(struct extractor_state * state) {
+    static char error [64];
+    int boundary_length = strlen(state->boundary);
+    char * found, * value, delimiter [BOUNDARY_SIZE + 1];
+    int limit, n, status;
+
+    while (TRUE) {
+        limit = state->chunked ? state->chunk_pos : state->net_end;
+
+        switch (state->phase) {
+        case PHASE_RESPONSE:
+            found = memmem(state->netbuffer + state->net_start, limit - state->net_start, "\r\n\r\n", 4);
+            if (found == NULL)
+                return (limit - state->net_start > MAX_HEADER_SIZE) ? "Response headers too long" : NULL;
+
+            if (limit - state->net_start < 12 || strncmp(state->netbuffer + state->net_start, "HTTP/", 5) != 0)
+                return "Invalid response";
+
+            status = atoi(state->netbuffer + state->net_start + 9);
+            if (status == 401)
+                return "Authentication failed";
+            if (status != 200) {
+                snprintf(error, sizeof(error), "Server answered with status %d", status);
+                return error;
+            }
+
+            if (state->rate > 0) {
+                if (snapshot_headers(state, found) < 0)
+                    return "Invalid chunked encoding";
                 break;
             }
-            state->buffer[state->length++] = buffer[i];
-            search_pattern_compare(&state->boundary, buffer[i]);
-            if (search_pattern_matches(&state->boundary)) {
-                state->length -= (strlen(state->boundary.string)+2); // magic happens here
-                DBG("Image of length %d received\n", (int)state->length);
-                if (state->on_image_received) // callback
-                  state->on_image_received(state->buffer, state->length);
-                init_extractor_state(state); // reset fsm
+
+            parse_boundary(state, state->netbuffer + state->net_start, found + 2 - state->netbuffer - state->net_start);
+            value = find_header(state->netbuffer + state->net_start, found + 2 - state->netbuffer - state->net_start, TRANSFER_ENCODING);
+            state->net_start = found + 2 - state->netbuffer;
+
+            if (value != NULL && strncasecmp(value, "chunked", 7) == 0) {
+                state->chunked = TRUE;
+                state->chunk_pos = state->net_start + 2;
+                if (dechunk(state) < 0)
+                    return "Invalid chunked encoding";
+            }
+
+            state->stats.connects++;
+            fprintf(stderr, " i: upstream %s:%s%s: connected\n", state->hostname, state->port, state->path);
+            state->phase = PHASE_DELIMITER;
+            break;
+
+        case PHASE_DELIMITER:
+            found = memmem(state->netbuffer + state->net_start, limit - state->net_start, state->boundary, boundary_length);
+            if (found == NULL) {
+                // the delimiter may start in the last bytes, drop everything before
+                if (limit - state->net_start >= boundary_length)
+                    state->net_start = limit - boundary_length + 1;
+                return NULL;
             }
+            state->net_start = found + boundary_length - state->netbuffer;
+            state->phase = PHASE_HEADERS;
             break;
+
+        case PHASE_HEADERS:
+            found = memmem(state->netbuffer + state->net_start, limit - state->net_start, "\r\n\r\n", 4);
+            if (found == NULL)
+                return (limit - state->net_start > MAX_HEADER_SIZE) ? "Part headers too long" : NULL;
+
+            value = find_header(state->netbuffer + state->net_start, found + 2 - state->netbuffer - state->net_start, CONTENT_LENGTH);
+            state->content_length = value ? atoi(value) : -1;
+            state->net_start = found + 4 - state->netbuffer;
+
+            if (state->content_length > 0 && state->content_length <= MAX_FRAME_SIZE) {
+                DBG("Content length found: %d\n", state->content_length);
+                if (reserve(&state->buffer, &state->capacity, state->content_length))
+                    return "Not enough memory";
+                state->copied = 0;
+                state->phase = PHASE_BODY_LENGTH;
+            } else {
+                // no usable Content-Length, the body ends with CRLF before the next delimiter
+                state->searched = state->net_start;
+                state->phase = PHASE_BODY_SEARCH;
+            }
+            break;
+
+        case PHASE_BODY_LENGTH:
+            n = min(state->content_length - state->copied, limit - state->net_start);
+            memcpy(state->buffer + state->copied, state->netbuffer + state->net_start, n);
+            state->copied += n;
+            state->net_start += n;
+            if (state->copied < state->content_length)
+                return NULL;
+
+            if (state->content_length > 0)
+                deliver(state, state->buffer, state->content_length);
+            if (state->rate > 0) {
+                snapshot_done(state);
+                state->phase = PHASE_RESPONSE;
+            } else {
+                state->phase = PHASE_DELIMITER;
+            }
+            break;
+
+        case PHASE_BODY_CHUNKED:
+            if (state->chunked)
+                return (limit - state->net_start > MAX_FRAME_SIZE) ? "Snapshot too large" : NULL;
+
+            // dechunk() found the end at chunk_pos
+            if (state->chunk_pos > state->net_start)
+                deliver(state, state->netbuffer + state->net_start, state->chunk_pos - state->net_start);
+            state->net_start = state->chunk_pos;
+            state->chunk_last = FALSE;
+            snapshot_done(state);
+            state->phase = PHASE_RESPONSE;
+            break;
+
+        case PHASE_BODY_CLOSE:
+            // delivered by proxy_receive() once the server closes the connection
+            return (limit - state->net_start > MAX_FRAME_SIZE) ? "Snapshot too large" : NULL;
+
+        case PHASE_BODY_SEARCH:
+            snprintf(delimiter, sizeof(delimiter), "\n%s", state->boundary);
+            found = memmem(state->netbuffer + state->searched, limit - state->searched, delimiter, boundary_length + 1);
+            if (found == NULL) {
+                // do not search the same bytes again
+                if (limit - state->searched > boundary_length)
+                    state->searched = limit - boundary_length;
+                return (limit - state->net_start > MAX_FRAME_SIZE) ? "No boundary found" : NULL;
+            }
+
+            n = found - (state->netbuffer + state->net_start);
+            if (n > 0 && found[-1] == '\r')
+                n--;
+            if (n > 0)
+                deliver(state, state->netbuffer + state->net_start, n);
+
+            // leave the delimiter for the next part
+            state->net_start = found + 1 - state->netbuffer;
+            state->phase = PHASE_DELIMITER;
+            break;
+
+        default:
+            return "Invalid state";
+        }
+    }
+}
+
+// receives what is available on the socket, called for each EPOLLIN
+void proxy_receive(struct extractor_state * state) {
+    const char * error;
+    int received, shift;
+
+    // the rest of a body with known length goes straight into the frame buffer
+    if (state->phase == PHASE_BODY_LENGTH && !state->chunked) {
+        received = recv(state->sockfd, state->buffer + state->copied, state->content_length - state->copied, 0);
+        if (received < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (received <= 0) {
+            proxy_fail(state, received ? strerror(errno) : "Connection closed");
+            return;
+        }
+
+        state->stats.bytes += received;
+        state->deadline = now_ms() + state->timeout;
+        state->copied += received;
+        if (state->copied == state->content_length) {
+            deliver(state, state->buffer, state->content_length);
+            if (state->rate > 0) {
+                snapshot_done(state);
+                state->phase = PHASE_RESPONSE;
+            } else {
+                state->phase = PHASE_DELIMITER;
+            }
         }
+        return;
+    }
+
+    // move the unparsed data to the front if the space behind runs short
+    if (state->net_start == state->net_end && state->chunk_pos == state->net_end) {
+        state->net_start = state->net_end = state->chunk_pos = state->searched = 0;
+    } else if (state->net_start > 0 && state->net_capacity - state->net_end < NETBUFFER_SIZE / 2) {
+        shift = state->net_start;
+        memmove(state->netbuffer, state->netbuffer + shift, state->net_end - shift);
+        state->net_start = 0;
+        state->net_end -= shift;
+        state->chunk_pos = max(state->chunk_pos - shift, 0);
+        state->searched = max(state->searched - shift, 0);
+    }
 
+    if (reserve(&state->netbuffer, &state->net_capacity, state->net_end + NETBUFFER_SIZE / 2)) {
+        proxy_fail(state, "Not enough memory");
+        return;
     }
 
+    received = recv(state->sockfd, state->netbuffer + state->net_end, state->net_capacity - state->net_end, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    // snapshot servers may close the connection after each response
+    if (received == 0 && state->rate > 0) {
+        if (state->phase == PHASE_BODY_CLOSE) {
+            if (state->net_end > state->net_start)
+                deliver(state, state->netbuffer + state->net_start, state->net_end - state->net_start);
+            state->net_start = state->net_end;
+            state->phase = PHASE_RESPONSE;
+            snapshot_done(state);
+        }
+        if (state->responses > 0 && state->phase == PHASE_RESPONSE && state->net_start == state->net_end) {
+            proxy_close(state);
+            state->keepalive = FALSE;
+            state->deadline = state->next_request;
+            return;
+        }
+    }
+
+    if (received <= 0) {
+        proxy_fail(state, received ? strerror(errno) : "Connection closed");
+        return;
+    }
+
+    state->stats.bytes += received;
+    state->deadline = now_ms() + state->timeout;
+    state->net_end += received;
+
+    if (state->chunked && dechunk(state) < 0) {
+        proxy_fail(state, "Invalid chunked encoding");
+        return;
+    }
+
+    if ((error = extract_data(state)) != NULL)
+        proxy_fail(state, error);
 }
 
-char request [] = "GET /?action=stream HTTP/1.0\r\n\r\n";
+void proxy_report(struct extractor_state * state) {
+    char polling [64] = "";
 
-void send_request_and_process_response(struct extractor_state * state) {
-    int recv_length;
-    char netbuffer[NETBUFFER_SIZE];
+    if (state->rate > 0)
+        snprintf(polling, sizeof(polling), ", polling every %d ms, response %.0f ms",
+                 state->poll_interval, state->response_time);
 
-    init_extractor_state(state);
-    
-    // send request
-    send(state->sockfd, request, sizeof(request), 0);
+    fprintf(stderr, " i: upstream %s:%s%s: %s%s, %llu frames (%.1f fps), %.1f MB, %lu connects, %lu failures%s%s\n",
+            state->hostname, state->port, state->path,
+            state->phase >= PHASE_RESPONSE ? "connected" : "disconnected", polling,
+            state->stats.frames,
+            (state->stats.frames - state->stats.frames_reported) * 1000.0 / state->stats_interval,
+            state->stats.bytes / (1024.0 * 1024.0),
+            state->stats.connects, state->stats.failures,
+            state->stats.last_error[0] ? ", last error: " : "", state->stats.last_error);
+    state->stats.frames_reported = state->stats.frames;
+}
+
+int proxy_loop_init(void) {
+    struct epoll_event event;
+
+    if (epollfd >= 0)
+        return 0;
+
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("Can't create epoll instance");
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    return epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &event);
+}
+
+// adds an upstream to the loop, it connects right away
+void proxy_loop_add(struct extractor_state * state) {
+    struct extractor_state ** last;
+    uint64_t value = 1;
+
+    state->deadline = 0;
+    state->next_report = now_ms() + state->stats_interval;
+
+    pthread_mutex_lock(&upstreams_mutex);
+    for (last = &upstreams; *last != NULL; last = &(*last)->next)
+        ;
+    *last = state;
+    pthread_mutex_unlock(&upstreams_mutex);
+
+    if (write(wakefd, &value, sizeof(value)) < 0)
+        DBG("Can't wake up the loop\n");
+}
+
+// serves all upstreams until THEY stop us
+void proxy_loop_run(int * should_stop) {
+    struct epoll_event events [MAX_EVENTS];
+    struct extractor_state * state;
+    int count, i, timeout;
+    long long now;
+    uint64_t value;
+
+    while (!*should_stop) {
+        // connect, time out and report, and find the next deadline
+        now = now_ms();
+        timeout = 1000;
+
+        pthread_mutex_lock(&upstreams_mutex);
+        for (state = upstreams; state != NULL; state = state->next) {
+            if (state->lookup_pending)
+                proxy_lookup_finished(state);
+            if (state->deadline <= now) {
+                if (state->phase == PHASE_IDLE) {
+                    if (state->addresses != NULL)
+                        proxy_connect(state, state->addresses);
+                    else
+                        proxy_resolve(state);
+                } else if (state->phase == PHASE_RESOLVING) {
+                    gai_cancel(&state->lookup);
+                    proxy_fail(state, "Name lookup timed out");
+                } else {
+                    proxy_fail(state, state->phase == PHASE_CONNECTING ? "Connect timed out" : "Read timed out");
+                }
+            }
+            if (state->rate > 0 && state->phase >= PHASE_RESPONSE) {
+                proxy_poll(state, now);
+                if (state->in_flight < (state->keepalive ? PIPELINE_DEPTH : 1) && state->next_request - now < timeout)
+                    timeout = max(state->next_request - now, 0);
+            }
+            if (state->stats_interval > 0 && state->next_report <= now) {
+                proxy_report(state);
+                state->next_report = now + state->stats_interval;
+            }
+            if (state->deadline - now < timeout)
+                timeout = max(state->deadline - now, 0);
+        }
+        pthread_mutex_unlock(&upstreams_mutex);
+
+        count = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+        for (i = 0; i < count && !*should_stop; i++) {
+            state = events[i].data.ptr;
+            if (state == NULL) {
+                if (read(wakefd, &value, sizeof(value)) < 0)
+                    DBG("Nothing to read from eventfd\n");
+            } else if (state->phase == PHASE_CONNECTING) {
+                proxy_connected(state);
+            } else if (state->sockfd >= 0) {
+                proxy_receive(state);
+            }
+        }
+    }
+}
 
-    // and listen for answer until sockerror or THEY stop us 
-    // TODO: we must handle EINTR here, it really might occur
-    while ( (recv_length = recv(state->sockfd, netbuffer, sizeof(netbuffer), 0)) > 0 && !*(state->should_stop))
-        extract_data(state, netbuffer, recv_length);
+void proxy_loop_close(void) {
+    struct extractor_state * state;
+    const struct gaicb * list [1];
 
+    for (state = upstreams; state != NULL; state = state->next) {
+        if (state->sockfd >= 0)
+            close(state->sockfd);
+        state->sockfd = -1;
+
+        // the resolver may still use the gaicb, wait for a lookup it can't drop
+        if (state->lookup_pending && gai_cancel(&state->lookup) == EAI_NOTCANCELED) {
+            list[0] = &state->lookup;
+            while (gai_error(&state->lookup) == EAI_INPROGRESS)
+                gai_suspend(list, 1, NULL);
+        }
+        if (state->lookup_pending && state->lookup.ar_result != NULL)
+            freeaddrinfo(state->lookup.ar_result);
+        state->lookup_pending = FALSE;
+        proxy_forget_addresses(state);
+    }
+
+    if (epollfd >= 0)
+        close(epollfd);
+    pthread_mutex_lock(&wakefd_mutex);
+    if (wakefd >= 0)
+        close(wakefd);
+    epollfd = wakefd = -1;
+    pthread_mutex_unlock(&wakefd_mutex);
 }
 
 // TODO:this must be reworked to decouple from mjpeg-streamer
@@ -137,8 +1006,13 @@ fprintf(stderr, " --------------------------------------------------------------
                 " The following parameters can be passed to this plugin:\n\n" \
                 " [-v | --version ]........: current SVN Revision\n" \
                 " [-h | --help]............: show this message\n"
+                " [-u | --url]..............: http://[user:password@]host[:port]/path to read from\n"
                 " [-H | --host]............: select host to data from, localhost is default\n"
                 " [-p | --port]............: port, defaults to 8080\n"
+                " [-t | --timeout]..........: connect and read timeout in seconds, defaults to 5\n"
+                " [-b | --backoff]..........: maximum delay between reconnects in seconds, defaults to 60\n"
+                " [-s | --stats]............: report the stream statistics every n seconds\n"
+                " [-r | --rate].............: poll snapshots at up to n frames per second instead\n"
                 " ---------------------------------------------------------------\n", program_name);
 }
 // TODO: this must be reworked, too. I don't know how
@@ -151,13 +1025,18 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
         static struct option long_options [] = {
             {"help", no_argument, 0, 'h'},
             {"version", no_argument, 0, 'v'},
+            {"url", required_argument, 0, 'u'},
             {"host", required_argument, 0, 'H'},
             {"port", required_argument, 0, 'p'},
+            {"timeout", required_argument, 0, 't'},
+            {"backoff", required_argument, 0, 'b'},
+            {"stats", required_argument, 0, 's'},
+            {"rate", required_argument, 0, 'r'},
             {0,0,0,0}
         };
 
         int index = 0, c = 0;
-        c = getopt_long_only(argc,argv, "hvH:p:", long_options, &index);
+        c = getopt_long_only(argc,argv, "hvu:H:p:t:b:s:r:", long_options, &index);
 
         if (c==-1) break;
 
@@ -175,6 +1054,10 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
                 show_version();
                 return 1;
                 break;
+            case 'u' :
+                if (parse_url(state, optarg))
+                    return 1;
+                break;
             case 'H' :
                 free(state->hostname);
                 state->hostname = strdup(optarg);
@@ -183,62 +1066,42 @@ int parse_cmd_line(struct extractor_state * state, int argc, char * argv []) {
                 free(state->port);
                 state->port = strdup(optarg);
                 break;
-            }
-    }
-
-  return 0;
-}
-
-// TODO: consider using hints for http
-
-// TODO: consider moving delays to plugin command line arguments
-void connect_and_stream(struct extractor_state * state){
-    struct addrinfo * info, * rp;
-    int errorcode;
-    while (TRUE) {
-        errorcode = getaddrinfo(state->hostname, state->port, NULL, &info);
-        if (errorcode) {
-            perror(gai_strerror(errorcode));
-        };
-        for (rp = info ; rp != NULL; rp = rp->ai_next) {
-            state->sockfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-            if (state->sockfd <0) {
-                perror("Can't allocate socket, will continue probing\n");
-                continue;
-            }
-
-            DBG("socket value is %d\n", state->sockfd);
-            if (connect(state->sockfd, (struct sockaddr *) rp->ai_addr, rp->ai_addrlen)>=0 ) {
-                DBG("connected to host\n");
+            case 't' :
+                state->timeout = atof(optarg) * 1000;
+                break;
+            case 'b' :
+                state->max_backoff = max(atof(optarg) * 1000, INITIAL_BACKOFF);
+                break;
+            case 's' :
+                state->stats_interval = atof(optarg) * 1000;
+                break;
+            case 'r' :
+                state->rate = atof(optarg);
+                if (state->rate <= 0 || state->rate > 1000) {
+                    fprintf(stderr, "The rate must be between 0 and 1000 frames per second\n");
+                    return 1;
+                }
                 break;
             }
+    }
 
-            close(state->sockfd);
-
-        }
-
-        freeaddrinfo(info);
-
-        if (rp==NULL) {
-            perror("Can't connect to server, will retry in 5 sec");
-            sleep(5);
+    // without a URL the snapshots of mjpeg-streamer are polled
+    if (state->rate > 0) {
+        state->poll_interval = 1000 / state->rate;
+        if (strcmp(state->path, "/?action=stream") == 0) {
+            free(state->path);
+            state->path = strdup("/?action=snapshot");
         }
-        else
-        {
-            send_request_and_process_response(state);
-            
-            DBG ("Closing socket\n");
-            close (state->sockfd);
-            if (*state->should_stop)
-              break;
-            sleep(1);
-        };
     }
 
+  return 0;
 }
 
 void close_mjpg_proxy(struct extractor_state * state){
     free(state->hostname);
     free(state->port);
+    free(state->path);
+    free(state->authorization);
+    free(state->buffer);
+    free(state->netbuffer);
 }
-
@@ -20,6 +20,7 @@
 #ifndef MJPG_PROXY_H
 #define MJPG_PROXY_H
 
+#include <netdb.h>
 #include "misc.h"
 
 
@@ -32,34 +33,119 @@
 #endif
 
 #define BUFFER_SIZE 1024 * 256
+#define BOUNDARY_SIZE 128
+// snapshot requests in flight on a keep-alive connection
+#define PIPELINE_DEPTH 2
+
+// connection phases of an upstream
+enum proxy_phase {
+    PHASE_IDLE,         // waiting for the next connection attempt
+    PHASE_RESOLVING,    // asynchronous name lookup in progress
+    PHASE_CONNECTING,   // non-blocking connect in progress
+    PHASE_RESPONSE,     // reading the response headers
+    PHASE_DELIMITER,    // looking for the next part delimiter
+    PHASE_HEADERS,      // reading the part headers
+    PHASE_BODY_LENGTH,  // receiving Content-Length bytes of body
+    PHASE_BODY_SEARCH,  // searching the delimiter behind the body
+    PHASE_BODY_CHUNKED, // receiving a chunked snapshot
+    PHASE_BODY_CLOSE    // receiving a snapshot that ends with the connection
+};
+
+struct proxy_stats {
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long connects;
+    unsigned long failures;
+    unsigned long long frames_reported; // frames at the last report, for the rate
+    char last_error [128];
+};
 
 struct extractor_state {
-    
+
+    // input plugin this upstream feeds
+    int id;
+
     char * port;
     char * hostname;
+    char * path;
+    char * authorization; // base64 encoded user:password or NULL
 
-    // this is current result
-    char buffer [BUFFER_SIZE];
+    // this is current result, grows with the frames
+    char * buffer;
+    int capacity;
     int length;
 
-    // this is inner state of a parser
+    // received data not parsed yet, net_start..net_end of netbuffer
+
+    // name lookup, it may outlive a timed out attempt and is then discarded
+    struct gaicb lookup;
+    struct addrinfo hints;
+    int lookup_pending;
+    // result of the last lookup, reused until a connect to it fails
+    struct addrinfo * addresses;
 
     int sockfd;
-    int part;
-    int last_four_bytes;
-    struct search_pattern contentlength;
-    struct search_pattern boundary;
-
-    int * should_stop;
-    void (*on_image_received)(char * data, int length);
-        
+    char * netbuffer;
+    int net_capacity;
+    int net_start;
+    int net_end;
+
+    // inner state of the parser
+    enum proxy_phase phase;
+    int content_length;
+    int copied;
+    int searched;        // search offset in netbuffer, data before is checked
+    int chunked;         // Transfer-Encoding: chunked
+    int chunk_pos;       // data before this offset is de-chunked
+    int chunk_remaining; // data bytes left of the current chunk
+    int chunk_crlf;      // CRLF behind a chunk still to skip
+    int chunk_last;      // the last chunk of a snapshot was seen
+
+    // part delimiter, "--" followed by the boundary of the Content-Type
+    char boundary [BOUNDARY_SIZE];
+
+    // timeouts and reconnecting, in ms
+    int timeout;
+    int backoff;
+    int max_backoff;
+    long long deadline;
+
+    // snapshot polling, a rate of 0 reads a stream instead
+    double rate;
+    int poll_interval;          // current interval in ms, adapted to the response time
+    int in_flight;
+    long long sent_at [PIPELINE_DEPTH];
+    long long next_request;
+    long long last_complete;
+    double response_time;       // smoothed service time of the camera in ms
+    int keepalive;
+    int responses;              // completed on this connection
+
+    // stats are reported every stats_interval ms, 0 disables it
+    struct proxy_stats stats;
+    int stats_interval;
+    long long next_report;
+
+    void (*on_image_received)(struct extractor_state * state, char * data, int length);
+
+    struct extractor_state * next;
 };
 
 void init_mjpg_proxy(struct extractor_state  * state);
 
 int parse_cmd_line(struct extractor_state * out_state, int argc, char * argv []);
 
-void connect_and_stream(struct extractor_state * state);
+// parses the data in netbuffer, returns an error message or NULL if more data is needed
+const char * extract_data(struct extractor_state * state);
+
+// the event loop serving all upstreams
+int proxy_loop_init(void);
+
+void proxy_loop_add(struct extractor_state * state);
+
+void proxy_loop_run(int * should_stop);
+
+void proxy_loop_close(void);
 
 void close_mjpg_proxy(struct extractor_state * state);
 
@@ -360,3 +360,25 @@ PyObject* NDArrayConverter::toNDArray(const cv::Mat& m)
     Py_INCREF(o);
     return o;
 }
+
+PyObject* NDArrayConverter::toNDArrayView(const cv::Mat& m)
+{
+    if( !m.data )
+        Py_RETURN_NONE;
+    
+    int depth = m.depth(), cn = m.channels();
+    int typenum = depth == CV_8U ? NPY_UBYTE : depth == CV_8S ? NPY_BYTE :
+    depth == CV_16U ? NPY_USHORT : depth == CV_16S ? NPY_SHORT :
+    depth == CV_32S ? NPY_INT : depth == CV_32F ? NPY_FLOAT :
+    depth == CV_64F ? NPY_DOUBLE : -1;
+    if( typenum < 0 || m.dims != 2 )
+    {
+        failmsg("%s can not be shared with numpy", info.name);
+        return NULL;
+    }
+    
+    npy_intp sizes[3] = { m.rows, m.cols, cn };
+    npy_intp strides[3] = { (npy_intp)m.step[0], (npy_intp)m.elemSize(), (npy_intp)m.elemSize1() };
+    return PyArray_New(&PyArray_Type, cn > 1 ? 3 : 2, sizes, typenum, strides,
+                       m.data, 0, NPY_ARRAY_WRITEABLE, NULL);
+}
@@ -10,6 +10,9 @@ public:
     
     bool toMat(PyObject* o, cv::Mat &m);
     PyObject* toNDArray(const cv::Mat& mat);
+    
+    // an ndarray using the memory of the mat, which must outlive it
+    PyObject* toNDArrayView(const cv::Mat& mat);
 };
 
 # endif
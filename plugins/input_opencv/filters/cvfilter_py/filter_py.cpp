@@ -7,6 +7,14 @@
 
 #include <libgen.h>
 #include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include "opencv2/opencv.hpp"
 #include <Python.h>
@@ -25,6 +33,89 @@ extern "C" {
 
 static int python_loaded = 0;
 
+// the interpreter's main thread state while the GIL is released, the filter
+// contexts of all workers of input_opencv share it
+static PyThreadState *pMainThread = NULL;
+
+// "--fargs '-p filter.py'" runs the script in a process of its own
+#define PROCESS_PREFIX "-p "
+
+// the frames are exchanged with the filter process through shared memory,
+// only the pages actually used get allocated
+#define SHM_FRAME_SIZE (32 << 20)
+
+// frames of input_opencv living in shared memory, one per pipeline slot
+#define MAX_SHARED_FRAMES 64
+
+enum {
+    RESULT_FAILED = -1,
+    RESULT_OUTPUT = 0,      // the result is in the output area
+    RESULT_IN_PLACE = 1     // the script changed the input area
+};
+
+// request and reply exchanged with the filter process, the first request for
+// a shared frame carries its file descriptor
+typedef struct {
+    int frame;
+    int rows, cols, type;
+    int result;
+} frame_message;
+
+/**
+    Places the pixels of a Mat in a shared memory area, the input half of it.
+    The pipeline slots of input_opencv capture into these, so the filter
+    processes read the frame and write their result without any copy in
+    mjpg-streamer. The output half takes a new array returned by the script.
+*/
+class SharedFrameAllocator : public MatAllocator
+{
+public:
+    int fd;
+    uchar *area;
+    
+    SharedFrameAllocator() : fd(-1), area(NULL) { stdAllocator = Mat::getStdAllocator(); }
+    
+    UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, int flags, UMatUsageFlags usageFlags) const
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        int i;
+        
+        for (i = dims - 1; i >= 0; i--) {
+            if (step != NULL)
+                step[i] = total;
+            total *= sizes[i];
+        }
+        
+        // larger frames are not filtered, see process_frame
+        if (data != NULL || area == NULL || total > SHM_FRAME_SIZE)
+            return stdAllocator->allocate(dims, sizes, type, data, step, flags, usageFlags);
+        
+        UMatData* u = new UMatData(this);
+        u->data = u->origdata = area;
+        u->size = total;
+        return u;
+    }
+    
+    bool allocate(UMatData* u, int accessFlags, UMatUsageFlags usageFlags) const
+    {
+        return stdAllocator->allocate(u, accessFlags, usageFlags);
+    }
+    
+    void deallocate(UMatData* u) const
+    {
+        // the area stays mapped for the next frame
+        if (u != NULL && u->refcount == 0)
+            delete u;
+    }
+    
+    const MatAllocator* stdAllocator;
+};
+
+static SharedFrameAllocator shared_frames[MAX_SHARED_FRAMES];
+static int shared_count = 0;
+static int processes = 0;
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 struct Context {
     NDArrayConverter converter;
     
@@ -32,7 +123,13 @@ struct Context {
     PyObject *filter_fn;
     PyObject *lastRetval;
     
-    PyThreadState *pMainThread;
+    // filter process
+    bool process;
+    pid_t pid;
+    int sock;
+    bool sent[MAX_SHARED_FRAMES];       // the process got the frame's descriptor
+    bool unshared;                      // a frame outside of shared memory was seen
+    uchar *mapped[MAX_SHARED_FRAMES];   // in the process, the frames it got
 };
 
 
@@ -57,31 +154,13 @@ static PyObject* get_import(const char * args) {
 }
 
 /**
-    Initializes the filter. If you return something, it will be passed to the
-    filter_process function, and should be freed by the filter_free function
+    Imports the filter script and calls its init_filter function, the GIL must
+    be held
 */
-bool filter_init(const char * args, void** filter_ctx) {
+static bool load_module(Context *ctx, const char * args) {
     
     PyObject *sys, *sys_path = NULL;
     PyObject *pModuleDir, *pModuleName, *pFunc;
-    Context * ctx;
-    char * dupargs, *mod_name, *mod_dir;
-    
-    if (strlen(args) < 3) {
-        fprintf(stderr, "Need to specify python filter module via --fargs\n");
-        return false;
-    }
-    
-    // don't initialize python more than once
-    if (python_loaded == 0) {
-        Py_Initialize();
-        PyEval_InitThreads();
-    }
-    
-    ctx = new Context();
-    *filter_ctx = ctx;
-    
-    python_loaded += 1;
     
     if (!NDArrayConverter::init_numpy()) {
         fprintf(stderr, "Error loading numpy!\n");
@@ -141,8 +220,224 @@ bool filter_init(const char * args, void** filter_ctx) {
         return false;
     }
     
+    return true;
+}
+
+/**
+    Receives the next request in the filter process, a shared frame sent along
+    gets mapped
+*/
+static bool receive_request(Context *ctx, frame_message *msg) {
+    
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr header;
+    struct cmsghdr *cmsg;
+    void *area;
+    int fd;
+    
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buf;
+    header.msg_controllen = sizeof(control.buf);
+    
+    if (recvmsg(ctx->sock, &header, MSG_CMSG_CLOEXEC) != sizeof(*msg))
+        return false;
+    
+    cmsg = CMSG_FIRSTHDR(&header);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        area = mmap(NULL, 2 * SHM_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (area == MAP_FAILED) {
+            perror("could not map the shared frame");
+        } else if (msg->frame < 0 || msg->frame >= MAX_SHARED_FRAMES || ctx->mapped[msg->frame] != NULL) {
+            munmap(area, 2 * SHM_FRAME_SIZE);
+        } else {
+            ctx->mapped[msg->frame] = (uchar*)area;
+        }
+    }
+    
+    return true;
+}
+
+/**
+    Main loop of the filter process: the script gets an ndarray on the input
+    half of the shared frame, a new array it returns is copied to the output
+    half
+*/
+static void serve_frames(Context *ctx) {
+    
+    frame_message msg;
+    
+    while (receive_request(ctx, &msg)) {
+        PyObject *ndArray, *retval;
+        
+        msg.result = RESULT_FAILED;
+        
+        if (msg.frame < 0 || msg.frame >= MAX_SHARED_FRAMES || ctx->mapped[msg.frame] == NULL) {
+            if (write(ctx->sock, &msg, sizeof(msg)) != sizeof(msg))
+                break;
+            continue;
+        }
+        
+        Mat src(msg.rows, msg.cols, msg.type, ctx->mapped[msg.frame]), dst;
+        
+        ndArray = ctx->converter.toNDArrayView(src);
+        if (ndArray == NULL) {
+            PyErr_Print();
+        } else {
+            retval = PyObject_CallFunctionObjArgs(ctx->filter_fn, ndArray, NULL);
+            if (retval == NULL) {
+                PyErr_Print();
+            } else if (retval == Py_None) {
+                msg.result = RESULT_IN_PLACE;
+            } else if (!ctx->converter.toMat(retval, dst)) {
+                PyErr_Print();
+            } else if (dst.data == src.data && dst.size() == src.size() && dst.type() == src.type()) {
+                msg.result = RESULT_IN_PLACE;
+            } else if (dst.total() * dst.elemSize() <= SHM_FRAME_SIZE) {
+                Mat out(dst.rows, dst.cols, dst.type(), ctx->mapped[msg.frame] + SHM_FRAME_SIZE);
+                dst.copyTo(out);
+                msg.rows = dst.rows;
+                msg.cols = dst.cols;
+                msg.type = dst.type();
+                msg.result = RESULT_OUTPUT;
+            } else {
+                fprintf(stderr, "filter result exceeds %d bytes\n", SHM_FRAME_SIZE);
+            }
+            
+            // release the result before its reference goes away
+            dst.release();
+            Py_XDECREF(retval);
+            Py_DECREF(ndArray);
+        }
+        
+        if (write(ctx->sock, &msg, sizeof(msg)) != sizeof(msg))
+            break;
+    }
+}
+
+/**
+    Closes the descriptors inherited from mjpg-streamer. The filter processes
+    started before would never see their socket closed otherwise.
+*/
+static void close_inherited(int keep) {
+    
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry;
+    
+    if (dir == NULL)
+        return;
+    
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        if (fd > 2 && fd != keep && fd != dirfd(dir))
+            close(fd);
+    }
+    closedir(dir);
+}
+
+/**
+    Forks the process running the script. It has an interpreter of its own, so
+    the scripts of several filter workers run in parallel.
+*/
+static bool start_process(Context *ctx, const char * args) {
+    
+    int sv[2];
+    char status = 0;
+    
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+        perror("could not create socket pair");
+        return false;
+    }
+    
+    ctx->pid = fork();
+    if (ctx->pid == -1) {
+        perror("could not fork the filter process");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    
+    if (ctx->pid == 0) {
+        // mjpg-streamer stops the process by closing the socket
+        signal(SIGINT, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        close_inherited(sv[1]);
+        ctx->sock = sv[1];
+        
+        Py_Initialize();
+        status = load_module(ctx, args);
+        
+        // tell the parent whether the script could be loaded
+        if (write(ctx->sock, &status, 1) == 1 && status)
+            serve_frames(ctx);
+        _exit(status ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    
+    close(sv[1]);
+    ctx->sock = sv[0];
+    
+    if (read(ctx->sock, &status, 1) != 1 || !status) {
+        fprintf(stderr, "filter process %d failed to load \"%s\"\n", ctx->pid, args);
+        return false;
+    }
+    return true;
+}
+
+/**
+    Initializes the filter. If you return something, it will be passed to the
+    filter_process function, and should be freed by the filter_free function
+*/
+bool filter_init(const char * args, void** filter_ctx) {
+    
+    Context * ctx;
+    bool process = false;
+    
+    if (strncmp(args, PROCESS_PREFIX, strlen(PROCESS_PREFIX)) == 0) {
+        args += strlen(PROCESS_PREFIX);
+        process = true;
+    }
+    
+    if (strlen(args) < 3) {
+        fprintf(stderr, "Need to specify python filter module via --fargs\n");
+        return false;
+    }
+    
+    ctx = new Context();
+    ctx->process = process;
+    ctx->sock = -1;
+    *filter_ctx = ctx;
+    
+    if (process) {
+        pthread_mutex_lock(&shared_mutex);
+        processes++;
+        pthread_mutex_unlock(&shared_mutex);
+        return start_process(ctx, args);
+    }
+    
+    // don't initialize python more than once
+    if (python_loaded == 0) {
+        Py_Initialize();
+        PyEval_InitThreads();
+    } else {
+        PyEval_RestoreThread(pMainThread);
+        pMainThread = NULL;
+    }
+    
+    python_loaded += 1;
+    
+    if (!load_module(ctx, args)) {
+        return false;
+    }
+    
     // done with initialization, let go of the GIL
-    ctx->pMainThread = PyEval_SaveThread();
+    pMainThread = PyEval_SaveThread();
     return true;
 }
 
@@ -156,6 +451,39 @@ void dbgMat(const char * wat, Mat &m) {
 Mat filter_init_frame(void *filter_ctx) {
     Context *ctx = (Context*)filter_ctx;
     
+    // the frames of filter processes are captured into shared memory, every
+    // call hands out a frame of its own
+    if (ctx->process) {
+        Mat mat;
+        SharedFrameAllocator *frame;
+        void *area;
+        int fd;
+        
+        pthread_mutex_lock(&shared_mutex);
+        if (shared_count == MAX_SHARED_FRAMES) {
+            pthread_mutex_unlock(&shared_mutex);
+            return mat;
+        }
+        
+        fd = memfd_create("cvfilter_py", MFD_CLOEXEC);
+        if (fd == -1 || ftruncate(fd, 2 * SHM_FRAME_SIZE) == -1 ||
+            (area = mmap(NULL, 2 * SHM_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+            perror("could not create a shared frame");
+            if (fd != -1)
+                close(fd);
+            pthread_mutex_unlock(&shared_mutex);
+            return mat;
+        }
+        
+        frame = &shared_frames[shared_count++];
+        frame->fd = fd;
+        frame->area = (uchar*)area;
+        pthread_mutex_unlock(&shared_mutex);
+        
+        mat.allocator = frame;
+        return mat;
+    }
+    
     // this function ensures that the initial mat is using the numpy allocator,
     // which avoids copies each time the source image is captured
     Mat mat;
@@ -165,6 +493,86 @@ Mat filter_init_frame(void *filter_ctx) {
     return mat;
 }
 
+/**
+    Sends a request to the filter process, along with the descriptor of the
+    shared frame if the process does not know it yet
+*/
+static bool send_request(Context *ctx, frame_message *msg) {
+    
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { msg, sizeof(*msg) };
+    struct msghdr header;
+    struct cmsghdr *cmsg;
+    
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    
+    if (!ctx->sent[msg->frame]) {
+        header.msg_control = control.buf;
+        header.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &shared_frames[msg->frame].fd, sizeof(int));
+    }
+    
+    if (sendmsg(ctx->sock, &header, MSG_NOSIGNAL) != sizeof(*msg))
+        return false;
+    
+    ctx->sent[msg->frame] = true;
+    return true;
+}
+
+/**
+    Passes a frame through the filter process. The frame was captured into
+    shared memory, so the process filters it where it is and a new result
+    arrives in the output half of the same area, nothing gets copied here.
+*/
+static void process_frame(Context *ctx, Mat &src, Mat &dst) {
+    
+    frame_message msg;
+    int frame;
+    
+    dst = src;
+    if (ctx->sock == -1)
+        return;
+    
+    // frames too large for the shared memory pass unfiltered
+    for (frame = 0; frame < shared_count; frame++) {
+        if (src.data == shared_frames[frame].area)
+            break;
+    }
+    if (frame == shared_count) {
+        if (!ctx->unshared)
+            fprintf(stderr, "frame is not in shared memory, passing it through\n");
+        ctx->unshared = true;
+        return;
+    }
+    
+    msg.frame = frame;
+    msg.rows = src.rows;
+    msg.cols = src.cols;
+    msg.type = src.type();
+    msg.result = RESULT_FAILED;
+    
+    if (!send_request(ctx, &msg) ||
+        read(ctx->sock, &msg, sizeof(msg)) != sizeof(msg)) {
+        fprintf(stderr, "filter process %d is gone, passing frames through\n", ctx->pid);
+        close(ctx->sock);
+        ctx->sock = -1;
+        return;
+    }
+    
+    // the slot keeps the frame until the encoder released dst
+    if (msg.result == RESULT_OUTPUT)
+        dst = Mat(msg.rows, msg.cols, msg.type, shared_frames[frame].area + SHM_FRAME_SIZE);
+}
+
 /**
     Called by the OpenCV plugin upon each frame
 */
@@ -173,6 +581,11 @@ void filter_process(void* filter_ctx, Mat &src, Mat &dst) {
     Context *ctx = (Context*)filter_ctx;
     PyObject *ndArray, *pArgs;
     
+    if (ctx->process) {
+        process_frame(ctx, src, dst);
+        return;
+    }
+    
     PyGILState_STATE gil_state = PyGILState_Ensure();
     
     ndArray = ctx->converter.toNDArray(src);
@@ -219,8 +632,32 @@ void filter_free(void* filter_ctx) {
     
     Context * ctx = (Context*)filter_ctx;
     
-    if (ctx->pMainThread != NULL) {
-        PyEval_RestoreThread(ctx->pMainThread);
+    if (ctx->process) {
+        // the process exits once the socket is closed
+        if (ctx->sock != -1)
+            close(ctx->sock);
+        if (ctx->pid > 0)
+            waitpid(ctx->pid, NULL, 0);
+        delete ctx;
+        
+        // input_opencv released the frames before, the last one unmaps them
+        pthread_mutex_lock(&shared_mutex);
+        if (--processes == 0) {
+            while (shared_count > 0) {
+                SharedFrameAllocator *frame = &shared_frames[--shared_count];
+                munmap(frame->area, 2 * SHM_FRAME_SIZE);
+                close(frame->fd);
+                frame->area = NULL;
+                frame->fd = -1;
+            }
+        }
+        pthread_mutex_unlock(&shared_mutex);
+        return;
+    }
+    
+    if (pMainThread != NULL) {
+        PyEval_RestoreThread(pMainThread);
+        pMainThread = NULL;
     }
     
     Py_XDECREF(ctx->lastRetval);
@@ -235,6 +672,8 @@ void filter_free(void* filter_ctx) {
         // TODO: weird threading KeyError... probably because this is not called
         //       from the same thread as filter_init
         Py_Finalize();
+    } else {
+        pMainThread = PyEval_SaveThread();
     }
 }
 
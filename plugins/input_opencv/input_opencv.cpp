@@ -23,6 +23,7 @@
 #include <getopt.h>
 #include <dlfcn.h>
 #include <pthread.h>
+#include <sys/time.h>
 
 #include "input_opencv.h"
 
@@ -34,8 +35,14 @@ using namespace std;
 /* private functions and variables to this plugin */
 static globals     *pglobal;
 
+#define MAX_FILTER_WORKERS 16
+#define MAX_FRAME_SLOTS (2 * MAX_FILTER_WORKERS + 2)
+
 typedef struct {
     char *filter_args;
+    int workers;
+    bool nodrop;
+    bool mjpeg;
     int fps_set, fps,
         quality_set, quality,
         co_set, co,
@@ -52,24 +59,76 @@ typedef void (*filter_process_fn)(void* filter_ctx, Mat &src, Mat &dst);
 typedef void (*filter_free_fn)(void* filter_ctx);
 
 
+// a captured frame on its way through the filters to the encoder
+typedef enum {
+    SLOT_FREE,
+    SLOT_CAPTURING,
+    SLOT_QUEUED,
+    SLOT_FILTERING,
+    SLOT_FILTERED,
+    SLOT_ENCODING
+} slot_state;
+
 typedef struct {
+    slot_state state;
+    unsigned long captured;     // capture order, used to find the oldest queued frame
+    unsigned long seq;          // dispatch order, the encoder publishes in this order
+    Mat src, dst;
+} frame_slot;
+
+struct _context;
+
+typedef struct {
+    pthread_t thread;
+    struct _context *pctx;
+    input *in;
+    int index;
+} filter_worker;
+
+typedef struct _context {
     pthread_t   worker;
     VideoCapture capture;
     
     context_settings *init_settings;
     
     void* filter_handle;
-    void* filter_ctx;
+    void* filter_ctx[MAX_FILTER_WORKERS];
     
     filter_init_fn filter_init;
     filter_init_frame_fn filter_init_frame;
     filter_process_fn filter_process;
     filter_free_fn filter_free;
     
+    /* the pipeline: capture thread -> filter workers -> encoder thread */
+    pthread_mutex_t pipeline;
+    pthread_cond_t queued;      // a frame waits for a filter worker
+    pthread_cond_t finished;    // a frame got filtered or a slot got free
+    bool stopping;
+    
+    int workers, nslots, queue_limit;
+    bool nodrop;
+    bool passthrough;           // publish the camera's JPEG frames as they are
+    frame_slot slots[MAX_FRAME_SLOTS];
+    filter_worker filters[MAX_FILTER_WORKERS];
+    int filters_started;
+    pthread_t encoder;
+    bool encoder_started;
+    
+    unsigned long captured, dispatched, next_seq, dropped;
+    
+    vector<int> compression_params;
+    
+    /* in->buf points into one of them, the next frame is encoded into the
+       other one, so the published frame stays valid until it is replaced */
+    vector<uchar> jpeg_buffers[2];
+    int published;
+    
 } context;
 
 
 void *worker_thread(void *);
+void *filter_thread(void *);
+void *encoder_thread(void *);
 void worker_cleanup(void *);
 
 #define INPUT_PLUGIN_NAME "OpenCV Input plugin"
@@ -95,6 +154,7 @@ static void help() {
     
     fprintf(stderr,
     " [-f | --fps ]..........: frames per second\n" \
+    " [-mjpeg ]..............: ask the camera for MJPEG frames\n" \
     " [-q | --quality ] .....: set quality of JPEG encoding\n" \
     " ---------------------------------------------------------------\n" \
     " Optional parameters (may not be supported by all cameras):\n\n"
@@ -108,6 +168,9 @@ static void help() {
     " Optional filter plugin:\n" \
     " [ -filter ]............: filter plugin .so\n" \
     " [ -fargs ].............: filter plugin arguments\n" \
+    " [ -workers ]...........: number of threads running the filter, defaults to 1\n" \
+    " [ -nodrop ]............: wait for the filters instead of dropping the oldest\n" \
+    "                          frame when they fall behind\n" \
     " ---------------------------------------------------------------\n\n"\
     );
 }
@@ -122,6 +185,7 @@ static context_settings* init_settings() {
     }
     
     settings->quality = 80;
+    settings->workers = 1;
     return settings;
 }
 
@@ -180,6 +244,9 @@ int input_init(input_parameter *param, int plugin_no)
             {"ex", required_argument, 0, 0},
             {"filter", required_argument, 0, 0},
             {"fargs", required_argument, 0, 0},
+            {"workers", required_argument, 0, 0},
+            {"nodrop", no_argument, 0, 0},
+            {"mjpeg", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
     
@@ -243,6 +310,25 @@ int input_init(input_parameter *param, int plugin_no)
             filter_args = optarg;
             break;
             
+        /* workers */
+        case 17:
+            settings->workers = atoi(optarg);
+            if (settings->workers < 1 || settings->workers > MAX_FILTER_WORKERS) {
+                fprintf(stderr, "-workers must be between 1 and %d\n", MAX_FILTER_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+            
+        /* nodrop */
+        case 18:
+            settings->nodrop = true;
+            break;
+            
+        /* mjpeg */
+        case 19:
+            settings->mjpeg = true;
+            break;
+            
         default:
             help();
             return 1;
@@ -252,6 +338,15 @@ int input_init(input_parameter *param, int plugin_no)
     IPRINT("device........... : %s\n", device);
     IPRINT("Desired Resolution: %i x %i\n", width, height);
     
+    pthread_mutex_init(&pctx->pipeline, NULL);
+    pthread_cond_init(&pctx->queued, NULL);
+    pthread_cond_init(&pctx->finished, NULL);
+    
+    pctx->workers = settings->workers;
+    pctx->nodrop = settings->nodrop;
+    pctx->nslots = 2 * pctx->workers + 2;
+    pctx->queue_limit = pctx->workers;
+    
     // need to allocate a VideoCapture object: default device is 0
     try {
         if (!strcasecmp(device, "default")) {
@@ -275,6 +370,9 @@ int input_init(input_parameter *param, int plugin_no)
     pctx->capture.set(CAP_PROP_FRAME_WIDTH, width);
     pctx->capture.set(CAP_PROP_FRAME_HEIGHT, height);
     
+    if (settings->mjpeg && !pctx->capture.set(CAP_PROP_FOURCC, VideoWriter::fourcc('M', 'J', 'P', 'G')))
+        IPRINT("the device does not support MJPEG\n");
+    
     if (settings->fps_set)
         pctx->capture.set(CAP_PROP_FPS, settings->fps);
     
@@ -314,18 +412,32 @@ int input_init(input_parameter *param, int plugin_no)
         // optional functions
         pctx->filter_init_frame = (filter_init_frame_fn)dlsym(pctx->filter_handle, "filter_init_frame");
         
-        // initialize it
-        if (!pctx->filter_init(filter_args, &pctx->filter_ctx)) {
-            goto fatal_error;
+        // initialize it, every worker gets a context of its own
+        for (i = 0; i < pctx->workers; i++) {
+            if (!pctx->filter_init(filter_args, &pctx->filter_ctx[i])) {
+                goto fatal_error;
+            }
         }
         
+        IPRINT("filter workers... : %d\n", pctx->workers);
+        
     } else {
         pctx->filter_handle = NULL;
-        pctx->filter_ctx = NULL;
         pctx->filter_process = null_filter;
         pctx->filter_free = NULL;
+        
+        /* nothing needs the pixels of a camera delivering MJPEG, unless
+           the frames shall be encoded with another quality */
+        if (!settings->quality_set &&
+            (int)pctx->capture.get(CAP_PROP_FOURCC) == VideoWriter::fourcc('M', 'J', 'P', 'G') &&
+            pctx->capture.set(CAP_PROP_CONVERT_RGB, 0)) {
+            pctx->passthrough = true;
+            IPRINT("JPEG pass-through: frames are published as the camera delivers them\n");
+        }
     }
     
+    IPRINT("when behind...... : %s\n", pctx->nodrop ? "wait for the filters" : "drop the oldest frame");
+    
     return 0;
     
 fatal_error:
@@ -345,6 +457,12 @@ int input_stop(int id)
     context *pctx = (context*)in->context;
     
     if (pctx != NULL) {
+        /* a capture waiting for a free slot is not cancelable */
+        pthread_mutex_lock(&pctx->pipeline);
+        pctx->stopping = true;
+        pthread_cond_broadcast(&pctx->finished);
+        pthread_mutex_unlock(&pctx->pipeline);
+        
         DBG("will cancel input thread\n");
         pthread_cancel(pctx->worker);
     }
@@ -374,11 +492,102 @@ int input_run(int id)
     return 0;
 }
 
+/******************************************************************************
+Description.: publishes the spare JPEG buffer, the other one is the spare
+              buffer afterwards
+Input Value.: in is the input, pctx its context
+Return Value: -
+******************************************************************************/
+static void publish(input *in, context *pctx)
+{
+    vector<uchar> &jpeg_buffer = pctx->jpeg_buffers[1 - pctx->published];
+    struct timeval timestamp;
+    
+    gettimeofday(&timestamp, NULL);
+    
+    pthread_mutex_lock(&in->db);
+    
+    // std::vector is guaranteed to be contiguous
+    in->buf = &jpeg_buffer[0];
+    in->size = jpeg_buffer.size();
+    in->timestamp = timestamp;
+    
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&in->db_update);
+    pthread_mutex_unlock(&in->db);
+    
+    pctx->published = 1 - pctx->published;
+}
+
+/******************************************************************************
+Description.: publishes a frame the camera delivered as JPEG already, it gets
+              copied as the capture reuses its memory for the next frame
+Input Value.: in is the input, pctx its context, raw the captured frame
+Return Value: false if the frame is not a JPEG
+******************************************************************************/
+static bool publish_jpeg(input *in, context *pctx, Mat &raw)
+{
+    size_t size = raw.total() * raw.elemSize();
+    
+    if (!raw.isContinuous() || size < 4 || raw.data[0] != 0xff || raw.data[1] != 0xd8)
+        return false;
+    
+    pctx->jpeg_buffers[1 - pctx->published].assign(raw.data, raw.data + size);
+    publish(in, pctx);
+    return true;
+}
+
+/******************************************************************************
+Description.: returns the queued frame that was captured first
+Input Value.: pctx is the plugin context, the pipeline lock must be held
+Return Value: the slot or NULL if no frame is queued
+******************************************************************************/
+static frame_slot *oldest_queued(context *pctx)
+{
+    frame_slot *oldest = NULL;
+    
+    for (int i = 0; i < pctx->nslots; i++) {
+        frame_slot *slot = &pctx->slots[i];
+        if (slot->state == SLOT_QUEUED && (oldest == NULL || slot->captured < oldest->captured))
+            oldest = slot;
+    }
+    return oldest;
+}
+
+/******************************************************************************
+Description.: returns a slot to capture the next frame into, when all are in
+              use the oldest queued frame gets dropped, or with -nodrop the
+              capture waits until the encoder freed one
+Input Value.: pctx is the plugin context, the pipeline lock must be held
+Return Value: the slot or NULL if the pipeline is full or stopping
+******************************************************************************/
+static frame_slot *capture_slot(context *pctx)
+{
+    while (!pctx->stopping) {
+        for (int i = 0; i < pctx->nslots; i++) {
+            if (pctx->slots[i].state == SLOT_FREE)
+                return &pctx->slots[i];
+        }
+        
+        if (!pctx->nodrop) {
+            frame_slot *slot = oldest_queued(pctx);
+            if (slot != NULL)
+                pctx->dropped++;
+            return slot;
+        }
+        
+        pthread_cond_wait(&pctx->finished, &pctx->pipeline);
+    }
+    return NULL;
+}
+
+/* the capture thread, feeds the filter workers */
 void *worker_thread(void *arg)
 {
     input * in = (input*)arg;
     context *pctx = (context*)in->context;
     context_settings *settings = (context_settings*)pctx->init_settings;
+    int i, oldstate;
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, arg);
@@ -404,44 +613,113 @@ void *worker_thread(void *arg)
     CVOPT_SET(CAP_PROP_EXPOSURE, ex, "exposure")
     
     /* setup imencode options */
-    vector<int> compression_params;
-    compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-    compression_params.push_back(settings->quality); // 1-100
+    pctx->compression_params.push_back(CV_IMWRITE_JPEG_QUALITY);
+    pctx->compression_params.push_back(settings->quality); // 1-100
     
     free(settings);
     pctx->init_settings = NULL;
     settings = NULL;
     
-    Mat src, dst;
-    vector<uchar> jpeg_buffer;
+    Mat scratch;
+    bool eof = false;
+    
+    /* the JPEG frames of the camera need neither decoding nor encoding */
+    while (pctx->passthrough && !pglobal->stop) {
+        if (!pctx->capture.read(scratch)) {
+            eof = true;
+            break;
+        }
+        
+        if (!publish_jpeg(in, pctx, scratch)) {
+            IPRINT("the device does not deliver JPEG frames, encoding them\n");
+            pctx->passthrough = false;
+            pctx->capture.set(CAP_PROP_CONVERT_RGB, 1);
+            break;
+        }
+        pctx->captured++;
+    }
     
     // this exists so that the numpy allocator can assign a custom allocator to
     // the mat, so that it doesn't need to copy the data each time
-    if (pctx->filter_init_frame != NULL)
-        src = pctx->filter_init_frame(pctx->filter_ctx);
+    if (pctx->filter_init_frame != NULL) {
+        for (i = 0; i < pctx->nslots; i++)
+            pctx->slots[i].src = pctx->filter_init_frame(pctx->filter_ctx[0]);
+    }
     
-    while (!pglobal->stop) {
-        if (!pctx->capture.read(src))
-            break; // TODO
-            
-        // call the filter function
-        pctx->filter_process(pctx->filter_ctx, src, dst);
-            
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&in->db);
+    /* start the filter workers and the encoder */
+    for (i = 0; i < pctx->workers; i++) {
+        filter_worker *worker = &pctx->filters[i];
+        worker->pctx = pctx;
+        worker->in = in;
+        worker->index = i;
+        if (pthread_create(&worker->thread, 0, filter_thread, worker) != 0) {
+            fprintf(stderr, "could not start filter thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pctx->filters_started++;
+    }
+    
+    if (pthread_create(&pctx->encoder, 0, encoder_thread, in) != 0) {
+        fprintf(stderr, "could not start encoder thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pctx->encoder_started = true;
+    
+    while (!eof && !pglobal->stop) {
+        frame_slot *slot;
         
-        // take whatever Mat it returns, and write it to jpeg buffer
-        imencode(".jpg", dst, jpeg_buffer, compression_params);
+        /* the pipeline lock is never held at a cancellation point */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        pthread_mutex_lock(&pctx->pipeline);
+        slot = capture_slot(pctx);
+        if (slot != NULL)
+            slot->state = SLOT_CAPTURING;
+        bool stopping = pctx->stopping;
+        pthread_mutex_unlock(&pctx->pipeline);
+        pthread_setcancelstate(oldstate, NULL);
         
-        // TODO: what to do if imencode returns an error?
+        if (stopping)
+            break;
         
-        // std::vector is guaranteed to be contiguous
-        in->buf = &jpeg_buffer[0];
-        in->size = jpeg_buffer.size();
+        /* keep reading while every slot is busy, so the frames stay current */
+        if (slot == NULL) {
+            if (!pctx->capture.read(scratch))
+                break;
+            pthread_mutex_lock(&pctx->pipeline);
+            pctx->dropped++;
+            pthread_mutex_unlock(&pctx->pipeline);
+            continue;
+        }
         
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&in->db_update);
-        pthread_mutex_unlock(&in->db);
+        bool ok = pctx->capture.read(slot->src);
+        
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        pthread_mutex_lock(&pctx->pipeline);
+        if (ok) {
+            slot->state = SLOT_QUEUED;
+            slot->captured = pctx->captured++;
+            
+            /* more frames waiting than workers to take them: the filters
+               are behind, so the oldest one is not worth filtering anymore */
+            int waiting = 0;
+            for (i = 0; i < pctx->nslots; i++) {
+                if (pctx->slots[i].state == SLOT_QUEUED)
+                    waiting++;
+            }
+            if (!pctx->nodrop && waiting > pctx->queue_limit) {
+                oldest_queued(pctx)->state = SLOT_FREE;
+                pctx->dropped++;
+            }
+            
+            pthread_cond_signal(&pctx->queued);
+        } else {
+            slot->state = SLOT_FREE;
+        }
+        pthread_mutex_unlock(&pctx->pipeline);
+        pthread_setcancelstate(oldstate, NULL);
+        
+        if (!ok)
+            break; // TODO
     }
     
     IPRINT("leaving input thread, calling cleanup function now\n");
@@ -450,6 +728,86 @@ void *worker_thread(void *arg)
     return NULL;
 }
 
+/* a filter worker, runs the filter with a context of its own */
+void *filter_thread(void *arg)
+{
+    filter_worker *worker = (filter_worker*)arg;
+    context *pctx = worker->pctx;
+    void *filter_ctx = pctx->filter_ctx[worker->index];
+    
+    pthread_mutex_lock(&pctx->pipeline);
+    while (!pctx->stopping) {
+        frame_slot *slot = oldest_queued(pctx);
+        if (slot == NULL) {
+            pthread_cond_wait(&pctx->queued, &pctx->pipeline);
+            continue;
+        }
+        
+        slot->state = SLOT_FILTERING;
+        slot->seq = pctx->dispatched++;
+        pthread_mutex_unlock(&pctx->pipeline);
+        
+        // call the filter function
+        pctx->filter_process(filter_ctx, slot->src, slot->dst);
+        
+        pthread_mutex_lock(&pctx->pipeline);
+        slot->state = SLOT_FILTERED;
+        pthread_cond_broadcast(&pctx->finished);
+    }
+    pthread_mutex_unlock(&pctx->pipeline);
+    
+    return NULL;
+}
+
+/* the encoder, publishes the filtered frames in the order they were captured */
+void *encoder_thread(void *arg)
+{
+    input * in = (input*)arg;
+    context *pctx = (context*)in->context;
+    
+    pthread_mutex_lock(&pctx->pipeline);
+    while (!pctx->stopping) {
+        frame_slot *slot = NULL;
+        
+        for (int i = 0; i < pctx->nslots; i++) {
+            if (pctx->slots[i].state == SLOT_FILTERED && pctx->slots[i].seq == pctx->next_seq) {
+                slot = &pctx->slots[i];
+                break;
+            }
+        }
+        
+        if (slot == NULL) {
+            pthread_cond_wait(&pctx->finished, &pctx->pipeline);
+            continue;
+        }
+        
+        slot->state = SLOT_ENCODING;
+        pthread_mutex_unlock(&pctx->pipeline);
+        
+        // take whatever Mat it returns, and write it to the spare jpeg buffer
+        vector<uchar> &jpeg_buffer = pctx->jpeg_buffers[1 - pctx->published];
+        bool encoded = false;
+        try {
+            encoded = imencode(".jpg", slot->dst, jpeg_buffer, pctx->compression_params);
+        } catch (Exception &e) {
+            IPRINT("imencode() failed: %s\n", e.what());
+        }
+        
+        /* publish the JPG picture by swapping the buffers */
+        if (encoded && !jpeg_buffer.empty())
+            publish(in, pctx);
+        
+        pthread_mutex_lock(&pctx->pipeline);
+        slot->dst.release();
+        slot->state = SLOT_FREE;
+        pctx->next_seq++;
+        pthread_cond_broadcast(&pctx->finished);
+    }
+    pthread_mutex_unlock(&pctx->pipeline);
+    
+    return NULL;
+}
+
 /******************************************************************************
 Description.: this functions cleans up allocated resources
 Input Value.: arg is unused
@@ -460,9 +818,40 @@ void worker_cleanup(void *arg)
     input * in = (input*)arg;
     if (in->context != NULL) {
         context *pctx = (context*)in->context;
+        int i;
+        
+        /* the filter workers and the encoder finish their current frame */
+        pthread_mutex_lock(&pctx->pipeline);
+        pctx->stopping = true;
+        pthread_cond_broadcast(&pctx->queued);
+        pthread_cond_broadcast(&pctx->finished);
+        pthread_mutex_unlock(&pctx->pipeline);
         
-        if (pctx->filter_free != NULL && pctx->filter_ctx != NULL) {
-            pctx->filter_free(pctx->filter_ctx);
+        for (i = 0; i < pctx->filters_started; i++)
+            pthread_join(pctx->filters[i].thread, NULL);
+        if (pctx->encoder_started)
+            pthread_join(pctx->encoder, NULL);
+        
+        if (pctx->captured > 0)
+            IPRINT("%lu frames captured, %lu dropped\n", pctx->captured, pctx->dropped);
+        
+        /* the frame buffers go away with the context */
+        pthread_mutex_lock(&in->db);
+        in->buf = NULL;
+        in->size = 0;
+        pthread_mutex_unlock(&in->db);
+        
+        /* the frames may live in memory of the filter */
+        for (i = 0; i < pctx->nslots; i++) {
+            pctx->slots[i].src.release();
+            pctx->slots[i].dst.release();
+        }
+        
+        if (pctx->filter_free != NULL) {
+            for (i = 0; i < MAX_FILTER_WORKERS; i++) {
+                if (pctx->filter_ctx[i] != NULL)
+                    pctx->filter_free(pctx->filter_ctx[i]);
+            }
             pctx->filter_free = NULL;
         }
         
@@ -471,6 +860,10 @@ void worker_cleanup(void *arg)
             pctx->filter_handle = NULL;
         }
         
+        pthread_cond_destroy(&pctx->finished);
+        pthread_cond_destroy(&pctx->queued);
+        pthread_mutex_destroy(&pctx->pipeline);
+        
         delete pctx;
         in->context = NULL;
     }
@@ -26,6 +26,7 @@
 #include <pthread.h>
 #include <gphoto2/gphoto2-camera.h>
 #include "input_ptp2.h"
+#include "../../pacing.h"
 
 #define INPUT_PLUGIN_NAME "PTP2 input plugin"
 
@@ -120,7 +121,7 @@ void help()
 	" ---------------------------------------------------------------\n"
 	" The following parameters can be passed to this plugin:\n\n"
 	" [-h ]..........: print this help\n"
-	" [-u X ]........: delay between frames in us (default 0)\n"
+	" [-u X ]........: interval between frames in us (default 0)\n"
 	" [-d X ]........: camera address in [usb:xxx,yyy] form; use\n"
 	"                  gphoto2 --auto-detect to get a list of\n"
 	"                  available cameras\n"
@@ -231,11 +232,15 @@ void* capture(void* arg)
 		return NULL;
 	}
 
+	pacing pacer;
+	pacing_init(&pacer, delay / 1000000.0, PACING_SKIP);
+
 	pthread_cleanup_push(cleanup, NULL);
 	while(!global->stop)
 	{
 		unsigned long int xsize;
 		const char* xdata;
+		pacing_wait(&pacer);
 		pthread_mutex_lock(&control_mutex);
 		res = gp_file_new(&file);
 		CAMERA_CHECK_GP(res, "gp_file_new");
@@ -281,7 +286,6 @@ void* capture(void* arg)
 		DBG("Read %d bytes from camera.\n", global->in[plugin_id].size);
 		pthread_cond_broadcast(&global->in[plugin_id].db_update);
 		pthread_mutex_unlock(&global->in[plugin_id].db);
-		usleep(delay);
 	}
 	pthread_cleanup_pop(1);
 
@@ -0,0 +1,611 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+#                                                                              #
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "../output_file/output_file.h"
+
+#define INPUT_PLUGIN_NAME "REPLAY input plugin"
+
+/* private functions and variables to this plugin */
+static pthread_t   worker;
+static globals     *pglobal;
+
+void *worker_thread(void *);
+void worker_cleanup(void *);
+void help(void);
+
+static char *path = NULL;
+static double speed = 1.0;
+static double fps = 0;
+static int loop = 0;
+static int plugin_number;
+
+/*
+ * every source is turned into a list of archive records: MJPG and AVI files
+ * are a single segment with timestamps derived from the frame rate, archives
+ * written by output_file bring their own index
+ */
+static archive_record *frames = NULL;
+static long frame_count = 0;
+static int is_archive = 0;
+
+static void *index_map = NULL;
+static size_t index_len = 0;
+
+static unsigned char *segment_map = NULL;
+static size_t segment_len = 0;
+static uint32_t segment_number = 0;
+
+/*** plugin interface functions ***/
+int input_init(input_parameter *param, int id)
+{
+    int i;
+    plugin_number = id;
+
+    param->argv[0] = INPUT_PLUGIN_NAME;
+
+    /* show all parameters for DBG purposes */
+    for(i = 0; i < param->argc; i++) {
+        DBG("argv[%d]=%s\n", i, param->argv[i]);
+    }
+
+    reset_getopt();
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0
+            },
+            {"help", no_argument, 0, 0},
+            {"f", required_argument, 0, 0},
+            {"file", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"speed", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"l", no_argument, 0, 0},
+            {"loop", no_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help();
+            return 1;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            DBG("case 0,1\n");
+            help();
+            return 1;
+            break;
+
+            /* f, file */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            path = strdup(optarg);
+            if(strlen(path) > 1 && path[strlen(path)-1] == '/')
+                path[strlen(path)-1] = '\0';
+            break;
+
+            /* s, speed */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            speed = atof(optarg);
+            break;
+
+            /* r, fps */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            fps = atof(optarg);
+            break;
+
+            /* l, loop */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            loop = 1;
+            break;
+        default:
+            DBG("default case\n");
+            help();
+            return 1;
+        }
+    }
+
+    pglobal = param->global;
+
+    /* check for required parameters */
+    if(path == NULL) {
+        IPRINT("ERROR: no file specified\n");
+        return 1;
+    }
+
+    IPRINT("replaying.........: %s\n", path);
+    IPRINT("speed.............: %.2f%s\n", speed, (speed > 0) ? "" : " (as fast as possible)");
+    IPRINT("loop..............: %s\n", (loop) ? "yes" : "no");
+
+    param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
+    sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
+
+    return 0;
+}
+
+int input_stop(int id)
+{
+    DBG("will cancel input thread\n");
+    pthread_cancel(worker);
+    return 0;
+}
+
+/*** private functions for this plugin below ***/
+void help(void)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+    " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
+    " ---------------------------------------------------------------\n" \
+    " The following parameters can be passed to this plugin:\n\n" \
+    " [-f | --file ].........: MJPG or AVI file, or the folder of an archive\n" \
+    "                          recorded by output_file\n" \
+    " [-s | --speed ]........: playback speed multiplier, 0 is as fast as possible\n" \
+    " [-r | --fps ]..........: frame rate of files without timing information\n" \
+    " [-l | --loop ].........: start over at the end\n" \
+    " ---------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: maps a file read-only
+Input Value.: name: file to map
+              len: receives the length of the mapping
+Return Value: the mapping, NULL in case of error
+******************************************************************************/
+static void *map_file(const char *name, size_t *len)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if((fd = open(name, O_RDONLY)) < 0) {
+        IPRINT("could not open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    if(fstat(fd, &st) < 0 || st.st_size == 0) {
+        IPRINT("could not read %s\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        perror("mmap()");
+        return NULL;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size;
+
+    return map;
+}
+
+/******************************************************************************
+Description.: appends a frame of the single segment of a MJPG or AVI file
+Input Value.: offset, size: position of the JPEG inside the file
+Return Value: 0 if everything is OK, -1 if out of memory
+******************************************************************************/
+static int add_frame(uint64_t offset, uint32_t size)
+{
+    static long allocated = 0;
+    archive_record *tmp;
+
+    if(frame_count == allocated) {
+        allocated = allocated * 2 + 256;
+        if((tmp = realloc(frames, allocated * sizeof(archive_record))) == NULL)
+            return -1;
+        frames = tmp;
+    }
+
+    frames[frame_count].offset = offset;
+    frames[frame_count].size = size;
+    frames[frame_count].segment = 0;
+    frames[frame_count].timestamp = 0;
+    frame_count++;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: determines the length of a JPEG by walking its marker segments,
+              thumbnails in APP segments are skipped that way
+Input Value.: buf, len: data starting with the SOI marker
+Return Value: length of the JPEG including EOI, 0 if it is incomplete
+******************************************************************************/
+static size_t jpeg_length(const unsigned char *buf, size_t len)
+{
+    const unsigned char *p;
+    size_t pos = 2;
+    unsigned char marker;
+
+    if(len < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+        return 0;
+
+    while(pos + 2 <= len) {
+        if(buf[pos] != 0xff)
+            return 0;
+
+        marker = buf[pos + 1];
+        if(marker == 0xff) {
+            /* fill byte */
+            pos++;
+            continue;
+        }
+        if(marker == 0xd9)
+            return pos + 2;
+        if((marker >= 0xd0 && marker <= 0xd7) || marker == 0x01) {
+            pos += 2;
+            continue;
+        }
+
+        if(pos + 4 > len)
+            return 0;
+        pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
+
+        if(marker == 0xda) {
+            /* entropy coded data ends at the first marker except RST and stuffing */
+            while(pos + 1 < len) {
+                if((p = memchr(buf + pos, 0xff, len - pos - 1)) == NULL)
+                    return 0;
+                pos = p - buf;
+                if(buf[pos + 1] != 0x00 && (buf[pos + 1] < 0xd0 || buf[pos + 1] > 0xd7))
+                    break;
+                pos += 2;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: indexes a file of concatenated JPEGs, e.g. recorded by
+              output_file --mjpeg or saved from a multipart HTTP stream
+Input Value.: map, len: the mapped file
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int index_mjpg(const unsigned char *map, size_t len)
+{
+    const unsigned char *p;
+    size_t pos = 0, size;
+
+    while(pos + 4 <= len) {
+        if((p = memmem(map + pos, len - pos, "\xff\xd8\xff", 3)) == NULL)
+            break;
+        pos = p - map;
+
+        if((size = jpeg_length(p, len - pos)) == 0) {
+            DBG("incomplete frame at offset %zu\n", pos);
+            break;
+        }
+
+        if(add_frame(pos, size) < 0)
+            return -1;
+        pos += size;
+    }
+
+    return 0;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/******************************************************************************
+Description.: walks the chunks of a RIFF/AVI file and indexes the compressed
+              video chunks ("##dc", "##db"), the frame rate is taken from
+              the main AVI header unless given on the command line
+Input Value.: map: the mapped file
+              start, end: range of chunks to walk
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int index_avi(const unsigned char *map, size_t start, size_t end)
+{
+    const unsigned char *chunk;
+    uint32_t size;
+
+    while(start + 8 <= end) {
+        chunk = map + start;
+        size = le32(chunk + 4);
+        if(size > end - start - 8)
+            size = end - start - 8;
+
+        if((memcmp(chunk, "RIFF", 4) == 0 || memcmp(chunk, "LIST", 4) == 0) && size >= 4) {
+            if(index_avi(map, start + 12, start + 8 + size) < 0)
+                return -1;
+        } else if(memcmp(chunk, "avih", 4) == 0 && size >= 4) {
+            if(fps <= 0 && le32(chunk + 8) > 0)
+                fps = 1000000.0 / le32(chunk + 8);
+        } else if((memcmp(chunk + 2, "dc", 2) == 0 || memcmp(chunk + 2, "db", 2) == 0) &&
+                  size > 2 && chunk[8] == 0xff && chunk[9] == 0xd8) {
+            if(add_frame(start + 8, size) < 0)
+                return -1;
+        }
+
+        /* chunks are padded to an even size */
+        start += 8 + size + (size & 1);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: maps the index of an archive recorded by output_file
+Input Value.: -
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int open_archive(void)
+{
+    char name[1024];
+    archive_header *header;
+
+    if(snprintf(name, sizeof(name), ARCHIVE_INDEX_FMT, path) >= sizeof(name)) {
+        IPRINT("the archive index filename in %s is too long\n", path);
+        return -1;
+    }
+    if((index_map = map_file(name, &index_len)) == NULL)
+        return -1;
+
+    header = index_map;
+    if(index_len < sizeof(archive_header) ||
+       memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+       header->record_size != sizeof(archive_record)) {
+        IPRINT("%s is not a valid archive index\n", name);
+        return -1;
+    }
+
+    frames = (archive_record *)((char *)index_map + sizeof(archive_header));
+    frame_count = (index_len - sizeof(archive_header)) / sizeof(archive_record);
+    is_archive = 1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: opens the file or archive and builds the list of frames
+Input Value.: -
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int open_source(void)
+{
+    struct stat st;
+    long i;
+
+    if(stat(path, &st) < 0) {
+        IPRINT("could not access %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if(S_ISDIR(st.st_mode)) {
+        if(open_archive() < 0)
+            return -1;
+        IPRINT("archive...........: %ld frames\n", frame_count);
+        return 0;
+    }
+
+    if((segment_map = map_file(path, &segment_len)) == NULL)
+        return -1;
+
+    if(segment_len >= 12 && memcmp(segment_map, "RIFF", 4) == 0 && memcmp(segment_map + 8, "AVI ", 4) == 0) {
+        if(index_avi(segment_map, 0, segment_len) < 0)
+            return -1;
+    } else if(index_mjpg(segment_map, segment_len) < 0) {
+        return -1;
+    }
+
+    if(fps <= 0)
+        fps = 25;
+
+    for(i = 0; i < frame_count; i++)
+        frames[i].timestamp = (uint64_t)(i * 1000000 / fps);
+
+    IPRINT("file..............: %ld frames at %.2f fps\n", frame_count, fps);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: returns a pointer to the JPEG of a frame inside the mapping
+              of its segment, archive segments get mapped on demand
+Input Value.: frame: the frame to look up
+Return Value: pointer to the JPEG, NULL in case of error
+******************************************************************************/
+static unsigned char *frame_data(archive_record *frame)
+{
+    char name[1024];
+
+    if(is_archive && (segment_map == NULL || frame->segment != segment_number ||
+                      frame->offset + frame->size > segment_len)) {
+        /* the consumers copy under the lock, so the old mapping is not referenced anymore */
+        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        if(segment_map != NULL) {
+            munmap(segment_map, segment_len);
+            segment_map = NULL;
+        }
+        pglobal->in[plugin_number].buf = NULL;
+        pglobal->in[plugin_number].size = 0;
+        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+        if(snprintf(name, sizeof(name), ARCHIVE_SEGMENT_FMT, path, frame->segment) >= sizeof(name)) {
+            IPRINT("the archive segment filename in %s is too long\n", path);
+            return NULL;
+        }
+        if((segment_map = map_file(name, &segment_len)) == NULL)
+            return NULL;
+        segment_number = frame->segment;
+    }
+
+    if(frame->offset + frame->size > segment_len) {
+        IPRINT("frame exceeds its segment\n");
+        return NULL;
+    }
+
+    return segment_map + frame->offset;
+}
+
+int input_run(int id)
+{
+    pglobal->in[id].buf = NULL;
+
+    if(open_source() < 0)
+        return 1;
+
+    if(frame_count == 0) {
+        IPRINT("no frames found in %s\n", path);
+        return 1;
+    }
+
+    if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
+        fprintf(stderr, "could not start worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_detach(worker);
+
+    return 0;
+}
+
+/* the single writer thread */
+void *worker_thread(void *arg)
+{
+    long current = 0;
+    unsigned char *data;
+    uint64_t first = 0;
+    int64_t due, elapsed;
+    struct timeval begin, now, timestamp;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    gettimeofday(&begin, NULL);
+    first = frames[0].timestamp;
+
+    while(!pglobal->stop) {
+        if(current == frame_count) {
+            if(!loop) {
+                IPRINT("end of %s reached\n", path);
+                break;
+            }
+            current = 0;
+            gettimeofday(&begin, NULL);
+            first = frames[0].timestamp;
+        }
+
+        if((data = frame_data(&frames[current])) == NULL)
+            break;
+
+        /* pace by the recorded timestamps, late frames are sent right away */
+        if(speed > 0) {
+            gettimeofday(&now, NULL);
+            due = (int64_t)((frames[current].timestamp - first) / speed);
+            elapsed = (int64_t)(now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_usec - begin.tv_usec);
+            if(due > elapsed)
+                usleep(due - elapsed);
+        }
+
+        if(is_archive) {
+            timestamp.tv_sec = frames[current].timestamp / 1000000;
+            timestamp.tv_usec = frames[current].timestamp % 1000000;
+        } else {
+            gettimeofday(&timestamp, NULL);
+        }
+
+        /* publish the frame by pointer, the data stays mapped */
+        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        pglobal->in[plugin_number].buf = data;
+        pglobal->in[plugin_number].size = frames[current].size;
+        pglobal->in[plugin_number].timestamp = timestamp;
+        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+        current++;
+    }
+
+    DBG("leaving input thread, calling cleanup function now\n");
+    /* call cleanup handler, signal with the parameter */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+void worker_cleanup(void *arg)
+{
+    static unsigned char first_run = 1;
+
+    if(!first_run) {
+        DBG("already cleaned up resources\n");
+        return;
+    }
+
+    first_run = 0;
+    DBG("cleaning up resources allocated by input thread\n");
+
+    /* frames are published by pointer, withdraw them before unmapping */
+    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    pglobal->in[plugin_number].buf = NULL;
+    pglobal->in[plugin_number].size = 0;
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    if(segment_map != NULL)
+        munmap(segment_map, segment_len);
+
+    if(is_archive)
+        munmap(index_map, index_len);
+    else
+        free(frames);
+}
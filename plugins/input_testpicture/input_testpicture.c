@@ -33,17 +33,33 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <sys/time.h>
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../../pacing.h"
+#include "../../latency.h"
+
+#ifndef NO_LIBJPEG
+#include <jpeglib.h>
+#endif
 
 #include "testpictures.h"
 
 #define INPUT_PLUGIN_NAME "TESTPICTURE input plugin"
 
+/* the COM segment after SOI carries the sequence number and the time of
+   publishing, it is rewritten in place for every frame */
+#define STAMP_OFFSET 6
+#define STAMP_SIZE 64
+#define STAMP_FORMAT "mjpg-streamer seq=%010u time=%ld.%06ld"
+
+/* frames generated for other resolutions, a bar moves across them */
+#define GENERATED_FRAMES 8
+
 /* private functions and variables to this plugin */
 static pthread_t   worker;
 static globals     *pglobal;
@@ -55,6 +71,11 @@ void worker_cleanup(void *);
 void help(void);
 
 static int delay = 1000;
+static int fps = -1;
+static int burst = 1;
+static int target_size = 0;
+static int quality = 80;
+static int width = 0, height = 0;
 
 /* details of converted JPG pictures */
 struct pic {
@@ -76,6 +97,20 @@ static struct pictures {
 
 struct pictures *pics;
 
+/* the frames are prepared once and published by pointing the global buffer
+   at them, the one published last is never stamped again before the next
+   one is published */
+typedef struct {
+    unsigned char *data;
+    int size;
+} frame_buffer;
+
+static frame_buffer frames[GENERATED_FRAMES];
+static int frame_count = 0;
+static unsigned int sequence = 0;
+static pacing pacer;
+static input_metrics metrics;
+
 /*** plugin interface functions ***/
 
 /******************************************************************************
@@ -88,6 +123,8 @@ int input_init(input_parameter *param, int plugin_no)
     int i;
 
     pics = &picture_lookup[1];
+    plugin_number = plugin_no;
+    input_metrics_register(&metrics, plugin_no);
 
     if(pthread_mutex_init(&controls_mutex, NULL) != 0) {
         IPRINT("could not initialize mutex variable\n");
@@ -112,6 +149,14 @@ int input_init(input_parameter *param, int plugin_no)
             {"delay", required_argument, 0, 0},
             {"r", required_argument, 0, 0},
             {"resolution", required_argument, 0, 0},
+            {"f", required_argument, 0, 0},
+            {"fps", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"burst", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"size", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -146,12 +191,43 @@ int input_init(input_parameter *param, int plugin_no)
         case 4:
         case 5:
             DBG("case 4,5\n");
+            pics = NULL;
             for(i = 0; i < LENGTH_OF(picture_lookup); i++) {
                 if(strcmp(picture_lookup[i].resolution, optarg) == 0) {
                     pics = &picture_lookup[i];
                     break;
                 }
             }
+            if(pics == NULL)
+                parse_resolution_opt(optarg, &width, &height);
+            break;
+
+            /* f, fps */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            fps = atoi(optarg);
+            break;
+
+            /* b, burst */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            burst = atoi(optarg);
+            break;
+
+            /* s, size */
+        case 10:
+        case 11:
+            DBG("case 10,11\n");
+            target_size = atoi(optarg);
+            break;
+
+            /* q, quality */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            quality = MIN(MAX(atoi(optarg), 1), 100);
             break;
 
         default:
@@ -163,8 +239,35 @@ int input_init(input_parameter *param, int plugin_no)
 
     pglobal = param->global;
 
-    IPRINT("delay.............: %i\n", delay);
-    IPRINT("resolution........: %s\n", pics->resolution);
+    if(pics == NULL) {
+        #ifdef NO_LIBJPEG
+        IPRINT("this plugin was built without libjpeg, only the built-in resolutions are available\n");
+        return 1;
+        #else
+        if(width <= 0 || height <= 0) {
+            IPRINT("invalid resolution %dx%d\n", width, height);
+            return 1;
+        }
+        #endif
+    }
+
+    if(burst < 1)
+        burst = 1;
+
+    if(fps >= 0) {
+        IPRINT("frames per second.: %i%s\n", fps, (fps == 0) ? " (as fast as possible)" : "");
+    } else {
+        IPRINT("delay.............: %i\n", delay);
+    }
+    if(pics != NULL) {
+        IPRINT("resolution........: %s\n", pics->resolution);
+    } else {
+        IPRINT("resolution........: %dx%d, generated with quality %d\n", width, height, quality);
+    }
+    IPRINT("frames per burst..: %i\n", burst);
+    if(target_size > 0) {
+        IPRINT("frame size........: %i bytes at least\n", target_size);
+    }
 
     return 0;
 }
@@ -183,20 +286,162 @@ int input_stop(int id)
 }
 
 /******************************************************************************
-Description.: starts the worker thread and allocates memory
+Description.: copies a JPEG into a frame and adds the COM segment for the
+              stamp after SOI, followed by COM segments of padding up to the
+              frame size requested
+Input Value.: JPEG and its size, frame to fill
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+static int prepare_frame(const unsigned char *jpeg, int size, frame_buffer *frame)
+{
+    int padding = 0, total, n;
+    unsigned char *p;
+
+    if(size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+        IPRINT("not a JPEG picture\n");
+        return -1;
+    }
+
+    total = size + 4 + STAMP_SIZE;
+    if(target_size > total)
+        padding = target_size - total;
+
+    /* a COM segment carries 65533 bytes at most and 4 bytes at least */
+    n = (padding + 65536) / 65537;
+    if(padding > 0 && padding < 4 * n)
+        padding = 4 * n;
+
+    frame->data = malloc(total + padding);
+    if(frame->data == NULL) {
+        IPRINT("could not allocate memory\n");
+        return -1;
+    }
+    frame->size = total + padding;
+
+    p = frame->data;
+    *p++ = 0xFF;
+    *p++ = 0xD8;
+
+    *p++ = 0xFF;
+    *p++ = 0xFE;
+    *p++ = (STAMP_SIZE + 2) >> 8;
+    *p++ = (STAMP_SIZE + 2) & 0xFF;
+    memset(p, ' ', STAMP_SIZE);
+    p += STAMP_SIZE;
+
+    while(padding > 0) {
+        int length = MIN(padding - 4 * (n - 1), 65537) - 2;
+
+        *p++ = 0xFF;
+        *p++ = 0xFE;
+        *p++ = length >> 8;
+        *p++ = length & 0xFF;
+        memset(p, 0, length - 2);
+        p += length - 2;
+        padding -= length + 2;
+        n--;
+    }
+
+    memcpy(p, jpeg + 2, size - 2);
+
+    return 0;
+}
+
+#ifndef NO_LIBJPEG
+/******************************************************************************
+Description.: compresses a test pattern of color bars above a gray ramp, with
+              a white bar at a position that depends on the frame number
+Input Value.: frame number, frame to fill
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+static int generate_frame(int number, frame_buffer *frame)
+{
+    static const unsigned char bars[8][3] = {
+        { 192, 192, 192 }, { 192, 192, 0 }, { 0, 192, 192 }, { 0, 192, 0 },
+        { 192, 0, 192 }, { 192, 0, 0 }, { 0, 0, 192 }, { 16, 16, 16 }
+    };
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *row, *jpeg = NULL;
+    unsigned long size = 0;
+    int x, y, marker, result;
+
+    row = malloc(width * 3);
+    if(row == NULL)
+        return -1;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg, &size);
+
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    marker = number * width / GENERATED_FRAMES;
+    while(cinfo.next_scanline < cinfo.image_height) {
+        y = cinfo.next_scanline;
+        for(x = 0; x < width; x++) {
+            unsigned char *pixel = row + 3 * x;
+
+            if(x >= marker && x < marker + width / 16) {
+                pixel[0] = pixel[1] = pixel[2] = 255;
+            } else if(y < height * 2 / 3) {
+                memcpy(pixel, bars[x * 8 / width], 3);
+            } else {
+                pixel[0] = pixel[1] = pixel[2] = x * 255 / width;
+            }
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    result = prepare_frame(jpeg, size, frame);
+    free(jpeg);
+
+    return result;
+}
+#endif
+
+/******************************************************************************
+Description.: prepares the frames and starts the worker thread
 Input Value.: -
 Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
+    int i;
+
+    if(pics != NULL) {
+        for(frame_count = 0; frame_count < LENGTH_OF(pics->sequence); frame_count++) {
+            struct pic *picture = &pics->sequence[frame_count];
+
+            if(prepare_frame(picture->data, picture->size, &frames[frame_count]) != 0)
+                exit(EXIT_FAILURE);
+        }
     }
+    #ifndef NO_LIBJPEG
+    else {
+        for(frame_count = 0; frame_count < GENERATED_FRAMES; frame_count++) {
+            if(generate_frame(frame_count, &frames[frame_count]) != 0) {
+                fprintf(stderr, "could not generate the test pictures\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    #endif
+
+    for(i = 0; i < frame_count; i++)
+        DBG("frame %d: %d bytes\n", i, frames[i].size);
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -216,38 +461,79 @@ void help(void)
     " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
     " ---------------------------------------------------------------\n" \
     " The following parameters can be passed to this plugin:\n\n" \
-    " [-d | --delay ]........: delay to pause between frames\n" \
-    " [-r | --resolution]....: can be 960x720, 640x480, 320x240, 160x120\n"
+    " [-d | --delay ]........: interval between frames in ms\n" \
+    " [-f | --fps ]..........: frames per second instead of a delay,\n" \
+    "                          0 publishes as fast as possible\n" \
+    " [-r | --resolution]....: 960x720, 640x480, 320x240 and 160x120 are\n" \
+    "                          built in, other resolutions are generated\n" \
+    " [-q | --quality ]......: JPEG quality of generated frames\n" \
+    " [-s | --size ].........: pad the frames to this many bytes\n" \
+    " [-b | --burst ]........: publish n frames back to back each time\n" \
     " ---------------------------------------------------------------\n");
 }
 
 /******************************************************************************
-Description.: copy a picture from testpictures.h and signal this to all output
-              plugins, afterwards switch to the next frame of the animation.
+Description.: stamps the next frame with its sequence number and the time,
+              then publishes it by pointing the global buffer at it
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void publish(frame_buffer *frame)
+{
+    char stamp[STAMP_SIZE + 1];
+    struct timeval timestamp;
+    long long captured = latency_now();
+    int length;
+
+    gettimeofday(&timestamp, NULL);
+
+    length = snprintf(stamp, sizeof(stamp), STAMP_FORMAT, sequence++,
+                      (long)timestamp.tv_sec, (long)timestamp.tv_usec);
+    memcpy(frame->data + STAMP_OFFSET, stamp, MIN(length, STAMP_SIZE));
+
+    metric_lock(&pglobal->in[plugin_number].db, metrics.lock_wait);
+    pglobal->in[plugin_number].buf = frame->data;
+    pglobal->in[plugin_number].size = frame->size;
+    pglobal->in[plugin_number].timestamp = timestamp;
+    pglobal->in[plugin_number].captured = captured;
+    latency_trace(plugin_number, captured, LATENCY_PUBLISH);
+
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    metric_add(metrics.frames, 1);
+}
+
+/******************************************************************************
+Description.: publishes the prepared frames in turn, "burst" of them back to
+              back at every deadline
 Input Value.: arg is not used
 Return Value: NULL
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int i = 0;
+    int i = 0, n;
+    double interval;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
-    while(!pglobal->stop) {
-
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    if(fps > 0)
+        interval = 1.0 / fps;
+    else if(fps == 0)
+        interval = 0;
+    else
+        interval = delay / 1000.0;
+    pacing_init(&pacer, interval, PACING_SKIP);
 
-        i = (i + 1) % LENGTH_OF(pics->sequence);
-        pglobal->in[plugin_number].size = pics->sequence[i].size;
-        memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+    while(!pglobal->stop) {
+        pacing_wait(&pacer);
 
-        usleep(1000 * delay);
+        for(n = 0; n < burst; n++) {
+            i = (i + 1) % frame_count;
+            publish(&frames[i]);
+        }
     }
 
     IPRINT("leaving input thread, calling cleanup function now\n");
@@ -264,6 +550,8 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     static unsigned char first_run = 1;
+    char report[128];
+    int i;
 
     if(!first_run) {
         DBG("already cleaned up resources\n");
@@ -273,7 +561,16 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    pacing_report(&pacer, report, sizeof(report));
+    IPRINT("published %u frames, %d per deadline, %s\n", sequence, burst, report);
+
+    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    pglobal->in[plugin_number].buf = NULL;
+    pglobal->in[plugin_number].size = 0;
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    for(i = 0; i < frame_count; i++)
+        free(frames[i].data);
 }
 
 
@@ -43,6 +43,7 @@
 #include <linux/videodev2.h>
 
 #include "../../utils.h"
+#include "../../latency.h"
 #include "v4l2uvc.h" // this header will includes the ../../mjpg_streamer.h
 
 #ifndef NO_LIBJPEG
@@ -396,6 +397,7 @@ int input_init(input_parameter *param, int id)
     DBG("input id: %d\n", id);
     pctx->id = id;
     pctx->pglobal = param->global;
+    input_metrics_register(&pctx->metrics, id);
 
     /* allocate webcam datastructure */
     pctx->videoIn = calloc(1, sizeof(struct vdIn));
@@ -723,10 +725,12 @@ void *cam_thread(void *arg)
                 IPRINT("Error grabbing frames\n");
                 goto endloop;
             }
+            latency_trace(pcontext->id, pcontext->videoIn->tmpcaptured, LATENCY_DEQUEUE);
 
             if ( every_count < every - 1 ) {
                 DBG("dropping %d frame for every=%d\n", every_count + 1, every);
                 ++every_count;
+                metric_add(pcontext->metrics.dropped, 1);
                 goto other_select_handlers;
             } else {
                 every_count = 0;
@@ -743,6 +747,7 @@ void *cam_thread(void *arg)
              */
             if(pcontext->videoIn->tmpbytesused < minimum_size) {
                 DBG("dropping too small frame, assuming it as broken\n");
+                metric_add(pcontext->metrics.dropped, 1);
                 goto other_select_handlers;
             }
 
@@ -764,13 +769,14 @@ void *cam_thread(void *arg)
                 // if the requested time did not esplashed skip the frame
                 if ((current - last) < pcontext->videoIn->frame_period_time) {
                     DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+                    metric_add(pcontext->metrics.dropped, 1);
                     goto other_select_handlers;
                 }
                 DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
             }
 
             /* copy JPG picture to global buffer */
-            pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+            metric_lock(&pglobal->in[pcontext->id].db, pcontext->metrics.lock_wait);
 
             /*
              * If capturing in YUV mode convert to JPEG now.
@@ -784,7 +790,11 @@ void *cam_thread(void *arg)
             (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB24) ||
             (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
                 DBG("compressing frame from input: %d\n", (int)pcontext->id);
+                long long start = metric_now();
+                latency_trace(pcontext->id, pcontext->videoIn->tmpcaptured, LATENCY_ENCODE_START);
                 pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
+                latency_trace(pcontext->id, pcontext->videoIn->tmpcaptured, LATENCY_ENCODE_END);
+                metric_add(pcontext->metrics.encode, metric_now() - start);
                 /* copy this frame's timestamp to user space */
                 pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
             } else {
@@ -805,9 +815,13 @@ void *cam_thread(void *arg)
             prev_size = global->size;
 #endif
 
+            pglobal->in[pcontext->id].captured = pcontext->videoIn->tmpcaptured;
+            latency_trace(pcontext->id, pcontext->videoIn->tmpcaptured, LATENCY_PUBLISH);
+
             /* signal fresh_frame */
             pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
             pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+            metric_add(pcontext->metrics.frames, 1);
         }
 
 other_select_handlers:
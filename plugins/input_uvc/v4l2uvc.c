@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include "v4l2uvc.h"
+#include "../../latency.h"
 #include "huffman.h"
 #include "dynctrl.h"
 
@@ -633,6 +634,13 @@ int uvcGrab(struct vdIn *vd)
         goto err;
     }
 
+    /* the capture time for the latency trace, the timestamp of the driver
+       only if it was taken from the same clock */
+    if((vd->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        vd->tmpcaptured = vd->buf.timestamp.tv_sec * 1000000000LL + vd->buf.timestamp.tv_usec * 1000LL;
+    else
+        vd->tmpcaptured = latency_now();
+
     switch(vd->formatIn) {
     case V4L2_PIX_FMT_JPEG:
         // Fall-through intentional
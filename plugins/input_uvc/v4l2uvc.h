@@ -111,6 +111,7 @@ struct vdIn {
     int recordtime;
     uint32_t tmpbytesused;
     struct timeval tmptimestamp;
+    long long tmpcaptured;
     v4l2_std_id vstd;
     unsigned long frame_period_time; // in ms
     unsigned char soft_framedrop;
@@ -144,6 +145,7 @@ typedef struct {
     pthread_mutex_t controls_mutex;
     struct vdIn *videoIn;
     context_settings *init_settings;
+    input_metrics metrics;
 } context;
 
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd);
@@ -151,6 +153,7 @@ void enumerateControls(struct vdIn *vd, globals *pglobal, int id);
 void control_readed(struct vdIn *vd, struct v4l2_queryctrl *ctrl, globals *pglobal, int id);
 int setResolution(struct vdIn *vd, int width, int height);
 
+int is_huffman(unsigned char *buf);
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
 int uvcGrab(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
@@ -15,12 +15,15 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../../pacing.h"
+#include "../../latency.h"
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -35,6 +38,9 @@
 #include <sys/shm.h>
 #include <X11/extensions/XShm.h>
 #endif
+#ifdef XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
 #define INPUT_PLUGIN_NAME "XGRAB input plugin"
 
 /* private functions and variables to this plugin */
@@ -59,6 +65,34 @@ struct xcursor {
     int to_line, to_column;
 };
 
+/* one buffer is published, the next frame is compressed into the other one */
+static jpeg_buffer frames[2];
+static int published = 0;
+
+/* RGB copy of the screen, only needed for formats libjpeg can not read */
+static unsigned char *rgb_buffer = NULL;
+
+/*
+ * damage tracking: unchanged frames are not grabbed at all, the last frame
+ * is repeated every "damage_repeat" seconds. If only some MCU rows changed,
+ * just these are grabbed, compressed and spliced into the last frame.
+ */
+static bool damage_tracking = false;
+static int damage_repeat = 0;
+static jpeg_buffer band;
+
+static struct {
+    unsigned int full, partial, skipped;
+} stats;
+
+/* a frame every 1/fps seconds, late frames are dropped */
+static pacing pacer;
+
+/* when the grab of the current frame started, for the latency trace */
+static long long captured;
+
+static input_metrics metrics;
+
 /*** plugin interface functions ***/
 
 /******************************************************************************
@@ -68,6 +102,8 @@ Return Value: 0 if everything is ok
 ******************************************************************************/
 int input_init(input_parameter *param, int plugin_no)
 {
+    plugin_number = plugin_no;
+    input_metrics_register(&metrics, plugin_no);
 
     if(pthread_mutex_init(&controls_mutex, NULL) != 0) {
         IPRINT("could not initialize mutex variable\n");
@@ -97,6 +133,9 @@ int input_init(input_parameter *param, int plugin_no)
             {"help", no_argument, 0, 0},
             {"o", required_argument, 0, 0},
             {"offset", required_argument, 0, 0},
+            {"d", required_argument, 0, 0},
+            {"damage", required_argument, 0, 0},
+            {0, 0, 0, 0}
         };
         
         c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
@@ -119,11 +158,14 @@ int input_init(input_parameter *param, int plugin_no)
             sscanf(optarg, "%d", &quality);
             break;
         case 4:
-            sscanf(optarg, "%d", &fps);
+            if(sscanf(optarg, "%d", &fps) != 1 || fps <= 0) {
+                IPRINT("the framerate must be at least 1\n");
+                return 1;
+            }
             break;
         case 5:
         case 6:
-            sscanf(optarg, "%d", &grabPointer);
+            grabPointer = atoi(optarg) != 0;
             break;
         case 7:
         case 8:
@@ -133,6 +175,12 @@ int input_init(input_parameter *param, int plugin_no)
         case 10:
             parse_resolution_opt(optarg, &offset_x, &offset_y);
             break;
+        case 11:
+        case 12:
+            DBG("case 11,12\n");
+            damage_tracking = true;
+            damage_repeat = atoi(optarg);
+            break;
          }
 
     }
@@ -144,6 +192,18 @@ int input_init(input_parameter *param, int plugin_no)
     IPRINT("quality...........: %i\n", quality);
     IPRINT("framerate.........: %i\n", fps);
     IPRINT("pointer...........: %s\n", grabPointer ? "true" : "false");
+#ifdef XDAMAGE
+    if (damage_tracking) {
+        IPRINT("damage tracking...: repeat after %i s\n", damage_repeat);
+    } else {
+        IPRINT("damage tracking...: %s\n", "disabled");
+    }
+#else
+    if (damage_tracking) {
+        IPRINT("damage tracking...: %s\n", "not supported by this build");
+        damage_tracking = false;
+    }
+#endif
 
     return 0;
 }
@@ -168,14 +228,9 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(2048 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
+    pglobal->in[id].buf = NULL;
 
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -199,6 +254,8 @@ void help(void)
     " [--fps]..............: Grabbing framerate (1-60)\n" \
     " [-q | --quality].....: JPEG compression quality (0-100)\n" \
     " [-p | --pointer].....: Enable/disable pointer grabbing (1 or 0)\n" \
+    " [-d | --damage]......: Grab only what changed, repeat an unchanged\n" \
+    "                        frame every n seconds (0 = never)\n" \
     " ---------------------------------------------------------------\n");
 }
 
@@ -210,6 +267,7 @@ void grab_mouse_pointer(struct xcursor *xc, Display *dpy)
     xc->xcim = NULL;
 
     xc->xcim = XFixesGetCursorImage(dpy);
+    if (xc->xcim == NULL) return;
     xc->x = xc->xcim->x - xc->xcim->xhot - offset_x;
     xc->y = xc->xcim->y - xc->xcim->yhot - offset_y;
     xc->to_line   = (xc->y + xc->xcim->height);
@@ -217,35 +275,254 @@ void grab_mouse_pointer(struct xcursor *xc, Display *dpy)
 
 }
 
-void draw_mouse_pointer(struct xcursor *xc, unsigned char *target_array, int column, int line, int width, int offset_x, int offset_y) {
-    if (column < xc->x || line < xc->y || column >= xc->to_column || line >= xc->to_line) return;
+/* scale a channel of a pixel to 0..255 and back, works for any mask */
+static int get_channel(unsigned long pixel, unsigned long mask)
+{
+    int shift = __builtin_ctzl(mask);
+    return ((pixel & mask) >> shift) * 255 / (mask >> shift);
+}
+
+static unsigned long put_channel(int value, unsigned long mask)
+{
+    int shift = __builtin_ctzl(mask);
+    return ((unsigned long)value * (mask >> shift) / 255) << shift;
+}
 
-    int xcim_addr  = (line - xc->y) * xc->xcim->width + column - xc->x;
+/******************************************************************************
+Description.: blends the cursor into the grabbed image, only the pixels of
+              its bounding box are touched
+Input Value.: cursor and image
+Return Value: -
+******************************************************************************/
+void draw_mouse_pointer(struct xcursor *xc, XImage *image)
+{
+    int column, line, first_column, last_column, first_line, last_line;
+
+    if (xc->xcim == NULL || !image->red_mask || !image->green_mask || !image->blue_mask) return;
+
+    first_column = (xc->x < 0) ? 0 : xc->x;
+    first_line   = (xc->y < 0) ? 0 : xc->y;
+    last_column  = (xc->to_column > image->width) ? image->width : xc->to_column;
+    last_line    = (xc->to_line > image->height) ? image->height : xc->to_line;
+
+    for (line = first_line; line < last_line; line++) {
+        for (column = first_column; column < last_column; column++) {
+            unsigned long cursor = xc->xcim->pixels[(line - xc->y) * xc->xcim->width + column - xc->x];
+            int a = (uint8_t)(cursor >> 24);
+            int r = (uint8_t)(cursor >> 16);
+            int g = (uint8_t)(cursor >>  8);
+            int b = (uint8_t)(cursor >>  0);
+            unsigned long pixel;
+
+            if (a == 0) continue;
+
+            if (a != 255) {
+                // pixel values from XFixesGetCursorImage come premultiplied by alpha
+                pixel = XGetPixel(image, column, line);
+                r += (get_channel(pixel, image->red_mask)   * (255 - a) + 255 / 2) / 255;
+                g += (get_channel(pixel, image->green_mask) * (255 - a) + 255 / 2) / 255;
+                b += (get_channel(pixel, image->blue_mask)  * (255 - a) + 255 / 2) / 255;
+            }
 
-    int r          = (uint8_t)(xc->xcim->pixels[xcim_addr] >>  0);
-    int g          = (uint8_t)(xc->xcim->pixels[xcim_addr] >>  8);
-    int b          = (uint8_t)(xc->xcim->pixels[xcim_addr] >> 16);
-    int a          = (uint8_t)(xc->xcim->pixels[xcim_addr] >> 24);
-    int pix_addr   = ((column) + width * (line));
-    if (a == 255) {
-        target_array[(pix_addr) * 3+0] = r;
-        target_array[(pix_addr) * 3+1] = g;
-        target_array[(pix_addr) * 3+2] = b;
+            pixel = put_channel(r, image->red_mask) | put_channel(g, image->green_mask) | put_channel(b, image->blue_mask);
+            XPutPixel(image, column, line, pixel);
+        }
     }
-     else if (a) {
-        // pixel values from XFixesGetCursorImage come premultiplied by alpha
-        target_array[(pix_addr) * 3+0] = r + (target_array[(pix_addr) * 3+0] * (255 - a) + 255 / 2) / 255;
-        target_array[(pix_addr) * 3+1] = g + (target_array[(pix_addr) * 3+1] * (255 - a) + 255 / 2) / 255;
-        target_array[(pix_addr) * 3+2] = b + (target_array[(pix_addr) * 3+2] * (255 - a) + 255 / 2) / 255;
+}
+
+/******************************************************************************
+Description.: finds the libjpeg input format matching the image, the usual
+              32 bit TrueColor visuals are read by libjpeg-turbo directly
+Input Value.: image and pointer to store the bytes per pixel
+Return Value: format, JCS_UNKNOWN if the image has to be converted
+******************************************************************************/
+static J_COLOR_SPACE direct_format(XImage *image, int *components)
+{
+#ifdef JCS_EXTENSIONS
+    if (image->bits_per_pixel == 32 && image->red_mask == 0xff0000 &&
+        image->green_mask == 0xff00 && image->blue_mask == 0xff) {
+        *components = 4;
+        return (image->byte_order == LSBFirst) ? JCS_EXT_BGRX : JCS_EXT_XRGB;
+    }
+#endif
+    return JCS_UNKNOWN;
+}
+
+/******************************************************************************
+Description.: converts rows of the image to RGB for formats libjpeg does
+              not know
+Input Value.: image, the target buffer of width * height * 3 bytes and the
+              rows to convert
+Return Value: -
+******************************************************************************/
+static void convert_to_rgb(XImage *image, unsigned char *rgb, int first, int lines)
+{
+    int x, y;
+    unsigned long pixel;
+
+    for (y = first; y < first + lines; y++) {
+        unsigned char *row = rgb + y * image->width * 3;
+
+        if (image->bits_per_pixel == 32 && image->red_mask == 0xff0000 &&
+            image->green_mask == 0xff00 && image->blue_mask == 0xff) {
+            unsigned char *src = (unsigned char *)image->data + y * image->bytes_per_line;
+            /* BGRX in memory for LSBFirst, XRGB otherwise */
+            int r = (image->byte_order == LSBFirst) ? 2 : 1;
+            int g = (image->byte_order == LSBFirst) ? 1 : 2;
+            int b = (image->byte_order == LSBFirst) ? 0 : 3;
+
+            for (x = 0; x < image->width; x++, src += 4) {
+                row[x * 3 + 0] = src[r];
+                row[x * 3 + 1] = src[g];
+                row[x * 3 + 2] = src[b];
+            }
+            continue;
         }
 
+        for (x = 0; x < image->width; x++) {
+            pixel = XGetPixel(image, x, y);
+            row[x * 3 + 0] = get_channel(pixel, image->red_mask);
+            row[x * 3 + 1] = get_channel(pixel, image->green_mask);
+            row[x * 3 + 2] = get_channel(pixel, image->blue_mask);
+        }
+    }
 }
 
+/******************************************************************************
+Description.: compresses rows of the grabbed image, they are handed to
+              libjpeg without a copy if possible
+Input Value.: image, the rows to compress and the buffer to compress to
+Return Value: size of the JPEG or -1 on error
+******************************************************************************/
+static int compress_image(XImage *image, int first, int lines, jpeg_buffer *out)
+{
+    J_COLOR_SPACE format;
+    int components;
+    int restart = damage_tracking ? 1 : 0;
+
+    if ((format = direct_format(image, &components)) != JCS_UNKNOWN)
+        return compress_rows((unsigned char *)image->data + first * image->bytes_per_line, image->width, lines,
+                             image->bytes_per_line, format, components, quality, restart, out);
+
+    if (rgb_buffer == NULL && (rgb_buffer = malloc(image->width * image->height * 3)) == NULL) {
+        IPRINT("could not allocate memory\n");
+        return -1;
+    }
+    convert_to_rgb(image, rgb_buffer, first, lines);
+
+    return compress_rows(rgb_buffer + first * image->width * 3, image->width, lines, image->width * 3,
+                         JCS_RGB, 3, quality, restart, out);
+}
+
+/******************************************************************************
+Description.: publishes the frame compressed last by swapping the buffers,
+              the readers copy under the lock so the old one is free afterwards
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void publish(void)
+{
+    jpeg_buffer *frame = &frames[1 - published];
+    struct timeval timestamp;
+
+    gettimeofday(&timestamp, NULL);
+
+    metric_lock(&pglobal->in[plugin_number].db, metrics.lock_wait);
+    pglobal->in[plugin_number].buf = frame->data;
+    pglobal->in[plugin_number].size = frame->size;
+    pglobal->in[plugin_number].timestamp = timestamp;
+    pglobal->in[plugin_number].captured = captured;
+    latency_trace(plugin_number, captured, LATENCY_PUBLISH);
+
+    /* signal fresh_frame */
+    pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    published = 1 - published;
+    metric_add(metrics.frames, 1);
+}
+
+#ifdef XDAMAGE
+/******************************************************************************
+Description.: signals the published frame again with a new timestamp, for
+              clients that expect frames even if nothing changes
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void republish(void)
+{
+    struct timeval timestamp;
+
+    gettimeofday(&timestamp, NULL);
+
+    metric_lock(&pglobal->in[plugin_number].db, metrics.lock_wait);
+    pglobal->in[plugin_number].timestamp = timestamp;
+    pglobal->in[plugin_number].captured = captured;
+    pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+}
+
+/******************************************************************************
+Description.: collects the screen areas that changed since the last call and
+              the area of a moved or changed cursor
+Input Value.: display, damage object, region to fetch the damage into, the
+              cursor before and after the grab and where to store the
+              first and last changed line of the grabbed area
+Return Value: true if anything in the grabbed area changed
+******************************************************************************/
+static bool collect_damage(Display *display, Damage damage, XserverRegion region,
+                           struct xcursor *before, struct xcursor *after, int *first, int *last)
+{
+    XRectangle *rects;
+    XEvent event;
+    int i, count, top, bottom;
+
+    *first = height;
+    *last = -1;
+
+    /* only the region matters, drop the notify events */
+    while (XPending(display))
+        XNextEvent(display, &event);
+
+    XDamageSubtract(display, damage, None, region);
+    rects = XFixesFetchRegion(display, region, &count);
+    for (i = 0; i < count; i++) {
+        /* skip damage outside of the grabbed area */
+        if (rects[i].x >= offset_x + width || rects[i].x + rects[i].width <= offset_x ||
+            rects[i].y >= offset_y + height || rects[i].y + rects[i].height <= offset_y)
+            continue;
+        top = rects[i].y - offset_y;
+        bottom = top + rects[i].height - 1;
+        if (top < *first) *first = top;
+        if (bottom > *last) *last = bottom;
+    }
+    if (rects != NULL) XFree(rects);
+
+    /* the cursor is no part of the screen content, moving it does not
+       cause damage */
+    if (grabPointer && after->xcim != NULL &&
+        (before->xcim == NULL || before->xcim->cursor_serial != after->xcim->cursor_serial ||
+         before->x != after->x || before->y != after->y)) {
+        if (before->xcim != NULL) {
+            if (before->y < *first) *first = before->y;
+            if (before->to_line - 1 > *last) *last = before->to_line - 1;
+        }
+        if (after->y < *first) *first = after->y;
+        if (after->to_line - 1 > *last) *last = after->to_line - 1;
+    }
+
+    if (*first < 0) *first = 0;
+    if (*last > height - 1) *last = height - 1;
+
+    return *first <= *last;
+}
+#endif
+
 
 /******************************************************************************
 Description.: opens up the X.org display and root window, grab screen
-              image, pointer (if enabled), rearrange it for JPEG compression
-              and then compress via libjpeg and send the frame.
+              image, pointer (if enabled), compress it via libjpeg and send
+              the frame.
 Input Value.: arg is not used
 Return Value: NULL
 ******************************************************************************/
@@ -262,17 +539,19 @@ void *worker_thread(void *arg)
    
    if (width+offset_x>gwa.width) width=gwa.width-offset_x;
    if (height+offset_y>gwa.height) height=gwa.height-offset_y;
-   unsigned char array[width * height * 3]; 
-   unsigned long red_mask, green_mask, blue_mask, pixel;
-   unsigned char blue, green, red;
    XImage *image;
-   struct xcursor pointer_grab_context;
+   struct xcursor pointer_grab_context, previous_pointer;
    pointer_grab_context.xcim=NULL;
-   int x, y;
-   int frametime = 1000/fps;
+   previous_pointer.xcim=NULL;
+   struct timeval last_publish;
+   #if defined(XSHM) || defined(XDAMAGE)
+   bool have_frame = false;
+   #endif
 
    #ifdef XSHM
    XShmSegmentInfo shminfo;
+   XImage band_image;
+   int rows = (height + MCU_ROWS - 1) / MCU_ROWS;
    image = XShmCreateImage(display,
                            DefaultVisual(display,0), // Use a correct visual. Omitted for brevity
                            DefaultDepth(display, 0),   // Determine correct depth from the visual. Omitted for brevity
@@ -287,44 +566,109 @@ void *worker_thread(void *arg)
    XShmAttach(display, &shminfo);
    #endif
 
+   #ifdef XDAMAGE
+   int damage_event, damage_error;
+   Damage damage = None;
+   XserverRegion region = None;
+
+   if (damage_tracking) {
+       if (XDamageQueryExtension(display, &damage_event, &damage_error)) {
+           damage = XDamageCreate(display, root, XDamageReportNonEmpty);
+           region = XFixesCreateRegion(display, NULL, 0);
+       } else {
+           IPRINT("the X server does not support the DAMAGE extension\n");
+           damage_tracking = false;
+       }
+   }
+   #endif
+
+   gettimeofday(&last_publish, NULL);
+   pacing_init(&pacer, 1.0 / fps, PACING_SKIP);
+
     while(!pglobal->stop) {
+        long long encode_start;
+        #if defined(XSHM) || defined(XDAMAGE)
+        int first = 0, last = height - 1;
+        #endif
+
+        pacing_wait(&pacer);
+        captured = latency_now();
+
+        if (grabPointer) {
+            if (previous_pointer.xcim != NULL) XFree(previous_pointer.xcim);
+            previous_pointer = pointer_grab_context;
+            pointer_grab_context.xcim = NULL;
+            grab_mouse_pointer(&pointer_grab_context, display);
+        }
+
+        #ifdef XDAMAGE
+        if (damage_tracking && have_frame &&
+            !collect_damage(display, damage, region, &previous_pointer, &pointer_grab_context, &first, &last)) {
+            struct timeval now;
+
+            /* nothing changed */
+            stats.skipped++;
+            gettimeofday(&now, NULL);
+            if (damage_repeat > 0 && now.tv_sec - last_publish.tv_sec >= damage_repeat) {
+                republish();
+                last_publish = now;
+            }
+            continue;
+        }
+        #endif
+
         #ifdef XSHM
+        /* grab and compress the changed MCU rows only if that saves half
+           the work at least, the rest of the frame is taken from the
+           previous JPEG */
+        first = first / MCU_ROWS;
+        last = last / MCU_ROWS;
+        if (damage_tracking && have_frame && (last - first + 1) * 2 <= rows) {
+            int top = first * MCU_ROWS;
+            int lines = ((last + 1) * MCU_ROWS > height) ? height - top : (last - first + 1) * MCU_ROWS;
+
+            /* an image header for the rows, in the same shared memory */
+            band_image = *image;
+            band_image.data = image->data + top * image->bytes_per_line;
+            band_image.height = lines;
+            XShmGetImage(display, RootWindow(display,0), &band_image, offset_x, offset_y + top, AllPlanes);
+            if (grabPointer) draw_mouse_pointer(&pointer_grab_context, image);
+
+            encode_start = metric_now();
+            latency_trace(plugin_number, captured, LATENCY_ENCODE_START);
+            if (compress_image(image, top, lines, &band) >= 0 &&
+                splice_rows(&frames[published], rows, &band, first, last - first + 1, &frames[1 - published]) >= 0) {
+                latency_trace(plugin_number, captured, LATENCY_ENCODE_END);
+                metric_add(metrics.encode, metric_now() - encode_start);
+                publish();
+                gettimeofday(&last_publish, NULL);
+                stats.partial++;
+                continue;
+            }
+            DBG("could not splice the rows, compressing the whole frame\n");
+        }
         XShmGetImage(display, RootWindow(display,0), image, offset_x, offset_y, AllPlanes);
         #else
         image = XGetImage(display, root, offset_x, offset_y, width, height, AllPlanes, ZPixmap);
         #endif
-        red_mask = image->red_mask;
-        green_mask = image->green_mask;
-        blue_mask = image->blue_mask;
-        if (grabPointer) grab_mouse_pointer(&pointer_grab_context, display);
-
-        for (x = 0; x < width; x++)
-            for (y = 0; y < height ; y++)
-            {
-                pixel = XGetPixel(image,x,y);
-
-                blue = pixel & blue_mask;
-                green = (pixel & green_mask) >> 8;
-                red = (pixel & red_mask) >> 16;
-                
-                array[(x + width * y) * 3] = red;
-                array[(x + width * y) * 3+1] = green;
-                array[(x + width * y) * 3+2] = blue;
-                if (grabPointer) draw_mouse_pointer(&pointer_grab_context, array, x, y, width, offset_x, offset_y);
-            }
+        if (grabPointer) draw_mouse_pointer(&pointer_grab_context, image);
+
+        encode_start = metric_now();
+        latency_trace(plugin_number, captured, LATENCY_ENCODE_START);
+        if (compress_image(image, 0, height, &frames[1 - published]) >= 0) {
+            latency_trace(plugin_number, captured, LATENCY_ENCODE_END);
+            metric_add(metrics.encode, metric_now() - encode_start);
+            publish();
+            gettimeofday(&last_publish, NULL);
+            #if defined(XSHM) || defined(XDAMAGE)
+            have_frame = true;
+            #endif
+            stats.full++;
+        }
+
         #ifndef XSHM
         XDestroyImage(image);
         #endif
-        /* copy JPG picture to global buffer */
-        
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-        pglobal->in[plugin_number].size = save_jpg(array, width, height, quality, pglobal->in[plugin_number].buf);
-
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-
-        usleep(1000 * frametime);
     }
 
     IPRINT("leaving input thread, calling cleanup function now\n");
@@ -350,5 +694,20 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    pglobal->in[plugin_number].buf = NULL;
+    pglobal->in[plugin_number].size = 0;
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    if (damage_tracking)
+        IPRINT("frames............: %u full, %u partial, %u unchanged\n", stats.full, stats.partial, stats.skipped);
+
+    char report[128];
+    pacing_report(&pacer, report, sizeof(report));
+    IPRINT("pacing............: %s\n", report);
+
+    free(frames[0].data);
+    free(frames[1].data);
+    free(band.data);
+    free(rgb_buffer);
 }
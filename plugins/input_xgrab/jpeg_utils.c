@@ -10,25 +10,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <setjmp.h>
+#include <jerror.h>
 
-#define OUTPUT_BUF_SIZE  4096
+#include "jpeg_utils.h"
 
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
-    JOCTET * buffer;    /* start of buffer */
-
-    unsigned char *outbuffer;
-    int outbuffer_size;
-    unsigned char *outbuffer_cursor;
-    int *written;
-
+    jpeg_buffer *out;
 } mjpg_destination_mgr;
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} mjpg_error_mgr;
+
+/* the compressor is set up once and reused for every frame */
+static struct jpeg_compress_struct cinfo;
+static mjpg_error_mgr jerr;
+static bool initialized = false;
+
 /******************************************************************************
-Description.:
+Description.: the frame is written straight into the output buffer
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -36,101 +42,238 @@ METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
-
-    *(dest->written) = 0;
-
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->pub.next_output_byte = dest->out->data;
+    dest->pub.free_in_buffer = dest->out->capacity;
 }
 
 /******************************************************************************
-Description.: called whenever local jpeg buffer fills up
+Description.: called whenever the output buffer fills up, it is grown
 Input Value.:
 Return Value:
 ******************************************************************************/
 METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
+    int used = dest->out->capacity;
+    unsigned char *tmp;
 
-    memcpy(dest->outbuffer_cursor, dest->buffer, OUTPUT_BUF_SIZE);
-    dest->outbuffer_cursor += OUTPUT_BUF_SIZE;
-    *(dest->written) += OUTPUT_BUF_SIZE;
+    if((tmp = realloc(dest->out->data, dest->out->capacity * 2)) == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
 
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->out->data = tmp;
+    dest->out->capacity *= 2;
+    dest->pub.next_output_byte = dest->out->data + used;
+    dest->pub.free_in_buffer = dest->out->capacity - used;
 
     return TRUE;
 }
 
 /******************************************************************************
 Description.: called by jpeg_finish_compress after all data has been written.
-              Usually needs to flush buffer.
 Input Value.:
 Return Value:
 ******************************************************************************/
 METHODDEF(void) term_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
-    size_t datacount = OUTPUT_BUF_SIZE - dest->pub.free_in_buffer;
 
-    /* Write any data remaining in the buffer */
-    memcpy(dest->outbuffer_cursor, dest->buffer, datacount);
-    dest->outbuffer_cursor += datacount;
-    *(dest->written) += datacount;
+    dest->out->size = dest->out->capacity - dest->pub.free_in_buffer;
+}
+
+METHODDEF(void) error_exit(j_common_ptr cinfo)
+{
+    mjpg_error_mgr *err = (mjpg_error_mgr *) cinfo->err;
+
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->setjmp_buffer, 1);
 }
 
 /******************************************************************************
-Description.: Prepare for output to a stdio stream.
-Input Value.: buffer is the already allocated buffer memory that will hold
-              the compressed picture. "size" is the size in bytes.
-Return Value: -
+Description.: compresses rows of pixels in any format libjpeg accepts as input,
+              with libjpeg-turbo that includes the 32 bit formats of X.org
+Input Value.: pixels, dimension and distance between rows in bytes, the
+              pixel format and its bytes per pixel, the JPEG quality, the
+              restart interval in MCU rows (0 for none) and the buffer to
+              compress to
+Return Value: size of the JPEG or -1 on error
 ******************************************************************************/
-GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size, int *written)
+int compress_rows(unsigned char *pixels, int width, int height, int stride, J_COLOR_SPACE format, int components, int quality, int restart, jpeg_buffer *out)
 {
     mjpg_dest_ptr dest;
+    JSAMPROW rows[16];
+    int i, count;
 
-    if(cinfo->dest == NULL) {
-        cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
-    }
+    if(!initialized) {
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = error_exit;
+        jpeg_create_compress(&cinfo);
 
-    dest = (mjpg_dest_ptr) cinfo->dest;
-    dest->pub.init_destination = init_destination;
-    dest->pub.empty_output_buffer = empty_output_buffer;
-    dest->pub.term_destination = term_destination;
-    dest->outbuffer = buffer;
-    dest->outbuffer_size = size;
-    dest->outbuffer_cursor = buffer;
-    dest->written = written;
-}
+        cinfo.dest = (struct jpeg_destination_mgr *)(*cinfo.mem->alloc_small)((j_common_ptr) &cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
+        dest = (mjpg_dest_ptr) cinfo.dest;
+        dest->pub.init_destination = init_destination;
+        dest->pub.empty_output_buffer = empty_output_buffer;
+        dest->pub.term_destination = term_destination;
+        initialized = true;
+    }
 
+    /* a byte per pixel holds most frames, the buffer grows otherwise */
+    if(out->data == NULL) {
+        out->capacity = width * height + 4096;
+        if((out->data = malloc(out->capacity)) == NULL) {
+            out->capacity = 0;
+            return -1;
+        }
+    }
 
-int save_jpg(int8_t* buffer, uint16_t width, uint16_t height, int quality, unsigned char *outbuffer) {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    static int written;
+    dest = (mjpg_dest_ptr) cinfo.dest;
+    dest->out = out;
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+    if(setjmp(jerr.setjmp_buffer)) {
+        jpeg_abort_compress(&cinfo);
+        return -1;
+    }
 
-    dest_buffer(&cinfo, outbuffer, (int)(width*height*8), &written);
     cinfo.image_width      = width;
     cinfo.image_height     = height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space   = JCS_RGB;
+    cinfo.input_components = components;
+    cinfo.in_color_space   = format;
 
     jpeg_set_defaults(&cinfo);
     jpeg_set_quality (&cinfo, quality, true);
+    cinfo.restart_in_rows = restart;
     jpeg_start_compress(&cinfo, true);
 
-    JSAMPROW row_pointer;
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer = (JSAMPROW) &buffer[cinfo.next_scanline * cinfo.input_components * cinfo.image_width];
-        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+        count = cinfo.image_height - cinfo.next_scanline;
+        if(count > 16)
+            count = 16;
+        for(i = 0; i < count; i++)
+            rows[i] = pixels + (cinfo.next_scanline + i) * stride;
+        jpeg_write_scanlines(&cinfo, rows, count);
     }
-    
+
     jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    return (written);
+    return out->size;
+}
+
+/******************************************************************************
+Description.: finds the entropy coded segments of a JPEG, they are separated
+              by restart markers and the last one ends with EOI
+Input Value.: JPEG, array to store the start of each segment with room for
+              max + 1 entries, the end of the last one is stored last
+Return Value: number of segments, -1 if the JPEG can not be parsed
+******************************************************************************/
+static int find_segments(jpeg_buffer *jpeg, int *segments, int max)
+{
+    unsigned char *data = jpeg->data;
+    int pos = 2, count = 0, marker;
+
+    if(jpeg->size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return -1;
+
+    /* skip the tables up to and including the start of scan */
+    while(1) {
+        if(pos + 4 > jpeg->size || data[pos] != 0xFF)
+            return -1;
+        marker = data[pos + 1];
+        pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+        if(marker == 0xDA)
+            break;
+    }
+
+    segments[count++] = pos;
+    for(; pos + 1 < jpeg->size; pos++) {
+        if(data[pos] != 0xFF || data[pos + 1] == 0x00)
+            continue;
+        if(data[pos + 1] >= 0xD0 && data[pos + 1] <= 0xD7) {
+            if(count >= max)
+                return -1;
+            segments[count++] = pos + 2;
+            pos++;
+        } else if(data[pos + 1] == 0xD9) {
+            /* the end of the last segment, pointing at its marker */
+            segments[count] = pos;
+            return count;
+        }
+    }
+
+    return -1;
+}
+
+/******************************************************************************
+Description.: replaces MCU rows of a JPEG written with one restart interval
+              per MCU row by the rows of a second JPEG with the same tables.
+              Every segment starts with fresh DC predictions, so the result
+              is the same as compressing the whole frame again.
+Input Value.: frame....: the previous JPEG
+              rows.....: its number of MCU rows
+              band.....: JPEG of the rows that changed
+              first....: MCU row the band starts at
+              count....: MCU rows of the band
+              out......: buffer for the new JPEG
+Return Value: size of the new JPEG or -1 if it could not be spliced
+******************************************************************************/
+int splice_rows(jpeg_buffer *frame, int rows, jpeg_buffer *band, int first, int count, jpeg_buffer *out)
+{
+    static int *frame_segments = NULL, *band_segments = NULL;
+    static int capacity = 0;
+    unsigned char *dst;
+    int i, row, size, length;
+
+    if(first < 0 || count <= 0 || first + count > rows)
+        return -1;
+
+    if(rows + 1 > capacity) {
+        int *tmp_frame, *tmp_band;
+
+        if((tmp_frame = realloc(frame_segments, (rows + 1) * sizeof(int))) == NULL)
+            return -1;
+        frame_segments = tmp_frame;
+        if((tmp_band = realloc(band_segments, (rows + 1) * sizeof(int))) == NULL)
+            return -1;
+        band_segments = tmp_band;
+        capacity = rows + 1;
+    }
+
+    if(find_segments(frame, frame_segments, rows) != rows ||
+       find_segments(band, band_segments, count) != count)
+        return -1;
+
+    /* the band segments replace the frame segments including their markers,
+       so the new JPEG can not be larger than this */
+    size = frame->size + (band_segments[count] - band_segments[0]) + 2 * count;
+    if(size > out->capacity) {
+        unsigned char *tmp;
+
+        if((tmp = realloc(out->data, size)) == NULL)
+            return -1;
+        out->data = tmp;
+        out->capacity = size;
+    }
+
+    /* headers and the rows before the band, with their restart markers */
+    dst = out->data;
+    memcpy(dst, frame->data, frame_segments[first]);
+    dst += frame_segments[first];
+
+    for(i = 0; i < count; i++) {
+        row = first + i;
+        length = ((i + 1 < count) ? band_segments[i + 1] - 2 : band_segments[count]) - band_segments[i];
+        memcpy(dst, band->data + band_segments[i], length);
+        dst += length;
+
+        /* restart markers are numbered modulo 8 by their position */
+        *dst++ = 0xFF;
+        *dst++ = (row + 1 < rows) ? 0xD0 + (row % 8) : 0xD9;
+    }
+
+    /* the rows after the band, up to and including EOI */
+    if(first + count < rows) {
+        length = frame->size - frame_segments[first + count];
+        memcpy(dst, frame->data + frame_segments[first + count], length);
+        dst += length;
+    }
+
+    out->size = dst - out->data;
+    return out->size;
 }
@@ -1 +1,12 @@
-int save_jpg(int8_t*, uint16_t, uint16_t, int, unsigned char*);
+/* a buffer that grows to hold the largest frame and is reused afterwards */
+typedef struct {
+    unsigned char *data;
+    int size;
+    int capacity;
+} jpeg_buffer;
+
+/* height of a MCU row, jpeg_set_defaults() samples the chroma 2x2 */
+#define MCU_ROWS 16
+
+int compress_rows(unsigned char *pixels, int width, int height, int stride, J_COLOR_SPACE format, int components, int quality, int restart, jpeg_buffer *out);
+int splice_rows(jpeg_buffer *frame, int rows, jpeg_buffer *band, int first, int count, jpeg_buffer *out);
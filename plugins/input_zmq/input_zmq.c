@@ -0,0 +1,560 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <zmq.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "../output_zmqserver/output_zmqserver.h"
+
+#define INPUT_PLUGIN_NAME "ZMQ input plugin"
+
+/* topic, raw header and one part per frame */
+#define MAX_FRAMES 64
+#define MAX_PARTS (MAX_FRAMES + 2)
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    struct timeval timestamp;
+} zmq_frame;
+
+/* a received message, its parts stay open while a frame points into them */
+typedef struct {
+    zmq_msg_t part[MAX_PARTS];
+    int count;
+} zmq_message;
+
+/* private functions and variables to this plugin */
+static pthread_t   worker;
+static globals     *pglobal;
+
+void *worker_thread(void *);
+void worker_cleanup(void *);
+void help(void);
+
+static char *address = NULL;
+static char *topic = "frames";
+static int socket_type = ZMQ_SUB;
+static int bind_socket = 0;
+static int plugin_number;
+
+static void *context = NULL;
+static void *subscriber = NULL;
+
+static zmq_message message[2];
+static int published = -1;
+static zmq_frame frames[MAX_FRAMES];
+static unsigned long long received = 0, invalid = 0;
+
+/*** plugin interface functions ***/
+int input_init(input_parameter *param, int id)
+{
+    int i;
+    plugin_number = id;
+
+    param->argv[0] = INPUT_PLUGIN_NAME;
+
+    /* show all parameters for DBG purposes */
+    for(i = 0; i < param->argc; i++) {
+        DBG("argv[%d]=%s\n", i, param->argv[i]);
+    }
+
+    reset_getopt();
+    while(1) {
+        int option_index = 0, c = 0;
+        static struct option long_options[] = {
+            {"h", no_argument, 0, 0
+            },
+            {"help", no_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"address", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"socket", required_argument, 0, 0},
+            {"b", no_argument, 0, 0},
+            {"bind", no_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"topic", required_argument, 0, 0},
+            {0, 0, 0, 0}
+        };
+
+        c = getopt_long_only(param->argc, param->argv, "", long_options, &option_index);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        /* unrecognized option */
+        if(c == '?') {
+            help();
+            return 1;
+        }
+
+        switch(option_index) {
+            /* h, help */
+        case 0:
+        case 1:
+            DBG("case 0,1\n");
+            help();
+            return 1;
+            break;
+
+            /* a, address */
+        case 2:
+        case 3:
+            DBG("case 2,3\n");
+            address = strdup(optarg);
+            break;
+
+            /* s, socket */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            if(strcasecmp(optarg, "sub") == 0) {
+                socket_type = ZMQ_SUB;
+            } else if(strcasecmp(optarg, "pull") == 0) {
+                socket_type = ZMQ_PULL;
+            } else {
+                IPRINT("ERROR: socket type must be sub or pull\n");
+                return 1;
+            }
+            break;
+
+            /* b, bind */
+        case 6:
+        case 7:
+            DBG("case 6,7\n");
+            bind_socket = 1;
+            break;
+
+            /* t, topic */
+        case 8:
+        case 9:
+            DBG("case 8,9\n");
+            topic = strdup(optarg);
+            break;
+        default:
+            DBG("default case\n");
+            help();
+            return 1;
+        }
+    }
+
+    pglobal = param->global;
+
+    /* check for required parameters */
+    if(address == NULL) {
+        IPRINT("ERROR: no ZMQ address specified\n");
+        return 1;
+    }
+
+    IPRINT("zmq address.......: %s (%s)\n", address, (bind_socket) ? "bind" : "connect");
+    IPRINT("socket type.......: %s\n", (socket_type == ZMQ_SUB) ? "SUB" : "PULL");
+    IPRINT("topic.............: %s\n", topic);
+
+    param->global->in[id].name = malloc((strlen(INPUT_PLUGIN_NAME) + 1) * sizeof(char));
+    sprintf(param->global->in[id].name, INPUT_PLUGIN_NAME);
+
+    return 0;
+}
+
+int input_stop(int id)
+{
+    DBG("will cancel input thread\n");
+    pthread_cancel(worker);
+    return 0;
+}
+
+/*** private functions for this plugin below ***/
+void help(void)
+{
+    fprintf(stderr, " ---------------------------------------------------------------\n" \
+    " Help for input plugin..: "INPUT_PLUGIN_NAME"\n" \
+    " ---------------------------------------------------------------\n" \
+    " The following parameters can be passed to this plugin:\n\n" \
+    " [-a | --address ]......: ZMQ address to receive the frames from\n" \
+    " [-s | --socket ].......: socket type, sub (default) or pull\n" \
+    " [-b | --bind ].........: bind to the address instead of connecting\n" \
+    " [-t | --topic ]........: topic to subscribe to, default is frames\n" \
+    " ---------------------------------------------------------------\n");
+}
+
+/******************************************************************************
+Description.: reads a protobuf varint
+Input Value.: p: the varint
+              end: end of the buffer
+              value: the decoded value
+Return Value: pointer behind the varint, NULL if it is truncated
+******************************************************************************/
+static unsigned char *read_varint(unsigned char *p, unsigned char *end, uint64_t *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    while(p < end && shift < 64) {
+        *value |= (uint64_t)(*p & 0x7f) << shift;
+        if((*p++ & 0x80) == 0)
+            return p;
+        shift += 7;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: skips a protobuf field of an unknown tag
+Input Value.: p: the field value
+              end: end of the buffer
+              wire_type: wire type of the field
+Return Value: pointer behind the field, NULL if it is invalid
+******************************************************************************/
+static unsigned char *skip_field(unsigned char *p, unsigned char *end, int wire_type)
+{
+    uint64_t value;
+
+    switch(wire_type) {
+    case 0:
+        return read_varint(p, end, &value);
+    case 1:
+        return (end - p >= 8) ? p + 8 : NULL;
+    case 2:
+        if((p = read_varint(p, end, &value)) == NULL || value > (uint64_t)(end - p))
+            return NULL;
+        return p + value;
+    case 5:
+        return (end - p >= 4) ? p + 4 : NULL;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: decodes a serialized pb.Package as sent by output_zmqserver.
+              The wire format is walked by hand, the frames keep pointing
+              into the message instead of being copied by the unpacker.
+Input Value.: p: the package
+              end: end of the package
+Return Value: number of frames, -1 if the package is invalid
+******************************************************************************/
+static int decode_package(unsigned char *p, unsigned char *end)
+{
+    uint64_t key, value;
+    unsigned char *frame_end;
+    zmq_frame *frame;
+    int count = 0;
+
+    while(p < end) {
+        if((p = read_varint(p, end, &key)) == NULL)
+            return -1;
+
+        /* anything but "repeated Frame frame = 1" */
+        if(key != ((1 << 3) | 2)) {
+            if((p = skip_field(p, end, key & 7)) == NULL)
+                return -1;
+            continue;
+        }
+
+        if((p = read_varint(p, end, &value)) == NULL || value > (uint64_t)(end - p))
+            return -1;
+        frame_end = p + value;
+
+        if(count == MAX_FRAMES) {
+            p = frame_end;
+            continue;
+        }
+
+        frame = &frames[count];
+        memset(frame, 0, sizeof(*frame));
+
+        while(p < frame_end) {
+            if((p = read_varint(p, frame_end, &key)) == NULL)
+                return -1;
+
+            switch(key) {
+            case (2 << 3) | 0: /* timestamp_s */
+                p = read_varint(p, frame_end, &value);
+                frame->timestamp.tv_sec = value;
+                break;
+            case (3 << 3) | 0: /* timestamp_us */
+                p = read_varint(p, frame_end, &value);
+                frame->timestamp.tv_usec = value;
+                break;
+            case (4 << 3) | 2: /* blob */
+                if((p = read_varint(p, frame_end, &value)) == NULL || value > (uint64_t)(frame_end - p))
+                    return -1;
+                frame->data = p;
+                frame->size = value;
+                p += value;
+                break;
+            default:
+                p = skip_field(p, frame_end, key & 7);
+            }
+
+            if(p == NULL)
+                return -1;
+        }
+
+        if(frame->data != NULL && frame->size > 0)
+            count++;
+    }
+
+    return count;
+}
+
+/******************************************************************************
+Description.: finds the frames of a received message. Accepted are a
+              serialized pb.Package, the raw format of output_zmqserver
+              (a header part with one zmq_raw_frame per frame, followed by
+              one part per JPEG) or a single part holding a plain JPEG.
+              A leading part matching the topic gets skipped.
+Input Value.: msg: the message
+Return Value: number of frames, -1 if the message is invalid
+******************************************************************************/
+static int decode_message(zmq_message *msg)
+{
+    zmq_raw_frame *header;
+    unsigned char *data;
+    size_t size;
+    int first = 0, count, i;
+
+    if(msg->count > 1 &&
+       zmq_msg_size(&msg->part[0]) == strlen(topic) &&
+       memcmp(zmq_msg_data(&msg->part[0]), topic, strlen(topic)) == 0)
+        first = 1;
+
+    count = msg->count - first;
+    data = zmq_msg_data(&msg->part[first]);
+    size = zmq_msg_size(&msg->part[first]);
+
+    /* raw format */
+    if(count > 1) {
+        /* without a topic part a message may carry one part too many */
+        if(count - 1 > MAX_FRAMES) {
+            DBG("message with %d frames exceeds the limit of %d\n", count - 1, MAX_FRAMES);
+            return -1;
+        }
+        if(size != (count - 1) * sizeof(zmq_raw_frame))
+            return -1;
+
+        header = (zmq_raw_frame *)data;
+        for(i = 0; i < count - 1; i++) {
+            frames[i].data = zmq_msg_data(&msg->part[first + 1 + i]);
+            frames[i].size = zmq_msg_size(&msg->part[first + 1 + i]);
+            frames[i].timestamp.tv_sec = header[i].timestamp_s;
+            frames[i].timestamp.tv_usec = header[i].timestamp_us;
+        }
+        return count - 1;
+    }
+
+    /* plain JPEG */
+    if(size >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
+        frames[0].data = data;
+        frames[0].size = size;
+        timerclear(&frames[0].timestamp);
+        return 1;
+    }
+
+    return decode_package(data, data + size);
+}
+
+/******************************************************************************
+Description.: receives all parts of the next message
+Input Value.: msg: the message to fill, its parts must be closed
+Return Value: 0 if a message was received, -1 on timeout or error
+******************************************************************************/
+static int receive_message(zmq_message *msg)
+{
+    zmq_msg_t extra;
+    int more;
+
+    msg->count = 0;
+    do {
+        zmq_msg_init(&msg->part[msg->count]);
+        if(zmq_msg_recv(&msg->part[msg->count], subscriber, 0) == -1) {
+            zmq_msg_close(&msg->part[msg->count]);
+            /* a timeout before the first part is no error, mid message it is unlikely */
+            if(msg->count > 0) {
+                DBG("message truncated: %s\n", zmq_strerror(errno));
+            }
+            while(msg->count > 0)
+                zmq_msg_close(&msg->part[--msg->count]);
+            return -1;
+        }
+        more = zmq_msg_more(&msg->part[msg->count]);
+        msg->count++;
+    } while(more && msg->count < MAX_PARTS);
+
+    /* drop parts beyond what a valid message can have */
+    while(more) {
+        zmq_msg_init(&extra);
+        if(zmq_msg_recv(&extra, subscriber, 0) == -1)
+            more = 0;
+        else
+            more = zmq_msg_more(&extra);
+        zmq_msg_close(&extra);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: closes all parts of a message
+Input Value.: msg: the message
+Return Value: -
+******************************************************************************/
+static void close_message(zmq_message *msg)
+{
+    while(msg->count > 0)
+        zmq_msg_close(&msg->part[--msg->count]);
+}
+
+int input_run(int id)
+{
+    int timeout = 500;
+
+    pglobal->in[id].buf = NULL;
+
+    context = zmq_ctx_new();
+    subscriber = zmq_socket(context, socket_type);
+    if(subscriber == NULL) {
+        IPRINT("could not create ZMQ socket: %s\n", zmq_strerror(errno));
+        return 1;
+    }
+
+    /* wake up regularly to notice when to stop */
+    zmq_setsockopt(subscriber, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    if(socket_type == ZMQ_SUB)
+        zmq_setsockopt(subscriber, ZMQ_SUBSCRIBE, topic, strlen(topic));
+
+    if(((bind_socket) ? zmq_bind(subscriber, address) : zmq_connect(subscriber, address)) == -1) {
+        IPRINT("could not %s to %s: %s\n", (bind_socket) ? "bind" : "connect", address, zmq_strerror(errno));
+        return 1;
+    }
+
+    if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
+        fprintf(stderr, "could not start worker thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_detach(worker);
+
+    return 0;
+}
+
+/* the single writer thread */
+void *worker_thread(void *arg)
+{
+    int next, count, i;
+    int64_t gap;
+    struct timeval timestamp;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    while(!pglobal->stop) {
+        next = (published == 0) ? 1 : 0;
+
+        if(receive_message(&message[next]) < 0)
+            continue;
+
+        if((count = decode_message(&message[next])) <= 0) {
+            DBG("ignoring invalid message\n");
+            invalid++;
+            close_message(&message[next]);
+            continue;
+        }
+
+        for(i = 0; i < count && !pglobal->stop; i++) {
+            /* frames of a batch keep the distance they were captured at */
+            if(i > 0) {
+                gap = (int64_t)(frames[i].timestamp.tv_sec - frames[i-1].timestamp.tv_sec) * 1000000 +
+                      (frames[i].timestamp.tv_usec - frames[i-1].timestamp.tv_usec);
+                if(gap > 0 && gap < 1000000)
+                    usleep(gap);
+            }
+
+            if(timerisset(&frames[i].timestamp))
+                timestamp = frames[i].timestamp;
+            else
+                gettimeofday(&timestamp, NULL);
+
+            /* publish the frame by pointer into the message */
+            pthread_mutex_lock(&pglobal->in[plugin_number].db);
+            pglobal->in[plugin_number].buf = frames[i].data;
+            pglobal->in[plugin_number].size = frames[i].size;
+            pglobal->in[plugin_number].timestamp = timestamp;
+            pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+            /* nobody points into the previous message anymore */
+            if(i == 0 && published >= 0)
+                close_message(&message[published]);
+            published = next;
+            received++;
+        }
+
+        /* stopped before the first frame, nobody points into the message */
+        if(i == 0)
+            close_message(&message[next]);
+    }
+
+    DBG("leaving input thread, calling cleanup function now\n");
+    /* call cleanup handler, signal with the parameter */
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+void worker_cleanup(void *arg)
+{
+    static unsigned char first_run = 1;
+
+    if(!first_run) {
+        DBG("already cleaned up resources\n");
+        return;
+    }
+
+    first_run = 0;
+    DBG("cleaning up resources allocated by input thread\n");
+    IPRINT("frames received...: %llu, invalid messages: %llu\n", received, invalid);
+
+    /* frames are published by pointer, withdraw them before closing the message */
+    pthread_mutex_lock(&pglobal->in[plugin_number].db);
+    pglobal->in[plugin_number].buf = NULL;
+    pglobal->in[plugin_number].size = 0;
+    pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+
+    if(published >= 0)
+        close_message(&message[published]);
+
+    zmq_close(subscriber);
+    zmq_ctx_destroy(context);
+}
@@ -30,10 +30,12 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <time.h>
+#include <limits.h>
 #include <syslog.h>
 
 #include <linux/types.h>          /* for videodev2.h */
@@ -41,16 +43,42 @@
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
+#include "../../sharpness.h"
 
-#include "processJPEG_onlyCenter.h"
+#include "output_autofocus.h"
 
 #define OUTPUT_PLUGIN_NAME "autofocus output plugin"
 
+/* positions tried over the whole range before the golden-section search */
+#define COARSE_STEPS 4
+/* positions measured by one search at most */
+#define MAX_PROBES 64
+
+#define GOLDEN_RATIO 1.6180339887
+
+typedef struct {
+    int position;
+    double sharpness;
+} probe;
+
 static pthread_t worker;
 static globals *pglobal;
-static int fd, delay;
+static int plugin_number, input_number;
+static int delay = 0, every = 10, settle = 2, threshold = 30, precision = 0;
 static unsigned char *frame = NULL;
-static int input_number;
+static int frame_capacity = 0;
+static sharpness *engine = NULL;
+static sharpness_roi roi = { 0.0, 0.0, 1.0, 1.0 };
+
+/* the focus control of the input plugin, focus_max < focus_min if it has
+   none and the plugin only measures */
+static int focus_min = 0, focus_max = -1, focus_step = 1, has_auto_focus = 0;
+
+static pthread_mutex_t refocus_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int refocus = 1;
+
+static probe probes[MAX_PROBES];
+static int probe_count;
 
 /******************************************************************************
 Description.: print a help message
@@ -63,7 +91,18 @@ void help(void)
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
-            " [-d | --delay ].........: delay after saving pictures in ms\n" \
+            " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-r | --roi ]...........: measure the sharpness in this region only,\n" \
+            "                           x,y,width,height in fractions of the frame\n" \
+            " [-e | --every ].........: check the sharpness of every Nth frame\n" \
+            "                           while in focus, default 10\n" \
+            " [-s | --settle ]........: frames to drop after moving the lens,\n" \
+            "                           default 2\n" \
+            " [-t | --threshold ].....: search again when the sharpness drops by\n" \
+            "                           this many percent, default 30\n" \
+            " [-p | --precision ].....: stop searching when the focus is known\n" \
+            "                           this close, default 1/32 of the range\n" \
+            " [-d | --delay ].........: pause between two checks in ms\n" \
             " ---------------------------------------------------------------\n");
 }
 
@@ -85,79 +124,204 @@ void worker_cleanup(void *arg)
     OPRINT("cleaning up resources allocated by worker thread\n");
 
     free(frame);
-    close(fd);
+    sharpness_free(engine);
 }
 
+/******************************************************************************
+Description.: waits for fresh frames and measures the sharpness of the last
+Input Value.: number of frames to wait for, 1 for the next one
+Return Value: the sharpness, -1 if the frame could not be measured
+******************************************************************************/
+static double next_sharpness(int frames)
+{
+    unsigned char *tmp;
+    int frame_size;
+    double sv;
+
+    pthread_mutex_lock(&pglobal->in[input_number].db);
+    while(frames-- > 0 && !pglobal->stop)
+        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+
+    /* check if buffer for frame is large enough, increase it if necessary */
+    frame_size = pglobal->in[input_number].size;
+    if(frame_size > frame_capacity) {
+        DBG("increasing buffer size to %d\n", frame_size);
+        if((tmp = realloc(frame, frame_size + (1 << 16))) == NULL) {
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+            OPRINT("not enough memory\n");
+            return -1;
+        }
+        frame = tmp;
+        frame_capacity = frame_size + (1 << 16);
+    }
+    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
 
+    sv = sharpness_measure(engine, frame, frame_size, &roi, NULL);
+    if(sv < 0) {
+        DBG("unable to measure the sharpness: %s\n", sharpness_error(engine));
+        return -1;
+    }
+
+    DBG("sharpness is: %f\n", sv);
+    pglobal->out[plugin_number].out_parameters[2].value = (int)sv;
+    return sv;
+}
 
 /******************************************************************************
-Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and calculates focus
-Input Value.:
-Return Value:
+Description.: moves the lens through the input plugin
+Input Value.: focus position
+Return Value: 0 if ok, -1 if the input plugin refused
 ******************************************************************************/
-void *worker_thread(void *arg)
+static int set_focus(int position)
 {
-    int frame_size = 0;
-    double sv = -1.0, max_sv = 100.0, delta = 500;
-    int focus = 255, step = 10, max_focus = 100, search_focus = 1;
-
-    if((frame = malloc(256 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
+    if(pglobal->in[input_number].cmd(input_number, V4L2_CID_FOCUS_ABSOLUTE, IN_CMD_V4L2, position, NULL) < 0) {
+        DBG("unable to set the focus to %d\n", position);
+        return -1;
     }
 
-    /* set cleanup handler to cleanup allocated resources */
-    pthread_cleanup_push(worker_cleanup, NULL);
+    pglobal->out[plugin_number].out_parameters[1].value = position;
+    return 0;
+}
 
-    while(!pglobal->stop) {
-        DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+/******************************************************************************
+Description.: measures the sharpness at a focus position, positions measured
+              during this search already are not measured again
+Input Value.: focus position, rounded to the step of the control
+Return Value: the sharpness, -1 if it could not be measured
+******************************************************************************/
+static double probe_focus(double position)
+{
+    int i, p;
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+    p = focus_min + (int)((position - focus_min) / focus_step + 0.5) * focus_step;
+    p = MIN(MAX(p, focus_min), focus_max);
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+    for(i = 0; i < probe_count; i++)
+        if(probes[i].position == p)
+            return probes[i].sharpness;
 
-        /* process frame */
-        sv = getFrameSharpnessValue(frame, frame_size);
-        DBG("sharpness is: %f\n", sv);
+    if(probe_count == MAX_PROBES || set_focus(p) < 0)
+        return -1;
 
-        if(search_focus || (ABS(sv - max_sv) > delta)) {
-            DBG("adjusting focus: %d\n", focus);
+    /* the frames in flight were taken before the lens settled */
+    probes[probe_count].position = p;
+    probes[probe_count].sharpness = next_sharpness(settle + 1);
+    DBG("focus %d: sharpness %f\n", p, probes[probe_count].sharpness);
 
-            /* entered because focus changed */
-            if(!search_focus) {
-                DBG("starting to search for focus\n");
-                max_focus    = 255;
-                focus        = 255;
-                max_sv       = -1.0;
-                search_focus = 1;
-            }
+    return probes[probe_count++].sharpness;
+}
 
-            if(focus <= 0) {
-                focus = max_focus;
-                DBG("max focus found at: %d\n", max_focus);
-                search_focus = 0;
-            }
+/******************************************************************************
+Description.: searches the sharpest focus position: a few positions over the
+              whole range find the peak, a golden-section search between the
+              neighbours of the best one narrows it down
+Input Value.: -
+Return Value: the sharpness at the position found, -1 on errors
+******************************************************************************/
+static double search_focus(void)
+{
+    double low, high, a, b, fa, fb, coarse, sv;
+    struct timeval start, end;
+    int i, best = 0;
+
+    gettimeofday(&start, NULL);
+    probe_count = 0;
+
+    coarse = (double)(focus_max - focus_min) / COARSE_STEPS;
+    for(i = 0; i <= COARSE_STEPS && !pglobal->stop; i++)
+        probe_focus(focus_min + i * coarse);
+
+    /* no position could be set, or stopped before the first one */
+    if(probe_count == 0)
+        return -1;
+
+    for(i = 1; i < probe_count; i++)
+        if(probes[i].sharpness > probes[best].sharpness)
+            best = i;
+
+    /* the peak lies between the neighbours of the best position */
+    low = MAX(probes[best].position - coarse, focus_min);
+    high = MIN(probes[best].position + coarse, focus_max);
+
+    a = high - (high - low) / GOLDEN_RATIO;
+    b = low + (high - low) / GOLDEN_RATIO;
+    fa = probe_focus(a);
+    fb = probe_focus(b);
+
+    while(high - low > precision && !pglobal->stop) {
+        if(fa < fb) {
+            low = a;
+            a = b;
+            fa = fb;
+            b = low + (high - low) / GOLDEN_RATIO;
+            fb = probe_focus(b);
+        } else {
+            high = b;
+            b = a;
+            fb = fa;
+            a = high - (high - low) / GOLDEN_RATIO;
+            fa = probe_focus(a);
+        }
+    }
+
+    for(i = 1; i < probe_count; i++)
+        if(probes[i].sharpness > probes[best].sharpness)
+            best = i;
+
+    if(probes[best].sharpness < 0 || set_focus(probes[best].position) < 0)
+        return -1;
+    sv = next_sharpness(settle + 1);
 
-            if(search_focus) {
-                if(sv > max_sv) {
-                    /* sharpness is better then max now */
-                    DBG("found better focus at: %d\n", focus);
-                    max_focus = focus;
-                    max_sv = sv;
-                }
-
-                focus = MIN(MAX(focus - step, 0), 255);
-                DBG("decrement focus now to: %d\n", focus);
-                //focus = pglobal->in.cmd(IN_CMD_FOCUS_SET, focus);
+    gettimeofday(&end, NULL);
+    OPRINT("focus %d, sharpness %.0f, found with %d positions in %.1f s\n",
+           probes[best].position, sv, probe_count,
+           (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+
+    return sv;
+}
+
+/******************************************************************************
+Description.: this is the main worker thread
+              it searches the focus and watches the sharpness afterwards,
+              the focus is searched again when the sharpness drops
+Input Value.:
+Return Value:
+******************************************************************************/
+void *worker_thread(void *arg)
+{
+    double sv, reference = -1;
+    int search;
+
+    /* set cleanup handler to cleanup allocated resources */
+    pthread_cleanup_push(worker_cleanup, NULL);
+
+    /* the lens is ours from now on */
+    if(has_auto_focus)
+        pglobal->in[input_number].cmd(input_number, V4L2_CID_FOCUS_AUTO, IN_CMD_V4L2, 0, NULL);
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&refocus_mutex);
+        search = refocus && focus_max > focus_min;
+        refocus = 0;
+        pthread_mutex_unlock(&refocus_mutex);
+
+        if(search) {
+            if((reference = search_focus()) < 0)
+                OPRINT("unable to find the focus\n");
+        } else if((sv = next_sharpness(every)) >= 0) {
+            if(sv > reference) {
+                reference = sv;
+            } else if(sv < reference * (100 - threshold) / 100) {
+                DBG("sharpness dropped from %f to %f\n", reference, sv);
+                pthread_mutex_lock(&refocus_mutex);
+                refocus = 1;
+                pthread_mutex_unlock(&refocus_mutex);
             }
         }
 
-        if((delay > 0) && !search_focus) {
+        if(delay > 0) {
             usleep(1000 * delay);
         }
     }
@@ -174,12 +338,11 @@ Description.: this function is called first, in order to initialise
 Input Value.: parameters
 Return Value: 0 if everything is ok, non-zero otherwise
 ******************************************************************************/
-int output_init(output_parameter *param)
+int output_init(output_parameter *param, int id)
 {
+    control *ctrl;
     int i;
 
-    delay = 10000;
-
     param->argv[0] = OUTPUT_PLUGIN_NAME;
 
     /* show all parameters for DBG purposes */
@@ -198,6 +361,16 @@ int output_init(output_parameter *param)
             {"delay", required_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"roi", required_argument, 0, 0},
+            {"e", required_argument, 0, 0},
+            {"every", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"settle", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"threshold", required_argument, 0, 0},
+            {"p", required_argument, 0, 0},
+            {"precision", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -232,12 +405,117 @@ int output_init(output_parameter *param)
         case 5:
             input_number = atoi(optarg);
             break;
+            /* r, roi */
+        case 6:
+        case 7:
+            if(sharpness_parse_roi(optarg, &roi) < 0) {
+                OPRINT("invalid region of interest: %s\n", optarg);
+                return 1;
+            }
+            break;
+            /* e, every */
+        case 8:
+        case 9:
+            every = MAX(atoi(optarg), 1);
+            break;
+            /* s, settle */
+        case 10:
+        case 11:
+            settle = MAX(atoi(optarg), 0);
+            break;
+            /* t, threshold */
+        case 12:
+        case 13:
+            threshold = MIN(MAX(atoi(optarg), 1), 100);
+            break;
+            /* p, precision */
+        case 14:
+        case 15:
+            precision = MAX(atoi(optarg), 1);
+            break;
         }
     }
 
     pglobal = param->global;
+    plugin_number = id;
+
+    if(!(input_number < pglobal->incnt)) {
+        OPRINT("ERROR: the %d input_plugin number is too much only %d plugins loaded\n", input_number, pglobal->incnt);
+        return 1;
+    }
+
+    /* look for the focus control of the input plugin */
+    for(i = 0; i < pglobal->in[input_number].parametercount; i++) {
+        ctrl = &pglobal->in[input_number].in_parameters[i];
+        if(ctrl->group != IN_CMD_V4L2)
+            continue;
+        if(ctrl->ctrl.id == V4L2_CID_FOCUS_ABSOLUTE) {
+            focus_min = ctrl->ctrl.minimum;
+            focus_max = ctrl->ctrl.maximum;
+            focus_step = MAX(ctrl->ctrl.step, 1);
+        } else if(ctrl->ctrl.id == V4L2_CID_FOCUS_AUTO) {
+            has_auto_focus = 1;
+        }
+    }
+    if(pglobal->in[input_number].cmd == NULL)
+        focus_max = focus_min - 1;
+
+    if(precision == 0)
+        precision = MAX((focus_max - focus_min) / 32, focus_step);
+
+    if((engine = sharpness_new()) == NULL) {
+        OPRINT("not enough memory\n");
+        return 1;
+    }
+
+    /* the position and sharpness are shown by output_http, a button
+       searches the focus again */
+    pglobal->out[id].parametercount = 3;
+    pglobal->out[id].out_parameters = calloc(3, sizeof(control));
+    if(pglobal->out[id].out_parameters == NULL) {
+        OPRINT("not enough memory\n");
+        return 1;
+    }
 
-    OPRINT("delay.............: %d\n", delay);
+    ctrl = &pglobal->out[id].out_parameters[0];
+    ctrl->group = IN_CMD_GENERIC;
+    ctrl->ctrl.id = OUT_AUTOFOCUS_CMD_REFOCUS;
+    ctrl->ctrl.type = V4L2_CTRL_TYPE_BUTTON;
+    strcpy((char*) ctrl->ctrl.name, "Refocus");
+    ctrl->ctrl.maximum = 1;
+    ctrl->ctrl.step = 1;
+
+    ctrl = &pglobal->out[id].out_parameters[1];
+    ctrl->group = IN_CMD_GENERIC;
+    ctrl->ctrl.id = OUT_AUTOFOCUS_FOCUS;
+    ctrl->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+    strcpy((char*) ctrl->ctrl.name, "Focus");
+    ctrl->ctrl.minimum = focus_min;
+    ctrl->ctrl.maximum = MAX(focus_max, focus_min);
+    ctrl->ctrl.step = focus_step;
+    ctrl->ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+
+    ctrl = &pglobal->out[id].out_parameters[2];
+    ctrl->group = IN_CMD_GENERIC;
+    ctrl->ctrl.id = OUT_AUTOFOCUS_SHARPNESS;
+    ctrl->ctrl.type = V4L2_CTRL_TYPE_INTEGER;
+    strcpy((char*) ctrl->ctrl.name, "Sharpness");
+    ctrl->ctrl.maximum = INT_MAX;
+    ctrl->ctrl.step = 1;
+    ctrl->ctrl.flags = V4L2_CTRL_FLAG_READ_ONLY;
+    ctrl->value = -1;
+
+    OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    if(focus_max > focus_min) {
+        OPRINT("focus range......: %d..%d, step %d, precision %d\n", focus_min, focus_max, focus_step, precision);
+    } else {
+        OPRINT("focus range......: the input plugin has no focus control, measuring only\n");
+    }
+    OPRINT("region of interest: %.2f,%.2f %.2fx%.2f\n", roi.x, roi.y, roi.width, roi.height);
+    OPRINT("check every......: %d frames\n", every);
+    OPRINT("settle frames....: %d\n", settle);
+    OPRINT("refocus threshold: %d%%\n", threshold);
+    OPRINT("delay............: %d\n", delay);
     return 0;
 }
 
@@ -265,3 +543,23 @@ int output_run(int id)
     pthread_detach(worker);
     return 0;
 }
+
+/******************************************************************************
+Description.: the "Refocus" button starts a new search of the focus
+Input Value.: plugin, control, group, value and string value of the command
+Return Value: 0 if ok, -1 for unknown or read-only controls
+******************************************************************************/
+int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int value, char *valueStr)
+{
+    DBG("command (%d, value: %d) for group %d triggered for plugin instance #%02d\n", control_id, value, group, plugin_id);
+
+    if(group != IN_CMD_GENERIC || control_id != OUT_AUTOFOCUS_CMD_REFOCUS) {
+        DBG("Requested control (%d) not found or read-only\n", control_id);
+        return -1;
+    }
+
+    pthread_mutex_lock(&refocus_mutex);
+    refocus = 1;
+    pthread_mutex_unlock(&refocus_mutex);
+    return 0;
+}
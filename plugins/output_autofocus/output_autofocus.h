@@ -0,0 +1,8 @@
+#ifndef OUTPUT_AUTOFOCUS_H
+#define OUTPUT_AUTOFOCUS_H
+
+#define OUT_AUTOFOCUS_CMD_REFOCUS   1
+#define OUT_AUTOFOCUS_FOCUS         2
+#define OUT_AUTOFOCUS_SHARPNESS     3
+
+#endif
@@ -30,20 +30,28 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
 #include <time.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include "output_file.h"
 
 #include "../../utils.h"
 #include "../../mjpg_streamer.h"
+#include "../../transcode.h"
 
 #define OUTPUT_PLUGIN_NAME "FILE output plugin"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static pthread_t worker;
 static globals *pglobal;
 static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
@@ -53,6 +61,32 @@ static char *command = NULL;
 static int input_number = 0;
 static char *mjpgFileName = NULL;
 static char *linkFileName = NULL;
+static int quality = 0;
+
+/*
+ * event recording: the frames of the last "preroll" seconds are kept in a ring
+ * of reusable buffers, a trigger flushes them to a clip and keeps recording
+ * for "postroll" seconds
+ */
+typedef struct {
+    unsigned char *buf;
+    int size;
+    int capacity;
+    struct timeval timestamp;
+} ring_frame;
+
+static ring_frame *ring = NULL;
+static int ring_len = 0, ring_head = 0, ring_count = 0;
+static int preroll = -1, postroll = 10, motion = 0;
+static int event_fd = -1;
+static int event_trigger = 0;
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* archive mode: segments of "archive_size" MB plus an index */
+static int archive_size = 0;
+static int archive_index_fd = -1, archive_data_fd = -1;
+static uint32_t archive_segment = 0;
+static uint64_t archive_offset = 0, archive_last = 0;
 
 /******************************************************************************
 Description.: print a help message
@@ -74,6 +108,14 @@ void help(void)
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
             " [-c | --command ].......: execute command after saving picture\n"\
+            " The following arguments enable the event recording mode\n" \
+            " [-b | --buffer ]........: keep the frames of the last N seconds in memory\n" \
+            " [-a | --after ].........: continue recording N seconds after a trigger\n" \
+            " [-t | --motion ]........: trigger if the frame size changes by this percentage\n" \
+            " The following argument enables the archive mode\n" \
+            " [-r | --archive ].......: append frames to segments of N MB with a time index\n" \
+            " The following argument applies to all modes\n" \
+            " [-q | --quality ].......: lower the JPEG quality to 1..99 by requantizing\n" \
             " ---------------------------------------------------------------\n");
 }
 
@@ -102,6 +144,269 @@ void worker_cleanup(void *arg)
         free(frame);
     }
     close(fd);
+
+    if(event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+
+    for(; ring_len > 0; ring_len--) {
+        free(ring[ring_len - 1].buf);
+    }
+    free(ring);
+    ring = NULL;
+
+    if(archive_data_fd >= 0) {
+        close(archive_data_fd);
+        archive_data_fd = -1;
+    }
+    if(archive_index_fd >= 0) {
+        close(archive_index_fd);
+        archive_index_fd = -1;
+    }
+}
+
+/******************************************************************************
+Description.: milliseconds elapsed between two points in time
+Input Value.: from, to: the two timestamps
+Return Value: difference in milliseconds
+******************************************************************************/
+static long elapsed_ms(struct timeval *from, struct timeval *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_usec - from->tv_usec) / 1000;
+}
+
+/******************************************************************************
+Description.: returns the ring slot the next frame should be copied to.
+              The slot of the oldest frame is recycled once it fell out of
+              the pre-roll window, the ring only grows while every stored
+              frame is still needed.
+Input Value.: now: arrival time of the frame
+              size: size of the frame
+Return Value: slot with room for at least size bytes, NULL if out of memory
+******************************************************************************/
+static ring_frame *ring_push(struct timeval *now, int size)
+{
+    ring_frame *slot, *tmp;
+    unsigned char *buf;
+    int i, len;
+
+    if(ring_count == ring_len) {
+        if(ring_len > 0 && elapsed_ms(&ring[ring_head].timestamp, now) > preroll * 1000) {
+            ring_head = (ring_head + 1) % ring_len;
+            ring_count--;
+        } else {
+            /* grow and unwrap, so the oldest frame ends up at index 0 */
+            len = ring_len * 2 + 16;
+            if((tmp = calloc(len, sizeof(ring_frame))) == NULL)
+                return NULL;
+
+            for(i = 0; i < ring_len; i++)
+                tmp[i] = ring[(ring_head + i) % ring_len];
+
+            free(ring);
+            ring = tmp;
+            ring_len = len;
+            ring_head = 0;
+        }
+    }
+
+    slot = &ring[(ring_head + ring_count) % ring_len];
+    if(size > slot->capacity) {
+        DBG("increasing ring slot size to %d\n", size);
+        if((buf = realloc(slot->buf, size + (1 << 16))) == NULL)
+            return NULL;
+
+        slot->buf = buf;
+        slot->capacity = size + (1 << 16);
+    }
+
+    slot->timestamp = *now;
+    ring_count++;
+
+    return slot;
+}
+
+/******************************************************************************
+Description.: writes a vector of buffers completely, retries on short writes
+Input Value.: fd: file to write to
+              iov, cnt: the buffers, iov gets modified
+Return Value: 0 if everything was written, -1 in case of error
+******************************************************************************/
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t rc;
+
+    while(cnt > 0) {
+        if((rc = writev(fd, iov, cnt)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while(cnt > 0 && rc >= (ssize_t)iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        if(cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: writes all frames of the pre-roll window to fd with as few
+              writev() calls as possible and empties the ring afterwards.
+              The buffers stay allocated for the next frames.
+Input Value.: fd: file to write to
+              now: arrival time of the newest frame
+Return Value: 0 if everything is OK, -1 in case of a write error
+******************************************************************************/
+static int ring_flush(int fd, struct timeval *now)
+{
+    struct iovec iov[IOV_MAX];
+    ring_frame *f;
+    int i, n = 0;
+
+    for(i = 0; i < ring_count; i++) {
+        f = &ring[(ring_head + i) % ring_len];
+
+        /* stale frames are only recycled when the ring is full, skip them */
+        if(elapsed_ms(&f->timestamp, now) > preroll * 1000)
+            continue;
+
+        iov[n].iov_base = f->buf;
+        iov[n].iov_len = f->size;
+        n++;
+
+        if(n == IOV_MAX) {
+            if(writev_all(fd, iov, n) < 0)
+                return -1;
+            n = 0;
+        }
+    }
+
+    ring_head = (ring_len > 0) ? (ring_head + ring_count) % ring_len : 0;
+    ring_count = 0;
+
+    return (n > 0) ? writev_all(fd, iov, n) : 0;
+}
+
+/******************************************************************************
+Description.: cheap motion estimation: compares the size of the compressed
+              frame against a running average, changes of the scene make
+              the JPEG size jump.
+Input Value.: size: size of the current frame
+Return Value: deviation from the average in percent
+******************************************************************************/
+static int motion_score(int size)
+{
+    static int average = 0;
+    int score;
+
+    if(average <= 0) {
+        average = size;
+        return 0;
+    }
+
+    score = ABS(size - average) * 100 / average;
+    average += (size - average) / 8;
+
+    return score;
+}
+
+/******************************************************************************
+Description.: event recording, called for each frame once it was stored in
+              the ring. A trigger opens a new clip and flushes the pre-roll,
+              following frames get appended until the post-roll expired.
+              Triggers during a recording extend the post-roll.
+Input Value.: now: arrival time of the current frame
+              counter: running number for the clip filenames
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int record_event(struct timeval *now, unsigned long long *counter)
+{
+    static struct timeval stop_time;
+    static char clipname[1024];
+    char buffer[1024 + 64];
+    int trigger, rc;
+    time_t t;
+    struct tm *tm;
+
+    pthread_mutex_lock(&event_mutex);
+    trigger = event_trigger;
+    event_trigger = 0;
+    pthread_mutex_unlock(&event_mutex);
+
+    if(motion > 0 && motion_score(ring[(ring_head + ring_count - 1) % ring_len].size) >= motion) {
+        DBG("motion detected\n");
+        trigger = 1;
+    }
+
+    if(trigger) {
+        stop_time = *now;
+        stop_time.tv_sec += postroll;
+
+        if(event_fd < 0) {
+            t = now->tv_sec;
+            if((tm = localtime(&t)) == NULL) {
+                perror("localtime");
+                return -1;
+            }
+
+            if(strftime(buffer, sizeof(buffer), "%%s/%Y_%m_%d_%H_%M_%S_event_%%09llu.mjpg", tm) == 0) {
+                OPRINT("strftime returned 0\n");
+                return -1;
+            }
+            if(snprintf(clipname, sizeof(clipname), buffer, folder, (*counter)++) >= sizeof(clipname)) {
+                OPRINT("the clip filename in %s is too long\n", folder);
+                return -1;
+            }
+
+            DBG("recording event: %s\n", clipname);
+            if((event_fd = open(clipname, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+                OPRINT("could not open the file %s\n", clipname);
+                return -1;
+            }
+        }
+    }
+
+    if(event_fd < 0)
+        return 0;
+
+    /* the pre-roll on the first call, just the current frame afterwards */
+    if(ring_flush(event_fd, now) < 0) {
+        OPRINT("could not write to file %s\n", clipname);
+        perror("writev()");
+        close(event_fd);
+        event_fd = -1;
+        return -1;
+    }
+
+    if(elapsed_ms(&stop_time, now) < 0)
+        return 0;
+
+    DBG("event recording finished: %s\n", clipname);
+    close(event_fd);
+    event_fd = -1;
+
+    /* call the command if user specified one, pass the clip as argument */
+    if(command != NULL) {
+        snprintf(buffer, sizeof(buffer), "%s \"%s\"", command, clipname);
+        if((rc = setenv("MJPG_FILE", clipname, 1)) != 0) {
+            LOG("setenv failed (return value %d)\n", rc);
+        }
+        if((rc = system(buffer)) != 0) {
+            LOG("command failed (return value %d)\n", rc);
+        }
+    }
+
+    return 0;
 }
 
 /******************************************************************************
@@ -195,6 +500,144 @@ void maintain_ringbuffer(int size)
     free(namelist);
 }
 
+/******************************************************************************
+Description.: starts the next data segment of the archive
+Input Value.: -
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int archive_next_segment(void)
+{
+    char name[1024];
+
+    if(archive_data_fd >= 0) {
+        close(archive_data_fd);
+        archive_segment++;
+    }
+
+    if(snprintf(name, sizeof(name), ARCHIVE_SEGMENT_FMT, folder, archive_segment) >= sizeof(name)) {
+        OPRINT("the archive segment filename in %s is too long\n", folder);
+        return -1;
+    }
+    DBG("starting archive segment %s\n", name);
+
+    if((archive_data_fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        OPRINT("could not open the file %s\n", name);
+        return -1;
+    }
+    archive_offset = 0;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: opens the archive index, an existing archive gets continued
+              with a fresh segment behind the last indexed one
+Input Value.: -
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int archive_open(void)
+{
+    char name[1024];
+    archive_header header;
+    archive_record last;
+    struct stat st;
+
+    if(snprintf(name, sizeof(name), ARCHIVE_INDEX_FMT, folder) >= sizeof(name)) {
+        OPRINT("the archive index filename in %s is too long\n", folder);
+        return -1;
+    }
+    if((archive_index_fd = open(name, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        OPRINT("could not open the file %s\n", name);
+        return -1;
+    }
+
+    if(fstat(archive_index_fd, &st) < 0) {
+        perror("fstat()");
+        return -1;
+    }
+
+    if(st.st_size < sizeof(header)) {
+        /* new archive, drop a partially written header */
+        if(ftruncate(archive_index_fd, 0) < 0) {
+            perror("ftruncate()");
+            return -1;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version = 1;
+        header.record_size = sizeof(archive_record);
+        if(write(archive_index_fd, &header, sizeof(header)) != sizeof(header)) {
+            perror("write()");
+            return -1;
+        }
+    } else {
+        if(pread(archive_index_fd, &header, sizeof(header), 0) != sizeof(header) ||
+           memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0 ||
+           header.record_size != sizeof(archive_record)) {
+            OPRINT("%s is not a valid archive index\n", name);
+            return -1;
+        }
+
+        /* cut a record torn by a crash, then continue behind the last one */
+        st.st_size -= (st.st_size - sizeof(header)) % sizeof(archive_record);
+        if(ftruncate(archive_index_fd, st.st_size) < 0) {
+            perror("ftruncate()");
+            return -1;
+        }
+
+        if(st.st_size > sizeof(header)) {
+            if(pread(archive_index_fd, &last, sizeof(last), st.st_size - sizeof(last)) != sizeof(last)) {
+                perror("pread()");
+                return -1;
+            }
+            archive_segment = last.segment + 1;
+            archive_last = last.timestamp;
+        }
+    }
+
+    return archive_next_segment();
+}
+
+/******************************************************************************
+Description.: appends a frame to the current segment and indexes it
+              the index uses the wall clock (CLOCK_REALTIME), the timestamps
+              of the input plugins may come from a monotonic clock
+Input Value.: buf, size: the JPEG
+              arrival: wall clock time the frame arrived at this plugin
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int archive_append(unsigned char *buf, int size, struct timeval *arrival)
+{
+    archive_record record;
+
+    if(archive_offset + size > (uint64_t)archive_size * 1024 * 1024 && archive_offset > 0) {
+        if(archive_next_segment() < 0)
+            return -1;
+    }
+
+    /* the index must stay sorted, clocks may jump backwards */
+    record.timestamp = (uint64_t)arrival->tv_sec * 1000000 + arrival->tv_usec;
+    if(record.timestamp < archive_last)
+        record.timestamp = archive_last;
+    record.offset = archive_offset;
+    record.segment = archive_segment;
+    record.size = size;
+
+    if(write(archive_data_fd, buf, size) != size) {
+        perror("write()");
+        return -1;
+    }
+    archive_offset += size;
+
+    if(write(archive_index_fd, &record, sizeof(record)) != sizeof(record)) {
+        perror("write()");
+        return -1;
+    }
+    archive_last = record.timestamp;
+
+    return 0;
+}
+
 /******************************************************************************
 Description.: this is the main worker thread
               it loops forever, grabs a fresh frame and stores it to file
@@ -208,6 +651,8 @@ void *worker_thread(void *arg)
     unsigned long long counter = 0;
     time_t t;
     struct tm *now;
+    struct timeval arrival, timestamp;
+    ring_frame *slot;
     unsigned char *tmp_framebuffer = NULL;
 
     /* set cleanup handler to cleanup allocated resources */
@@ -222,6 +667,28 @@ void *worker_thread(void *arg)
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
+        /* event recording mode, copy the frame straight into the ring */
+        if(preroll >= 0) {
+            gettimeofday(&arrival, NULL);
+            if((slot = ring_push(&arrival, frame_size)) == NULL) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                LOG("not enough memory\n");
+                break;
+            }
+
+            memcpy(slot->buf, pglobal->in[input_number].buf, frame_size);
+            timestamp = pglobal->in[input_number].timestamp;
+
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+            slot->size = jpeg_transcode(input_number, quality, &timestamp,
+                                        &slot->buf, frame_size, &slot->capacity);
+
+            if(record_event(&arrival, &counter) < 0)
+                break;
+            continue;
+        }
+
         /* check if buffer for frame is large enough, increase it if necessary */
         if(frame_size > max_frame_size) {
             DBG("increasing buffer size to %d\n", frame_size);
@@ -238,11 +705,21 @@ void *worker_thread(void *arg)
 
         /* copy frame to our local buffer now */
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        timestamp = pglobal->in[input_number].timestamp;
+        gettimeofday(&arrival, NULL);
 
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
+        frame_size = jpeg_transcode(input_number, quality, &timestamp,
+                                    &frame, frame_size, &max_frame_size);
+
+        if (archive_size > 0) { // archive with time index
+            if(archive_append(frame, frame_size, &arrival) < 0) {
+                OPRINT("could not append to the archive in %s\n", folder);
+                break;
+            }
+        } else if (mjpgFileName == NULL) { // single files with ringbuffer mode
             /* prepare filename */
             memset(buffer1, 0, sizeof(buffer1));
             memset(buffer2, 0, sizeof(buffer2));
@@ -390,6 +867,16 @@ int output_init(output_parameter *param, int id)
             {"link", required_argument, 0, 0},
             {"c", required_argument, 0, 0},
             {"command", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"buffer", required_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"after", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"motion", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"archive", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -467,6 +954,36 @@ int output_init(output_parameter *param, int id)
             DBG("case 16,17\n");
             command = strdup(optarg);
             break;
+            /* b buffer */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            preroll = atoi(optarg);
+            break;
+            /* a after */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            postroll = atoi(optarg);
+            break;
+            /* t motion */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            motion = atoi(optarg);
+            break;
+            /* r archive */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            archive_size = atoi(optarg);
+            break;
+            /* q quality */
+        case 26:
+        case 27:
+            DBG("case 26,27\n");
+            quality = atoi(optarg);
+            break;
         }
     }
 
@@ -478,7 +995,35 @@ int output_init(output_parameter *param, int id)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     OPRINT("delay after save..: %d\n", delay);
-    if  (mjpgFileName == NULL) {
+    if(quality != 0) {
+        if(quality < 1 || quality > 99) {
+            OPRINT("ERROR: the quality must be between 1 and 99\n");
+            return 1;
+        }
+        OPRINT("JPEG quality......: %d\n", quality);
+    }
+    if(archive_size > 0) {
+        if(mjpgFileName != NULL || preroll >= 0) {
+            OPRINT("ERROR: the archive can not be combined with the mjpeg or event mode\n");
+            return 1;
+        }
+        OPRINT("archive segments..: %d MB\n", archive_size);
+        if(archive_open() < 0) {
+            return 1;
+        }
+    } else if(preroll >= 0) {
+        if(mjpgFileName != NULL) {
+            OPRINT("ERROR: event recording can not be combined with the mjpeg mode\n");
+            return 1;
+        }
+        OPRINT("event pre-roll....: %d s\n", preroll);
+        OPRINT("event post-roll...: %d s\n", postroll);
+        if(motion > 0) {
+            OPRINT("motion trigger....: %d%%\n", motion);
+        } else {
+            OPRINT("motion trigger....: %s\n", "disabled");
+        }
+    } else if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
         } else {
@@ -497,9 +1042,9 @@ int output_init(output_parameter *param, int id)
         free(fnBuffer);
     }
 
-    param->global->out[id].parametercount = 2;
+    param->global->out[id].parametercount = (preroll >= 0) ? 3 : 2;
 
-    param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
+    param->global->out[id].out_parameters = (control*) calloc(3, sizeof(control));
 
     control take_ctrl;
 	take_ctrl.group = IN_CMD_GENERIC;
@@ -533,6 +1078,21 @@ int output_init(output_parameter *param, int id)
 
 	param->global->out[id].out_parameters[1] = filename_ctrl;
 
+    control record_ctrl;
+	record_ctrl.group = IN_CMD_GENERIC;
+	record_ctrl.menuitems = NULL;
+	record_ctrl.value = 1;
+	record_ctrl.class_id = 0;
+
+	record_ctrl.ctrl.id = OUT_FILE_CMD_RECORD;
+	record_ctrl.ctrl.type = V4L2_CTRL_TYPE_BUTTON;
+	strcpy((char*) record_ctrl.ctrl.name, "Record event");
+	record_ctrl.ctrl.minimum = 0;
+	record_ctrl.ctrl.maximum = 1;
+	record_ctrl.ctrl.step = 1;
+	record_ctrl.ctrl.default_value = 0;
+
+	param->global->out[id].out_parameters[2] = record_ctrl;
 
     return 0;
 }
@@ -576,6 +1136,7 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 if (valueStr != NULL) {
                                     int frame_size = 0;
                                     unsigned char *tmp_framebuffer = NULL;
+                                    struct timeval timestamp;
 
                                     if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
                                         DBG("Unable to lock mutex\n");
@@ -600,10 +1161,14 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
 
                                     /* copy frame to our local buffer now */
                                     memcpy(frame, pglobal->in[input_number].buf, frame_size);
+                                    timestamp = pglobal->in[input_number].timestamp;
 
                                     /* allow others to access the global buffer again */
                                     pthread_mutex_unlock(&pglobal->in[input_number].db);
 
+                                    frame_size = jpeg_transcode(input_number, quality, &timestamp,
+                                                                &frame, frame_size, &max_frame_size);
+
                                     DBG("writing file: %s\n", valueStr);
 
                                     int fd;
@@ -631,6 +1196,12 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
                                 DBG("Not yet implemented\n");
                                 return -1;
                             } break;
+                            case OUT_FILE_CMD_RECORD: {
+                                /* the worker thread flushes the pre-roll with the next frame */
+                                pthread_mutex_lock(&event_mutex);
+                                event_trigger = 1;
+                                pthread_mutex_unlock(&event_mutex);
+                            } break;
                             default: {
                                 DBG("Unknown command\n");
                                 return -1;
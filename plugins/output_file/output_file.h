@@ -3,5 +3,34 @@
 
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
+#define OUT_FILE_CMD_RECORD         3
+
+#include <stdint.h>
+
+/*
+ * archive format
+ *
+ * The frames are appended to data segments, each segment is a plain
+ * concatenation of JPEGs and thus also a valid MJPG file. The index is a
+ * header followed by one fixed size record per frame, sorted by timestamp.
+ * Data gets written before its index record, so every record a reader can
+ * see points to complete data.
+ */
+#define ARCHIVE_INDEX_FMT       "%s/archive.idx"
+#define ARCHIVE_SEGMENT_FMT     "%s/segment_%06u.mjpg"
+#define ARCHIVE_MAGIC           "MJPGIDX1"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} archive_header;
+
+typedef struct {
+    uint64_t timestamp;     /* arrival time, wall clock microseconds since the epoch */
+    uint64_t offset;        /* position of the JPEG inside the segment */
+    uint32_t segment;       /* segment number */
+    uint32_t size;          /* size of the JPEG */
+} archive_record;
 
 #endif
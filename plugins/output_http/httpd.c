@@ -30,12 +30,17 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 
 #include <linux/version.h>
 #include <linux/types.h>          /* for videodev2.h */
@@ -43,6 +48,9 @@
 
 #include "../../mjpg_streamer.h"
 #include "../../utils.h"
+#include "../../transcode.h"
+#include "../../latency.h"
+#include "../../sharpness.h"
 
 #include "httpd.h"
 
@@ -57,6 +65,10 @@ static globals *pglobal;
 extern context servers[MAX_OUTPUT_PLUGINS];
 int piggy_fine = 2; // FIXME make it command line parameter
 
+/* one engine per input plugin keeps its tables between the requests */
+static sharpness *sharpness_engines[MAX_INPUT_PLUGINS];
+static pthread_mutex_t sharpness_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /******************************************************************************
 Description.: initializes the iobuffer structure properly
 Input Value.: pointer to already allocated iobuffer
@@ -114,8 +126,7 @@ Return Value: * buffer.: will become filled with bytes read
 int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
 {
     int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
+    struct pollfd pfd;
 
     memset(buffer, 0, len);
 
@@ -128,12 +139,11 @@ int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
         if(copied >= len)
             return copied;
 
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
+        /* poll will return in case of timeout or new data arrived, unlike
+           select it copes with descriptors above FD_SETSIZE of many clients */
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if((rc = poll(&pfd, 1, timeout * 1000)) <= 0) {
             if(rc < 0)
                 exit(EXIT_FAILURE);
 
@@ -144,9 +154,9 @@ int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
         init_iobuffer(iobuf);
 
         /*
-         * there should be at least one byte, because select signalled it.
+         * there should be at least one byte, because poll signalled it.
          * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
+         * the poll() and the following read. That is the reason for not relying
          * on reading at least one byte.
          */
         if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
@@ -402,19 +412,21 @@ Return Value: -
 void send_snapshot(cfd *context_fd, int input_number)
 {
     unsigned char *frame = NULL;
-    int frame_size = 0;
+    int frame_size = 0, max_frame_size = 0;
     char buffer[BUFFER_SIZE] = {0};
     struct timeval timestamp;
+    long long captured;
 
     /* wait for a fresh frame */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
+    metric_lock(&pglobal->in[input_number].db, context_fd->pc->lock_wait);
     pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
     /* read buffer */
     frame_size = pglobal->in[input_number].size;
 
     /* allocate a buffer for this single frame */
-    if((frame = malloc(frame_size + 1)) == NULL) {
+    max_frame_size = frame_size + 1;
+    if((frame = malloc(max_frame_size)) == NULL) {
         free(frame);
         pthread_mutex_unlock(&pglobal->in[input_number].db);
         send_error(context_fd->fd, 500, "not enough memory");
@@ -422,11 +434,16 @@ void send_snapshot(cfd *context_fd, int input_number)
     }
     /* copy v4l2_buffer timeval to user space */
     timestamp = pglobal->in[input_number].timestamp;
+    captured = pglobal->in[input_number].captured;
 
     memcpy(frame, pglobal->in[input_number].buf, frame_size);
     DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
     pthread_mutex_unlock(&pglobal->in[input_number].db);
+    latency_trace(input_number, captured, LATENCY_COPY);
+
+    frame_size = jpeg_transcode(input_number, context_fd->pc->conf.quality, &timestamp,
+                                &frame, frame_size, &max_frame_size);
 
     #ifdef MANAGMENT
     update_client_timestamp(context_fd->client);
@@ -446,10 +463,35 @@ void send_snapshot(cfd *context_fd, int input_number)
         free(frame);
         return;
     }
+    latency_trace(input_number, captured, LATENCY_WRITE);
+    metric_add(context_fd->pc->frames_sent, 1);
+    metric_add(context_fd->pc->bytes_sent, strlen(buffer) + frame_size);
 
     free(frame);
 }
 
+/* what a streaming client holds, released by stream_cleanup */
+typedef struct {
+    metric *frames, *bytes;
+    unsigned char **frame;
+} stream_client;
+
+/******************************************************************************
+Description.: releases the per client metrics and the frame buffer of a
+              stream, also if the client thread gets cancelled
+Input Value.: arg: the stream_client
+Return Value: -
+******************************************************************************/
+static void stream_cleanup(void *arg)
+{
+    stream_client *client = arg;
+
+    metric_unregister(client->frames);
+    metric_unregister(client->bytes);
+    free(*client->frame);
+    *client->frame = NULL;
+}
+
 /******************************************************************************
 Description.: Send a complete HTTP response and a stream of JPG-frames.
 Input Value.: fildescriptor fd to send the answer to
@@ -461,6 +503,12 @@ void send_stream(cfd *context_fd, int input_number)
     int frame_size = 0, max_frame_size = 0;
     char buffer[BUFFER_SIZE] = {0};
     struct timeval timestamp;
+    long long captured;
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    char host[NI_MAXHOST], port[NI_MAXSERV];
+    stream_client client = { NULL, NULL, &frame };
+    int header_size;
 
     DBG("preparing header\n");
     sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
@@ -477,10 +525,25 @@ void send_stream(cfd *context_fd, int input_number)
 
     DBG("Headers send, sending stream now\n");
 
+    /* the frames and bytes sent to this client */
+    if(getpeername(context_fd->fd, (struct sockaddr *)&peer, &peer_len) != 0 ||
+       getnameinfo((struct sockaddr *)&peer, peer_len, host, sizeof(host), port, sizeof(port),
+                   NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(host, sizeof(host), "unknown");
+        snprintf(port, sizeof(port), "%d", context_fd->fd);
+    }
+    client.frames = metric_register("mjpg_http_client_frames_sent_total", "Frames sent to a streaming client",
+                                    METRIC_COUNTER, 1, "output=\"%d\",client=\"%s:%s\"",
+                                    context_fd->pc->id, host, port);
+    client.bytes = metric_register("mjpg_http_client_bytes_sent_total", "Bytes sent to a streaming client",
+                                   METRIC_COUNTER, 1, "output=\"%d\",client=\"%s:%s\"",
+                                   context_fd->pc->id, host, port);
+    pthread_cleanup_push(stream_cleanup, &client);
+
     while(!pglobal->stop) {
 
         /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
+        metric_lock(&pglobal->in[input_number].db, context_fd->pc->lock_wait);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
@@ -492,10 +555,9 @@ void send_stream(cfd *context_fd, int input_number)
 
             max_frame_size = frame_size + TEN_K;
             if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
                 pthread_mutex_unlock(&pglobal->in[input_number].db);
                 send_error(context_fd->fd, 500, "not enough memory");
-                return;
+                break;
             }
 
             frame = tmp;
@@ -503,11 +565,16 @@ void send_stream(cfd *context_fd, int input_number)
 
         /* copy v4l2_buffer timeval to user space */
         timestamp = pglobal->in[input_number].timestamp;
+        captured = pglobal->in[input_number].captured;
 
         memcpy(frame, pglobal->in[input_number].buf, frame_size);
         DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
+        latency_trace(input_number, captured, LATENCY_COPY);
+
+        frame_size = jpeg_transcode(input_number, context_fd->pc->conf.quality, &timestamp,
+                                    &frame, frame_size, &max_frame_size);
 
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
@@ -522,18 +589,292 @@ void send_stream(cfd *context_fd, int input_number)
                 "Content-Length: %d\r\n" \
                 "X-Timestamp: %d.%06d\r\n" \
                 "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
+        header_size = strlen(buffer);
         DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        if(write(context_fd->fd, buffer, header_size) < 0) break;
 
         DBG("sending frame\n");
         if(write(context_fd->fd, frame, frame_size) < 0) break;
+        latency_trace(input_number, captured, LATENCY_WRITE);
 
         DBG("sending boundary\n");
         sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
         if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+
+        metric_add(context_fd->pc->frames_sent, 1);
+        metric_add(context_fd->pc->bytes_sent, header_size + frame_size + strlen(buffer));
+        metric_add(client.frames, 1);
+        metric_add(client.bytes, header_size + frame_size + strlen(buffer));
     }
 
-    free(frame);
+    pthread_cleanup_pop(1);
+}
+
+/******************************************************************************
+Description.: Parse a point in time, either seconds since the epoch or local
+              time as "YYYY-MM-DDTHH:MM:SS", both with optional fraction.
+Input Value.: string to parse, parsing stops at the first unknown character
+Return Value: microseconds since the epoch
+******************************************************************************/
+static uint64_t parse_archive_time(char *string)
+{
+    struct tm tm;
+    char *rest;
+    double fraction = 0;
+
+    memset(&tm, 0, sizeof(tm));
+    if((rest = strptime(string, "%Y-%m-%dT%H:%M:%S", &tm)) != NULL) {
+        tm.tm_isdst = -1;
+        if(*rest == '.')
+            fraction = strtod(rest, NULL);
+        return (uint64_t)mktime(&tm) * 1000000 + (uint64_t)(fraction * 1000000);
+    }
+
+    return (uint64_t)(strtod(string, NULL) * 1000000);
+}
+
+/******************************************************************************
+Description.: (Re)map the index of an archive written by output_file. The
+              index only grows, remapping makes new records visible.
+Input Value.: * folder.: the archive folder
+              * map....: current mapping or NULL, gets replaced
+              * maplen.: length of the mapping
+Return Value: number of records, -1 in case of error
+******************************************************************************/
+static long archive_map(char *folder, void **map, size_t *maplen)
+{
+    char name[BUFFER_SIZE];
+    archive_header *header;
+    struct stat st;
+    int fd;
+
+    if(*map != NULL) {
+        munmap(*map, *maplen);
+        *map = NULL;
+    }
+
+    snprintf(name, sizeof(name), ARCHIVE_INDEX_FMT, folder);
+    if((fd = open(name, O_RDONLY)) < 0) {
+        DBG("archive index %s not accessible\n", name);
+        return -1;
+    }
+
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(archive_header)) {
+        close(fd);
+        return -1;
+    }
+
+    *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(*map == MAP_FAILED) {
+        *map = NULL;
+        return -1;
+    }
+    *maplen = st.st_size;
+
+    header = *map;
+    if(memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0 ||
+       header->record_size != sizeof(archive_record)) {
+        DBG("%s is not a valid archive index\n", name);
+        munmap(*map, *maplen);
+        *map = NULL;
+        return -1;
+    }
+
+    return (st.st_size - sizeof(archive_header)) / sizeof(archive_record);
+}
+
+/******************************************************************************
+Description.: binary search for the first record not older than t
+Input Value.: records, count: the mapped index
+              t: point in time in microseconds
+Return Value: index of the record, count if all records are older
+******************************************************************************/
+static long archive_find(archive_record *records, long count, uint64_t t)
+{
+    long low = 0, high = count, mid;
+
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(records[mid].timestamp < t)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/******************************************************************************
+Description.: Send the JPEG of an archive record directly from the segment
+              file to the socket. The segment stays open for the next call.
+Input Value.: * fd.........: socket to send the frame to
+              * folder.....: the archive folder
+              * record.....: index record of the frame
+              * segment_fd.: open segment or -1
+              * segment....: number of the open segment
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int archive_sendfile(int fd, char *folder, archive_record *record, int *segment_fd, uint32_t *segment)
+{
+    char name[BUFFER_SIZE];
+    off_t offset = record->offset;
+    size_t left = record->size;
+    ssize_t rc;
+
+    if(*segment_fd < 0 || *segment != record->segment) {
+        if(*segment_fd >= 0)
+            close(*segment_fd);
+
+        snprintf(name, sizeof(name), ARCHIVE_SEGMENT_FMT, folder, record->segment);
+        if((*segment_fd = open(name, O_RDONLY)) < 0) {
+            DBG("archive segment %s not accessible\n", name);
+            return -1;
+        }
+        *segment = record->segment;
+    }
+
+    while(left > 0) {
+        if((rc = sendfile(fd, *segment_fd, &offset, left)) <= 0) {
+            if(rc < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= rc;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Serve frames of the archive configured with --archive.
+              "t" selects the frame closest to that time. If "end" or
+              "speed" are given, the frames from "t" on are sent as stream,
+              paced by their timestamps. Without "end" the stream follows
+              the archive as it grows, "speed=0" disables the pacing.
+Input Value.: * context_fd: the client connection
+              * parameter.: the query string after "?action=archive"
+Return Value: -
+******************************************************************************/
+void send_archive(cfd *context_fd, char *parameter)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    char *folder = context_fd->pc->conf.archive_folder;
+    char *t, *end_str, *speed_str;
+    void *map = NULL;
+    size_t maplen = 0;
+    archive_record *records, *r;
+    long count, i;
+    uint64_t start, end = UINT64_MAX, first = 0;
+    int64_t due, elapsed;
+    double speed = 1;
+    int segment_fd = -1;
+    uint32_t segment = 0;
+    struct timeval begin, now;
+
+    if(folder == NULL) {
+        send_error(context_fd->fd, 501, "no archive configured");
+        return;
+    }
+
+    if(parameter == NULL || (t = strstr(parameter, "&t=")) == NULL) {
+        send_error(context_fd->fd, 400, "no GET variable \"t=...\" found");
+        return;
+    }
+    start = parse_archive_time(t + strlen("&t="));
+
+    if((end_str = strstr(parameter, "&end=")) != NULL)
+        end = parse_archive_time(end_str + strlen("&end="));
+    if((speed_str = strstr(parameter, "&speed=")) != NULL)
+        speed = strtod(speed_str + strlen("&speed="), NULL);
+
+    if((count = archive_map(folder, &map, &maplen)) <= 0) {
+        if(map != NULL)
+            munmap(map, maplen);
+        send_error(context_fd->fd, 404, "archive is empty or not accessible");
+        return;
+    }
+    records = (archive_record *)((char *)map + sizeof(archive_header));
+    i = archive_find(records, count, start);
+
+    /* a single frame, the closest one */
+    if(end_str == NULL && speed_str == NULL) {
+        if(i == count || (i > 0 && start - records[i - 1].timestamp < records[i].timestamp - start))
+            i--;
+        r = &records[i];
+
+        sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+                "Access-Control-Allow-Origin: *\r\n" \
+                STD_HEADER \
+                "Content-type: image/jpeg\r\n" \
+                "Content-Length: %u\r\n" \
+                "X-Timestamp: %d.%06d\r\n" \
+                "\r\n", r->size, (int)(r->timestamp / 1000000), (int)(r->timestamp % 1000000));
+
+        if(write(context_fd->fd, buffer, strlen(buffer)) >= 0)
+            archive_sendfile(context_fd->fd, folder, r, &segment_fd, &segment);
+
+        if(segment_fd >= 0)
+            close(segment_fd);
+        munmap(map, maplen);
+        return;
+    }
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Access-Control-Allow-Origin: *\r\n" \
+            STD_HEADER \
+            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+            "\r\n" \
+            "--" BOUNDARY "\r\n");
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+        munmap(map, maplen);
+        return;
+    }
+
+    while(!pglobal->stop) {
+        if(i >= count) {
+            /* follow the archive while it is written */
+            if((count = archive_map(folder, &map, &maplen)) < 0)
+                break;
+            records = (archive_record *)((char *)map + sizeof(archive_header));
+            if(i >= count)
+                usleep(100 * 1000);
+            continue;
+        }
+
+        r = &records[i++];
+        if(r->timestamp > end)
+            break;
+
+        /* pace the frames by their recorded timestamps */
+        if(first == 0) {
+            first = r->timestamp;
+            gettimeofday(&begin, NULL);
+        } else if(speed > 0) {
+            gettimeofday(&now, NULL);
+            due = (int64_t)((r->timestamp - first) / speed);
+            elapsed = (int64_t)(now.tv_sec - begin.tv_sec) * 1000000 + (now.tv_usec - begin.tv_usec);
+            if(due > elapsed)
+                usleep(due - elapsed);
+        }
+
+        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
+                "Content-Length: %u\r\n" \
+                "X-Timestamp: %d.%06d\r\n" \
+                "\r\n", r->size, (int)(r->timestamp / 1000000), (int)(r->timestamp % 1000000));
+        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+
+        if(archive_sendfile(context_fd->fd, folder, r, &segment_fd, &segment) < 0) break;
+
+        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
+        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+    }
+
+    if(segment_fd >= 0)
+        close(segment_fd);
+    if(map != NULL)
+        munmap(map, maplen);
 }
 
 #ifdef WXP_COMPAT
@@ -548,6 +889,7 @@ void send_stream_wxp(cfd *context_fd, int input_number)
     int frame_size = 0, max_frame_size = 0;
     char buffer[BUFFER_SIZE] = {0};
     struct timeval timestamp;
+    long long captured;
 
     DBG("preparing header\n");
 
@@ -583,7 +925,7 @@ void send_stream_wxp(cfd *context_fd, int input_number)
     while(!pglobal->stop) {
 
         /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
+        metric_lock(&pglobal->in[input_number].db, context_fd->pc->lock_wait);
         pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
 
         /* read buffer */
@@ -606,6 +948,7 @@ void send_stream_wxp(cfd *context_fd, int input_number)
 
         /* copy v4l2_buffer timeval to user space */
         timestamp = pglobal->in[input_number].timestamp;
+        captured = pglobal->in[input_number].captured;
 
         #ifdef MANAGMENT
         update_client_timestamp(context_fd->client);
@@ -615,6 +958,10 @@ void send_stream_wxp(cfd *context_fd, int input_number)
         DBG("got frame (size: %d kB)\n", frame_size / 1024);
 
         pthread_mutex_unlock(&pglobal->in[input_number].db);
+        latency_trace(input_number, captured, LATENCY_COPY);
+
+        frame_size = jpeg_transcode(input_number, context_fd->pc->conf.quality, &timestamp,
+                                    &frame, frame_size, &max_frame_size);
 
         memset(buffer, 0, 50*sizeof(char));
         sprintf(buffer, "mjpeg %07d12345", frame_size);
@@ -623,6 +970,9 @@ void send_stream_wxp(cfd *context_fd, int input_number)
 
         DBG("sending frame\n");
         if(write(context_fd->fd, frame, frame_size) < 0) break;
+        latency_trace(input_number, captured, LATENCY_WRITE);
+        metric_add(context_fd->pc->frames_sent, 1);
+        metric_add(context_fd->pc->bytes_sent, 50 + frame_size);
     }
 
     free(frame);
@@ -1033,10 +1383,10 @@ Input Value.: arg is the filedescriptor and server-context of the connected TCP
 Return Value: always NULL
 ******************************************************************************/
 /* thread for clients that connected to this server */
-void *client_thread(void *arg)
+static void *serve_client(void *arg)
 {
     int cnt;
-    char query_suffixed = 0;
+    char query_suffixed = 0, suffix_invalid = 0;
     int input_number = 0;
     char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
     iobuffer iobuf;
@@ -1154,6 +1504,65 @@ void *client_thread(void *arg)
             close(lcfd.fd);
             return NULL;
         }
+    } else if(strstr(buffer, "GET /?action=archive") != NULL) {
+        int len;
+        req.type = A_ARCHIVE;
+
+        /* advance by the length of known string */
+        if((pb = strstr(buffer, "GET /?action=archive")) == NULL) {
+            DBG("HTTP request seems to be malformed\n");
+            send_error(lcfd.fd, 400, "Malformed HTTP request");
+            close(lcfd.fd);
+            return NULL;
+        }
+        pb += strlen("GET /?action=archive");
+
+        /* only accept certain characters */
+        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./:"), 0), 100);
+        req.parameter = malloc(len + 1);
+        if(req.parameter == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        memset(req.parameter, 0, len + 1);
+        strncpy(req.parameter, pb, len);
+
+        if(unescape(req.parameter) == -1) {
+            free(req.parameter);
+            send_error(lcfd.fd, 500, "could not properly unescape archive parameter string");
+            LOG("could not properly unescape archive parameter string\n");
+            close(lcfd.fd);
+            return NULL;
+        }
+    } else if(strstr(buffer, "GET /?action=sharpness") != NULL) {
+        int len;
+        req.type = A_SHARPNESS;
+        query_suffixed = 255;
+
+        /* advance by the length of known string */
+        if((pb = strstr(buffer, "GET /?action=sharpness")) == NULL) {
+            DBG("HTTP request seems to be malformed\n");
+            send_error(lcfd.fd, 400, "Malformed HTTP request");
+            close(lcfd.fd);
+            return NULL;
+        }
+        pb += strlen("GET /?action=sharpness");
+
+        /* only accept certain characters */
+        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%.,"), 0), 100);
+        req.parameter = malloc(len + 1);
+        if(req.parameter == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        memset(req.parameter, 0, len + 1);
+        strncpy(req.parameter, pb, len);
+
+        if(unescape(req.parameter) == -1) {
+            free(req.parameter);
+            send_error(lcfd.fd, 500, "could not properly unescape sharpness parameter string");
+            LOG("could not properly unescape sharpness parameter string\n");
+            close(lcfd.fd);
+            return NULL;
+        }
     } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
         req.type = A_INPUT_JSON;
         query_suffixed = 255;
@@ -1162,6 +1571,10 @@ void *client_thread(void *arg)
         query_suffixed = 255;
     } else if(strstr(buffer, "GET /program.json") != NULL) {
         req.type = A_PROGRAM_JSON;
+    } else if(strstr(buffer, "GET /?action=latency") != NULL) {
+        req.type = A_LATENCY;
+    } else if(strstr(buffer, "GET /metrics") != NULL) {
+        req.type = A_METRICS;
     #ifdef MANAGMENT
     } else if(strstr(buffer, "GET /clients.json") != NULL) {
         req.type = A_CLIENTS_JSON;
@@ -1251,11 +1664,17 @@ void *client_thread(void *arg)
     if(query_suffixed) {
         char *sch = strchr(buffer, '_');
         if(sch != NULL) {  // there is an _ in the url so the input number should be present
-            DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
+            char *end;
+            long number;
+
+            DBG("Suffix character: %s\n", sch + 1);
+            errno = 0;
+            number = strtol(sch + 1, &end, 10);
+            if(end == sch + 1 || errno != 0 || number < INT_MIN || number > INT_MAX) {
+                suffix_invalid = 1;
+            } else {
+                input_number = number;
+            }
 
             if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
                 input_number--;
@@ -1299,16 +1718,20 @@ void *client_thread(void *arg)
         DBG("access granted\n");
     }
 
-    /* now it's time to answer */
+    /* now it's time to answer, the plugin number is checked before it indexes anything */
     if (query_suffixed) {
-        if (req.type == A_OUTPUT_JSON) {
-            if(!(input_number < pglobal->outcnt)) {
+        if (suffix_invalid) {
+            DBG("invalid plugin number suffix\n");
+            send_error(lcfd.fd, 400, "Invalid plugin number");
+            req.type = A_UNKNOWN;
+        } else if (req.type == A_OUTPUT_JSON) {
+            if(input_number < 0 || input_number >= pglobal->outcnt) {
                 DBG("Output number: %d out of range (valid: 0..%d)\n", input_number, pglobal->outcnt-1);
                 send_error(lcfd.fd, 404, "Invalid output plugin number");
                 req.type = A_UNKNOWN;
             }
         } else {
-            if(!(input_number < pglobal->incnt)) {
+            if(input_number < 0 || input_number >= pglobal->incnt) {
                 DBG("Input number: %d out of range (valid: 0..%d)\n", input_number, pglobal->incnt-1);
                 send_error(lcfd.fd, 404, "Invalid input plugin number");
                 req.type = A_UNKNOWN;
@@ -1351,6 +1774,22 @@ void *client_thread(void *arg)
         DBG("Request for the program descriptor JSON file\n");
         send_program_JSON(lcfd.fd);
         break;
+    case A_ARCHIVE:
+        DBG("Request for archived frames: %s\n", req.parameter);
+        send_archive(&lcfd, req.parameter);
+        break;
+    case A_LATENCY:
+        DBG("Request for the latency histograms\n");
+        send_latency_JSON(lcfd.fd);
+        break;
+    case A_METRICS:
+        DBG("Request for the metrics\n");
+        send_metrics(lcfd.fd);
+        break;
+    case A_SHARPNESS:
+        DBG("Request for the sharpness of input: %d\n", input_number);
+        send_sharpness_JSON(&lcfd, input_number, req.parameter);
+        break;
     #ifdef MANAGMENT
     case A_CLIENTS_JSON:
         DBG("Request for the clients JSON file\n");
@@ -1426,6 +1865,26 @@ void *client_thread(void *arg)
     return NULL;
 }
 
+/******************************************************************************
+Description.: counts the connected clients around serve_client()
+Input Value.: see serve_client()
+Return Value: always NULL
+******************************************************************************/
+void *client_thread(void *arg)
+{
+    context *pc = (arg != NULL) ? ((cfd *)arg)->pc : NULL;
+
+    if(pc != NULL)
+        metric_add(pc->clients, 1);
+
+    serve_client(arg);
+
+    if(pc != NULL)
+        metric_add(pc->clients, -1);
+
+    return NULL;
+}
+
 /******************************************************************************
 Description.: This function cleans up resources allocated by the server_thread
 Input Value.: arg is not used
@@ -1578,6 +2037,7 @@ void *server_thread(void *arg)
             if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
                 pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
                 pcfd->pc = pcontext;
+                metric_add(pcontext->connections, 1);
 
                 /* start new thread that will handle this TCP connected client */
                 DBG("create thread to handle client that just established a connection\n");
@@ -2030,6 +2490,186 @@ void send_output_JSON(int fd, int input_number)
     }
 }
 
+/******************************************************************************
+Description.: Send the latency histograms of the frames as JSON, the time
+              from the capture of a frame to each trace point in us
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_latency_JSON(int fd)
+{
+    char header[BUFFER_SIZE];
+    char *text = NULL, *tmp;
+    int size = BUFFER_SIZE * 8, length;
+
+    DBG("Serving the latency JSON file\n");
+
+    /* inputs and stages may get traced while formatting, so retry until
+       the buffer was large enough */
+    do {
+        size *= 2;
+        if((tmp = realloc(text, size)) == NULL) {
+            free(text);
+            send_error(fd, 500, "not enough memory");
+            return;
+        }
+        text = tmp;
+        length = latency_json(text, size);
+    } while(length >= size);
+
+    sprintf(header, "HTTP/1.0 200 OK\r\n" \
+            "Content-type: %s\r\n" \
+            STD_HEADER \
+            "\r\n", "application/json");
+
+    if(write(fd, header, strlen(header)) < 0 || write(fd, text, length) < 0) {
+        DBG("unable to serve the latency JSON file\n");
+    }
+
+    free(text);
+}
+
+/******************************************************************************
+Description.: Send the sharpness of the next frame of an input plugin as JSON,
+              the region of interest may be given as "&roi=x,y,width,height"
+              in fractions of the frame
+Input Value.: * context_fd: the context of the connection
+              * input_number: the input plugin
+              * parameter: the rest of the query string
+Return Value: -
+******************************************************************************/
+void send_sharpness_JSON(cfd *context_fd, int input_number, char *parameter)
+{
+    char buffer[BUFFER_SIZE] = {0};
+    unsigned char *frame = NULL;
+    int frame_size = 0, length;
+    struct timeval timestamp;
+    sharpness_roi roi = { 0.0, 0.0, 1.0, 1.0 };
+    sharpness_info info;
+    sharpness *engine;
+    long long start, duration;
+    double value;
+    char *roi_str;
+
+    if(parameter != NULL && (roi_str = strstr(parameter, "&roi=")) != NULL) {
+        roi_str += strlen("&roi=");
+        if((length = strcspn(roi_str, "&")) >= 64) {
+            send_error(context_fd->fd, 400, "invalid region of interest");
+            return;
+        }
+        memcpy(buffer, roi_str, length);
+        buffer[length] = '\0';
+        if(sharpness_parse_roi(buffer, &roi) < 0) {
+            send_error(context_fd->fd, 400, "invalid region of interest");
+            return;
+        }
+    }
+
+    /* wait for a fresh frame */
+    metric_lock(&pglobal->in[input_number].db, context_fd->pc->lock_wait);
+    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+
+    frame_size = pglobal->in[input_number].size;
+    if((frame = malloc(frame_size)) == NULL) {
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        send_error(context_fd->fd, 500, "not enough memory");
+        return;
+    }
+    timestamp = pglobal->in[input_number].timestamp;
+    memcpy(frame, pglobal->in[input_number].buf, frame_size);
+
+    pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+    pthread_mutex_lock(&sharpness_mutex);
+    if(sharpness_engines[input_number] == NULL)
+        sharpness_engines[input_number] = sharpness_new();
+    if((engine = sharpness_engines[input_number]) == NULL) {
+        pthread_mutex_unlock(&sharpness_mutex);
+        free(frame);
+        send_error(context_fd->fd, 500, "not enough memory");
+        return;
+    }
+
+    start = metric_now();
+    value = sharpness_measure(engine, frame, frame_size, &roi, &info);
+    duration = metric_now() - start;
+    if(value < 0) {
+        snprintf(buffer, sizeof(buffer), "unable to measure the sharpness: %s", sharpness_error(engine));
+        pthread_mutex_unlock(&sharpness_mutex);
+        free(frame);
+        send_error(context_fd->fd, 500, buffer);
+        return;
+    }
+    pthread_mutex_unlock(&sharpness_mutex);
+    free(frame);
+
+    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
+            "Content-type: %s\r\n" \
+            STD_HEADER \
+            "\r\n", "application/json");
+
+    length = strlen(buffer);
+    snprintf(buffer + length, sizeof(buffer) - length,
+             "{\n"
+             "\"input\": %d,\n"
+             "\"timestamp\": %ld.%06ld,\n"
+             "\"sharpness\": %.3f,\n"
+             "\"width\": %d,\n"
+             "\"height\": %d,\n"
+             "\"roi\": [%g, %g, %g, %g],\n"
+             "\"blocks\": %d,\n"
+             "\"mcus\": %d,\n"
+             "\"mcus_decoded\": %d,\n"
+             "\"table_builds\": %d,\n"
+             "\"time_us\": %lld\n"
+             "}\n",
+             input_number, (long)timestamp.tv_sec, (long)timestamp.tv_usec, value,
+             info.width, info.height, roi.x, roi.y, roi.width, roi.height,
+             info.blocks, info.mcus, info.mcus_decoded, info.table_builds, duration);
+
+    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
+        DBG("unable to serve the sharpness JSON file\n");
+    }
+}
+
+/******************************************************************************
+Description.: Send the metrics of all plugins in the Prometheus text format
+Input Value.: fildescriptor fd to send the answer to
+Return Value: -
+******************************************************************************/
+void send_metrics(int fd)
+{
+    char header[BUFFER_SIZE];
+    char *text = NULL, *tmp;
+    int size = BUFFER_SIZE * 16, length;
+
+    DBG("Serving the metrics\n");
+
+    /* the metrics of clients may come and go while formatting, so retry
+       until the buffer was large enough */
+    do {
+        size *= 2;
+        if((tmp = realloc(text, size)) == NULL) {
+            free(text);
+            send_error(fd, 500, "not enough memory");
+            return;
+        }
+        text = tmp;
+        length = metrics_text(text, size);
+    } while(length >= size);
+
+    sprintf(header, "HTTP/1.0 200 OK\r\n" \
+            "Content-type: %s\r\n" \
+            STD_HEADER \
+            "\r\n", "text/plain; version=0.0.4");
+
+    if(write(fd, header, strlen(header)) < 0 || write(fd, text, length) < 0) {
+        DBG("unable to serve the metrics\n");
+    }
+
+    free(text);
+}
+
 #ifdef MANAGMENT
 void send_clients_JSON(int fd)
 {
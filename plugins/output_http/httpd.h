@@ -94,6 +94,10 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_ARCHIVE,
+    A_LATENCY,
+    A_METRICS,
+    A_SHARPNESS,
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
@@ -123,7 +127,9 @@ typedef struct {
     char *hostname;
     char *credentials;
     char *www_folder;
+    char *archive_folder;
     char nocommands;
+    int quality;            /* requantize frames to this JPEG quality, 0 = off */
 } config;
 
 /* context of each server thread */
@@ -135,6 +141,13 @@ typedef struct {
     pthread_t threadID;
 
     config conf;
+
+    /* exposed at /metrics */
+    metric *connections;    /* accepted so far */
+    metric *clients;        /* connected now */
+    metric *frames_sent;
+    metric *bytes_sent;
+    metric *lock_wait;      /* us client threads waited for the frame lock */
 } context;
 
 
@@ -171,11 +184,18 @@ typedef struct {
 
 
 /* prototypes */
+void init_iobuffer(iobuffer *iobuf);
+int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout);
+int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout);
 void *server_thread(void *arg);
 void send_error(int fd, int which, char *message);
 void send_output_JSON(int fd, int plugin_number);
 void send_input_JSON(int fd, int plugin_number);
 void send_program_JSON(int fd);
+void send_latency_JSON(int fd);
+void send_metrics(int fd);
+void send_sharpness_JSON(cfd *context_fd, int input_number, char *parameter);
+void send_archive(cfd *context_fd, char *parameter);
 void check_JSON_string(char *source, char *destination);
 
 #ifdef MANAGMENT
@@ -64,6 +64,9 @@ void help(void)
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            " [-a | --archive ].......: folder of an output_file archive to serve\n"
+            " [-q | --quality ].......: lower the JPEG quality of streams and snapshots\n"
+            "                           to 1..99 by requantizing the frames\n"
             " ---------------------------------------------------------------\n");
 }
 
@@ -81,8 +84,9 @@ int output_init(output_parameter *param, int id)
 {
     int i;
     int  port;
-    char *credentials, *www_folder, *hostname = NULL;
+    char *credentials, *www_folder, *archive_folder = NULL, *hostname = NULL;
     char nocommands;
+    int quality = 0;
 
     DBG("output #%02d\n", param->id);
 
@@ -115,6 +119,10 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"archive", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"quality", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -175,6 +183,26 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* a, archive */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            archive_folder = strdup(optarg);
+            if(archive_folder[strlen(archive_folder)-1] == '/')
+                archive_folder[strlen(archive_folder)-1] = '\0';
+            break;
+
+            /* q, quality */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            quality = atoi(optarg);
+            if(quality < 1 || quality > 99) {
+                OPRINT("quality must be between 1 and 99\n");
+                return 1;
+            }
+            break;
         }
     }
 
@@ -184,13 +212,32 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.hostname = hostname;
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
+    servers[param->id].conf.archive_folder = archive_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.quality = quality;
+
+    servers[param->id].connections = metric_register("mjpg_http_connections_total",
+            "Connections accepted", METRIC_COUNTER, 1, "output=\"%d\"", param->id);
+    servers[param->id].clients = metric_register("mjpg_http_clients",
+            "Clients connected", METRIC_GAUGE, 1, "output=\"%d\"", param->id);
+    servers[param->id].frames_sent = metric_register("mjpg_http_frames_sent_total",
+            "Frames sent to all clients", METRIC_COUNTER, 1, "output=\"%d\"", param->id);
+    servers[param->id].bytes_sent = metric_register("mjpg_http_bytes_sent_total",
+            "Bytes of frames sent to all clients", METRIC_COUNTER, 1, "output=\"%d\"", param->id);
+    servers[param->id].lock_wait = metric_register("mjpg_http_lock_wait_seconds_total",
+            "Time client threads waited for the frame lock", METRIC_COUNTER, 1e-6, "output=\"%d\"", param->id);
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("archive..............: %s\n", (archive_folder == NULL) ? "disabled" : archive_folder);
+    if(quality) {
+        OPRINT("JPEG quality.........: %d\n", quality);
+    } else {
+        OPRINT("JPEG quality.........: %s\n", "unchanged");
+    }
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
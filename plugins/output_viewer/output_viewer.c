@@ -26,9 +26,12 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <syslog.h>
+#include <setjmp.h>
+#include <time.h>
 
 #include <SDL/SDL.h>
 #include <jpeglib.h>
+#include <jerror.h>
 
 
 #include "../../utils.h"
@@ -36,10 +39,48 @@
 
 #define OUTPUT_PLUGIN_NAME "VIEWER output plugin"
 
-static pthread_t worker;
+/*
+ * Two threads: the grabber copies every frame of the input plugin into the
+ * "pending" buffer, the renderer takes whatever is pending when it is done
+ * with the last frame. A slow display thus skips frames instead of falling
+ * behind. The renderer owns the SDL window, decodes the JPEG straight into
+ * YUV planes and shows them as overlay, there is no RGB conversion.
+ */
+typedef struct {
+    unsigned char *buf;
+    int size;
+    int capacity;
+} frame_buffer;
+
+typedef struct {
+    int width;
+    int height;
+    int chroma_width;
+    int chroma_height;
+    /* Y, U and V planes without padding, IYUV layout */
+    unsigned char *plane[3];
+    int capacity;
+} yuv_image;
+
+static pthread_t grabber, renderer;
 static globals *pglobal;
-static unsigned char *frame = NULL;
 static int input_number = 0;
+static int stats_interval = 0;
+
+static pthread_mutex_t viewer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t viewer_update = PTHREAD_COND_INITIALIZER;
+static frame_buffer pending = { NULL, 0, 0 }, current = { NULL, 0, 0 };
+static unsigned long pending_seq = 0;
+static int stopping = 0;
+
+static SDL_Surface *screen = NULL;
+static SDL_Overlay *overlay = NULL;
+
+/* timings, reset with every report */
+static struct {
+    unsigned long shown, skipped, failed;
+    double decode_sum, decode_max, render_sum, render_max;
+} stats;
 
 /******************************************************************************
 Description.: print a help message
@@ -50,11 +91,16 @@ void help(void)
 {
     fprintf(stderr, " ---------------------------------------------------------------\n" \
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
+            " ---------------------------------------------------------------\n" \
+            " The following parameters can be passed to this plugin:\n\n" \
+            " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-s | --stats ].........: report decode and render times every n seconds\n" \
             " ---------------------------------------------------------------\n");
 }
 
 /******************************************************************************
-Description.: clean up allocated resources
+Description.: clean up allocated resources of the renderer, SDL must be shut
+              down by the thread that uses it
 Input Value.: unused argument
 Return Value: -
 ******************************************************************************/
@@ -70,7 +116,10 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
+    if(overlay != NULL)
+        SDL_FreeYUVOverlay(overlay);
+    overlay = NULL;
+    screen = NULL;
     SDL_Quit();
 }
 
@@ -81,6 +130,11 @@ typedef struct {
     int jpegsize;
 } my_source_mgr;
 
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} my_error_mgr;
+
 static void init_source(j_decompress_ptr cinfo)
 {
     return;
@@ -88,10 +142,12 @@ static void init_source(j_decompress_ptr cinfo)
 
 static int fill_input_buffer(j_decompress_ptr cinfo)
 {
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
     my_source_mgr * src = (my_source_mgr *) cinfo->src;
 
-    src->pub.next_input_byte = src->jpegdata;
-    src->pub.bytes_in_buffer = src->jpegsize;
+    /* the frame is truncated, end it to let libjpeg finish */
+    src->pub.next_input_byte = eoi;
+    src->pub.bytes_in_buffer = 2;
 
     return TRUE;
 }
@@ -100,6 +156,11 @@ static void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
 {
     my_source_mgr * src = (my_source_mgr *) cinfo->src;
 
+    if(num_bytes > (long)src->pub.bytes_in_buffer) {
+        fill_input_buffer(cinfo);
+        return;
+    }
+
     if(num_bytes > 0) {
         src->pub.next_input_byte += (size_t) num_bytes;
         src->pub.bytes_in_buffer -= (size_t) num_bytes;
@@ -126,8 +187,8 @@ static void jpeg_init_src(j_decompress_ptr cinfo, Uint8 *jpegdata, int jpegsize)
     src->pub.skip_input_data = skip_input_data;
     src->pub.resync_to_restart = jpeg_resync_to_restart;
     src->pub.term_source = term_source;
-    src->pub.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
-    src->pub.next_input_byte = NULL; /* until buffer loaded */
+    src->pub.bytes_in_buffer = jpegsize;
+    src->pub.next_input_byte = jpegdata;
 
     src->jpegdata = jpegdata;
     src->jpegsize = jpegsize;
@@ -135,7 +196,10 @@ static void jpeg_init_src(j_decompress_ptr cinfo, Uint8 *jpegdata, int jpegsize)
 
 static void my_error_exit(j_common_ptr cinfo)
 {
+    my_error_mgr *err = (my_error_mgr *) cinfo->err;
+
     DBG("JPEG data contains an error\n");
+    longjmp(err->setjmp_buffer, 1);
 }
 
 static void my_error_output_message(j_common_ptr cinfo)
@@ -143,50 +207,243 @@ static void my_error_output_message(j_common_ptr cinfo)
     DBG("JPEG data contains an error\n");
 }
 
-typedef struct {
-    int height;
-    int width;
-    unsigned char *buffer;
-    int buffersize;
-} decompressed_image;
+/******************************************************************************
+Description.: time in milliseconds from a monotonic clock
+Input Value.: -
+Return Value: milliseconds
+******************************************************************************/
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/******************************************************************************
+Description.: make sure the image can hold planes of the given dimension
+Input Value.: image and its dimension
+Return Value: 0 if OK, 1 if out of memory
+******************************************************************************/
+static int resize_image(yuv_image *image, int width, int height)
+{
+    int luma = width * height, chroma;
+    unsigned char *tmp;
+
+    image->width = width;
+    image->height = height;
+    image->chroma_width = (width + 1) / 2;
+    image->chroma_height = (height + 1) / 2;
+    chroma = image->chroma_width * image->chroma_height;
+
+    if(luma + 2 * chroma > image->capacity) {
+        if((tmp = realloc(image->plane[0], luma + 2 * chroma)) == NULL)
+            return 1;
+        image->plane[0] = tmp;
+        image->capacity = luma + 2 * chroma;
+    }
+    image->plane[1] = image->plane[0] + luma;
+    image->plane[2] = image->plane[1] + chroma;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: grow a scratch buffer
+Input Value.: pointer to the buffer, its capacity and the needed size
+Return Value: 0 if OK, 1 if out of memory
+******************************************************************************/
+static int reserve(unsigned char **buffer, int *capacity, int size)
+{
+    unsigned char *tmp;
+
+    if(size <= *capacity)
+        return 0;
+    if((tmp = realloc(*buffer, size)) == NULL)
+        return 1;
+    *buffer = tmp;
+    *capacity = size;
+    return 0;
+}
+
+/******************************************************************************
+Description.: the common YCbCr layouts can be read as raw downsampled data,
+              which skips upsampling and color conversion completely
+Input Value.: decompressor after jpeg_read_header()
+Return Value: 1 if the chroma planes are 4:2:0, 4:2:2 or 4:4:4 sampled
+******************************************************************************/
+static int raw_decodable(j_decompress_ptr cinfo)
+{
+    int ci, h, v;
+
+    if(cinfo->num_components != 3 || cinfo->jpeg_color_space != JCS_YCbCr)
+        return 0;
+    if(cinfo->comp_info[0].h_samp_factor != cinfo->max_h_samp_factor ||
+       cinfo->comp_info[0].v_samp_factor != cinfo->max_v_samp_factor)
+        return 0;
+
+    for(ci = 1; ci < 3; ci++) {
+        h = cinfo->comp_info[ci].h_samp_factor;
+        v = cinfo->comp_info[ci].v_samp_factor;
+        if((h != cinfo->max_h_samp_factor && h * 2 != cinfo->max_h_samp_factor) ||
+           (v != cinfo->max_v_samp_factor && v * 2 != cinfo->max_v_samp_factor))
+            return 0;
+    }
+
+    return 1;
+}
+
+/******************************************************************************
+Description.: decodes raw YCbCr data, chroma planes are subsampled to 4:2:0
+              by skipping samples
+Input Value.: started decompressor and the image to fill
+Return Value: -
+******************************************************************************/
+static void decode_raw(j_decompress_ptr cinfo, yuv_image *image)
+{
+    static unsigned char *scratch[3] = { NULL, NULL, NULL };
+    static int capacity[3] = { 0, 0, 0 };
+    JSAMPROW rows[3][4 * DCTSIZE];
+    JSAMPARRAY data[3];
+    int ci, i, x, lines = cinfo->max_v_samp_factor * DCTSIZE;
+    JDIMENSION first;
+
+    for(ci = 0; ci < 3; ci++) {
+        jpeg_component_info *comp = &cinfo->comp_info[ci];
+        int stride = comp->width_in_blocks * DCTSIZE;
+
+        if(reserve(&scratch[ci], &capacity[ci], stride * comp->v_samp_factor * DCTSIZE))
+            ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+        for(i = 0; i < comp->v_samp_factor * DCTSIZE; i++)
+            rows[ci][i] = scratch[ci] + i * stride;
+        data[ci] = rows[ci];
+    }
+
+    while(cinfo->output_scanline < cinfo->output_height) {
+        first = cinfo->output_scanline;
+        if(jpeg_read_raw_data(cinfo, data, lines) == 0)
+            break;
+
+        /* luma rows map 1:1 */
+        for(i = 0; i < lines && first + i < (JDIMENSION)image->height; i++)
+            memcpy(image->plane[0] + (first + i) * image->width, rows[0][i], image->width);
+
+        /* chroma rows are taken every second row if not vertically subsampled,
+           columns every second column if not horizontally subsampled */
+        for(ci = 1; ci < 3; ci++) {
+            jpeg_component_info *comp = &cinfo->comp_info[ci];
+            int step_x = (comp->h_samp_factor == cinfo->max_h_samp_factor) ? 2 : 1;
+            int step_y = (comp->v_samp_factor == cinfo->max_v_samp_factor) ? 2 : 1;
+            int comp_lines = comp->v_samp_factor * DCTSIZE;
+            int row = first / 2;
+
+            for(i = 0; i < comp_lines; i += step_y, row++) {
+                unsigned char *dst, *src = rows[ci][i];
+
+                if(row >= image->chroma_height)
+                    break;
+                dst = image->plane[ci] + row * image->chroma_width;
+                if(step_x == 1) {
+                    memcpy(dst, src, image->chroma_width);
+                } else {
+                    for(x = 0; x < image->chroma_width; x++)
+                        dst[x] = src[2 * x];
+                }
+            }
+        }
+    }
+}
 
-int decompress_jpeg(unsigned char *jpeg, int jpegsize, decompressed_image *image)
+/******************************************************************************
+Description.: decodes any other JPEG line by line as YCbCr or grayscale
+Input Value.: started decompressor and the image to fill
+Return Value: -
+******************************************************************************/
+static void decode_lines(j_decompress_ptr cinfo, yuv_image *image)
 {
-    struct jpeg_decompress_struct cinfo;
+    static unsigned char *line = NULL;
+    static int capacity = 0;
+    int x, y, components = cinfo->output_components;
     JSAMPROW rowptr[1];
-    struct jpeg_error_mgr jerr;
 
-    /* create an error handler that does not terminate MJPEG-streamer */
-    cinfo.err = jpeg_std_error(&jerr);
-    jerr.error_exit = my_error_exit;
-    jerr.output_message = my_error_output_message;
+    if(reserve(&line, &capacity, image->width * components))
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    rowptr[0] = line;
+
+    if(components == 1) {
+        memset(image->plane[1], 128, image->chroma_width * image->chroma_height * 2);
+    }
+
+    while(cinfo->output_scanline < cinfo->output_height) {
+        y = cinfo->output_scanline;
+        if(jpeg_read_scanlines(cinfo, rowptr, 1) == 0)
+            break;
+
+        if(components == 1) {
+            memcpy(image->plane[0] + y * image->width, line, image->width);
+            continue;
+        }
+
+        for(x = 0; x < image->width; x++)
+            image->plane[0][y * image->width + x] = line[3 * x];
+
+        if(y % 2 == 0) {
+            for(x = 0; x < image->chroma_width; x++) {
+                image->plane[1][(y / 2) * image->chroma_width + x] = line[6 * x + 1];
+                image->plane[2][(y / 2) * image->chroma_width + x] = line[6 * x + 2];
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: decompresses a JPEG into YUV planes, the decompressor is created
+              once and reused for every frame
+Input Value.: JPEG data, its size and the image to fill
+Return Value: 0 if OK, 1 if the frame could not be decoded
+******************************************************************************/
+int decompress_jpeg(unsigned char *jpeg, int jpegsize, yuv_image *image)
+{
+    static struct jpeg_decompress_struct cinfo;
+    static my_error_mgr jerr;
+    static int initialized = 0;
+
+    if(!initialized) {
+        /* create an error handler that does not terminate MJPEG-streamer */
+        cinfo.err = jpeg_std_error(&jerr.pub);
+        jerr.pub.error_exit = my_error_exit;
+        jerr.pub.output_message = my_error_output_message;
+
+        /* create the decompressor structures */
+        jpeg_create_decompress(&cinfo);
+        initialized = 1;
+    }
 
-    /* create the decompressor structures */
-    jpeg_create_decompress(&cinfo);
+    if(setjmp(jerr.setjmp_buffer)) {
+        /* keep the object for the next frame */
+        jpeg_abort_decompress(&cinfo);
+        return 1;
+    }
 
     /* initalize the structures of decompressor */
     jpeg_init_src(&cinfo, jpeg, jpegsize);
 
     /* read the JPEG header data */
-    if(jpeg_read_header(&cinfo, TRUE) < 0) {
-        jpeg_destroy_decompress(&cinfo);
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_abort_decompress(&cinfo);
         DBG("could not read the header\n");
         return 1;
     }
 
-    /*
-     * I just expect RGB colored JPEGs, so the num_components must be three
-     */
-    if(cinfo.num_components != 3) {
-        jpeg_destroy_decompress(&cinfo);
+    if(cinfo.num_components != 1 && cinfo.num_components != 3) {
+        jpeg_abort_decompress(&cinfo);
         DBG("unsupported number of components (~colorspace)\n");
         return 1;
     }
 
-    /* just use RGB output and adjust decompression parameters */
-    cinfo.out_color_space = JCS_RGB;
+    cinfo.raw_data_out = raw_decodable(&cinfo);
+    cinfo.out_color_space = (cinfo.num_components == 3) ? JCS_YCbCr : JCS_GRAYSCALE;
     cinfo.quantize_colors = FALSE;
-    /* to scale the decompressed image, the fraction could be changed here */
     cinfo.scale_num   = 1;
     cinfo.scale_denom = 1;
     cinfo.dct_method = JDCT_FASTEST;
@@ -194,72 +451,174 @@ int decompress_jpeg(unsigned char *jpeg, int jpegsize, decompressed_image *image
 
     jpeg_calc_output_dimensions(&cinfo);
 
-    /* store the image information */
-    image->width = cinfo.output_width;
-    image->height = cinfo.output_height;
-
-    /*
-     * just allocate a new buffer if not already allocated
-     * pay a lot attention, that the calling function has to ensure, that the buffer
-     * must be large enough
-     */
-    if(image->buffer == NULL) {
-        image->buffersize = image->width * image->height * cinfo.num_components;
-        /* the calling function has to ensure that this buffer will become freed after use! */
-        image->buffer = malloc(image->buffersize);
-        if(image->buffer == NULL) {
-            jpeg_destroy_decompress(&cinfo);
-            DBG("allocating memory failed\n");
-            return 1;
-        }
-    }
-
-    /* start to decompress */
-    if(jpeg_start_decompress(&cinfo) < 0) {
-        jpeg_destroy_decompress(&cinfo);
-        DBG("could not start decompression\n");
+    if(resize_image(image, cinfo.output_width, cinfo.output_height)) {
+        jpeg_abort_decompress(&cinfo);
+        DBG("allocating memory failed\n");
         return 1;
     }
 
-    while(cinfo.output_scanline < cinfo.output_height) {
-        rowptr[0] = (JSAMPROW)(Uint8 *)image->buffer + cinfo.output_scanline * image->width * cinfo.num_components;
+    jpeg_start_decompress(&cinfo);
+
+    if(cinfo.raw_data_out)
+        decode_raw(&cinfo, image);
+    else
+        decode_lines(&cinfo, image);
+
+    jpeg_finish_decompress(&cinfo);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: shows the image, (re)creates window and overlay if the size
+              of the frames changes
+Input Value.: decoded image
+Return Value: 0 if OK, 1 on error
+******************************************************************************/
+static int render(yuv_image *image)
+{
+    SDL_Rect rect;
+    int i, p;
+
+    if(overlay == NULL || overlay->w != image->width || overlay->h != image->height) {
+        if(overlay != NULL)
+            SDL_FreeYUVOverlay(overlay);
+        overlay = NULL;
+
+        /* create the primary surface (the visible window) */
+        screen = SDL_SetVideoMode(image->width, image->height, 0, SDL_ANYFORMAT | SDL_HWSURFACE);
+        if(screen == NULL) {
+            OPRINT("could not set video mode: %s\n", SDL_GetError());
+            return 1;
+        }
+        SDL_WM_SetCaption("MJPG-Streamer Viewer", NULL);
 
-        if(jpeg_read_scanlines(&cinfo, rowptr, (JDIMENSION) 1) < 0) {
-            jpeg_destroy_decompress(&cinfo);
-            DBG("could not decompress this line\n");
+        /* the overlay takes planar YUV 4:2:0, scaled by hardware if possible */
+        overlay = SDL_CreateYUVOverlay(image->width, image->height, SDL_IYUV_OVERLAY, screen);
+        if(overlay == NULL) {
+            OPRINT("could not create overlay: %s\n", SDL_GetError());
             return 1;
         }
+        OPRINT("overlay..........: %dx%d, %s\n", image->width, image->height,
+               overlay->hw_overlay ? "hardware" : "software");
     }
 
-    if(jpeg_finish_decompress(&cinfo) < 0) {
-        jpeg_destroy_decompress(&cinfo);
-        DBG("could not finish compression\n");
+    if(SDL_LockYUVOverlay(overlay) < 0)
         return 1;
+
+    for(p = 0; p < 3; p++) {
+        int width = (p == 0) ? image->width : image->chroma_width;
+        int height = (p == 0) ? image->height : image->chroma_height;
+
+        if(overlay->pitches[p] == width) {
+            memcpy(overlay->pixels[p], image->plane[p], width * height);
+            continue;
+        }
+        for(i = 0; i < height; i++)
+            memcpy(overlay->pixels[p] + i * overlay->pitches[p], image->plane[p] + i * width, width);
     }
 
-    /* all is done */
-    jpeg_destroy_decompress(&cinfo);
+    SDL_UnlockYUVOverlay(overlay);
+
+    rect.x = 0;
+    rect.y = 0;
+    rect.w = image->width;
+    rect.h = image->height;
+    SDL_DisplayYUVOverlay(overlay, &rect);
 
     return 0;
 }
 
+/******************************************************************************
+Description.: prints the statistics and resets them
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void report_stats(void)
+{
+    if(stats.shown == 0) {
+        OPRINT("frames shown.....: 0, skipped: %lu, broken: %lu\n", stats.skipped, stats.failed);
+    } else {
+        OPRINT("frames shown.....: %lu, skipped: %lu, broken: %lu, " \
+               "decode: %.1f/%.1f ms, render: %.1f/%.1f ms (avg/max)\n",
+               stats.shown, stats.skipped, stats.failed,
+               stats.decode_sum / stats.shown, stats.decode_max,
+               stats.render_sum / stats.shown, stats.render_max);
+    }
+
+    memset(&stats, 0, sizeof(stats));
+}
+
+/******************************************************************************
+Description.: unlocks the mutex of the input if the grabber gets cancelled
+              while waiting for a frame
+Input Value.: mutex
+Return Value: -
+******************************************************************************/
+static void unlock_mutex(void *arg)
+{
+    pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+/******************************************************************************
+Description.: copies every frame of the input plugin to the pending buffer,
+              a frame the renderer did not take yet gets overwritten
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void *grabber_thread(void *arg)
+{
+    unsigned char *tmp;
+    int frame_size;
+
+    while(!pglobal->stop) {
+        pthread_mutex_lock(&pglobal->in[input_number].db);
+        pthread_cleanup_push(unlock_mutex, &pglobal->in[input_number].db);
+        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        pthread_cleanup_pop(0);
+
+        frame_size = pglobal->in[input_number].size;
+
+        pthread_mutex_lock(&viewer_mutex);
+        if(frame_size > pending.capacity) {
+            if((tmp = realloc(pending.buf, frame_size + (1 << 16))) == NULL) {
+                pthread_mutex_unlock(&viewer_mutex);
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                OPRINT("not enough memory for worker thread\n");
+                continue;
+            }
+            pending.buf = tmp;
+            pending.capacity = frame_size + (1 << 16);
+        }
+
+        memcpy(pending.buf, pglobal->in[input_number].buf, frame_size);
+        pending.size = frame_size;
+        pending_seq++;
+        pthread_cond_signal(&viewer_update);
+        pthread_mutex_unlock(&viewer_mutex);
+
+        pthread_mutex_unlock(&pglobal->in[input_number].db);
+    }
+
+    return NULL;
+}
+
 /******************************************************************************
 Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame, decompressed the JPEG
+              it loops forever, takes the newest frame, decompresses the JPEG
               and displays the decoded data using SDL
 Input Value.:
 Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int frame_size = 0, firstrun = 1;
-
-    SDL_Surface *screen = NULL, *image = NULL;
-    decompressed_image rgbimage;
+    unsigned long shown_seq = 0;
+    frame_buffer swap;
+    yuv_image image;
+    double start, decoded, rendered, last_report;
+    SDL_Event event;
 
-    /* initialze the buffer for the decompressed image */
-    rgbimage.buffersize = 0;
-    rgbimage.buffer = NULL;
+    memset(&image, 0, sizeof(image));
 
     /* initialze the SDL video subsystem */
     if(SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -267,68 +626,63 @@ void *worker_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* just allocate a large buffer for the JPEGs */
-    if((frame = malloc(4096 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    last_report = now_ms();
+
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        pthread_mutex_lock(&viewer_mutex);
+        while(pending_seq == shown_seq && !stopping)
+            pthread_cond_wait(&viewer_update, &viewer_mutex);
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        if(stopping) {
+            pthread_mutex_unlock(&viewer_mutex);
+            break;
+        }
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* take the newest frame, everything before it is stale */
+        stats.skipped += pending_seq - shown_seq - 1;
+        shown_seq = pending_seq;
+        swap = current;
+        current = pending;
+        pending = swap;
+        pthread_mutex_unlock(&viewer_mutex);
 
-        /* decompress the JPEG and store results in memory */
-        if(decompress_jpeg(frame, frame_size, &rgbimage)) {
+        /* keep the window responsive */
+        while(SDL_PollEvent(&event))
+            ;
+
+        start = now_ms();
+        if(decompress_jpeg(current.buf, current.size, &image)) {
             DBG("could not properly decompress JPEG data\n");
+            stats.failed++;
             continue;
         }
+        decoded = now_ms();
 
-        if(firstrun) {
-            /* create the primary surface (the visible window) */
-            screen = SDL_SetVideoMode(rgbimage.width, rgbimage.height, 0, SDL_ANYFORMAT | SDL_HWSURFACE);
-            SDL_WM_SetCaption("MJPG-Streamer Viewer", NULL);
-
-            /* create a SDL surface to display the data */
-            image = SDL_AllocSurface(SDL_SWSURFACE, rgbimage.width, rgbimage.height, 24,
-#if SDL_BYTEORDER == SDL_LIL_ENDIAN
-                                     0x0000FF, 0x00FF00, 0xFF0000,
-#else
-                                     0xFF0000, 0x00FF00, 0x0000FF,
-#endif
-                                     0);
-
-            /* copy the decoded data across */
-            memcpy(image->pixels, rgbimage.buffer, rgbimage.width * rgbimage.height * 3);
-            free(rgbimage.buffer);
-
-            /* now, that we know the dimensions, we can directly copy to the right surface */
-            rgbimage.buffer = image->pixels;
-            rgbimage.buffersize = rgbimage.width * rgbimage.height * 3;
-
-            firstrun = 0;
+        if(render(&image))
+            break;
+        rendered = now_ms();
+
+        stats.shown++;
+        stats.decode_sum += decoded - start;
+        stats.render_sum += rendered - decoded;
+        if(decoded - start > stats.decode_max)
+            stats.decode_max = decoded - start;
+        if(rendered - decoded > stats.render_max)
+            stats.render_max = rendered - decoded;
+
+        if(stats_interval > 0 && rendered - last_report >= stats_interval * 1000.0) {
+            report_stats();
+            last_report = rendered;
         }
-
-        /* copy the image to the primary surface */
-        SDL_BlitSurface(image, NULL, screen, NULL);
-
-        /* redraw the whole surface */
-        SDL_Flip(screen);
     }
 
     pthread_cleanup_pop(1);
 
-    /* get rid of the image */
-    SDL_FreeSurface(image);
+    free(image.plane[0]);
 
     return NULL;
 }
@@ -360,6 +714,8 @@ int output_init(output_parameter *param)
             {"help", no_argument, 0, 0},
             {"i", required_argument, 0, 0},
             {"input", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"stats", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -388,6 +744,12 @@ int output_init(output_parameter *param)
             DBG("case 2,3\n");
             input_number = atoi(optarg);
             break;
+            /* s, stats */
+        case 4:
+        case 5:
+            DBG("case 4,5\n");
+            stats_interval = atoi(optarg);
+            break;
         }
     }
 
@@ -397,6 +759,11 @@ int output_init(output_parameter *param)
         return 1;
     }
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
+    if(stats_interval > 0) {
+        OPRINT("statistics.......: every %d s\n", stats_interval);
+    } else {
+        OPRINT("statistics.......: %s\n", "disabled");
+    }
 
     return 0;
 }
@@ -409,7 +776,24 @@ Return Value: always 0
 int output_stop(int id)
 {
     DBG("will cancel worker thread\n");
-    pthread_cancel(worker);
+    pthread_cancel(grabber);
+    pthread_join(grabber, NULL);
+
+    /* the renderer owns the SDL window, let it shut down by itself */
+    pthread_mutex_lock(&viewer_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&viewer_update);
+    pthread_mutex_unlock(&viewer_mutex);
+
+    if(!pthread_equal(pthread_self(), renderer)) {
+        pthread_join(renderer, NULL);
+        free(pending.buf);
+        free(current.buf);
+    }
+
+    if(stats_interval > 0)
+        report_stats();
+
     return 0;
 }
 
@@ -421,8 +805,8 @@ Return Value: always 0
 int output_run(int id)
 {
     DBG("launching worker thread\n");
-    pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
+    pthread_create(&renderer, 0, worker_thread, NULL);
+    pthread_create(&grabber, 0, grabber_thread, NULL);
     return 0;
 }
 
@@ -431,4 +815,3 @@ int output_cmd()
 
 
 }
-
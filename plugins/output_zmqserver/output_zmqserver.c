@@ -34,6 +34,7 @@
 #include <pthread.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/time.h>
 #include <syslog.h>
 #include <dirent.h>
 #include <netinet/in.h>
@@ -57,21 +58,41 @@ static globals *pglobal;
 static int fd, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
 static char *folder = "/tmp";
 static unsigned char *frame = NULL;
-static unsigned char *frames[MAX_ZMQ_BUFFER_SIZE];
 static char *command = NULL;
 static int input_number = 0;
 static char *mjpgFileName = NULL;
 static char *zmqAddress = NULL;
 static int zmqBufferSize = 3;
-static int zmqBufferPos = 0;
-static Pb__Package pbPackage = PB__PACKAGE__INIT; // Package
+static int zmqLatency = 0;
+static int zmqRaw = 0;
 
 static void *context;
 static void *publisher;
-static void *buf;                         // Buffer to store serialized data
-static int bufferSize;
 
-static clock_t begin, end;
+/*
+ * Frames are handed to zmq without copying. A buffer belongs to the worker
+ * while it gets filled and to the zmq message afterwards, zmq calls
+ * zmq_buffer_release() from its I/O thread once the message was sent to all
+ * subscribers. If all buffers are in flight the frame gets dropped, which
+ * limits the memory slow subscribers can tie up.
+ */
+#define MAX_ZMQ_POOL_SIZE (4 * MAX_ZMQ_BUFFER_SIZE)
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int refcount;
+} zmq_buffer;
+
+static zmq_buffer pool[MAX_ZMQ_POOL_SIZE];
+
+/* the frames of the current batch, protobuf mode packs them all into batch[0] */
+static zmq_buffer *batch[MAX_ZMQ_BUFFER_SIZE];
+static zmq_raw_frame batch_header[MAX_ZMQ_BUFFER_SIZE];
+static int batch_count = 0;
+static struct timeval batch_begin;
+static unsigned long long dropped = 0;
 
 /******************************************************************************
 Description.: print a help message
@@ -80,18 +101,20 @@ Return Value: -
 ******************************************************************************/
 void help(void)
 {
-    // TODO: Update available command line arguments.
     fprintf(stderr, " ---------------------------------------------------------------\n" \
             " Help for output plugin..: "OUTPUT_PLUGIN_NAME"\n" \
             " ---------------------------------------------------------------\n" \
             " The following parameters can be passed to this plugin:\n\n" \
-            " [-f | --folder ]........: folder to save pictures\n" \
-            " [-m | --mjpeg ].........: save the frames to an mjpg file \n" \
+            " [-a | --address ].......: ZMQ address to publish the frames at\n" \
+            " [-b | --buffer_size ]...: number of frames sent in one message\n" \
+            " [-l | --latency ].......: send an incomplete batch after this many ms\n" \
+            " [-r | --raw ]...........: send the JPEGs as message parts instead of protobuf\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-f | --folder ]........: folder to save pictures\n" \
+            " [-m | --mjpeg ].........: write the frames to stdout instead\n" \
             " The following arguments are takes effect only if the current mode is not MJPG\n" \
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
-            " [-c | --command ].......: execute command after saving picture\n"\
             " ---------------------------------------------------------------\n");
 }
 
@@ -116,25 +139,163 @@ void worker_cleanup(void *arg)
 
     first_run = 0;
     OPRINT("cleaning up ressources allocated by worker thread\n");
+    OPRINT("frames dropped....: %llu\n", dropped);
 
     if(frame != NULL) {
         free(frame);
     }
     close(fd);
 
-    // cleanup zmq
+    // cleanup zmq, this waits until all messages released their buffers
     zmq_close (publisher);
     zmq_ctx_destroy (context);
 
-    // Free the allocated serialized buffer
-    free(buf);
+    for (i = 0; i < MAX_ZMQ_POOL_SIZE; ++i)
+    {
+        free(pool[i].data);
+    }
+}
+
+/******************************************************************************
+Description.: zmq free function, called once a message is done with a buffer
+Input Value.: data: the message data
+              hint: the buffer
+Return Value: -
+******************************************************************************/
+static void zmq_buffer_release(void *data, void *hint)
+{
+    zmq_buffer *buffer = hint;
+
+    __sync_sub_and_fetch(&buffer->refcount, 1);
+}
+
+/******************************************************************************
+Description.: makes sure a buffer owned by the worker can hold size bytes
+Input Value.: buffer: the buffer
+              size: required capacity
+Return Value: 0 if everything is OK, -1 if out of memory
+******************************************************************************/
+static int zmq_buffer_reserve(zmq_buffer *buffer, size_t size)
+{
+    unsigned char *tmp;
+
+    if(size <= buffer->capacity)
+        return 0;
+
+    DBG("increasing buffer size to %zu\n", size);
+    if((tmp = realloc(buffer->data, size + (1 << 16))) == NULL)
+        return -1;
+
+    buffer->data = tmp;
+    buffer->capacity = size + (1 << 16);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: takes a free buffer from the pool
+Input Value.: size: required capacity
+Return Value: the empty buffer, NULL if all buffers are in flight
+******************************************************************************/
+static zmq_buffer *zmq_buffer_get(size_t size)
+{
+    int i;
+
+    for (i = 0; i < MAX_ZMQ_POOL_SIZE; ++i)
+    {
+        if (__sync_bool_compare_and_swap(&pool[i].refcount, 0, 1)) {
+            if (zmq_buffer_reserve(&pool[i], size) < 0) {
+                __sync_sub_and_fetch(&pool[i].refcount, 1);
+                return NULL;
+            }
+            pool[i].size = 0;
+            return &pool[i];
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: sends a buffer as message part without copying it, the
+              buffer belongs to zmq afterwards, even if sending failed
+Input Value.: buffer: the buffer
+              flags: zmq send flags
+Return Value: 0 if everything is OK, -1 in case of error
+******************************************************************************/
+static int zmq_buffer_send(zmq_buffer *buffer, int flags)
+{
+    zmq_msg_t msg;
+
+    if (zmq_msg_init_data(&msg, buffer->data, buffer->size, zmq_buffer_release, buffer) != 0) {
+        zmq_buffer_release(buffer->data, buffer);
+        return -1;
+    }
 
-    // Free protobuf message
-    for (i = 0; i < pbPackage.n_frame; ++i)
+    if (zmq_msg_send(&msg, publisher, flags) == -1) {
+        zmq_msg_close(&msg);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: appends one frame to a protobuf message as "repeated Frame"
+              field. A packed Package is just the concatenation of its
+              fields, so the message can be built frame by frame.
+Input Value.: pbFrame: the frame, blob may point to the input buffer
+              packed: pb__package__frame__get_packed_size(pbFrame)
+              out: destination, needs room for packed + 11 bytes
+Return Value: number of bytes written
+******************************************************************************/
+static size_t pack_frame(Pb__Package__Frame *pbFrame, size_t packed, uint8_t *out)
+{
+    size_t len = 0, value = packed;
+
+    out[len++] = 0x0a; /* field 1 (frame), length delimited */
+    while (value >= 0x80) {
+        out[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[len++] = value;
+
+    return len + pb__package__frame__pack(pbFrame, out + len);
+}
+
+/******************************************************************************
+Description.: sends the current batch in the configured wire format
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void send_batch(void)
+{
+    char topic[] = "frames";
+    int i, parts = zmqRaw ? batch_count : 1, rc = 0;
+
+    DBG("transmitting ZMQ batch of %d frames\n", batch_count);
+
+    if (zmq_send(publisher, topic, strlen(topic), ZMQ_SNDMORE) == -1)
+        rc = -1;
+    else if (zmqRaw && zmq_send(publisher, batch_header, batch_count * sizeof(zmq_raw_frame), ZMQ_SNDMORE) == -1)
+        rc = -1;
+
+    /* every buffer gets handed over, or given back if the message broke */
+    for (i = 0; i < parts; ++i)
     {
-        free(pbPackage.frame[i]);
+        if (rc == 0) {
+            rc = zmq_buffer_send(batch[i], (i < parts - 1) ? ZMQ_SNDMORE : 0);
+        } else {
+            zmq_buffer_release(batch[i]->data, batch[i]);
+        }
+        batch[i] = NULL;
     }
-    free(pbPackage.frame);
+
+    if (rc == -1) {
+        DBG("ZMQ Transmission failure: %s\n", zmq_strerror(errno));
+    }
+
+    batch_count = 0;
 }
 
 /******************************************************************************
@@ -230,7 +391,7 @@ void maintain_ringbuffer(int size)
 
 /******************************************************************************
 Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
+              it loops forever, grabs a fresh frame and publishes it
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -240,43 +401,24 @@ void *worker_thread(void *arg)
     char buffer1[1024] = {0}, buffer2[1024] = {0};
     unsigned long long counter = 0;
     unsigned char *tmp_framebuffer = NULL;
+    Pb__Package__Frame pbFrame = PB__PACKAGE__FRAME__INIT;
+    zmq_buffer *current;
+    size_t packed;
+    struct timeval timestamp, now;
+    struct timespec deadline;
 
     //  Prepare our context and publisher
-    //char zmqAddress[20];
     if (zmqAddress == NULL) {
         LOG("No ZMQ address specified");
     }
 
     context = zmq_ctx_new ();
     publisher = zmq_socket (context, ZMQ_PUB);
-    //snprintf(zmqAddress, 20u, "epgm://eth0;239.1.1.1:%i", zmqPort);
 
     if (zmq_bind (publisher, zmqAddress) == -1) {
         LOG("Couldn't create zmq socket.\n");
     }
 
-    unsigned len;                      // Length of serialized data
-    char topic[] = "frames";
-    struct timeval timestamp;
-    int i;
-
-    buf = NULL;
-    for (i = 0; i < MAX_ZMQ_BUFFER_SIZE; ++i)
-    {
-        frames[i] = NULL;
-    }
-
-    pbPackage.n_frame = zmqBufferSize;
-    if ((pbPackage.frame = malloc(sizeof(Pb__Package__Frame*) * pbPackage.n_frame)) == NULL) {
-        LOG("not enough memory\n");
-    }
-    for (i = 0; i < pbPackage.n_frame; ++i)
-    {
-        if ((pbPackage.frame[i] = malloc(sizeof(Pb__Package__Frame))) == NULL) {
-            LOG("not enough memory\n");
-        }
-        pb__package__frame__init(pbPackage.frame[i]);
-    }
     /* set cleanup handler to cleanup allocated ressources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
@@ -284,141 +426,148 @@ void *worker_thread(void *arg)
         DBG("waiting for fresh frame\n");
 
         pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        if (batch_count > 0 && zmqLatency > 0) {
+            /* send the incomplete batch in time even if no frame arrives */
+            deadline.tv_sec = batch_begin.tv_sec + zmqLatency / 1000;
+            deadline.tv_nsec = (batch_begin.tv_usec + (zmqLatency % 1000) * 1000) * 1000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_cond_timedwait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db, &deadline) == ETIMEDOUT) {
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                send_batch();
+                continue;
+            }
+        } else {
+            pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        }
 
         /* read buffer */
         frame_size = pglobal->in[input_number].size;
 
-        /* set the right frame to store the data */
-        frame = frames[zmqBufferPos];
+        /* copy v4l2_buffer timeval to user space */
+        timestamp = pglobal->in[input_number].timestamp;
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if((frame_size > max_frame_size) || (frame == NULL)) {
-            DBG("increasing buffer size to %d\n", frame_size);
+        if (mjpgFileName != NULL) { // recording to MJPG file
+            /* check if buffer for frame is large enough, increase it if necessary */
+            if(frame_size > max_frame_size) {
+                DBG("increasing buffer size to %d\n", frame_size);
 
-            if (frame_size > max_frame_size) {
                 max_frame_size = frame_size + (1 << 16);
+                if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
+                    pthread_mutex_unlock(&pglobal->in[input_number].db);
+                    LOG("not enough memory\n");
+                    return NULL;
+                }
+
+                frame = tmp_framebuffer;
             }
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
+
+            memcpy(frame, pglobal->in[input_number].buf, frame_size);
+            pthread_mutex_unlock(&pglobal->in[input_number].db);
+
+            /* save picture to file */
+            if(fwrite(frame, sizeof(unsigned char), frame_size, stdout) != frame_size) {
+                OPRINT("could not write to file %s\n", buffer2);
+                perror("fwrite()");
+                close(fd);
                 return NULL;
             }
+            continue;
+        }
 
-            if ((setvbuf(stdout, NULL, _IOFBF, max_frame_size)) != 0) {
-                DBG("setvbuf failed.\n");
+        if (zmqRaw) {
+            /* the only copy of the frame, straight into the buffer zmq will send */
+            if ((current = zmq_buffer_get(frame_size)) != NULL) {
+                memcpy(current->data, pglobal->in[input_number].buf, frame_size);
+                current->size = frame_size;
+            }
+        } else {
+            /* pack straight from the input buffer into the message */
+            pbFrame.timestamp_unix = (u_int32_t)time(NULL);
+            pbFrame.timestamp_s = (u_int32_t)timestamp.tv_sec;
+            pbFrame.timestamp_us = (u_int32_t)timestamp.tv_usec;
+            pbFrame.blob.data = pglobal->in[input_number].buf;
+            pbFrame.blob.len = frame_size;
+            packed = pb__package__frame__get_packed_size(&pbFrame);
+
+            if (batch_count == 0) {
+                batch[0] = zmq_buffer_get(packed + 11);
+            } else if (zmq_buffer_reserve(batch[0], batch[0]->size + packed + 11) < 0) {
+                LOG("not enough memory\n");
+                pthread_mutex_unlock(&pglobal->in[input_number].db);
+                continue;
             }
 
-            frame = tmp_framebuffer;
+            if ((current = batch[0]) != NULL) {
+                current->size += pack_frame(&pbFrame, packed, current->data + current->size);
+            }
         }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
-
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* resync again with the frame buffer */
-        frames[zmqBufferPos] = frame;
-
         /* allow others to access the global buffer again */
         pthread_mutex_unlock(&pglobal->in[input_number].db);
 
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
-            DBG("Packaging data: %lld\n", counter);
-            counter++;
-
-            begin = clock();
-
-            /* allocate enough memory to store a serialized string */
-            if ((buf == NULL) || (bufferSize < (max_frame_size * zmqBufferSize + 20)))
-            {
-                bufferSize = (max_frame_size * zmqBufferSize + 20);
-                buf = realloc(buf, bufferSize);
-                if (buf == NULL) {
-                    LOG("Not enough memory");
-                }
-            }
+        if (current == NULL) {
+            DBG("all buffers in flight, dropping frame\n");
+            dropped++;
+            continue;
+        }
 
-            /* fill protobuf data */
-            pbPackage.frame[zmqBufferPos]->timestamp_unix = (u_int32_t)time(NULL);
-            pbPackage.frame[zmqBufferPos]->timestamp_s = (u_int32_t)timestamp.tv_sec;
-            pbPackage.frame[zmqBufferPos]->timestamp_us = (u_int32_t)timestamp.tv_usec;
-            pbPackage.frame[zmqBufferPos]->blob.data = frame;
-            pbPackage.frame[zmqBufferPos]->blob.len = frame_size;
-
-            zmqBufferPos++;
-
-            if (zmqBufferPos == zmqBufferSize)
-            {
-                DBG("transmitting ZMQ: %lld\n", counter);
-                /* pack protobuf data */
-                len = pb__package__get_packed_size(&pbPackage);
-                DBG("packing data: %i %i", max_frame_size, len);
-                pb__package__pack(&pbPackage, buf);
-
-                DBG("sending data");
-                // send data using zmq
-                if ((zmq_send(publisher, topic, strlen(topic), ZMQ_SNDMORE) == -1) || (zmq_send(publisher, buf, len, 0) == -1)) {
-                    DBG("ZMQ Transmission failure");
-                }
+        DBG("Packaging data: %lld\n", counter);
+        counter++;
 
-                zmqBufferPos = 0;
-            }
+        if (zmqRaw) {
+            batch[batch_count] = current;
+            batch_header[batch_count].timestamp_unix = (uint32_t)time(NULL);
+            batch_header[batch_count].timestamp_s = (uint32_t)timestamp.tv_sec;
+            batch_header[batch_count].timestamp_us = (uint32_t)timestamp.tv_usec;
+            batch_header[batch_count].size = frame_size;
+        }
 
-            end = clock();
-            DBG("Time1: %f\n", (double)(end-begin) / CLOCKS_PER_SEC);
-            begin = clock();
+        if (batch_count++ == 0) {
+            gettimeofday(&batch_begin, NULL);
+        }
 
-            /* call the command if user specified one, pass current filename as argument */
-            if(command != NULL) {
-                memset(buffer1, 0, sizeof(buffer1));
+        /* send full batches, or incomplete ones that waited long enough */
+        if (batch_count < zmqBufferSize && zmqLatency > 0) {
+            gettimeofday(&now, NULL);
+            if ((now.tv_sec - batch_begin.tv_sec) * 1000 + (now.tv_usec - batch_begin.tv_usec) / 1000 >= zmqLatency)
+                send_batch();
+        } else if (batch_count >= zmqBufferSize) {
+            send_batch();
+        }
 
-                /* buffer2 still contains the filename, pass it to the command as parameter */
-                snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
-                DBG("calling command %s", buffer1);
+        /* call the command if user specified one, pass current filename as argument */
+        if(command != NULL) {
+            memset(buffer1, 0, sizeof(buffer1));
 
-                /* in addition provide the filename as environment variable */
-                if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
-                    LOG("setenv failed (return value %d)\n", rc);
-                }
+            /* buffer2 still contains the filename, pass it to the command as parameter */
+            snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
+            DBG("calling command %s", buffer1);
 
-                /* execute the command now */
-                if((rc = system(buffer1)) != 0) {
-                    LOG("command failed (return value %d)\n", rc);
-                }
+            /* in addition provide the filename as environment variable */
+            if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
+                LOG("setenv failed (return value %d)\n", rc);
             }
 
-            end = clock();
-            DBG("Time2: %f\n", (double)(end-begin) / CLOCKS_PER_SEC);
-            begin = clock();
-
-            /*
-             * maintain ringbuffer
-             * do not maintain ringbuffer for each picture, this saves ressources since
-             * each run of the maintainance function involves sorting/malloc/free operations
-             */
-            if(ringbuffer_exceed <= 0) {
-                /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
-                maintain_ringbuffer(ringbuffer_size);
-            } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
-                DBG("counter: %llu, will clean-up now\n", counter);
-                maintain_ringbuffer(ringbuffer_size);
+            /* execute the command now */
+            if((rc = system(buffer1)) != 0) {
+                LOG("command failed (return value %d)\n", rc);
             }
+        }
 
-            end = clock();
-            DBG("Time3: %f\n", (double)(end-begin) / CLOCKS_PER_SEC);
-
-        } else { // recording to MJPG file
-            DBG("Entered else branch!\n");
-            /* save picture to file */
-            //if(write(fileno(stdout), frame, frame_size) < 0) {
-            if(fwrite(frame, sizeof(unsigned char), frame_size, stdout) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("fwrite()");
-                close(fd);
-                return NULL;
-            }
+        /*
+         * maintain ringbuffer
+         * do not maintain ringbuffer for each picture, this saves ressources since
+         * each run of the maintainance function involves sorting/malloc/free operations
+         */
+        if(ringbuffer_exceed <= 0) {
+            /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
+            maintain_ringbuffer(ringbuffer_size);
+        } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
+            DBG("counter: %llu, will clean-up now\n", counter);
+            maintain_ringbuffer(ringbuffer_size);
         }
     }
 
@@ -471,6 +620,10 @@ int output_init(output_parameter *param, int id)
             {"address", required_argument, 0, 0},
             {"b", required_argument, 0, 0},
             {"buffer_size", required_argument, 0, 0},
+            {"l", required_argument, 0, 0},
+            {"latency", required_argument, 0, 0},
+            {"r", no_argument, 0, 0},
+            {"raw", no_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -541,6 +694,18 @@ int output_init(output_parameter *param, int id)
             DBG("case 14,15\n");
             zmqBufferSize = atoi(optarg);
             break;
+            /* latency */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            zmqLatency = atoi(optarg);
+            break;
+            /* raw */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            zmqRaw = 1;
+            break;
         }
     }
 
@@ -549,6 +714,15 @@ int output_init(output_parameter *param, int id)
         return 1;
     }
 
+    if(zmqBufferSize < 1 || zmqBufferSize > MAX_ZMQ_BUFFER_SIZE) {
+        OPRINT("ERROR: the buffer size must be between 1 and %d\n", MAX_ZMQ_BUFFER_SIZE);
+        return 1;
+    }
+
+    OPRINT("zmq address.......: %s\n", zmqAddress);
+    OPRINT("frames per message: %d\n", zmqBufferSize);
+    OPRINT("max. batch latency: %d ms\n", zmqLatency);
+    OPRINT("wire format.......: %s\n", zmqRaw ? "raw multipart" : "protobuf");
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     if  (mjpgFileName == NULL) {
@@ -1,7 +1,21 @@
-#ifndef OUTPUT_FILE_H
-#define OUTPUT_FILE_H
+#ifndef OUTPUT_ZMQSERVER_H
+#define OUTPUT_ZMQSERVER_H
 
 #define OUT_FILE_CMD_TAKE           1
 #define OUT_FILE_CMD_FILENAME       2
 
+#include <stdint.h>
+
+/*
+ * raw wire format (--raw): a multipart message made of the topic, a header
+ * part holding one zmq_raw_frame per JPEG (host byte order) and one part
+ * per JPEG
+ */
+typedef struct {
+    uint32_t timestamp_unix;
+    uint32_t timestamp_s;
+    uint32_t timestamp_us;
+    uint32_t size;
+} zmq_raw_frame;
+
 #endif
@@ -0,0 +1,886 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Estimates how sharp a JPEG frame is from the energy of its low frequency
+  DCT coefficients, without decoding the frame to pixels. The AC coefficients
+  0..20 in zigzag order of the luminance blocks are dequantized, squared and
+  weighted by a gaussian centred on the region of interest. The coefficients
+  of each zigzag diagonal count as much as the number of the diagonal, the
+  sum of the averages is the result. The numbers only compare frames of the
+  same scene, a higher value means a sharper frame.
+
+  A measurement only reads as much of the frame as it has to:
+  - Huffman codes are decoded with a lookahead table of the next 9 bits,
+    longer codes fall back to the canonical decoding of section F.2.2.3.
+  - The tables are built once and kept while the DHT segments of the frames
+    do not change. Frames without DHT get the tables of section K.3, as the
+    M-JPEG of UVC cameras.
+  - DC coefficients, chrominance blocks and AC coefficients past the ones
+    measured are skipped without extending their values.
+  - Decoding stops after the last MCU of the region of interest. With restart
+    markers, intervals without an MCU of the region are jumped over.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sharpness.h"
+
+#define LOOKAHEAD 9
+#define MAX_COMPONENTS 4
+
+/* zigzag positions 1..MEASURED-1 make up the first five diagonals */
+#define MEASURED 21
+
+/* an AC coefficient that fits into the lookahead bits with its code */
+typedef struct {
+    unsigned char length;   /* of code and value, 0 if it does not fit */
+    unsigned char run;      /* zeros in front, END_OF_BLOCK for EOB */
+    short value;
+} fast_ac;
+
+#define END_OF_BLOCK 0xff
+
+typedef struct {
+    /* the DHT entry the table was built from, 0 bytes if none */
+    unsigned char source[16 + 256];
+    int source_size;
+
+    /* the next LOOKAHEAD bits give the length of the code and its symbol,
+       length 0 means the code is longer */
+    unsigned char look_length[1 << LOOKAHEAD];
+    unsigned char look_symbol[1 << LOOKAHEAD];
+    fast_ac look_ac[1 << LOOKAHEAD];
+
+    /* the largest code of each length, -1 if there is none */
+    int maxcode[17];
+    /* added to a code of that length gives the index in symbols */
+    int offset[17];
+    unsigned char symbols[256];
+} huffman_table;
+
+typedef struct {
+    int id;
+    int h, v;               /* sampling factors */
+    int quant;              /* quantization table */
+    int dc, ac;             /* Huffman tables of the scan */
+} component;
+
+typedef struct {
+    const unsigned char *data, *end;
+    unsigned long long bits;
+    int count;              /* valid bits, the lowest ones of bits */
+    int zeros;              /* bytes made up after the data ran out */
+} bit_reader;
+
+struct _sharpness {
+    /* DC tables 0..3, then AC tables 0..3 */
+    huffman_table huffman[8];
+    int quant[4][64];       /* in zigzag order */
+
+    /* the tables defined by the current frame */
+    int huffman_defined, quant_defined;
+
+    int width, height;
+    component comp[MAX_COMPONENTS];
+    int components;
+    int restart_interval;
+
+    /* gaussian weights of the block columns and rows of the region */
+    double *weight_x, *weight_y;
+    int weights_size;
+
+    const char *error;
+    unsigned long table_builds;
+};
+
+/* the number of the zigzag diagonal of each coefficient */
+static const int diagonal[MEASURED] = {
+    0, 1, 1, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5
+};
+
+/* the tables of section K.3 as DHT segment, without marker and length */
+static const unsigned char std_dht[] = {
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01,
+    0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x10, 0x00,
+    0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00,
+    0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21,
+    0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81,
+    0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+    0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25,
+    0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a,
+    0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+    0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86,
+    0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99,
+    0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3,
+    0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6,
+    0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9,
+    0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1,
+    0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0x11, 0x00, 0x02,
+    0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01,
+    0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06,
+    0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14,
+    0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62,
+    0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19,
+    0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a,
+    0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56,
+    0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85,
+    0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2,
+    0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
+    0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2,
+    0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const sharpness_roi whole_frame = { 0.0, 0.0, 1.0, 1.0 };
+
+static int get16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+/* the value of size bits, section F.2.2.1 */
+static inline int extend(int bits, int size)
+{
+    return bits < (1 << (size - 1)) ? bits - (1 << size) + 1 : bits;
+}
+
+/* fills the AC lookahead entries of a code, the value of the coefficient
+   follows the code and has to fit into the lookahead bits as well */
+static void fast_ac_entries(huffman_table *t, int first, int last, int length, int symbol)
+{
+    int i, size = symbol & 0x0f, shift;
+    fast_ac *e;
+
+    for(i = first; i < last; i++) {
+        e = &t->look_ac[i];
+        e->length = 0;
+        e->value = 0;
+
+        if(symbol == 0x00) {
+            e->length = length;
+            e->run = END_OF_BLOCK;
+        } else if(symbol == 0xf0) {
+            e->length = length;
+            e->run = 15;
+        } else if(size != 0 && length + size <= LOOKAHEAD) {
+            shift = LOOKAHEAD - length - size;
+            e->length = length + size;
+            e->run = symbol >> 4;
+            e->value = extend((i >> shift) & ((1 << size) - 1), size);
+        }
+    }
+}
+
+/******************************************************************************
+Description.: builds the lookahead and the canonical decoding tables
+Input Value.: table, code counts per length and the symbols
+Return Value: 0 if the table is valid, -1 otherwise
+******************************************************************************/
+static int build_table(huffman_table *t, const unsigned char *counts, const unsigned char *symbols)
+{
+    int length, i, n = 0, code = 0, shift, first, last;
+
+    memset(t->look_length, 0, sizeof(t->look_length));
+    memset(t->look_ac, 0, sizeof(t->look_ac));
+
+    for(length = 1; length <= 16; length++) {
+        t->offset[length] = n - code;
+        for(i = 0; i < counts[length - 1]; i++, n++, code++) {
+            if(code >= (1 << length))
+                return -1;
+            t->symbols[n] = symbols[n];
+
+            if(length <= LOOKAHEAD) {
+                shift = LOOKAHEAD - length;
+                first = code << shift;
+                last = first + (1 << shift);
+                memset(t->look_length + first, length, last - first);
+                memset(t->look_symbol + first, symbols[n], last - first);
+                fast_ac_entries(t, first, last, length, symbols[n]);
+            }
+        }
+        t->maxcode[length] = counts[length - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the tables of a DHT segment, tables that are the same as
+              the cached ones are not built again
+Input Value.: engine, segment without marker and length, and whether tables
+              the frame defined already are kept (to fill in std_dht)
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int read_dht(sharpness *s, const unsigned char *p, int size, int keep_defined)
+{
+    const unsigned char *end = p + size;
+    huffman_table *t;
+    int index, i, n;
+
+    while(p < end) {
+        if(end - p < 17 || (p[0] >> 4) > 1 || (p[0] & 0x0f) > 3) {
+            s->error = "invalid DHT segment";
+            return -1;
+        }
+        index = (p[0] >> 4) * 4 + (p[0] & 0x0f);
+
+        for(i = 0, n = 0; i < 16; i++)
+            n += p[1 + i];
+        if(n > 256 || end - p < 17 + n) {
+            s->error = "invalid DHT segment";
+            return -1;
+        }
+
+        t = &s->huffman[index];
+        if(!(keep_defined && (s->huffman_defined & (1 << index)))) {
+            if(t->source_size != 16 + n || memcmp(t->source, p + 1, 16 + n) != 0) {
+                t->source_size = 0;
+                if(build_table(t, p + 1, p + 17) < 0) {
+                    s->error = "invalid Huffman table";
+                    return -1;
+                }
+                memcpy(t->source, p + 1, 16 + n);
+                t->source_size = 16 + n;
+                s->table_builds++;
+            }
+            s->huffman_defined |= 1 << index;
+        }
+
+        p += 17 + n;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the tables of a DQT segment
+Input Value.: engine, segment without marker and length
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int read_dqt(sharpness *s, const unsigned char *p, int size)
+{
+    const unsigned char *end = p + size;
+    int precision, id, i;
+
+    while(p < end) {
+        precision = p[0] >> 4;
+        id = p[0] & 0x0f;
+        if(precision > 1 || id > 3 || end - p < 1 + 64 * (precision + 1)) {
+            s->error = "invalid DQT segment";
+            return -1;
+        }
+        p++;
+
+        for(i = 0; i < 64; i++, p += precision + 1)
+            s->quant[id][i] = precision ? get16(p) : p[0];
+        s->quant_defined |= 1 << id;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the frame header of a baseline or extended sequential
+              frame
+Input Value.: engine, segment without marker and length
+Return Value: 0 if ok, -1 on errors
+******************************************************************************/
+static int read_sof(sharpness *s, const unsigned char *p, int size)
+{
+    int i;
+
+    if(size < 6 || p[0] != 8) {
+        s->error = "only 8 bit samples are supported";
+        return -1;
+    }
+
+    s->height = get16(p + 1);
+    s->width = get16(p + 3);
+    s->components = p[5];
+    if(s->width == 0 || s->height == 0 || s->components == 0 ||
+       s->components > MAX_COMPONENTS || size < 6 + 3 * s->components) {
+        s->error = "invalid SOF segment";
+        return -1;
+    }
+
+    for(i = 0; i < s->components; i++) {
+        s->comp[i].id = p[6 + 3 * i];
+        s->comp[i].h = p[7 + 3 * i] >> 4;
+        s->comp[i].v = p[7 + 3 * i] & 0x0f;
+        s->comp[i].quant = p[8 + 3 * i];
+        if(s->comp[i].h < 1 || s->comp[i].h > 4 || s->comp[i].v < 1 ||
+           s->comp[i].v > 4 || s->comp[i].quant > 3) {
+            s->error = "invalid SOF segment";
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* fills the bit buffer up to 57..64 bits, after the entropy-coded data
+   ended (at a marker or the end of the frame) zeros are added */
+static void fill(bit_reader *r)
+{
+    int byte;
+
+    while(r->count <= 56) {
+        if(r->data >= r->end) {
+            byte = 0;
+            r->zeros++;
+        } else if(r->data[0] != 0xff) {
+            byte = *r->data++;
+        } else if(r->data + 1 < r->end && r->data[1] == 0x00) {
+            byte = 0xff;
+            r->data += 2;
+        } else {
+            /* a marker, stay in front of it */
+            byte = 0;
+            r->zeros++;
+        }
+        r->bits = (r->bits << 8) | byte;
+        r->count += 8;
+    }
+}
+
+static inline int peek(const bit_reader *r, int n)
+{
+    return (int)(r->bits >> (r->count - n)) & ((1 << n) - 1);
+}
+
+/* decodes the next symbol, -1 for invalid codes */
+static inline int decode(bit_reader *r, const huffman_table *t)
+{
+    int look, length, code;
+
+    if(r->count < 32)
+        fill(r);
+
+    look = peek(r, LOOKAHEAD);
+    if((length = t->look_length[look]) != 0) {
+        r->count -= length;
+        return t->look_symbol[look];
+    }
+
+    for(length = LOOKAHEAD + 1; length <= 16; length++) {
+        code = peek(r, length);
+        if(code <= t->maxcode[length]) {
+            r->count -= length;
+            return t->symbols[code + t->offset[length]];
+        }
+    }
+
+    return -1;
+}
+
+/* the data ran out before the block was complete */
+static inline int truncated(const bit_reader *r)
+{
+    return r->zeros * 8 > r->count;
+}
+
+/******************************************************************************
+Description.: reads one block, the DC difference and the AC coefficients from
+              position keep on are skipped
+Input Value.: bit reader, DC and AC tables, the coefficients and how many of
+              them to extend, 0 to skip the whole block
+Return Value: the last coefficient stored, 0 if none, -1 on errors
+******************************************************************************/
+static int read_block(bit_reader *r, const huffman_table *dc, const huffman_table *ac,
+                      int *coef, int keep)
+{
+    const fast_ac *e;
+    int k, symbol, size, value, last = 0;
+
+    if((symbol = decode(r, dc)) < 0 || symbol > 11)
+        return -1;
+    r->count -= symbol;
+
+    for(k = 1; k < 64; k++) {
+        if(r->count < 32)
+            fill(r);
+
+        e = &ac->look_ac[peek(r, LOOKAHEAD)];
+        if(e->length != 0) {
+            r->count -= e->length;
+            if(e->run == END_OF_BLOCK)
+                break;
+            k += e->run;
+            value = e->value;
+        } else {
+            if((symbol = decode(r, ac)) < 0)
+                return -1;
+
+            size = symbol & 0x0f;
+            if(size == 0) {
+                if(symbol != 0xf0)
+                    break;
+                /* sixteen zeros */
+                k += 15;
+                continue;
+            }
+
+            k += symbol >> 4;
+            value = extend(peek(r, size), size);
+            r->count -= size;
+        }
+
+        if(k > 63)
+            return -1;
+
+        if(k < keep && value != 0) {
+            for(last++; last < k; last++)
+                coef[last] = 0;
+            coef[k] = value;
+        }
+    }
+
+    return last;
+}
+
+/******************************************************************************
+Description.: moves the reader behind the next restart marker
+Input Value.: bit reader
+Return Value: 0 if ok, -1 if there is none
+******************************************************************************/
+static int next_restart(bit_reader *r)
+{
+    const unsigned char *p = r->data;
+
+    while((p = memchr(p, 0xff, r->end - p)) != NULL && p + 1 < r->end) {
+        if(p[1] >= 0xd0 && p[1] <= 0xd7) {
+            r->data = p + 2;
+            r->bits = 0;
+            r->count = 0;
+            r->zeros = 0;
+            return 0;
+        }
+        if(p[1] != 0x00 && p[1] != 0xff)
+            return -1;
+        p++;
+    }
+
+    return -1;
+}
+
+/* the gaussian of the old output_autofocus, its radius is half the distance
+   from the centre to the nearer edge of the region */
+static int compute_weights(sharpness *s, int columns, int rows)
+{
+    double *tmp, center, radius;
+    int i, size = columns > rows ? columns : rows;
+
+    if(size > s->weights_size) {
+        if((tmp = realloc(s->weight_x, size * sizeof(double))) == NULL)
+            return -1;
+        s->weight_x = tmp;
+        if((tmp = realloc(s->weight_y, size * sizeof(double))) == NULL)
+            return -1;
+        s->weight_y = tmp;
+        s->weights_size = size;
+    }
+
+    radius = (columns < rows ? columns : rows) / 4;
+    radius = radius < 1 ? 1 : radius * radius;
+
+    center = columns / 2;
+    for(i = 0; i < columns; i++)
+        s->weight_x[i] = exp(-(i - center) * (i - center) / radius);
+    center = rows / 2;
+    for(i = 0; i < rows; i++)
+        s->weight_y[i] = exp(-(i - center) * (i - center) / radius);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: reads the entropy-coded data of a scan and sums up the weighted
+              coefficients of the luminance blocks in the region
+Input Value.: engine, scan data up to the end of the frame, components of
+              the scan, region and info to fill in
+Return Value: the sharpness, -1 on errors
+******************************************************************************/
+static double read_scan(sharpness *s, const unsigned char *data, const unsigned char *end,
+                        component **scan, int count, const sharpness_roi *roi,
+                        sharpness_info *info)
+{
+    double sum[MEASURED] = {0}, result = 0, d, w;
+    int coef[MEASURED];
+    int hmax = 1, vmax = 1, mcu_columns, mcu_rows, columns, rows, mcus;
+    int x0, x1, y0, y1, mcu, mcu_x, mcu_y, end_mcu, c, h, v, x, y, k, last;
+    int luma_h, luma_v, blocks = 0, decoded = 0;
+    bit_reader r = { data, end, 0, 0, 0 };
+    component *comp;
+
+    for(c = 0; c < s->components; c++) {
+        hmax = s->comp[c].h > hmax ? s->comp[c].h : hmax;
+        vmax = s->comp[c].v > vmax ? s->comp[c].v : vmax;
+    }
+
+    /* blocks of the luminance that show the frame */
+    columns = (s->width * s->comp[0].h / hmax + 7) / 8;
+    rows = (s->height * s->comp[0].v / vmax + 7) / 8;
+
+    if(count == 1) {
+        /* not interleaved, every block is an MCU */
+        luma_h = luma_v = 1;
+        mcu_columns = columns;
+        mcu_rows = rows;
+    } else {
+        luma_h = s->comp[0].h;
+        luma_v = s->comp[0].v;
+        mcu_columns = (s->width + 8 * hmax - 1) / (8 * hmax);
+        mcu_rows = (s->height + 8 * vmax - 1) / (8 * vmax);
+    }
+    mcus = mcu_columns * mcu_rows;
+
+    /* the region in luminance blocks */
+    x0 = (int)(roi->x * columns);
+    y0 = (int)(roi->y * rows);
+    x1 = (int)ceil((roi->x + roi->width) * columns);
+    y1 = (int)ceil((roi->y + roi->height) * rows);
+    x1 = x1 > columns ? columns : x1;
+    y1 = y1 > rows ? rows : y1;
+    if(x1 <= x0 || y1 <= y0) {
+        s->error = "the region of interest is empty";
+        return -1;
+    }
+
+    if(compute_weights(s, x1 - x0, y1 - y0) < 0) {
+        s->error = "not enough memory";
+        return -1;
+    }
+
+    /* no MCU after this one has blocks of the region */
+    end_mcu = ((y1 - 1) / luma_v) * mcu_columns + (x1 - 1) / luma_h + 1;
+
+    for(mcu = 0; mcu < end_mcu; mcu++) {
+        mcu_x = mcu % mcu_columns;
+        mcu_y = mcu / mcu_columns;
+
+        if(s->restart_interval && mcu > 0 && mcu % s->restart_interval == 0) {
+            if(next_restart(&r) < 0) {
+                s->error = "restart marker missing";
+                return -1;
+            }
+        }
+
+        /* at the start of an interval that misses the region, jump to the
+           next one */
+        if(s->restart_interval && mcu % s->restart_interval == 0) {
+            int next = mcu + s->restart_interval, m, hit = 0;
+
+            for(m = mcu; m < next && m < end_mcu && !hit; m++) {
+                x = (m % mcu_columns) * luma_h;
+                y = (m / mcu_columns) * luma_v;
+                hit = x < x1 && x + luma_h > x0 && y < y1 && y + luma_v > y0;
+                /* the rest of the row is right of the region */
+                if(!hit && x >= x1)
+                    m += mcu_columns - m % mcu_columns - 1;
+            }
+            if(!hit && next < end_mcu) {
+                mcu = next - 1;
+                continue;
+            }
+        }
+
+        for(c = 0; c < count; c++) {
+            comp = scan[c];
+            for(v = 0; v < (count == 1 ? 1 : comp->v); v++) {
+                for(h = 0; h < (count == 1 ? 1 : comp->h); h++) {
+                    x = mcu_x * luma_h + h;
+                    y = mcu_y * luma_v + v;
+                    if(comp != &s->comp[0] || x < x0 || x >= x1 || y < y0 || y >= y1) {
+                        if(read_block(&r, &s->huffman[comp->dc], &s->huffman[4 + comp->ac], NULL, 0) < 0)
+                            goto invalid;
+                        continue;
+                    }
+
+                    last = read_block(&r, &s->huffman[comp->dc], &s->huffman[4 + comp->ac], coef, MEASURED);
+                    if(last < 0)
+                        goto invalid;
+
+                    w = s->weight_x[x - x0] * s->weight_y[y - y0];
+                    for(k = 1; k <= last; k++) {
+                        d = coef[k] * s->quant[comp->quant][k];
+                        sum[k] += d * d * w;
+                    }
+                    blocks++;
+                }
+            }
+        }
+
+        if(truncated(&r)) {
+            s->error = "the frame is truncated";
+            return -1;
+        }
+        decoded++;
+    }
+
+    for(k = 1; k < MEASURED; k++)
+        result += diagonal[k] * sum[k] / blocks;
+
+    if(info != NULL) {
+        info->mcus = mcus;
+        info->mcus_decoded = decoded;
+        info->blocks = blocks;
+    }
+
+    return result;
+
+invalid:
+    s->error = "invalid Huffman code";
+    return -1;
+}
+
+/******************************************************************************
+Description.: reads the start of scan header and measures the scan
+Input Value.: engine, segment without marker and length, the end of the
+              frame, region and info to fill in
+Return Value: the sharpness, -1 on errors
+******************************************************************************/
+static double read_sos(sharpness *s, const unsigned char *p, int size,
+                       const unsigned char *end, const sharpness_roi *roi,
+                       sharpness_info *info)
+{
+    component *scan[MAX_COMPONENTS];
+    int count, i, c, blocks = 0;
+
+    if(s->components == 0) {
+        s->error = "scan without frame header";
+        return -1;
+    }
+
+    count = p[0];
+    if(count < 1 || count > s->components || size < 1 + 2 * count + 3) {
+        s->error = "invalid SOS segment";
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        for(c = 0; c < s->components && s->comp[c].id != p[1 + 2 * i]; c++)
+            ;
+        if(c == s->components || (p[2 + 2 * i] >> 4) > 3 || (p[2 + 2 * i] & 0x0f) > 3) {
+            s->error = "invalid SOS segment";
+            return -1;
+        }
+        scan[i] = &s->comp[c];
+        scan[i]->dc = p[2 + 2 * i] >> 4;
+        scan[i]->ac = p[2 + 2 * i] & 0x0f;
+        blocks += scan[i]->h * scan[i]->v;
+
+        /* frames without DHT use the tables of section K.3 */
+        if(!(s->huffman_defined & (1 << scan[i]->dc)) ||
+           !(s->huffman_defined & (1 << (4 + scan[i]->ac)))) {
+            if(read_dht(s, std_dht, sizeof(std_dht), 1) < 0)
+                return -1;
+            if(!(s->huffman_defined & (1 << scan[i]->dc)) ||
+               !(s->huffman_defined & (1 << (4 + scan[i]->ac)))) {
+                s->error = "Huffman table missing";
+                return -1;
+            }
+        }
+        if(!(s->quant_defined & (1 << scan[i]->quant))) {
+            s->error = "quantization table missing";
+            return -1;
+        }
+    }
+
+    if(scan[0] != &s->comp[0]) {
+        s->error = "the first scan has no luminance";
+        return -1;
+    }
+    if(count > 1 && blocks > 10) {
+        s->error = "invalid sampling factors";
+        return -1;
+    }
+
+    return read_scan(s, p + size, end, scan, count, roi, info);
+}
+
+/******************************************************************************
+Description.: creates an engine, it keeps the tables between frames and must
+              not be used by two threads at a time
+Input Value.: -
+Return Value: the engine, NULL if there is not enough memory
+******************************************************************************/
+sharpness *sharpness_new(void)
+{
+    return calloc(1, sizeof(sharpness));
+}
+
+/******************************************************************************
+Description.: frees an engine
+Input Value.: engine or NULL
+Return Value: -
+******************************************************************************/
+void sharpness_free(sharpness *s)
+{
+    if(s == NULL)
+        return;
+
+    free(s->weight_x);
+    free(s->weight_y);
+    free(s);
+}
+
+/******************************************************************************
+Description.: measures the sharpness of a baseline JPEG frame
+Input Value.: engine, frame, region of interest or NULL for the whole frame,
+              info about the frame to fill in or NULL
+Return Value: the sharpness, -1 if the frame can not be read, see
+              sharpness_error() why
+******************************************************************************/
+double sharpness_measure(sharpness *s, const unsigned char *frame, int size,
+                         const sharpness_roi *roi, sharpness_info *info)
+{
+    const unsigned char *p = frame, *end = frame + size;
+    unsigned long builds = s->table_builds;
+    double result = -1;
+    int marker, length;
+
+    s->huffman_defined = s->quant_defined = 0;
+    s->components = 0;
+    s->restart_interval = 0;
+    s->error = NULL;
+
+    if(info != NULL)
+        memset(info, 0, sizeof(*info));
+    if(roi == NULL)
+        roi = &whole_frame;
+
+    if(size < 4 || p[0] != 0xff || p[1] != 0xd8) {
+        s->error = "not a JPEG frame";
+        return -1;
+    }
+    p += 2;
+
+    while(s->error == NULL) {
+        if(p >= end || *p != 0xff) {
+            s->error = "invalid marker";
+            break;
+        }
+
+        /* markers may be preceded by any number of 0xff */
+        while(p < end && *p == 0xff)
+            p++;
+        if(p >= end) {
+            s->error = "the frame is truncated";
+            break;
+        }
+        marker = *p++;
+
+        if(marker == 0xd9) {
+            s->error = "the frame has no scan";
+            break;
+        }
+        if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+            continue;
+
+        if(end - p < 2 || (length = get16(p)) < 2 || end - p < length) {
+            s->error = "the frame is truncated";
+            break;
+        }
+
+        switch(marker) {
+        case 0xc0:
+        case 0xc1:
+            read_sof(s, p + 2, length - 2);
+            break;
+        case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+        case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+            s->error = "only baseline JPEG is supported";
+            break;
+        case 0xc4:
+            read_dht(s, p + 2, length - 2, 0);
+            break;
+        case 0xdb:
+            read_dqt(s, p + 2, length - 2);
+            break;
+        case 0xdd:
+            if(length < 4)
+                s->error = "invalid DRI segment";
+            else
+                s->restart_interval = get16(p + 2);
+            break;
+        case 0xda:
+            result = read_sos(s, p + 2, length - 2, end, roi, info);
+            goto done;
+        default:
+            /* APPn, COM and the like */
+            break;
+        }
+        p += length;
+    }
+
+done:
+    if(info != NULL) {
+        info->width = s->width;
+        info->height = s->height;
+        info->table_builds = s->table_builds - builds;
+    }
+
+    return s->error == NULL ? result : -1;
+}
+
+/******************************************************************************
+Description.: tells why the last frame could not be measured
+Input Value.: engine
+Return Value: a message, NULL if the last frame was fine
+******************************************************************************/
+const char *sharpness_error(const sharpness *s)
+{
+    return s->error;
+}
+
+/******************************************************************************
+Description.: parses a region of interest given as "x,y,width,height" in
+              fractions of the frame
+Input Value.: text and the region to fill in
+Return Value: 0 if ok, -1 if the text is no valid region
+******************************************************************************/
+int sharpness_parse_roi(const char *text, sharpness_roi *roi)
+{
+    sharpness_roi r;
+    char rest;
+
+    if(sscanf(text, "%lf,%lf,%lf,%lf%c", &r.x, &r.y, &r.width, &r.height, &rest) != 4)
+        return -1;
+    if(r.x < 0 || r.y < 0 || r.width <= 0 || r.height <= 0 ||
+       r.x + r.width > 1 || r.y + r.height > 1)
+        return -1;
+
+    *roi = r;
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef SHARPNESS_H
+#define SHARPNESS_H
+
+/* a region of interest in fractions of the frame, 0,0 is the top left */
+typedef struct {
+    double x, y, width, height;
+} sharpness_roi;
+
+/* what it took to measure the last frame */
+typedef struct {
+    int width, height;
+    int mcus;               /* MCUs of the frame */
+    int mcus_decoded;       /* read to get through the region of interest */
+    int blocks;             /* luminance blocks in the region of interest */
+    int table_builds;       /* Huffman tables built, 0 when all were cached */
+} sharpness_info;
+
+typedef struct _sharpness sharpness;
+
+sharpness *sharpness_new(void);
+void sharpness_free(sharpness *s);
+double sharpness_measure(sharpness *s, const unsigned char *frame, int size,
+                         const sharpness_roi *roi, sharpness_info *info);
+const char *sharpness_error(const sharpness *s);
+int sharpness_parse_roi(const char *text, sharpness_roi *roi);
+
+#endif
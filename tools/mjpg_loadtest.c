@@ -0,0 +1,1200 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  A load generator for output_http. It opens many connections from a few
+  threads, each thread serves its share of the clients with epoll:
+
+    stream     one ?action=stream per client, the parts of the multipart
+               response are parsed as they arrive
+    snapshot   ?action=snapshot over and over, a new connection for each
+    keepalive  like snapshot, but asks to keep the connection open and reuses
+               it as long as the server does
+
+  Every frame is checked for SOI and EOI. Frames of input_testpicture carry a
+  sequence number and the time they were published, from those the skipped
+  and repeated frames and the latency are counted. The latency is only
+  meaningful if the server runs on the same machine or the clocks are synced.
+
+  Slow readers receive at most --slow-rate bytes per second, with a small
+  receive buffer, so the server sees the backpressure of a bad connection.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define NSEC 1000000000LL
+#define USEC 1000000LL
+
+#define MAX_THREADS 64
+#define MAX_EVENTS 256
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+#define MAX_HEADER_SIZE (64 * 1024)
+#define RECEIVE_SIZE (64 * 1024)
+
+/* the event loops wake up at least that often for timers */
+#define TICK_MS 10
+
+/* buffer of slow readers, small so the server notices them */
+#define SLOW_RCVBUF 8192
+
+/* log-linear histogram in us, 32 buckets per power of two, up to 2^36 us */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((36 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define STAMP_FORMAT "mjpg-streamer seq=%u time=%ld.%ld"
+
+typedef enum {
+    MODE_STREAM,
+    MODE_SNAPSHOT,
+    MODE_KEEPALIVE
+} load_mode;
+
+typedef enum {
+    PHASE_IDLE,         /* waiting for the time to connect */
+    PHASE_CONNECTING,   /* non-blocking connect in progress */
+    PHASE_RESPONSE,     /* reading the response headers */
+    PHASE_DELIMITER,    /* looking for the next part delimiter */
+    PHASE_HEADERS,      /* reading the part headers */
+    PHASE_BODY,         /* reading a body of known length */
+    PHASE_SEARCH,       /* reading a part without Content-Length */
+    PHASE_UNTIL_CLOSE   /* reading a snapshot that ends with the connection */
+} client_phase;
+
+typedef struct {
+    unsigned long long count[HIST_BUCKETS];
+    unsigned long long total;
+} histogram;
+
+typedef struct {
+    int id;
+    int fd;
+    int slow;
+    client_phase phase;
+
+    char *buffer;
+    int capacity, start, end;
+    int searched;
+    int content_length;
+    int keepalive;              /* the server keeps the connection open */
+    char delimiter[80];
+
+    long long next_connect;     /* ns, when to connect or send the next request */
+    double budget;              /* bytes a slow reader may receive */
+    long long budget_time;
+    int paused;
+
+    /* counted in the measuring window */
+    unsigned long long frames, bytes;
+    unsigned long skipped, repeated, invalid, errors, connects, requests;
+    unsigned int last_seq;
+    int have_seq;
+    long long last_frame;       /* ns, for the gaps */
+} client;
+
+typedef struct {
+    pthread_t thread;
+    int epollfd;
+    client *clients;
+    int count;
+    histogram gaps, latency;
+
+    /* read by the main thread for the progress report */
+    unsigned long long frames, bytes;
+    int connected;
+} worker;
+
+static struct addrinfo *server;
+static char *host = "127.0.0.1";
+static char *port = "8080";
+static char *path = NULL;
+static char *authorization = NULL;
+static load_mode mode = MODE_STREAM;
+static int client_count = 100;
+static int thread_count = 1;
+static int slow_count = 0;
+static double slow_rate = 64 * 1024;
+static double snapshot_fps = 0;
+static double duration = 10, ramp = 1, warmup = 1, interval = 1;
+static int reconnect = 1;
+static int verbose = 0;
+static char *output_file = NULL;
+
+static worker workers[MAX_THREADS];
+
+/* client i is served by thread i % thread_count */
+#define CLIENT(i) (&workers[(i) % thread_count].clients[(i) / thread_count])
+static volatile int measuring, stop;
+
+/******************************************************************************
+Description.: print the help for this program
+Input Value.: name of the program
+Return Value: -
+******************************************************************************/
+static void help(char *progname)
+{
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Usage: %s [options]\n" \
+            " opens many connections to output_http and measures what they receive\n\n" \
+            " [-H | --host ]........: server, default 127.0.0.1\n" \
+            " [-p | --port ]........: port, default 8080\n" \
+            " [-m | --mode ]........: stream, snapshot or keepalive, default stream\n" \
+            " [-u | --url ].........: path to request, default /?action=stream or\n" \
+            "                         /?action=snapshot\n" \
+            " [-a | --auth ]........: username:password\n" \
+            " [-c | --clients ].....: number of clients, default 100\n" \
+            " [-j | --threads ].....: threads serving the clients, default 1\n" \
+            " [-s | --slow ]........: number of the clients that read slowly\n" \
+            " [-S | --slow-rate ]...: bytes per second a slow client reads, default 65536\n" \
+            " [-f | --fps ].........: snapshots per second of each client, default 0\n" \
+            "                         for as many as possible\n" \
+            " [-r | --ramp ]........: seconds to spread the connects over, default 1\n" \
+            " [-w | --warmup ]......: seconds to wait after the ramp, default 1\n" \
+            " [-d | --duration ]....: seconds to measure, default 10\n" \
+            " [-i | --interval ]....: seconds between progress reports, 0 for none,\n" \
+            "                         default 1\n" \
+            " [-n | --no-reconnect ]: do not reconnect a stream that ended\n" \
+            " [-o | --output ]......: write the results as JSON to this file\n" \
+            " [-v | --verbose ].....: print the results of every client\n" \
+            " [-h | --help ]........: display this help\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+    fprintf(stderr, "Example:\n" \
+            " 2000 clients of a stream, 100 of them reading 32 kB/s:\n" \
+            "  %s -p 8080 -c 2000 -j 4 -s 100 -S 32768\n", progname);
+    fprintf(stderr, "-----------------------------------------------------------------------\n");
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/******************************************************************************
+Description.: add a value to a histogram
+Input Value.: histogram, value in us
+Return Value: -
+******************************************************************************/
+static void hist_add(histogram *h, long long us)
+{
+    int exponent, index;
+
+    if(us < 0)
+        us = 0;
+
+    if(us < HIST_SUB) {
+        index = us;
+    } else {
+        exponent = 63 - __builtin_clzll(us);
+        index = (exponent - HIST_SUB_BITS + 1) * HIST_SUB +
+                ((us >> (exponent - HIST_SUB_BITS)) & (HIST_SUB - 1));
+        if(index >= HIST_BUCKETS)
+            index = HIST_BUCKETS - 1;
+    }
+
+    h->count[index]++;
+    h->total++;
+}
+
+/* the smallest value of a bucket */
+static long long hist_value(int index)
+{
+    int exponent;
+
+    if(index < HIST_SUB)
+        return index;
+
+    exponent = index / HIST_SUB + HIST_SUB_BITS - 1;
+    return (1LL << exponent) + ((long long)(index % HIST_SUB) << (exponent - HIST_SUB_BITS));
+}
+
+static long long hist_percentile(const histogram *h, double percentile)
+{
+    unsigned long long rank, seen = 0;
+    int i;
+
+    if(h->total == 0)
+        return 0;
+
+    rank = (unsigned long long)(h->total * percentile / 100.0);
+    if(rank >= h->total)
+        rank = h->total - 1;
+
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if(seen > rank)
+            return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static void hist_merge(histogram *to, const histogram *from)
+{
+    int i;
+
+    for(i = 0; i < HIST_BUCKETS; i++)
+        to->count[i] += from->count[i];
+    to->total += from->total;
+}
+
+/******************************************************************************
+Description.: encode username:password for the Authorization header
+Input Value.: the string to encode
+Return Value: base64 string, to be freed
+******************************************************************************/
+static char *base64(const char *data)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int length = strlen(data), i, j = 0;
+    char *out = malloc(4 * ((length + 2) / 3) + 1);
+    unsigned int n;
+
+    for(i = 0; i < length; i += 3) {
+        n = (unsigned char)data[i] << 16;
+        if(i + 1 < length) n |= (unsigned char)data[i + 1] << 8;
+        if(i + 2 < length) n |= (unsigned char)data[i + 2];
+        out[j++] = table[(n >> 18) & 63];
+        out[j++] = table[(n >> 12) & 63];
+        out[j++] = (i + 1 < length) ? table[(n >> 6) & 63] : '=';
+        out[j++] = (i + 2 < length) ? table[n & 63] : '=';
+    }
+    out[j] = '\0';
+    return out;
+}
+
+/******************************************************************************
+Description.: close the connection of a client and schedule the next one
+Input Value.: worker, client, time of the next connect in ns or -1 for never
+Return Value: -
+******************************************************************************/
+static void disconnect(worker *w, client *cl, long long next)
+{
+    if(cl->fd >= 0) {
+        epoll_ctl(w->epollfd, EPOLL_CTL_DEL, cl->fd, NULL);
+        close(cl->fd);
+        cl->fd = -1;
+        if(cl->phase > PHASE_CONNECTING)
+            __atomic_fetch_sub(&w->connected, 1, __ATOMIC_RELAXED);
+    }
+    cl->phase = PHASE_IDLE;
+    cl->next_connect = next;
+    cl->start = cl->end = 0;
+    cl->paused = 0;
+}
+
+static void fail(worker *w, client *cl, const char *reason)
+{
+    if(measuring)
+        cl->errors++;
+    if(verbose)
+        fprintf(stderr, "client %d: %s\n", cl->id, reason);
+
+    /* stream clients that fail are not replaced, it would hide the problem */
+    disconnect(w, cl, (mode == MODE_STREAM && !reconnect) ? -1 : now_ns() + NSEC / 10);
+}
+
+/******************************************************************************
+Description.: start a non-blocking connect
+Input Value.: worker, client
+Return Value: -
+******************************************************************************/
+static void start_connect(worker *w, client *cl)
+{
+    struct epoll_event event;
+    int size = SLOW_RCVBUF, one = 1;
+
+    cl->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(cl->fd < 0) {
+        fail(w, cl, strerror(errno));
+        return;
+    }
+
+    if(cl->slow)
+        setsockopt(cl->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(cl->fd, server->ai_addr, server->ai_addrlen) != 0 && errno != EINPROGRESS) {
+        fail(w, cl, strerror(errno));
+        return;
+    }
+
+    cl->phase = PHASE_CONNECTING;
+    event.events = EPOLLOUT;
+    event.data.ptr = cl;
+    epoll_ctl(w->epollfd, EPOLL_CTL_ADD, cl->fd, &event);
+}
+
+/******************************************************************************
+Description.: send the request of a client
+Input Value.: worker, client
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+static int send_request(worker *w, client *cl)
+{
+    char request[1024];
+    int length;
+
+    length = snprintf(request, sizeof(request), "GET %s HTTP/1.%d\r\n" \
+                      "Host: %s:%s\r\n" \
+                      "User-Agent: mjpg_loadtest\r\n" \
+                      "%s%s%s" \
+                      "Connection: %s\r\n" \
+                      "\r\n",
+                      path, mode == MODE_KEEPALIVE, host, port,
+                      authorization ? "Authorization: Basic " : "",
+                      authorization ? authorization : "",
+                      authorization ? "\r\n" : "",
+                      mode == MODE_KEEPALIVE ? "keep-alive" : "close");
+
+    /* the request fits into the empty send buffer of the socket */
+    if(send(cl->fd, request, length, MSG_NOSIGNAL) != length)
+        return -1;
+
+    if(measuring)
+        cl->requests++;
+    cl->phase = PHASE_RESPONSE;
+    cl->content_length = -1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: check and count a frame
+Input Value.: worker, client, JPEG data and its size
+Return Value: -
+******************************************************************************/
+static void frame_done(worker *w, client *cl, const unsigned char *data, int size)
+{
+    struct timeval now;
+    long long t = now_ns();
+    unsigned int seq;
+    long sec, usec;
+
+    __atomic_fetch_add(&w->frames, 1, __ATOMIC_RELAXED);
+
+    if(!measuring) {
+        cl->last_frame = 0;
+        cl->have_seq = 0;
+        return;
+    }
+
+    cl->frames++;
+
+    if(size < 4 || data[0] != 0xff || data[1] != 0xd8 ||
+       data[size - 2] != 0xff || data[size - 1] != 0xd9) {
+        cl->invalid++;
+        if(verbose)
+            fprintf(stderr, "client %d: invalid JPEG of %d bytes\n", cl->id, size);
+    }
+
+    if(cl->last_frame != 0)
+        hist_add(&w->gaps, (t - cl->last_frame) / 1000);
+    cl->last_frame = t;
+
+    /* the COM segment of input_testpicture right after SOI */
+    if(size > 70 && data[2] == 0xff && data[3] == 0xfe &&
+       sscanf((const char *)data + 6, STAMP_FORMAT, &seq, &sec, &usec) == 3) {
+        gettimeofday(&now, NULL);
+        hist_add(&w->latency, (now.tv_sec - sec) * USEC + (now.tv_usec - usec));
+
+        if(cl->have_seq) {
+            if(seq == cl->last_seq || seq < cl->last_seq)
+                cl->repeated++;
+            else
+                cl->skipped += seq - cl->last_seq - 1;
+        }
+        cl->last_seq = seq;
+        cl->have_seq = 1;
+    }
+}
+
+/******************************************************************************
+Description.: the next snapshot of a client, on the same connection if the
+              server keeps it open
+Input Value.: worker, client
+Return Value: -
+******************************************************************************/
+static void next_snapshot(worker *w, client *cl)
+{
+    long long next = now_ns();
+
+    if(snapshot_fps > 0)
+        next += NSEC / snapshot_fps;
+
+    if(mode == MODE_KEEPALIVE && cl->keepalive && cl->content_length >= 0) {
+        cl->phase = PHASE_IDLE;
+        cl->next_connect = next;
+    } else {
+        disconnect(w, cl, next);
+    }
+}
+
+/* find the value of a header, the headers end with CRLF */
+static char *find_header(char *headers, const char *name)
+{
+    char *line;
+
+    for(line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, name, strlen(name)) == 0)
+            return line + 2 + strlen(name);
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Description.: parse the response headers, the boundary of a stream and the
+              length of a snapshot
+Input Value.: worker, client, headers terminated by the empty line
+Return Value: 0 if ok, -1 on error
+******************************************************************************/
+static int parse_response(worker *w, client *cl, char *headers)
+{
+    char *value, *end;
+
+    if(strncmp(headers, "HTTP/1.", 7) != 0 || atoi(headers + 9) != 200) {
+        fail(w, cl, "unexpected response");
+        return -1;
+    }
+
+    value = find_header(headers, "Content-Length:");
+    cl->content_length = value ? atoi(value) : -1;
+    value = find_header(headers, "Connection:");
+    cl->keepalive = value && strncasecmp(value + strspn(value, " "), "keep-alive", 10) == 0;
+
+    if(mode != MODE_STREAM) {
+        if(cl->content_length > MAX_FRAME_SIZE) {
+            fail(w, cl, "snapshot too large");
+            return -1;
+        }
+        cl->phase = (cl->content_length >= 0) ? PHASE_BODY : PHASE_UNTIL_CLOSE;
+        return 0;
+    }
+
+    value = find_header(headers, "Content-Type:");
+    if(value == NULL || (value = strstr(value, "boundary=")) == NULL) {
+        fail(w, cl, "no boundary in the response");
+        return -1;
+    }
+    value += strlen("boundary=");
+    if(*value == '"')
+        value++;
+    if(strncmp(value, "--", 2) == 0)
+        value += 2;
+    end = value + strcspn(value, "\"\r\n; ");
+    snprintf(cl->delimiter, sizeof(cl->delimiter), "--%.*s", (int)(end - value), value);
+
+    cl->phase = PHASE_DELIMITER;
+    return 0;
+}
+
+/******************************************************************************
+Description.: parse what a client received so far
+Input Value.: worker, client
+Return Value: 0 if ok, -1 if the client was disconnected
+******************************************************************************/
+static int parse(worker *w, client *cl)
+{
+    char *data, *found;
+    int available, length;
+
+    for(;;) {
+        data = cl->buffer + cl->start;
+        available = cl->end - cl->start;
+
+        switch(cl->phase) {
+        case PHASE_RESPONSE:
+        case PHASE_HEADERS:
+            if((found = memmem(data, available, "\r\n\r\n", 4)) == NULL) {
+                if(available > MAX_HEADER_SIZE) {
+                    fail(w, cl, "headers too long");
+                    return -1;
+                }
+                return 0;
+            }
+            found[2] = '\0';
+            cl->start += found + 4 - data;
+
+            if(cl->phase == PHASE_RESPONSE) {
+                if(parse_response(w, cl, data) != 0)
+                    return -1;
+                break;
+            }
+
+            found = find_header(data, "Content-Length:");
+            cl->content_length = found ? atoi(found) : -1;
+            if(cl->content_length > MAX_FRAME_SIZE) {
+                fail(w, cl, "frame too large");
+                return -1;
+            }
+            cl->searched = cl->start;
+            cl->phase = (cl->content_length >= 0) ? PHASE_BODY : PHASE_SEARCH;
+            break;
+
+        case PHASE_DELIMITER:
+            length = strlen(cl->delimiter);
+            if((found = memmem(data, available, cl->delimiter, length)) == NULL) {
+                if(available > length)
+                    cl->start = cl->end - length;
+                return 0;
+            }
+            /* the part headers start with the CRLF behind the delimiter */
+            cl->start += found + length - data;
+            cl->phase = PHASE_HEADERS;
+            break;
+
+        case PHASE_BODY:
+            if(available < cl->content_length)
+                return 0;
+            frame_done(w, cl, (unsigned char *)data, cl->content_length);
+            cl->start += cl->content_length;
+
+            if(mode != MODE_STREAM) {
+                next_snapshot(w, cl);
+                return 0;
+            }
+            cl->phase = PHASE_DELIMITER;
+            break;
+
+        case PHASE_SEARCH:
+            length = strlen(cl->delimiter);
+            found = memmem(cl->buffer + cl->searched, cl->end - cl->searched, cl->delimiter, length);
+            if(found == NULL) {
+                if(cl->end - cl->searched > length)
+                    cl->searched = cl->end - length;
+                if(available > MAX_FRAME_SIZE) {
+                    fail(w, cl, "no delimiter found");
+                    return -1;
+                }
+                return 0;
+            }
+            length = found - data;
+            if(length >= 2 && found[-2] == '\r' && found[-1] == '\n')
+                length -= 2;
+            frame_done(w, cl, (unsigned char *)data, length);
+            cl->start += found - data;
+            cl->phase = PHASE_DELIMITER;
+            break;
+
+        case PHASE_UNTIL_CLOSE:
+            if(available > MAX_FRAME_SIZE) {
+                fail(w, cl, "snapshot too large");
+                return -1;
+            }
+            return 0;
+
+        default:
+            return 0;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: make room for at least RECEIVE_SIZE bytes behind the data, or
+              the rest of a body of known length
+Input Value.: client
+Return Value: 0 if ok, -1 if out of memory
+******************************************************************************/
+static int make_room(client *cl)
+{
+    int needed = RECEIVE_SIZE, shift;
+    char *tmp;
+
+    if(cl->phase == PHASE_BODY && cl->content_length - (cl->end - cl->start) > needed)
+        needed = cl->content_length - (cl->end - cl->start);
+
+    if(cl->start == cl->end) {
+        cl->start = cl->end = 0;
+        cl->searched = 0;
+    } else if(cl->capacity - cl->end < needed && cl->start > 0) {
+        shift = cl->start;
+        memmove(cl->buffer, cl->buffer + shift, cl->end - shift);
+        cl->start = 0;
+        cl->end -= shift;
+        cl->searched = (cl->searched > shift) ? cl->searched - shift : 0;
+    }
+
+    if(cl->capacity - cl->end < needed) {
+        int capacity = cl->capacity ? cl->capacity : RECEIVE_SIZE;
+
+        while(capacity - cl->end < needed)
+            capacity *= 2;
+        if((tmp = realloc(cl->buffer, capacity)) == NULL)
+            return -1;
+        cl->buffer = tmp;
+        cl->capacity = capacity;
+    }
+    return 0;
+}
+
+/******************************************************************************
+Description.: receive what is available for a client
+Input Value.: worker, client
+Return Value: -
+******************************************************************************/
+static void receive(worker *w, client *cl)
+{
+    struct epoll_event event;
+    int limit, received;
+
+    if(make_room(cl) != 0) {
+        fail(w, cl, "not enough memory");
+        return;
+    }
+
+    limit = cl->capacity - cl->end;
+    if(cl->slow) {
+        if(cl->budget < 1) {
+            /* stop polling until the budget allows more */
+            event.events = 0;
+            event.data.ptr = cl;
+            epoll_ctl(w->epollfd, EPOLL_CTL_MOD, cl->fd, &event);
+            cl->paused = 1;
+            return;
+        }
+        if(limit > cl->budget)
+            limit = cl->budget;
+    }
+
+    received = recv(cl->fd, cl->buffer + cl->end, limit, 0);
+    if(received < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+            fail(w, cl, strerror(errno));
+        return;
+    }
+
+    if(received == 0) {
+        if(cl->phase == PHASE_UNTIL_CLOSE) {
+            frame_done(w, cl, (unsigned char *)cl->buffer + cl->start, cl->end - cl->start);
+            next_snapshot(w, cl);
+        } else if(mode != MODE_STREAM && cl->phase == PHASE_IDLE) {
+            /* the server closed a kept connection, use a new one */
+            disconnect(w, cl, cl->next_connect);
+        } else {
+            fail(w, cl, "connection closed by the server");
+        }
+        return;
+    }
+
+    cl->end += received;
+    if(cl->slow)
+        cl->budget -= received;
+    __atomic_fetch_add(&w->bytes, received, __ATOMIC_RELAXED);
+    if(measuring)
+        cl->bytes += received;
+
+    parse(w, cl);
+}
+
+/******************************************************************************
+Description.: a connect finished, send the request
+Input Value.: worker, client
+Return Value: -
+******************************************************************************/
+static void connected(worker *w, client *cl)
+{
+    struct epoll_event event;
+    socklen_t length = sizeof(int);
+    int error = 0;
+
+    getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if(error != 0) {
+        fail(w, cl, strerror(error));
+        return;
+    }
+
+    __atomic_fetch_add(&w->connected, 1, __ATOMIC_RELAXED);
+    if(measuring)
+        cl->connects++;
+
+    if(send_request(w, cl) != 0) {
+        fail(w, cl, "could not send the request");
+        return;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = cl;
+    epoll_ctl(w->epollfd, EPOLL_CTL_MOD, cl->fd, &event);
+}
+
+/******************************************************************************
+Description.: the timers of the clients: connects, snapshots on a kept
+              connection and the budget of slow readers
+Input Value.: worker, current time
+Return Value: -
+******************************************************************************/
+static void timers(worker *w, long long now)
+{
+    struct epoll_event event;
+    client *cl;
+    int i;
+
+    for(i = 0; i < w->count; i++) {
+        cl = &w->clients[i];
+
+        if(cl->phase == PHASE_IDLE && cl->next_connect >= 0 && cl->next_connect <= now) {
+            if(cl->fd < 0) {
+                start_connect(w, cl);
+            } else if(send_request(w, cl) != 0) {
+                /* the kept connection is gone */
+                disconnect(w, cl, now);
+            }
+        }
+
+        if(cl->slow && cl->fd >= 0) {
+            cl->budget += slow_rate * (now - cl->budget_time) / NSEC;
+            /* at most a tenth of a second in one go */
+            if(cl->budget > slow_rate / 10 + 1)
+                cl->budget = slow_rate / 10 + 1;
+            cl->budget_time = now;
+
+            if(cl->paused && cl->budget >= 1) {
+                event.events = EPOLLIN;
+                event.data.ptr = cl;
+                epoll_ctl(w->epollfd, EPOLL_CTL_MOD, cl->fd, &event);
+                cl->paused = 0;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: the event loop of a worker thread
+Input Value.: the worker
+Return Value: NULL
+******************************************************************************/
+static void *worker_thread(void *arg)
+{
+    worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    long long last_timers = 0, now;
+    client *cl;
+    int i, n;
+
+    while(!stop) {
+        n = epoll_wait(w->epollfd, events, MAX_EVENTS, TICK_MS);
+
+        for(i = 0; i < n; i++) {
+            cl = events[i].data.ptr;
+            if(cl->fd < 0)
+                continue;
+
+            if(cl->phase == PHASE_CONNECTING)
+                connected(w, cl);
+            else if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                receive(w, cl);
+        }
+
+        now = now_ns();
+        if(now - last_timers >= TICK_MS * 1000000LL) {
+            timers(w, now);
+            last_timers = now;
+        }
+    }
+
+    for(i = 0; i < w->count; i++)
+        disconnect(w, &w->clients[i], -1);
+
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/******************************************************************************
+Description.: print the results and write them as JSON if requested
+Input Value.: measured time in seconds
+Return Value: -
+******************************************************************************/
+static void report(double seconds)
+{
+    histogram gaps, latency;
+    unsigned long long frames = 0, bytes = 0;
+    unsigned long skipped = 0, repeated = 0, invalid = 0, errors = 0, connects = 0, requests = 0;
+    double *fps = malloc(client_count * sizeof(double));
+    FILE *f = NULL;
+    client *cl;
+    int i, j, k = 0;
+
+    memset(&gaps, 0, sizeof(gaps));
+    memset(&latency, 0, sizeof(latency));
+
+    for(i = 0; i < thread_count; i++) {
+        hist_merge(&gaps, &workers[i].gaps);
+        hist_merge(&latency, &workers[i].latency);
+        for(j = 0; j < workers[i].count; j++) {
+            cl = &workers[i].clients[j];
+            frames += cl->frames;
+            bytes += cl->bytes;
+            skipped += cl->skipped;
+            repeated += cl->repeated;
+            invalid += cl->invalid;
+            errors += cl->errors;
+            connects += cl->connects;
+            requests += cl->requests;
+            fps[k++] = cl->frames / seconds;
+        }
+    }
+    qsort(fps, k, sizeof(double), compare_double);
+
+    printf("clients.........: %d (%d slow), %s mode, %.1f s\n", client_count, slow_count,
+           mode == MODE_STREAM ? "stream" : (mode == MODE_SNAPSHOT ? "snapshot" : "keepalive"), seconds);
+    printf("frames..........: %llu, %.1f per second, %.1f MB/s\n",
+           frames, frames / seconds, bytes / seconds / (1024 * 1024));
+    printf("fps per client..: min %.1f, median %.1f, max %.1f\n", fps[0], fps[k / 2], fps[k - 1]);
+    printf("gaps (ms).......: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           hist_percentile(&gaps, 50) / 1e3, hist_percentile(&gaps, 90) / 1e3,
+           hist_percentile(&gaps, 99) / 1e3, hist_percentile(&gaps, 100) / 1e3);
+    if(latency.total > 0)
+        printf("latency (ms)....: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+               hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 90) / 1e3,
+               hist_percentile(&latency, 99) / 1e3, hist_percentile(&latency, 100) / 1e3);
+    else
+        printf("latency (ms)....: no frames of input_testpicture\n");
+    printf("frames skipped..: %lu, repeated: %lu, invalid: %lu\n", skipped, repeated, invalid);
+    printf("connects........: %lu, requests: %lu, errors: %lu\n", connects, requests, errors);
+
+    if(verbose) {
+        for(i = 0; i < client_count; i++) {
+            cl = CLIENT(i);
+            printf("client %5d%s: %.1f fps, %llu frames, %.1f kB/s, %lu skipped, %lu errors\n",
+                       cl->id, cl->slow ? " (slow)" : "", cl->frames / seconds, cl->frames,
+                   cl->bytes / seconds / 1024, cl->skipped, cl->errors);
+        }
+    }
+
+    if(output_file != NULL && (f = fopen(output_file, "w")) == NULL)
+        perror(output_file);
+
+    if(f != NULL) {
+        fprintf(f, "{\"mode\": \"%s\", \"clients\": %d, \"slow\": %d, \"seconds\": %.3f,\n",
+                mode == MODE_STREAM ? "stream" : (mode == MODE_SNAPSHOT ? "snapshot" : "keepalive"),
+                client_count, slow_count, seconds);
+        fprintf(f, "\"frames\": %llu, \"bytes\": %llu, \"skipped\": %lu, \"repeated\": %lu, "
+                "\"invalid\": %lu, \"connects\": %lu, \"requests\": %lu, \"errors\": %lu,\n",
+                frames, bytes, skipped, repeated, invalid, connects, requests, errors);
+        fprintf(f, "\"fps\": {\"min\": %.2f, \"p50\": %.2f, \"max\": %.2f},\n", fps[0], fps[k / 2], fps[k - 1]);
+        fprintf(f, "\"gaps_us\": {\"count\": %llu, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+                gaps.total, hist_percentile(&gaps, 50), hist_percentile(&gaps, 90),
+                hist_percentile(&gaps, 99), hist_percentile(&gaps, 100));
+        fprintf(f, "\"latency_us\": {\"count\": %llu, \"p50\": %lld, \"p90\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+                latency.total, hist_percentile(&latency, 50), hist_percentile(&latency, 90),
+                hist_percentile(&latency, 99), hist_percentile(&latency, 100));
+        fprintf(f, "\"per_client\": [");
+        for(i = 0; i < client_count; i++) {
+            cl = CLIENT(i);
+            fprintf(f, "%s\n{\"id\": %d, \"slow\": %s, \"fps\": %.2f, \"frames\": %llu, \"bytes\": %llu, "
+                    "\"skipped\": %lu, \"repeated\": %lu, \"invalid\": %lu, \"connects\": %lu, \"errors\": %lu}",
+                    i ? "," : "", cl->id, cl->slow ? "true" : "false", cl->frames / seconds,
+                    cl->frames, cl->bytes, cl->skipped, cl->repeated, cl->invalid, cl->connects, cl->errors);
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+    }
+
+    free(fps);
+}
+
+/******************************************************************************
+Description.: allow as many file descriptors as the hard limit permits
+Input Value.: descriptors needed
+Return Value: -
+******************************************************************************/
+static void raise_fd_limit(int needed)
+{
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return;
+
+    if(limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if(limit.rlim_cur < needed)
+        fprintf(stderr, "warning: only %lu file descriptors allowed, raise the limit with ulimit -n\n",
+                (unsigned long)limit.rlim_cur);
+}
+
+static void signal_handler(int sig)
+{
+    stop = 1;
+}
+
+/******************************************************************************
+Description.: wait, printing the progress
+Input Value.: seconds to wait, label of the phase
+Return Value: -
+******************************************************************************/
+static void wait_progress(double seconds, const char *phase)
+{
+    static unsigned long long last_frames, last_bytes;
+    static long long last_report;
+    long long end = now_ns() + seconds * NSEC, next = now_ns() + interval * NSEC, now;
+    double elapsed;
+    unsigned long long frames, bytes;
+    int i, connected;
+
+    while(!stop && (now = now_ns()) < end) {
+        if(interval <= 0 || next > end) {
+            usleep((end - now) / 1000 > 100000 ? 100000 : (end - now) / 1000);
+            continue;
+        }
+        if(now < next) {
+            usleep((next - now) / 1000 > 100000 ? 100000 : (next - now) / 1000);
+            continue;
+        }
+
+        frames = bytes = 0;
+        connected = 0;
+        for(i = 0; i < thread_count; i++) {
+            frames += __atomic_load_n(&workers[i].frames, __ATOMIC_RELAXED);
+            bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+            connected += __atomic_load_n(&workers[i].connected, __ATOMIC_RELAXED);
+        }
+        elapsed = last_report ? (double)(now - last_report) / NSEC : interval;
+        fprintf(stderr, "%-9s %5d connected, %8.1f frames/s, %8.1f MB/s\n", phase, connected,
+                (frames - last_frames) / elapsed, (bytes - last_bytes) / elapsed / (1024 * 1024));
+        last_report = now;
+        last_frames = frames;
+        last_bytes = bytes;
+        next += interval * NSEC;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    long long start;
+    double measured;
+    int i, j, rc;
+
+    while(1) {
+        int c = 0;
+        static struct option long_options[] = {
+            {"help", no_argument, NULL, 'h'},
+            {"host", required_argument, NULL, 'H'},
+            {"port", required_argument, NULL, 'p'},
+            {"mode", required_argument, NULL, 'm'},
+            {"url", required_argument, NULL, 'u'},
+            {"auth", required_argument, NULL, 'a'},
+            {"clients", required_argument, NULL, 'c'},
+            {"threads", required_argument, NULL, 'j'},
+            {"slow", required_argument, NULL, 's'},
+            {"slow-rate", required_argument, NULL, 'S'},
+            {"fps", required_argument, NULL, 'f'},
+            {"ramp", required_argument, NULL, 'r'},
+            {"warmup", required_argument, NULL, 'w'},
+            {"duration", required_argument, NULL, 'd'},
+            {"interval", required_argument, NULL, 'i'},
+            {"no-reconnect", no_argument, NULL, 'n'},
+            {"output", required_argument, NULL, 'o'},
+            {"verbose", no_argument, NULL, 'v'},
+            {NULL, 0, NULL, 0}
+        };
+
+        c = getopt_long(argc, argv, "hH:p:m:u:a:c:j:s:S:f:r:w:d:i:no:v", long_options, NULL);
+
+        /* no more options to parse */
+        if(c == -1) break;
+
+        switch(c) {
+        case 'H':
+            host = optarg;
+            break;
+
+        case 'p':
+            port = optarg;
+            break;
+
+        case 'm':
+            if(strcmp(optarg, "stream") == 0) {
+                mode = MODE_STREAM;
+            } else if(strcmp(optarg, "snapshot") == 0) {
+                mode = MODE_SNAPSHOT;
+            } else if(strcmp(optarg, "keepalive") == 0) {
+                mode = MODE_KEEPALIVE;
+            } else {
+                fprintf(stderr, "unknown mode %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'u':
+            path = optarg;
+            break;
+
+        case 'a':
+            authorization = base64(optarg);
+            break;
+
+        case 'c':
+            client_count = atoi(optarg);
+            break;
+
+        case 'j':
+            thread_count = atoi(optarg);
+            break;
+
+        case 's':
+            slow_count = atoi(optarg);
+            break;
+
+        case 'S':
+            slow_rate = strtod(optarg, NULL);
+            break;
+
+        case 'f':
+            snapshot_fps = strtod(optarg, NULL);
+            break;
+
+        case 'r':
+            ramp = strtod(optarg, NULL);
+            break;
+
+        case 'w':
+            warmup = strtod(optarg, NULL);
+            break;
+
+        case 'd':
+            duration = strtod(optarg, NULL);
+            break;
+
+        case 'i':
+            interval = strtod(optarg, NULL);
+            break;
+
+        case 'n':
+            reconnect = 0;
+            break;
+
+        case 'o':
+            output_file = optarg;
+            break;
+
+        case 'v':
+            verbose = 1;
+            break;
+
+        case 'h': /* fall through */
+        default:
+            help(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(client_count < 1 || thread_count < 1 || thread_count > MAX_THREADS ||
+       slow_count < 0 || slow_count > client_count || slow_rate < 1 || duration <= 0) {
+        fprintf(stderr, "invalid arguments, see %s --help\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if(thread_count > client_count)
+        thread_count = client_count;
+    if(path == NULL)
+        path = (mode == MODE_STREAM) ? "/?action=stream" : "/?action=snapshot";
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if((rc = getaddrinfo(host, port, &hints, &server)) != 0) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+
+    raise_fd_limit(client_count + thread_count + 16);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    /* the clients are spread over the threads, the slow ones too, the
+       connects over the ramp */
+    start = now_ns();
+    for(i = 0; i < thread_count; i++) {
+        workers[i].count = client_count / thread_count + (i < client_count % thread_count);
+        workers[i].clients = calloc(workers[i].count, sizeof(client));
+        if(workers[i].clients == NULL || (workers[i].epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("could not set up the clients");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < client_count; i++) {
+        client *cl = CLIENT(i);
+
+        cl->id = i;
+        cl->fd = -1;
+        cl->slow = slow_count > 0 && (long long)i * slow_count / client_count !=
+                   (long long)(i + 1) * slow_count / client_count;
+        cl->phase = PHASE_IDLE;
+        cl->next_connect = start + (long long)(ramp * NSEC * i / client_count);
+        cl->budget_time = start;
+    }
+    for(i = 0; i < thread_count; i++)
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+
+    wait_progress(ramp + warmup, "warmup");
+
+    start = now_ns();
+    measuring = 1;
+    wait_progress(duration, "measuring");
+    measuring = 0;
+    measured = (double)(now_ns() - start) / NSEC;
+
+    stop = 1;
+    for(i = 0; i < thread_count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    report(measured);
+
+    for(i = 0; i < thread_count; i++) {
+        for(j = 0; j < workers[i].count; j++)
+            free(workers[i].clients[j].buffer);
+        free(workers[i].clients);
+        close(workers[i].epollfd);
+    }
+    freeaddrinfo(server);
+    free(authorization);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,522 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+  Output plugins may ask for frames with a lower JPEG quality than the input
+  delivers, e.g. to serve clients on a slow link. Instead of decoding and
+  encoding the frame again the DCT coefficients are read, divided by the
+  coarser quantization tables and written out again. This is lossless in
+  everything but the requantization itself and much cheaper than a full
+  transcode.
+
+  The result is cached per input plugin and quality, so all consumers asking
+  for the same quality of the same frame share a single transcode. A consumer
+  that finds a transcode of its frame in progress waits for it instead of
+  doing the work a second time. Each input has its own lock, and consumers
+  copy a finished result out of the cache without holding it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifndef NO_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+
+#include "mjpg_streamer.h"
+#include "transcode.h"
+
+#ifndef NO_LIBJPEG
+
+typedef struct {
+    /* identifies the frame and quality this entry holds */
+    int quality;
+    struct timeval timestamp;
+    int source_size;
+    unsigned int source_hash;
+
+    unsigned char *data;
+    int size;
+    int capacity;
+
+    /* the frame can not be made smaller, consumers use the original */
+    int failed;
+    /* a transcode is in progress, data must not be touched */
+    int busy;
+    /* consumers copying data, the entry must not be reused */
+    int readers;
+    unsigned long last_used;
+} transcode_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    unsigned long clock;
+    transcode_entry entries[TRANSCODE_CACHE_ENTRIES];
+} transcode_cache;
+
+static transcode_cache cache[MAX_INPUT_PLUGINS];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/******************************************************************************
+Description.: initializes the locks of the per input caches
+Input Value.: -
+Return Value: -
+******************************************************************************/
+static void cache_init(void)
+{
+    int i;
+
+    for(i = 0; i < MAX_INPUT_PLUGINS; i++) {
+        pthread_mutex_init(&cache[i].mutex, NULL);
+        pthread_cond_init(&cache[i].done, NULL);
+    }
+}
+
+/* the example tables of the JPEG standard, section K.1, in natural order */
+static const unsigned int std_luminance_quant_tbl[DCTSIZE2] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99
+};
+
+static const unsigned int std_chrominance_quant_tbl[DCTSIZE2] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99
+};
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+} error_mgr;
+
+typedef struct {
+    struct jpeg_source_mgr pub;
+    const unsigned char *data;
+    int size;
+} memory_source;
+
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    transcode_entry *entry;
+} memory_destination;
+
+/******************************************************************************
+Description.: libjpeg error handlers, errors abort the transcode silently
+Input Value.: libjpeg object
+Return Value: -
+******************************************************************************/
+static void error_exit(j_common_ptr cinfo)
+{
+    error_mgr *err = (error_mgr *)cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+static void output_message(j_common_ptr cinfo)
+{
+    DBG("transcode: corrupt JPEG data\n");
+}
+
+/******************************************************************************
+Description.: source manager reading the whole frame from memory
+Input Value.: libjpeg decompressor
+Return Value: -
+******************************************************************************/
+static void init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean fill_input_buffer(j_decompress_ptr cinfo)
+{
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+    /* the frame is truncated, end it to let libjpeg finish */
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+static void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+{
+    if(num_bytes <= 0)
+        return;
+
+    if((size_t)num_bytes > cinfo->src->bytes_in_buffer) {
+        fill_input_buffer(cinfo);
+        return;
+    }
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void term_source(j_decompress_ptr cinfo)
+{
+}
+
+/******************************************************************************
+Description.: destination manager writing into the cache entry, the entry
+              buffer grows when the result does not fit
+Input Value.: libjpeg compressor
+Return Value: -
+******************************************************************************/
+static void init_destination(j_compress_ptr cinfo)
+{
+    memory_destination *dest = (memory_destination *)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->entry->data;
+    dest->pub.free_in_buffer = dest->entry->capacity;
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+    memory_destination *dest = (memory_destination *)cinfo->dest;
+    transcode_entry *entry = dest->entry;
+    int used = entry->capacity;
+    unsigned char *tmp;
+
+    if((tmp = realloc(entry->data, entry->capacity * 2)) == NULL)
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+
+    entry->data = tmp;
+    entry->capacity *= 2;
+    dest->pub.next_output_byte = entry->data + used;
+    dest->pub.free_in_buffer = entry->capacity - used;
+    return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+    memory_destination *dest = (memory_destination *)cinfo->dest;
+
+    dest->entry->size = dest->entry->capacity - dest->pub.free_in_buffer;
+}
+
+/******************************************************************************
+Description.: builds the quantization tables for the requested quality, a
+              table is never made finer than it was, that would only cost
+              space without bringing back detail
+Input Value.: source and destination objects, quality 1..99
+Return Value: number of tables that got coarser
+******************************************************************************/
+static int requantize_tables(j_decompress_ptr src, j_compress_ptr dst, int quality)
+{
+    int scale = jpeg_quality_scaling(quality);
+    int coarser = 0, t, k;
+    long value;
+
+    for(t = 0; t < NUM_QUANT_TBLS; t++) {
+        const unsigned int *basic = (t == 0) ? std_luminance_quant_tbl : std_chrominance_quant_tbl;
+
+        if(src->quant_tbl_ptrs[t] == NULL || dst->quant_tbl_ptrs[t] == NULL)
+            continue;
+
+        for(k = 0; k < DCTSIZE2; k++) {
+            value = ((long)basic[k] * scale + 50L) / 100L;
+            if(value <= 0)
+                value = 1;
+            if(value > 255)
+                value = 255;
+            if(value > src->quant_tbl_ptrs[t]->quantval[k]) {
+                dst->quant_tbl_ptrs[t]->quantval[k] = (UINT16)value;
+                coarser++;
+            } else {
+                dst->quant_tbl_ptrs[t]->quantval[k] = src->quant_tbl_ptrs[t]->quantval[k];
+            }
+        }
+    }
+
+    return coarser;
+}
+
+/******************************************************************************
+Description.: divides all coefficients of a component by the change of its
+              quantization table, rounding to the nearest value
+Input Value.: source object, its coefficient arrays, destination object and
+              the component index
+Return Value: -
+******************************************************************************/
+static void requantize_component(j_decompress_ptr src, jvirt_barray_ptr *coefficients,
+                                 j_compress_ptr dst, int ci)
+{
+    jpeg_component_info *comp = &src->comp_info[ci];
+    JQUANT_TBL *from = comp->quant_table ? comp->quant_table : src->quant_tbl_ptrs[comp->quant_tbl_no];
+    JQUANT_TBL *to = dst->quant_tbl_ptrs[dst->comp_info[ci].quant_tbl_no];
+    JDIMENSION row, x;
+    JBLOCKARRAY rows;
+    int y, k;
+    long value;
+
+    if(from == NULL || to == NULL || memcmp(from->quantval, to->quantval, sizeof(from->quantval)) == 0)
+        return;
+
+    for(row = 0; row < comp->height_in_blocks; row += comp->v_samp_factor) {
+        rows = (*src->mem->access_virt_barray)((j_common_ptr)src, coefficients[ci], row, (JDIMENSION)comp->v_samp_factor, TRUE);
+
+        for(y = 0; y < comp->v_samp_factor; y++) {
+            for(x = 0; x < comp->width_in_blocks; x++) {
+                JCOEF *block = rows[y][x];
+
+                for(k = 0; k < DCTSIZE2; k++) {
+                    if(block[k] == 0 || from->quantval[k] == to->quantval[k])
+                        continue;
+
+                    value = (long)block[k] * from->quantval[k];
+                    if(value >= 0)
+                        block[k] = (JCOEF)((value + to->quantval[k] / 2) / to->quantval[k]);
+                    else
+                        block[k] = (JCOEF) - ((-value + to->quantval[k] / 2) / to->quantval[k]);
+                }
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: requantizes a JPEG frame into the cache entry
+Input Value.: frame, its size, the quality and the entry to fill
+Return Value: 0 if the entry holds a smaller frame, -1 otherwise
+******************************************************************************/
+static int requantize(const unsigned char *frame, int size, int quality, transcode_entry *entry)
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    error_mgr err;
+    memory_source source;
+    memory_destination destination;
+    jvirt_barray_ptr *coefficients;
+    int ci, result = -1;
+
+    if(entry->data == NULL || entry->capacity < size) {
+        unsigned char *tmp;
+
+        if((tmp = realloc(entry->data, size)) == NULL)
+            return -1;
+        entry->data = tmp;
+        entry->capacity = size;
+    }
+
+    /* both objects share the error handler, any error ends up below */
+    src.err = jpeg_std_error(&err.pub);
+    dst.err = &err.pub;
+    err.pub.error_exit = error_exit;
+    err.pub.output_message = output_message;
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+
+    if(setjmp(err.setjmp_buffer)) {
+        DBG("transcode: could not requantize frame\n");
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        return -1;
+    }
+
+    source.pub.init_source = init_source;
+    source.pub.fill_input_buffer = fill_input_buffer;
+    source.pub.skip_input_data = skip_input_data;
+    source.pub.resync_to_restart = jpeg_resync_to_restart;
+    source.pub.term_source = term_source;
+    source.pub.next_input_byte = frame;
+    source.pub.bytes_in_buffer = size;
+    src.src = &source.pub;
+
+    destination.pub.init_destination = init_destination;
+    destination.pub.empty_output_buffer = empty_output_buffer;
+    destination.pub.term_destination = term_destination;
+    destination.entry = entry;
+    dst.dest = &destination.pub;
+
+    jpeg_read_header(&src, TRUE);
+    coefficients = jpeg_read_coefficients(&src);
+    jpeg_copy_critical_parameters(&src, &dst);
+
+    if(requantize_tables(&src, &dst, quality) > 0) {
+        for(ci = 0; ci < src.num_components; ci++)
+            requantize_component(&src, coefficients, &dst, ci);
+
+        jpeg_write_coefficients(&dst, coefficients);
+        jpeg_finish_compress(&dst);
+
+        /* huffman tables are not optimized, tiny changes may even grow */
+        if(entry->size < size)
+            result = 0;
+    }
+
+    jpeg_finish_decompress(&src);
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+
+    return result;
+}
+
+/******************************************************************************
+Description.: a cheap fingerprint of the frame, the timestamp alone is not
+              enough as not every input plugin sets it
+Input Value.: frame and its size
+Return Value: hash of the first and last bytes of the frame
+******************************************************************************/
+static unsigned int frame_hash(const unsigned char *frame, int size)
+{
+    unsigned int hash = 2166136261u;
+    int i, n = (size < 512) ? size : 512;
+
+    for(i = 0; i < n; i++)
+        hash = (hash ^ frame[i]) * 16777619u;
+    for(i = (size - 512 > n) ? size - 512 : n; i < size; i++)
+        hash = (hash ^ frame[i]) * 16777619u;
+
+    return hash;
+}
+
+/******************************************************************************
+Description.: replaces a frame copied from an input plugin by a version with
+              lower JPEG quality, see the comment at the top of this file
+Input Value.: input_number..: the plugin the frame was taken from
+              quality.......: 1..99, other values leave the frame alone
+              timestamp.....: timestamp of the frame as set by the input
+              frame.........: buffer holding the frame, may be reallocated
+              size..........: size of the frame
+              capacity......: allocated size of the buffer, updated if the
+                              buffer gets reallocated
+Return Value: size of the frame now in the buffer, the original size if the
+              frame could not be transcoded
+******************************************************************************/
+int jpeg_transcode(int input_number, int quality, struct timeval *timestamp,
+                   unsigned char **frame, int size, int *capacity)
+{
+    transcode_cache *c;
+    transcode_entry *entry, *victim;
+    unsigned int hash;
+    int i, result;
+
+    if(quality <= 0 || quality >= 100 || input_number < 0 || input_number >= MAX_INPUT_PLUGINS || size <= 0)
+        return size;
+
+    hash = frame_hash(*frame, size);
+
+    pthread_once(&cache_once, cache_init);
+    c = &cache[input_number];
+
+    pthread_mutex_lock(&c->mutex);
+    for(;;) {
+        entry = NULL;
+        victim = NULL;
+        for(i = 0; i < TRANSCODE_CACHE_ENTRIES; i++) {
+            transcode_entry *e = &c->entries[i];
+
+            if(e->quality == quality && e->source_size == size && e->source_hash == hash &&
+               e->timestamp.tv_sec == timestamp->tv_sec && e->timestamp.tv_usec == timestamp->tv_usec) {
+                entry = e;
+                break;
+            }
+            if(!e->busy && e->readers == 0 && (victim == NULL || e->last_used < victim->last_used))
+                victim = e;
+        }
+
+        if(entry == NULL || !entry->busy)
+            break;
+
+        /* another consumer is transcoding this very frame, use its result */
+        pthread_cond_wait(&c->done, &c->mutex);
+    }
+
+    if(entry == NULL) {
+        if(victim == NULL) {
+            /* every entry is being written or read, do not wait for a slot */
+            pthread_mutex_unlock(&c->mutex);
+            return size;
+        }
+
+        entry = victim;
+        entry->quality = quality;
+        entry->timestamp = *timestamp;
+        entry->source_size = size;
+        entry->source_hash = hash;
+        entry->busy = 1;
+        pthread_mutex_unlock(&c->mutex);
+
+        result = requantize(*frame, size, quality, entry);
+
+        pthread_mutex_lock(&c->mutex);
+        entry->failed = (result < 0);
+        entry->busy = 0;
+        pthread_cond_broadcast(&c->done);
+    }
+
+    entry->last_used = ++c->clock;
+
+    if(entry->failed) {
+        pthread_mutex_unlock(&c->mutex);
+        return size;
+    }
+
+    /* the entry is not reused while it has readers, copy without the lock */
+    entry->readers++;
+    pthread_mutex_unlock(&c->mutex);
+
+    result = size;
+    if(entry->size > *capacity) {
+        unsigned char *tmp;
+
+        if((tmp = realloc(*frame, entry->size)) != NULL) {
+            *frame = tmp;
+            *capacity = entry->size;
+        }
+    }
+
+    if(entry->size <= *capacity) {
+        memcpy(*frame, entry->data, entry->size);
+        result = entry->size;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    entry->readers--;
+    pthread_mutex_unlock(&c->mutex);
+
+    return result;
+}
+
+#else
+
+int jpeg_transcode(int input_number, int quality, struct timeval *timestamp,
+                   unsigned char **frame, int size, int *capacity)
+{
+    return size;
+}
+
+#endif
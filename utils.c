@@ -21,6 +21,7 @@
 *******************************************************************************/
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <linux/types.h>
@@ -143,3 +144,20 @@ void resolutions_help(const char * padding) {
     fprintf(stderr, "\n%sor a custom value like the following" \
     "\n%sexample: 640x480\n", padding, padding);
 }
+
+/******************************************************************************
+Description.: snprintf at the end of a text that is built piece by piece, the
+              text so far may already be longer than the buffer
+Input Value.: buffer and its size, length of the text so far and the format
+Return Value: -, length is increased by the full length of the formatted
+              text even if it did not fit
+******************************************************************************/
+void append_text(char *buffer, size_t size, int *length, const char *format, ...)
+{
+    va_list args;
+    size_t used = ((size_t)*length < size) ? (size_t)*length : size;
+
+    va_start(args, format);
+    *length += vsnprintf(buffer + used, size - used, format, args);
+    va_end(args);
+}
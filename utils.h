@@ -129,4 +129,5 @@ void daemon_mode(void);
 
 void resolutions_help(const char * padding);
 void parse_resolution_opt(const char * optarg, int * width, int * height);
+void append_text(char *buffer, size_t size, int *length, const char *format, ...);
 